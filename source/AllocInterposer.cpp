@@ -0,0 +1,411 @@
+#ifdef BUILD_ALLOC_INTERPOSER
+
+#include <cerrno>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "AllocInterposer.h"
+#include "Logger.h"
+
+
+// glibc allocator, which serves everything that is not a slot of the interposer
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void __libc_free(void* ptr);
+extern "C" void* __libc_calloc(size_t nmemb, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void* __libc_memalign(size_t alignment, size_t size);
+extern "C" void* __libc_valloc(size_t size);
+extern "C" void* __libc_pvalloc(size_t size);
+
+FUNC_FORWARD_DECL(malloc_usable_size, size_t, (void* ptr));
+
+
+size_t AllocInterposer::minAllocSize = SIZE_MAX;
+unsigned AllocInterposer::minClassShift = ALLOCINTERPOSER_MAX_CLASS_SHIFT + 1;
+uintptr_t AllocInterposer::regionStart = 0;
+size_t AllocInterposer::regionLen = 0;
+AllocInterposerClass AllocInterposer::classes[ALLOCINTERPOSER_NUM_CLASSES];
+std::atomic<size_t> AllocInterposer::cachedBytes(0);
+
+
+/**
+ * Reserve the address space of the slots and start serving allocations of at least minAllocSize.
+ * Can only be called once.
+ *
+ * @useHugePages enable transparent huge pages for slots of 2MiB and larger.
+ * @return false if address space could not be reserved (in which case everything continues to be
+ * 		served by the glibc allocator).
+ */
+bool AllocInterposer::enable(size_t minAllocSize, bool useHugePages)
+{
+	const size_t classRegionLen = (size_t)1 << ALLOCINTERPOSER_CLASS_REGION_SHIFT;
+
+	unsigned pageShift = __builtin_ctzl(sysconf(_SC_PAGESIZE) );
+
+	// slots need to be page-aligned to be mprotect'ed (getClassShift() uses this as lower bound)
+	minClassShift = pageShift;
+	minClassShift = getClassShift(minAllocSize);
+
+	if(minClassShift > ALLOCINTERPOSER_MAX_CLASS_SHIFT)
+		return false;
+
+	const size_t numClasses = ALLOCINTERPOSER_MAX_CLASS_SHIFT - minClassShift + 1;
+	const size_t reserveLen = (numClasses * classRegionLen) + classRegionLen; // +1 for alignment
+
+	/* reserve without access permissions, so that nothing counts against the commit limit before
+		a slot gets handed out */
+	void* reservation = mmap(NULL, reserveLen, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(reservation == MAP_FAILED)
+		return false;
+
+	// align to class region size, so that all slots are aligned to their class size
+
+	uintptr_t alignedStart =
+		( (uintptr_t)reservation + classRegionLen - 1) & ~(uintptr_t)(classRegionLen - 1);
+	size_t headLen = alignedStart - (uintptr_t)reservation;
+
+	if(headLen)
+		munmap(reservation, headLen);
+
+	munmap( (char*)alignedStart + (numClasses * classRegionLen), classRegionLen - headLen);
+
+	for(unsigned shift = minClassShift; shift <= ALLOCINTERPOSER_MAX_CLASS_SHIFT; shift++)
+	{
+		AllocInterposerClass& allocClass = classes[shift];
+
+		allocClass.regionStart =
+			(char*)alignedStart + ( (size_t)(shift - minClassShift) * classRegionLen);
+		allocClass.numSlotsTotal = classRegionLen >> shift;
+
+		if(useHugePages && (shift >= ALLOCINTERPOSER_HUGEPAGE_SHIFT) )
+			madvise(allocClass.regionStart, classRegionLen, MADV_HUGEPAGE);
+	}
+
+	regionStart = alignedStart;
+	regionLen = numClasses * classRegionLen;
+
+	// a class mutex that is locked during fork() would stay locked in the child forever
+	pthread_atfork(lockAllClasses, unlockAllClasses, unlockAllClasses);
+
+	__atomic_store_n(&AllocInterposer::minAllocSize, minAllocSize, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+ * Hand out a slot for the given size.
+ *
+ * @alignment power of two; 0 for default.
+ * @zeroFill true to get zero-filled memory (as calloc).
+ * @return NULL if size is too large or no slot is left, in which case the caller should fall back
+ * 		to the glibc allocator.
+ */
+void* AllocInterposer::alloc(size_t size, size_t alignment, bool zeroFill)
+{
+	unsigned shift = getClassShift( (alignment > size) ? alignment : size);
+
+	if(shift > ALLOCINTERPOSER_MAX_CLASS_SHIFT)
+		return NULL;
+
+	AllocInterposerClass& allocClass = classes[shift];
+	const size_t slotSize = (size_t)1 << shift;
+
+	char* slot;
+	bool isNewSlot = false;
+	bool isZeroed = true; // new and cold slots are zero-filled by the kernel (except for the link)
+
+	{
+		std::unique_lock<std::mutex> lock(allocClass.mutex); // L O C K (scoped)
+
+		if(allocClass.hotFreeList)
+		{
+			slot = (char*)allocClass.hotFreeList;
+			allocClass.hotFreeList = *(void**)slot;
+			isZeroed = false;
+
+			cachedBytes -= slotSize;
+		}
+		else
+		if(allocClass.coldFreeList)
+		{
+			slot = (char*)allocClass.coldFreeList;
+			allocClass.coldFreeList = *(void**)slot;
+		}
+		else
+		if(allocClass.numSlotsUsed < allocClass.numSlotsTotal)
+		{
+			slot = allocClass.regionStart + (allocClass.numSlotsUsed * slotSize);
+			allocClass.numSlotsUsed++;
+			isNewSlot = true;
+		}
+		else
+			return NULL; // class region exhausted
+	}
+
+	if(isNewSlot)
+	{
+		/* new slots are handed out in ascending order, so the kernel merges the mprotect'ed range
+			into a single mapping per class */
+		int protectRes = mprotect(slot, slotSize, PROT_READ | PROT_WRITE);
+		if(protectRes == -1)
+			return NULL; // slot is lost, but this is only address space
+	}
+	else
+		*(void**)slot = NULL; // clear free list link
+
+	if(zeroFill && !isZeroed)
+		memset(slot, 0, size);
+
+	return slot;
+}
+
+/**
+ * Return a slot to its class. Memory of the slot stays resident for reuse while the total resident
+ * memory in free slots is below ALLOCINTERPOSER_CACHE_LIMIT, otherwise it's given back to the
+ * kernel.
+ *
+ * @ptr must be a slot (see getIsSlot() ).
+ */
+void AllocInterposer::freeSlot(void* ptr)
+{
+	const size_t regionOffset = (uintptr_t)ptr - regionStart;
+	const unsigned shift = minClassShift + (regionOffset >> ALLOCINTERPOSER_CLASS_REGION_SHIFT);
+	const size_t slotSize = (size_t)1 << shift;
+
+	AllocInterposerClass& allocClass = classes[shift];
+
+	if(regionOffset & (slotSize - 1) )
+	{ // not the start of a slot (like glibc, we don't continue with a corrupted heap)
+		log_fprintf(stderr, LOG_PREFIX "ERROR: free() of invalid pointer: %p\n", ptr);
+		abort();
+	}
+
+	bool keepResident = (cachedBytes.fetch_add(slotSize) + slotSize) <= ALLOCINTERPOSER_CACHE_LIMIT;
+
+	if(!keepResident)
+	{
+		cachedBytes -= slotSize;
+
+		madvise(ptr, slotSize, MADV_DONTNEED);
+	}
+
+	std::unique_lock<std::mutex> lock(allocClass.mutex); // L O C K (scoped)
+
+	void** freeList = keepResident ? &allocClass.hotFreeList : &allocClass.coldFreeList;
+
+	*(void**)ptr = *freeList;
+	*freeList = ptr;
+}
+
+/**
+ * @ptr must be a slot (see getIsSlot() ).
+ * @return usable size of the slot.
+ */
+size_t AllocInterposer::getSlotSize(void* ptr)
+{
+	const size_t regionOffset = (uintptr_t)ptr - regionStart;
+
+	return (size_t)1 << (minClassShift + (regionOffset >> ALLOCINTERPOSER_CLASS_REGION_SHIFT) );
+}
+
+void AllocInterposer::lockAllClasses()
+{
+	for(unsigned shift = minClassShift; shift <= ALLOCINTERPOSER_MAX_CLASS_SHIFT; shift++)
+		classes[shift].mutex.lock();
+}
+
+void AllocInterposer::unlockAllClasses()
+{
+	for(unsigned shift = minClassShift; shift <= ALLOCINTERPOSER_MAX_CLASS_SHIFT; shift++)
+		classes[shift].mutex.unlock();
+}
+
+
+/**
+ * Alloc from slots if enabled for this size or from glibc otherwise (or if no slot is available).
+ */
+static void* allocWithAlignment(size_t alignment, size_t size)
+{
+	if(AllocInterposer::getIsEnabledForSize(size) )
+	{
+		void* ptr = AllocInterposer::alloc(size, alignment, false);
+		if(ptr)
+			return ptr;
+	}
+
+	return __libc_memalign(alignment, size);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(malloc)(size_t size)
+{
+	if(AllocInterposer::getIsEnabledForSize(size) )
+	{
+		void* ptr = AllocInterposer::alloc(size, 0, false);
+		if(ptr)
+			return ptr;
+	}
+
+	return __libc_malloc(size);
+}
+
+extern "C" void INTERCEPT_FUNC_DECL(free)(void* ptr)
+{
+	if(AllocInterposer::getIsSlot(ptr) )
+		AllocInterposer::freeSlot(ptr);
+	else
+		__libc_free(ptr);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(calloc)(size_t nmemb, size_t size)
+{
+	size_t totalSize;
+
+	if(__builtin_mul_overflow(nmemb, size, &totalSize) )
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if(AllocInterposer::getIsEnabledForSize(totalSize) )
+	{
+		void* ptr = AllocInterposer::alloc(totalSize, 0, true);
+		if(ptr)
+			return ptr;
+	}
+
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(realloc)(void* ptr, size_t size)
+{
+	if(!ptr)
+		return malloc(size);
+
+	if(AllocInterposer::getIsSlot(ptr) )
+	{
+		size_t slotSize = AllocInterposer::getSlotSize(ptr);
+
+		if(!size)
+		{ // same as glibc
+			AllocInterposer::freeSlot(ptr);
+			return NULL;
+		}
+
+		if( (size <= slotSize) && (size > (slotSize / 2) ) &&
+			AllocInterposer::getIsEnabledForSize(size) )
+			return ptr; // still the best fitting class
+
+		void* newPtr = malloc(size);
+		if(!newPtr)
+			return NULL;
+
+		memcpy(newPtr, ptr, MIN(size, slotSize) );
+
+		AllocInterposer::freeSlot(ptr);
+
+		return newPtr;
+	}
+
+	if(AllocInterposer::getIsEnabledForSize(size) )
+	{ // move from glibc to slot
+		void* newPtr = AllocInterposer::alloc(size, 0, false);
+
+		if(newPtr)
+		{
+			MAP_OR_FAIL(malloc_usable_size);
+
+			size_t oldSize = __real_malloc_usable_size(ptr);
+
+			memcpy(newPtr, ptr, MIN(size, oldSize) );
+
+			__libc_free(ptr);
+
+			return newPtr;
+		}
+	}
+
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(reallocarray)(void* ptr, size_t nmemb, size_t size)
+{
+	size_t totalSize;
+
+	if(__builtin_mul_overflow(nmemb, size, &totalSize) )
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return realloc(ptr, totalSize);
+}
+
+extern "C" int INTERCEPT_FUNC_DECL(posix_memalign)(void** memptr, size_t alignment, size_t size)
+{
+	if( (alignment % sizeof(void*) ) || (alignment & (alignment - 1) ) || !alignment)
+		return EINVAL;
+
+	void* ptr = allocWithAlignment(alignment, size);
+	if(!ptr)
+		return ENOMEM;
+
+	*memptr = ptr;
+
+	return 0;
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(aligned_alloc)(size_t alignment, size_t size)
+{
+	if(alignment & (alignment - 1) )
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return allocWithAlignment(alignment, size);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(memalign)(size_t alignment, size_t size)
+{
+	if(alignment & (alignment - 1) )
+		return __libc_memalign(alignment, size); // glibc rounds up in this case
+
+	return allocWithAlignment(alignment, size);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(valloc)(size_t size)
+{
+	if(AllocInterposer::getIsEnabledForSize(size) )
+	{
+		void* ptr = AllocInterposer::alloc(size, 0, false); // slots are always page-aligned
+		if(ptr)
+			return ptr;
+	}
+
+	return __libc_valloc(size);
+}
+
+extern "C" void* INTERCEPT_FUNC_DECL(pvalloc)(size_t size)
+{
+	if(AllocInterposer::getIsEnabledForSize(size) )
+	{
+		void* ptr = AllocInterposer::alloc(size, 0, false); // slots are whole pages
+		if(ptr)
+			return ptr;
+	}
+
+	return __libc_pvalloc(size);
+}
+
+extern "C" size_t INTERCEPT_FUNC_DECL(malloc_usable_size)(void* ptr)
+{
+	if(AllocInterposer::getIsSlot(ptr) )
+		return AllocInterposer::getSlotSize(ptr);
+
+	MAP_OR_FAIL(malloc_usable_size);
+
+	return __real_malloc_usable_size(ptr);
+}
+
+#endif // BUILD_ALLOC_INTERPOSER
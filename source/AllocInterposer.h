@@ -0,0 +1,93 @@
+#ifndef ALLOCINTERPOSER_H_
+#define ALLOCINTERPOSER_H_
+
+#ifdef BUILD_ALLOC_INTERPOSER
+
+#include <atomic>
+#include <mutex>
+#include "Common.h"
+
+
+#define ALLOCINTERPOSER_MAX_CLASS_SHIFT		32 // largest size class is 4GiB
+#define ALLOCINTERPOSER_CLASS_REGION_SHIFT	34 // each size class has 16GiB of virtual address space
+#define ALLOCINTERPOSER_NUM_CLASSES			(ALLOCINTERPOSER_MAX_CLASS_SHIFT + 1)
+#define ALLOCINTERPOSER_CACHE_LIMIT			(256*1024*1024) // max resident bytes in free slots
+#define ALLOCINTERPOSER_HUGEPAGE_SHIFT		21 // classes from 2MiB can be huge-page backed
+
+
+/**
+ * Pool of slots of one size class (a power of two). The slots are consecutive in the class region,
+ * so each slot is aligned to the class size.
+ */
+class AllocInterposerClass
+{
+	public:
+		std::mutex mutex;
+		char* regionStart{NULL};
+		size_t numSlotsTotal{0};
+		size_t numSlotsUsed{0}; // slots beyond this were never handed out (memory not committed)
+		void* hotFreeList{NULL}; // freed slots with resident memory; first word links to next
+		void* coldFreeList{NULL}; // freed slots of which the memory was given back to the kernel
+};
+
+
+/**
+ * Optional interposer of malloc() and related functions to serve large allocations from
+ * page-aligned slots, so that application I/O buffers satisfy the O_DIRECT alignment rules.
+ * Smaller allocations and everything before enable() go to the glibc allocator. Slots are
+ * recognized by their address range, so free()/realloc() route correctly no matter when the
+ * allocation happened.
+ *
+ * Only compiled in with "make BUILD_ALLOC_INTERPOSER=1".
+ */
+class AllocInterposer
+{
+	public:
+		static bool enable(size_t minAllocSize, bool useHugePages);
+
+		static void* alloc(size_t size, size_t alignment, bool zeroFill);
+		static void freeSlot(void* ptr);
+		static size_t getSlotSize(void* ptr);
+
+	private:
+		AllocInterposer() {}
+
+		static size_t minAllocSize; // SIZE_MAX while disabled
+		static unsigned minClassShift;
+		static uintptr_t regionStart; // start of all class regions
+		static size_t regionLen;
+		static AllocInterposerClass classes[ALLOCINTERPOSER_NUM_CLASSES];
+		static std::atomic<size_t> cachedBytes; // resident bytes in hot free slots
+
+		static void lockAllClasses();
+		static void unlockAllClasses();
+
+
+		// inliners
+	public:
+		static bool getIsEnabledForSize(size_t size)
+		{
+			return (size >= __atomic_load_n(&minAllocSize, __ATOMIC_ACQUIRE) );
+		}
+
+		static bool getIsSlot(const void* ptr)
+		{
+			return ( (uintptr_t)ptr - regionStart) < regionLen;
+		}
+
+	private:
+		/**
+		 * @return shift of the smallest class that fits the given size.
+		 */
+		static unsigned getClassShift(size_t size)
+		{
+			unsigned shift = (size <= 1) ? 0 : (64 - __builtin_clzll(size - 1) );
+
+			return (shift < minClassShift) ? minClassShift : shift;
+		}
+};
+
+
+#endif // BUILD_ALLOC_INTERPOSER
+
+#endif /* ALLOCINTERPOSER_H_ */
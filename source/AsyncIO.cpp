@@ -0,0 +1,412 @@
+#include <cerrno>
+#include <sys/syscall.h>
+#include "AsyncIO.h"
+#include "Config.h"
+#include "FDStore.h"
+#include "InjectionTk.h"
+#include "Logger.h"
+#include "Probes.h"
+
+std::mutex* AsyncIOTk::mutex = NULL;
+IOCBCtxMap* AsyncIOTk::resubmittedIOCBs = NULL;
+std::atomic<size_t> AsyncIOTk::numResubmittedIOCBs(0);
+bool AsyncIOTk::statsEnabled = false;
+AsyncIOStatsShard AsyncIOTk::statsShards[ASYNCIO_STATS_NUM_SHARDS];
+
+
+/**
+ * Called by initlib() before initDone gets set.
+ */
+void AsyncIOTk::init()
+{
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	mutex = new std::mutex();
+	resubmittedIOCBs = new IOCBCtxMap();
+}
+
+/**
+ * Enable counting of AIO traffic for the stats report.
+ */
+void AsyncIOTk::enableStats()
+{
+	statsEnabled = true;
+}
+
+/**
+ * io_submit() with counting of the queued iocbs and marking of buffered writes for fsync elision.
+ *
+ * @return number of queued iocbs or negative errno, like libaio's io_submit().
+ */
+int AsyncIOTk::submitWithPolicy(aio_context_t ctx, long nr, struct iocb** iocbpp,
+	AIOSubmitFunc submitFunc)
+{
+	/* mark before submission, because the app might call fsync right after the completion. this
+		is a no-op for fds that are still in O_DIRECT mode. */
+	if(libOpts & ENV_LIB_OPTS_SYNC_ELIDE)
+	{
+		for(long i=0; i < nr; i++)
+			if(getIsWrite(iocbpp[i]) )
+				InjectionTk::markBufferedWrite(iocbpp[i]->aio_fildes);
+	}
+
+	int ret = submitFunc(ctx, nr, iocbpp);
+
+	if(statsEnabled && (ret > 0) )
+		countSubmitted(iocbpp, ret);
+
+	return ret;
+}
+
+/**
+ * io_getevents() that resubmits iocbs which failed with EINVAL on tracked fds after removing
+ * O_DIRECT from the fd (see resubmitAfterEinval) and hides their EINVAL events from the app. If this
+ * leaves less than minNR events, we wait for more within what is left of the timeout.
+ *
+ * @return number of events or negative errno, like libaio's io_getevents().
+ */
+int AsyncIOTk::getEventsWithPolicy(aio_context_t ctx, long minNR, long nr, struct io_event* events,
+	struct timespec* timeout, AIOGetEventsFunc getEventsFunc, AIOSubmitFunc submitFunc)
+{
+	struct timespec deadline;
+	struct timespec remainingTimeout;
+	struct timespec* currentTimeout = timeout;
+	long numEventsDone = 0; // events that will be returned to the app
+
+	if(timeout)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+		deadline.tv_sec += timeout->tv_sec;
+		deadline.tv_nsec += timeout->tv_nsec;
+
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	for( ; ; )
+	{
+		int ret = getEventsFunc(ctx, minNR - numEventsDone, nr - numEventsDone,
+			&events[numEventsDone], currentTimeout);
+
+		if(ret < 0)
+			return numEventsDone ? numEventsDone : ret; // e.g. EINTR
+
+		long numKept = filterEvents(ctx, &events[numEventsDone], ret, submitFunc);
+
+		numEventsDone += numKept;
+
+		/* if nothing was filtered out, the kernel returned all it had within the timeout (it only
+			returns less than minNR on timeout or signal) */
+		if( (numKept == ret) || (numEventsDone >= minNR) )
+			return numEventsDone;
+
+		if(timeout)
+		{ // wait only for what is left of the original timeout
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			remainingTimeout.tv_sec = deadline.tv_sec - now.tv_sec;
+			remainingTimeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+
+			if(remainingTimeout.tv_nsec < 0)
+			{
+				remainingTimeout.tv_sec--;
+				remainingTimeout.tv_nsec += 1000000000L;
+			}
+
+			if(remainingTimeout.tv_sec < 0)
+			{ // deadline passed, so only check for events that are already there
+				remainingTimeout.tv_sec = 0;
+				remainingTimeout.tv_nsec = 0;
+			}
+
+			currentTimeout = &remainingTimeout;
+		}
+	}
+}
+
+/**
+ * Remove resubmitted iocbs that were not completed yet from the list of resubmitted iocbs, because
+ * their context got destroyed. Called before io_destroy().
+ */
+void AsyncIOTk::forgetContext(aio_context_t ctx)
+{
+	if(!numResubmittedIOCBs.load(std::memory_order_relaxed) )
+		return;
+
+	std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+	for(IOCBCtxMap::iterator iter = resubmittedIOCBs->begin(); iter != resubmittedIOCBs->end(); )
+	{
+		if(iter->second == ctx)
+			iter = resubmittedIOCBs->erase(iter);
+		else
+			iter++;
+	}
+
+	numResubmittedIOCBs.store(resubmittedIOCBs->size(), std::memory_order_relaxed);
+}
+
+/**
+ * Write the [aio] section of the stats report. Does nothing if the app didn't use AIO.
+ */
+void AsyncIOTk::writeReport(int fd)
+{
+	if(!statsEnabled || !getStatsSum(ASYNCIO_STATS_CONTEXTS) )
+		return;
+
+	dprintf(fd, "\n[aio]\n");
+	dprintf(fd, "# contexts submits iocbs_read iocbs_write iocbs_sync iocbs_other bytes_read "
+		"bytes_written completions errors resubmits\n");
+
+	for(unsigned counter = 0; counter < ASYNCIO_STATS_NUM_COUNTERS; counter++)
+		dprintf(fd, "%s%llu", counter ? " " : "", (unsigned long long)getStatsSum(counter) );
+
+	dprintf(fd, "\n");
+}
+
+/**
+ * Fallback for libaio's io_setup() if libaio is not loaded, e.g. because the app only looked up
+ * the symbol via dlsym() to probe for AIO support.
+ */
+int AsyncIOTk::syscallSetup(int maxEvents, aio_context_t* ctxp)
+{
+	int savedErrno = errno;
+
+	long ret = syscall(__NR_io_setup, maxEvents, ctxp);
+
+	ret = (ret == -1) ? -errno : ret;
+
+	errno = savedErrno;
+
+	return ret;
+}
+
+/**
+ * Fallback for libaio's io_destroy() (see syscallSetup).
+ */
+int AsyncIOTk::syscallDestroy(aio_context_t ctx)
+{
+	int savedErrno = errno;
+
+	long ret = syscall(__NR_io_destroy, ctx);
+
+	ret = (ret == -1) ? -errno : ret;
+
+	errno = savedErrno;
+
+	return ret;
+}
+
+/**
+ * Fallback for libaio's io_submit() (see syscallSetup).
+ */
+int AsyncIOTk::syscallSubmit(aio_context_t ctx, long nr, struct iocb** iocbpp)
+{
+	int savedErrno = errno;
+
+	long ret = syscall(__NR_io_submit, ctx, nr, iocbpp);
+
+	ret = (ret == -1) ? -errno : ret;
+
+	errno = savedErrno;
+
+	return ret;
+}
+
+/**
+ * Fallback for libaio's io_getevents() (see syscallSetup).
+ */
+int AsyncIOTk::syscallGetEvents(aio_context_t ctx, long minNR, long nr, struct io_event* events,
+	struct timespec* timeout)
+{
+	int savedErrno = errno;
+
+	long ret = syscall(__NR_io_getevents, ctx, minNR, nr, events, timeout);
+
+	ret = (ret == -1) ? -errno : ret;
+
+	errno = savedErrno;
+
+	return ret;
+}
+
+/**
+ * Remove the EINVAL events of resubmitted iocbs from the given events array.
+ *
+ * @return number of events that remain in the array (moved to the front).
+ */
+long AsyncIOTk::filterEvents(aio_context_t ctx, struct io_event* events, long numEvents,
+	AIOSubmitFunc submitFunc)
+{
+	long numKept = 0;
+
+	for(long i=0; i < numEvents; i++)
+	{
+		struct iocb* iocb = (struct iocb*)events[i].obj;
+
+		bool wasResubmitted = numResubmittedIOCBs.load(std::memory_order_relaxed) &&
+			forgetResubmitted(iocb);
+
+		// only one retry per iocb, so the app gets the EINVAL if it wasn't caused by O_DIRECT
+		if( (events[i].res == -EINVAL) && !wasResubmitted &&
+			resubmitAfterEinval(ctx, iocb, submitFunc) )
+			continue;
+
+		if(statsEnabled)
+			countCompletion(events[i]);
+
+		if(numKept != i)
+			events[numKept] = events[i];
+
+		numKept++;
+	}
+
+	return numKept;
+}
+
+/**
+ * Remove O_DIRECT from the fd of an iocb that completed with EINVAL and submit the iocb again, if
+ * the fd is tracked by us.
+ *
+ * @return true if the iocb was resubmitted, so that its EINVAL event should not go to the app.
+ */
+bool AsyncIOTk::resubmitAfterEinval(aio_context_t ctx, struct iocb* iocb, AIOSubmitFunc submitFunc)
+{
+	int fd = iocb->aio_fildes;
+
+	if(!getIsReadWrite(iocb) || !fdStore->getIsFDInStore(fd) )
+		return false;
+
+	InjectionTk::ejectAfterEinval(fd); // no-op if O_DIRECT was removed already by another event
+
+	if(iocb->aio_flags & IOCB_FLAG_RESFD)
+		return false; // app counts eventfd notifications, so it would miss a second one
+
+	if(getIsWrite(iocb) && (libOpts & ENV_LIB_OPTS_SYNC_ELIDE) )
+		InjectionTk::markBufferedWrite(fd);
+
+	{
+		// before submission, because another thread might get the event before we return
+		std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+		(*resubmittedIOCBs)[iocb] = ctx;
+		numResubmittedIOCBs.store(resubmittedIOCBs->size(), std::memory_order_relaxed);
+	}
+
+	int submitRes = submitFunc(ctx, 1, &iocb);
+
+	PROBE(aio_resubmit, fd, (int)iocb->aio_lio_opcode, (long)submitRes);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+		log_fprintf(stderr, LOG_PREFIX "Resubmitting AIO request after EINVAL. "
+			"fd: %d; offset: %lld; result: %d\n",
+			fd, (long long)iocb->aio_offset, submitRes);
+
+	if(submitRes != 1)
+	{ // app gets the original EINVAL event
+		forgetResubmitted(iocb);
+		return false;
+	}
+
+	if(statsEnabled)
+		incStats(ASYNCIO_STATS_RESUBMITS, 1);
+
+	return true;
+}
+
+/**
+ * @return true if the given iocb was in the list of resubmitted iocbs (and got removed from it).
+ */
+bool AsyncIOTk::forgetResubmitted(struct iocb* iocb)
+{
+	std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+	bool wasFound = resubmittedIOCBs->erase(iocb);
+
+	numResubmittedIOCBs.store(resubmittedIOCBs->size(), std::memory_order_relaxed);
+
+	return wasFound;
+}
+
+/**
+ * Count the first numSubmitted iocbs of an io_submit() call.
+ */
+void AsyncIOTk::countSubmitted(struct iocb** iocbpp, long numSubmitted)
+{
+	incStats(ASYNCIO_STATS_SUBMITS, 1);
+
+	for(long i=0; i < numSubmitted; i++)
+	{
+		switch(iocbpp[i]->aio_lio_opcode)
+		{
+			case IOCB_CMD_PREAD:
+			case IOCB_CMD_PREADV:
+				incStats(ASYNCIO_STATS_IOCBS_READ, 1);
+				break;
+
+			case IOCB_CMD_PWRITE:
+			case IOCB_CMD_PWRITEV:
+				incStats(ASYNCIO_STATS_IOCBS_WRITE, 1);
+				break;
+
+			case IOCB_CMD_FSYNC:
+			case IOCB_CMD_FDSYNC:
+				incStats(ASYNCIO_STATS_IOCBS_SYNC, 1);
+				break;
+
+			default:
+				incStats(ASYNCIO_STATS_IOCBS_OTHER, 1);
+				break;
+		}
+	}
+}
+
+/**
+ * Count an event that gets returned to the app. The iocb is still valid here, because the app may
+ * only reuse it after it got the event.
+ */
+void AsyncIOTk::countCompletion(const struct io_event& event)
+{
+	const struct iocb* iocb = (const struct iocb*)event.obj;
+
+	incStats(ASYNCIO_STATS_COMPLETIONS, 1);
+
+	if(event.res < 0)
+		incStats(ASYNCIO_STATS_ERRORS, 1);
+	else
+	if(getIsWrite(iocb) )
+		incStats(ASYNCIO_STATS_BYTES_WRITTEN, event.res);
+	else
+	if(getIsReadWrite(iocb) )
+		incStats(ASYNCIO_STATS_BYTES_READ, event.res);
+}
+
+/**
+ * @counter ASYNCIO_STATS_...
+ * @return sum of the given counter over all shards.
+ */
+uint64_t AsyncIOTk::getStatsSum(unsigned counter)
+{
+	uint64_t sum = 0;
+
+	for(unsigned shard = 0; shard < ASYNCIO_STATS_NUM_SHARDS; shard++)
+		sum += statsShards[shard].counters[counter].load(std::memory_order_relaxed);
+
+	return sum;
+}
+
+/**
+ * @return stats shard of the calling thread, assigned round-robin on first use.
+ */
+unsigned AsyncIOTk::getThreadShard()
+{
+	static std::atomic<unsigned> nextShard(0);
+	static thread_local unsigned threadShard = nextShard++ % ASYNCIO_STATS_NUM_SHARDS;
+
+	return threadShard;
+}
@@ -0,0 +1,134 @@
+#ifndef ASYNCIO_H_
+#define ASYNCIO_H_
+
+#include <atomic>
+#include <linux/aio_abi.h>
+#include <map>
+#include <mutex>
+#include <time.h>
+#include "Common.h"
+
+
+// counters of the [aio] stats report section
+#define ASYNCIO_STATS_CONTEXTS			0 // successful io_setup() calls
+#define ASYNCIO_STATS_SUBMITS			1 // io_submit() calls that queued at least one iocb
+#define ASYNCIO_STATS_IOCBS_READ		2 // queued pread/preadv iocbs
+#define ASYNCIO_STATS_IOCBS_WRITE		3 // queued pwrite/pwritev iocbs
+#define ASYNCIO_STATS_IOCBS_SYNC		4 // queued fsync/fdsync iocbs
+#define ASYNCIO_STATS_IOCBS_OTHER		5 // queued iocbs of other types (e.g. poll)
+#define ASYNCIO_STATS_BYTES_READ		6 // bytes of completed reads
+#define ASYNCIO_STATS_BYTES_WRITTEN		7 // bytes of completed writes
+#define ASYNCIO_STATS_COMPLETIONS		8 // events returned to the app
+#define ASYNCIO_STATS_ERRORS			9 // events with negative result returned to the app
+#define ASYNCIO_STATS_RESUBMITS			10 // iocbs resubmitted after EINVAL and O_DIRECT removal
+#define ASYNCIO_STATS_NUM_COUNTERS		11
+
+#define ASYNCIO_STATS_NUM_SHARDS		16 // threads get spread over shards round-robin
+
+
+/* libaio function types. libaio's io_context_t, struct iocb and struct io_event are ABI-compatible
+	with the kernel types of <linux/aio_abi.h>, so we use the kernel types to not depend on libaio
+	headers. Like libaio, these return a negative errno value on error instead of setting errno. */
+typedef int (*AIOSetupFunc)(int maxEvents, aio_context_t* ctxp);
+typedef int (*AIODestroyFunc)(aio_context_t ctx);
+typedef int (*AIOSubmitFunc)(aio_context_t ctx, long nr, struct iocb** iocbpp);
+typedef int (*AIOGetEventsFunc)(aio_context_t ctx, long minNR, long nr, struct io_event* events,
+	struct timespec* timeout);
+
+typedef std::map<struct iocb*, aio_context_t> IOCBCtxMap;
+
+
+/**
+ * Per-shard counters of the [aio] stats report section, padded to full cache lines.
+ */
+struct alignas(64) AsyncIOStatsShard
+{
+	std::atomic<uint64_t> counters[ASYNCIO_STATS_NUM_COUNTERS];
+};
+
+
+/**
+ * Toolkit to apply the direct I/O policy to Linux native AIO (libaio io_submit/io_getevents).
+ *
+ * The kernel checks O_DIRECT alignment of AIO reads/writes only after io_submit() accepted the
+ * iocb, so the EINVAL arrives as the result of the completion event. Like the EINVAL fallback of the
+ * sync read/write interceptors, such an event for a tracked fd removes O_DIRECT from the fd; the
+ * iocb then gets resubmitted once and the EINVAL event is not returned to the app, which instead
+ * later gets the event of the resubmitted iocb.
+ *
+ * iocbs that notify through an eventfd (IOCB_FLAG_RESFD) don't get resubmitted, because the
+ * eventfd would be signaled twice for a single event that the app gets.
+ */
+class AsyncIOTk
+{
+	public:
+		static void init();
+		static void enableStats();
+
+		static int submitWithPolicy(aio_context_t ctx, long nr, struct iocb** iocbpp,
+			AIOSubmitFunc submitFunc);
+		static int getEventsWithPolicy(aio_context_t ctx, long minNR, long nr,
+			struct io_event* events, struct timespec* timeout, AIOGetEventsFunc getEventsFunc,
+			AIOSubmitFunc submitFunc);
+		static void forgetContext(aio_context_t ctx);
+		static void writeReport(int fd);
+
+		static int syscallSetup(int maxEvents, aio_context_t* ctxp);
+		static int syscallDestroy(aio_context_t ctx);
+		static int syscallSubmit(aio_context_t ctx, long nr, struct iocb** iocbpp);
+		static int syscallGetEvents(aio_context_t ctx, long minNR, long nr,
+			struct io_event* events, struct timespec* timeout);
+
+	private:
+		AsyncIOTk() {}
+
+		static std::mutex* mutex; // protects resubmittedIOCBs
+		static IOCBCtxMap* resubmittedIOCBs; // resubmitted iocbs that didn't complete yet
+		static std::atomic<size_t> numResubmittedIOCBs; // to skip the lock if map is empty
+
+		static bool statsEnabled;
+		static AsyncIOStatsShard statsShards[ASYNCIO_STATS_NUM_SHARDS];
+
+		static long filterEvents(aio_context_t ctx, struct io_event* events, long numEvents,
+			AIOSubmitFunc submitFunc);
+		static bool resubmitAfterEinval(aio_context_t ctx, struct iocb* iocb,
+			AIOSubmitFunc submitFunc);
+		static bool forgetResubmitted(struct iocb* iocb);
+		static void countSubmitted(struct iocb** iocbpp, long numSubmitted);
+		static void countCompletion(const struct io_event& event);
+		static uint64_t getStatsSum(unsigned counter);
+		static unsigned getThreadShard();
+
+
+		// inliners
+	public:
+		static void countContext()
+		{
+			if(statsEnabled)
+				incStats(ASYNCIO_STATS_CONTEXTS, 1);
+		}
+
+	private:
+		static void incStats(unsigned counter, uint64_t value)
+		{
+			statsShards[getThreadShard()].counters[counter].fetch_add(value,
+				std::memory_order_relaxed);
+		}
+
+		static bool getIsReadWrite(const struct iocb* iocb)
+		{
+			return (iocb->aio_lio_opcode == IOCB_CMD_PREAD) ||
+				(iocb->aio_lio_opcode == IOCB_CMD_PWRITE) ||
+				(iocb->aio_lio_opcode == IOCB_CMD_PREADV) ||
+				(iocb->aio_lio_opcode == IOCB_CMD_PWRITEV);
+		}
+
+		static bool getIsWrite(const struct iocb* iocb)
+		{
+			return (iocb->aio_lio_opcode == IOCB_CMD_PWRITE) ||
+				(iocb->aio_lio_opcode == IOCB_CMD_PWRITEV);
+		}
+};
+
+
+#endif /* ASYNCIO_H_ */
@@ -0,0 +1,199 @@
+#include <cerrno>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "BufferPool.h"
+#include "Config.h"
+#include "Logger.h"
+
+BufferPool* bufferPool = NULL;
+
+
+/**
+ * @maxSize cap for the total size of all buffers; gets rounded down to full buffers.
+ */
+BufferPool::BufferPool(uint64_t maxSize) : maxSize(maxSize - (maxSize % BUFFERPOOL_BUF_SIZE) )
+{
+	numNodes = NumaTk::getNumNodes();
+	nodes = new BufferPoolNode[numNodes];
+
+	// a node mutex that is locked during fork() would stay locked in the child forever
+	pthread_atfork(lockAllNodes, unlockAllNodes, unlockAllNodes);
+}
+
+/**
+ * Get a buffer of BUFFERPOOL_BUF_SIZE, preferably from the node of the calling thread.
+ *
+ * @outNode node of which the buffer needs to be passed back to release().
+ * @return NULL if the pool is exhausted.
+ */
+char* BufferPool::acquire(unsigned& outNode)
+{
+	unsigned threadNode = NumaTk::getThreadNode();
+
+	numAcquires.fetch_add(1, std::memory_order_relaxed);
+
+	char* buf = NULL;
+
+	{
+		BufferPoolNode& node = nodes[threadNode];
+
+		std::unique_lock<std::mutex> lock(node.mutex); // L O C K (scoped)
+
+		if(!node.freeBufs.empty() )
+		{
+			buf = node.freeBufs.back();
+			node.freeBufs.pop_back();
+		}
+	}
+
+	if(buf)
+		outNode = threadNode;
+	else
+	if( (buf = allocBuf(threadNode) ) )
+		outNode = threadNode;
+	else
+	{ // cap reached, so a buffer of a remote node is better than none
+		for(unsigned remoteNode = 0; (remoteNode < numNodes) && !buf; remoteNode++)
+		{
+			BufferPoolNode& node = nodes[remoteNode];
+
+			std::unique_lock<std::mutex> lock(node.mutex); // L O C K (scoped)
+
+			if(node.freeBufs.empty() )
+				continue;
+
+			buf = node.freeBufs.back();
+			node.freeBufs.pop_back();
+
+			outNode = remoteNode;
+		}
+
+		if(!buf)
+		{
+			numCapMisses.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+	}
+
+	uint64_t newInUseSize =
+		inUseSize.fetch_add(BUFFERPOOL_BUF_SIZE, std::memory_order_relaxed) + BUFFERPOOL_BUF_SIZE;
+	uint64_t oldPeakInUseSize = peakInUseSize.load(std::memory_order_relaxed);
+
+	while( (newInUseSize > oldPeakInUseSize) &&
+		!peakInUseSize.compare_exchange_weak(oldPeakInUseSize, newInUseSize,
+			std::memory_order_relaxed) )
+		; // retry with updated oldPeakInUseSize
+
+	return buf;
+}
+
+/**
+ * Give back a buffer from acquire().
+ *
+ * @node as returned by acquire().
+ */
+void BufferPool::release(char* buf, unsigned node)
+{
+	inUseSize.fetch_sub(BUFFERPOOL_BUF_SIZE, std::memory_order_relaxed);
+
+	std::unique_lock<std::mutex> lock(nodes[node].mutex); // L O C K (scoped)
+
+	nodes[node].freeBufs.push_back(buf);
+}
+
+/**
+ * Write the [bufpool] section of the stats report. Does nothing if no buffer was ever requested.
+ */
+void BufferPool::writeReport(int fd)
+{
+	if(!numAcquires.load(std::memory_order_relaxed) )
+		return;
+
+	dprintf(fd, "\n[bufpool]\n");
+	dprintf(fd, "# buffer size: %u; max size: %llu; numa nodes: %u\n",
+		(unsigned)BUFFERPOOL_BUF_SIZE, (unsigned long long)maxSize, numNodes);
+	dprintf(fd, "# allocated_bytes peak_inuse_bytes acquires cap_misses\n");
+	dprintf(fd, "%llu %llu %llu %llu\n",
+		(unsigned long long)allocatedSize.load(std::memory_order_relaxed),
+		(unsigned long long)peakInUseSize.load(std::memory_order_relaxed),
+		(unsigned long long)numAcquires.load(std::memory_order_relaxed),
+		(unsigned long long)numCapMisses.load(std::memory_order_relaxed) );
+	dprintf(fd, "# node buffers free\n");
+
+	for(unsigned node = 0; node < numNodes; node++)
+	{
+		std::unique_lock<std::mutex> lock(nodes[node].mutex); // L O C K (scoped)
+
+		dprintf(fd, "%u %zu %zu\n", node, nodes[node].numBufs, nodes[node].freeBufs.size() );
+	}
+}
+
+/**
+ * Map a new buffer with memory on the given node if the cap allows it.
+ *
+ * @return NULL if cap is reached or mmap failed.
+ */
+char* BufferPool::allocBuf(unsigned node)
+{
+	uint64_t oldAllocatedSize = allocatedSize.load(std::memory_order_relaxed);
+
+	do
+	{
+		if(oldAllocatedSize + BUFFERPOOL_BUF_SIZE > maxSize)
+			return NULL;
+	} while(!allocatedSize.compare_exchange_weak(oldAllocatedSize,
+		oldAllocatedSize + BUFFERPOOL_BUF_SIZE, std::memory_order_relaxed) );
+
+	int savedErrno = errno;
+
+	// twice the size, so that we can cut out a range that is aligned for a huge page
+	void* mapping = mmap(NULL, 2 * BUFFERPOOL_BUF_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if(mapping == MAP_FAILED)
+	{
+		errno = savedErrno;
+
+		allocatedSize.fetch_sub(BUFFERPOOL_BUF_SIZE, std::memory_order_relaxed);
+
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Mapping of pool buffer failed. node: %u\n", node);
+
+		return NULL;
+	}
+
+	uintptr_t alignedStart = ( (uintptr_t)mapping + BUFFERPOOL_BUF_SIZE - 1) &
+		~(uintptr_t)(BUFFERPOOL_BUF_SIZE - 1);
+	size_t headLen = alignedStart - (uintptr_t)mapping;
+
+	if(headLen)
+		munmap(mapping, headLen);
+
+	munmap( (char*)alignedStart + BUFFERPOOL_BUF_SIZE, BUFFERPOOL_BUF_SIZE - headLen);
+
+	madvise( (void*)alignedStart, BUFFERPOOL_BUF_SIZE, MADV_HUGEPAGE);
+
+	NumaTk::bindMemToNode( (void*)alignedStart, BUFFERPOOL_BUF_SIZE, node);
+
+	errno = savedErrno;
+
+	{
+		std::unique_lock<std::mutex> lock(nodes[node].mutex); // L O C K (scoped)
+
+		nodes[node].numBufs++;
+	}
+
+	return (char*)alignedStart;
+}
+
+void BufferPool::lockAllNodes()
+{
+	for(unsigned node = 0; node < bufferPool->numNodes; node++)
+		bufferPool->nodes[node].mutex.lock();
+}
+
+void BufferPool::unlockAllNodes()
+{
+	for(unsigned node = 0; node < bufferPool->numNodes; node++)
+		bufferPool->nodes[node].mutex.unlock();
+}
@@ -0,0 +1,65 @@
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+#include <atomic>
+#include <mutex>
+#include "Common.h"
+#include "Numa.h"
+
+
+#define BUFFERPOOL_BUF_SIZE				(2*1024*1024) // huge page size, so one TLB entry per buffer
+#define BUFFERPOOL_DEFAULT_MAX_SIZE		(64*1024*1024)
+
+
+/**
+ * Free buffers of one NUMA node.
+ */
+class BufferPoolNode
+{
+	public:
+		std::mutex mutex;
+		BufferVec freeBufs;
+		size_t numBufs{0}; // allocated on this node (free or in use)
+};
+
+
+/**
+ * Pool of 2MiB aligned, huge-page backed buffers for the lib's own I/O staging (e.g. the bounce
+ * buffers of VectoredIOTk).
+ *
+ * Each NUMA node has its own free list and buffers are handed out from the node of the CPU that the
+ * calling thread runs on. New buffers get their memory bound to that node before first touch, so a
+ * thread only copies between its own node's memory and the app buffers. Buffers are never given
+ * back to the kernel; instead, the total size of all buffers is capped and acquire() returns NULL
+ * when the cap is reached and the free list of the node is empty.
+ */
+class BufferPool
+{
+	public:
+		BufferPool(uint64_t maxSize);
+
+		char* acquire(unsigned& outNode);
+		void release(char* buf, unsigned node);
+		void writeReport(int fd);
+
+	private:
+		uint64_t maxSize;
+		unsigned numNodes;
+		BufferPoolNode* nodes; // array of numNodes; never deleted, as buffers might be in use
+
+		std::atomic<uint64_t> allocatedSize{0}; // total size of all buffers
+		std::atomic<uint64_t> peakInUseSize{0}; // max total size of buffers handed out at a time
+		std::atomic<uint64_t> inUseSize{0};
+		std::atomic<uint64_t> numAcquires{0};
+		std::atomic<uint64_t> numCapMisses{0}; // acquire() returned NULL because of maxSize
+
+		char* allocBuf(unsigned node);
+
+		static void lockAllNodes();
+		static void unlockAllNodes();
+};
+
+extern BufferPool* bufferPool; // NULL if disabled
+
+
+#endif /* BUFFERPOOL_H_ */
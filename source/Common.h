@@ -72,17 +72,33 @@ typedef std::vector<uint64_t> UInt64Vec;
  */
 #define INTERCEPT_FUNC_DECL(__func)	__func
 
+/**
+ * Lookup of the real function for MAP_OR_FAIL. With O_DIRECT emulation, the real function gets
+ * wrapped by the emulation layer (see DirectEmu.h).
+ */
+#ifdef BUILD_DIRECT_EMULATION
+	#define REAL_FUNC_LOOKUP(__func) \
+		DirectEmu::wrapRealFunc(#__func, dlsym(RTLD_NEXT, #__func) )
+#else
+	#define REAL_FUNC_LOOKUP(__func) \
+		dlsym(RTLD_NEXT, #__func)
+#endif
+
 /**
  * Assign the pointer to an overloaded function to the function pointer declared via FUNC_FORWARD_DECL.
  */
 #define MAP_OR_FAIL(__func) \
-	if (!(__real_ ## __func)) \
+	if(__builtin_expect(!(__real_ ## __func), 0) ) \
 	{ \
-		__real_ ## __func = (__real_ ## __func ## _TYPE)dlsym(RTLD_NEXT, #__func); \
+		__real_ ## __func = (__real_ ## __func ## _TYPE)REAL_FUNC_LOOKUP(__func); \
 		if(!(__real_ ## __func)) { \
 			log_fprintf(stderr, LOG_PREFIX "Failed to find symbol: %s\n", #__func); \
 			exit(1); \
 	} \
 }
 
+#ifdef BUILD_DIRECT_EMULATION
+	#include "DirectEmu.h" // for REAL_FUNC_LOOKUP
+#endif
+
 #endif /* COMMON_H_ */
@@ -1,3 +1,5 @@
+#include <cerrno>
+#include <cstdlib>
 #include "Config.h"
 #include "Logger.h"
 
@@ -6,3 +8,39 @@ int libOpts = 0; // flags
 char libInjectPaths[ENV_PATHS_LEN+1]; // +1 for trailing zero
 
 
+
+/**
+ * Parse a size string with optional unit suffix (e.g. "4096", "8K", "16m", "1G"). Units are base 2,
+ * i.e. "K" is 1024.
+ *
+ * @return false if string is not a valid size.
+ */
+bool parseSizeStr(const char* sizeStr, uint64_t& outSize)
+{
+	char* endPtr;
+
+	errno = 0;
+
+	unsigned long long size = strtoull(sizeStr, &endPtr, 10);
+
+	if( (endPtr == sizeStr) || errno || (*sizeStr == '-') )
+		return false;
+
+	unsigned shift = 0;
+
+	switch(*endPtr)
+	{
+		case 'k': case 'K': shift = 10; endPtr++; break;
+		case 'm': case 'M': shift = 20; endPtr++; break;
+		case 'g': case 'G': shift = 30; endPtr++; break;
+		case 't': case 'T': shift = 40; endPtr++; break;
+		default: break;
+	}
+
+	if(*endPtr || (shift && (size > (UINT64_MAX >> shift) ) ) )
+		return false;
+
+	outSize = (uint64_t)size << shift;
+
+	return true;
+}
@@ -3,10 +3,37 @@
 
 #include "Common.h"
 
-#define ENV_LIB_OPTS				"LD_VAST_OPTS" // no opts defined yet
+#define ENV_LIB_OPTS				"LD_VAST_OPTS" // flags
 #define ENV_LIB_OPT_RAWPATHS		1 // don't normalize paths (e.g. remove ".." and "//")
+#define ENV_LIB_OPT_SYNC_DATAONLY	2 // fsync w/o buffered writes since last sync => fdatasync
+#define ENV_LIB_OPT_SYNC_SKIP		4 // fsync/fdatasync w/o buffered writes since last sync => no-op
+#define ENV_LIB_OPT_SYNC_COALESCE	8 // concurrent syncs of the same file share a single flush
+#define ENV_LIB_OPT_SHARED_PATHS	16 // share compiled path file between processes on a node
+#define ENV_LIB_OPT_ALLOC_HUGEPAGES	32 // huge pages for large allocations (see ENV_LIB_ALLOC_SIZE)
+#define ENV_LIB_OPT_INHERITED_DIRECT	64 // inject O_DIRECT into matching inherited fds at init
+
+#define ENV_LIB_OPTS_SYNC_ELIDE		(ENV_LIB_OPT_SYNC_DATAONLY | ENV_LIB_OPT_SYNC_SKIP)
+#define ENV_LIB_OPTS_SYNC			(ENV_LIB_OPTS_SYNC_ELIDE | ENV_LIB_OPT_SYNC_COALESCE)
 
 #define ENV_LIB_PATHFILE			"LD_VAST_PATHFILE" // paths for which injection is effective
+#define ENV_LIB_FSTYPES				"LD_VAST_FSTYPES" // fstypes for which injection is effective
+
+#define ENV_LIB_SPLIT_SIZE			"LD_VAST_SPLIT_SIZE" // min size of O_DIRECT reads/writes to split
+#define ENV_LIB_SPLIT_CHUNK			"LD_VAST_SPLIT_CHUNK" // size of chunks of split reads/writes
+#define ENV_LIB_SPLIT_THREADS		"LD_VAST_SPLIT_THREADS" // helper threads for split reads/writes
+#define ENV_LIB_SPLIT_FDS			"LD_VAST_SPLIT_FDS" // extra fds per file for split reads/writes
+#define ENV_LIB_SPLIT_NODE			"LD_VAST_SPLIT_NODE" // NUMA node or NIC to pin split threads to
+#define ENV_LIB_BUFPOOL_SIZE		"LD_VAST_BUFPOOL_SIZE" // max total size of pool buffers
+#define ENV_LIB_ALLOC_SIZE			"LD_VAST_ALLOC_SIZE" // min size of page-aligned allocations
+#define ENV_LIB_STATSFILE			"LD_VAST_STATSFILE" // report file written on exit ("%p" => pid)
+#define ENV_LIB_LATENCY				"LD_VAST_LATENCY" // clock for latency histograms in stats file
+#define ENV_LIB_PROFILE_LEARN		"LD_VAST_PROFILE_LEARN" // I/O profile file written on exit
+#define ENV_LIB_PROFILE_APPLY		"LD_VAST_PROFILE_APPLY" // I/O profile file to choose policies
+#define ENV_LIB_TRACEFILE			"LD_VAST_TRACEFILE" // binary I/O trace file ("%p" => pid)
+#define ENV_LIB_MMAP_SIZE			"LD_VAST_MMAP_SIZE" // min size of mmaps to serve from direct reads
+#define ENV_LIB_MMAP_MAXSIZE		"LD_VAST_MMAP_MAXSIZE" // max size of mmaps to serve from direct reads
+#define ENV_LIB_EMU_BLOCKSIZE		"LD_VAST_EMU_BLOCKSIZE" // O_DIRECT emulation alignment
+#define ENV_LIB_EMU_DELAY			"LD_VAST_EMU_DELAY" // O_DIRECT emulation delay per read/write (usecs)
 
 
 extern int libLogTopics; // flags
@@ -15,4 +42,7 @@ extern int libOpts; // flags
 extern char libInjectPaths[ENV_PATHS_LEN+1]; // +1 for trailing zero
 
 
+bool parseSizeStr(const char* sizeStr, uint64_t& outSize);
+
+
 #endif /* CONFIG_H_ */
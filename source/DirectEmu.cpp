@@ -0,0 +1,526 @@
+#ifdef BUILD_DIRECT_EMULATION
+
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include "DirectEmu.h"
+#include "Logger.h"
+
+std::atomic<bool> DirectEmu::directFDs[DIRECTEMU_MAX_FDS];
+uint64_t DirectEmu::blockSize = DIRECTEMU_DEFAULT_BLOCK_SIZE;
+uint64_t DirectEmu::delayUSecs = 0;
+
+
+// the actual libc functions below the emulation (set by wrapRealFunc() )
+
+typedef int (*OpenFunc)(const char* path, int flags, ...);
+typedef int (*Open2Func)(const char* path, int flags);
+typedef int (*OpenatFunc)(int dirfd, const char* path, int flags, ...);
+typedef int (*Openat2Func)(int dirfd, const char* path, int flags);
+typedef int (*CreatFunc)(const char* path, mode_t mode);
+typedef ssize_t (*ReadFunc)(int fd, void* buf, size_t count);
+typedef ssize_t (*WriteFunc)(int fd, const void* buf, size_t count);
+typedef ssize_t (*PreadFunc)(int fd, void* buf, size_t count, off64_t offset);
+typedef ssize_t (*PwriteFunc)(int fd, const void* buf, size_t count, off64_t offset);
+typedef ssize_t (*ReadvFunc)(int fd, const struct iovec* iov, int iovcnt);
+typedef ssize_t (*PreadvFunc)(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+typedef ssize_t (*Preadv2Func)(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags);
+typedef int (*CloseFunc)(int fd);
+typedef int (*FcloseFunc)(FILE* stream);
+typedef int (*ClosedirFunc)(DIR* dirp);
+typedef int (*FcntlFunc)(int fd, int cmd, ...);
+
+static OpenFunc realOpen, realOpen64;
+static Open2Func realOpen2, realOpen64_2;
+static OpenatFunc realOpenat, realOpenat64;
+static Openat2Func realOpenat2, realOpenat64_2;
+static CreatFunc realCreat, realCreat64;
+static ReadFunc realRead;
+static WriteFunc realWrite;
+static PreadFunc realPread, realPread64;
+static PwriteFunc realPwrite, realPwrite64;
+static ReadvFunc realReadv, realWritev;
+static PreadvFunc realPreadv, realPreadv64, realPwritev, realPwritev64;
+static Preadv2Func realPreadv2, realPreadv64v2, realPwritev2, realPwritev64v2;
+static CloseFunc realClose;
+static FcloseFunc realFclose;
+static ClosedirFunc realClosedir;
+static FcntlFunc realFcntl, realFcntl64;
+
+
+/**
+ * @return mode argument of an open call (only given with O_CREAT or O_TMPFILE).
+ */
+#define DIRECTEMU_GET_MODE(lastArg, flags) \
+	({ \
+		mode_t mode = 0; \
+		if( (flags) & (O_CREAT | O_TMPFILE) ) \
+		{ \
+			va_list args; \
+			va_start(args, lastArg); \
+			mode = va_arg(args, int); \
+			va_end(args); \
+		} \
+		mode; \
+	})
+
+
+static int emuOpen(const char* path, int flags, ...)
+{
+	int fd = realOpen(path, DirectEmu::stripOpenFlags(flags), DIRECTEMU_GET_MODE(flags, flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpen64(const char* path, int flags, ...)
+{
+	int fd = realOpen64(path, DirectEmu::stripOpenFlags(flags),
+		DIRECTEMU_GET_MODE(flags, flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpen2(const char* path, int flags)
+{
+	int fd = realOpen2(path, DirectEmu::stripOpenFlags(flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpen64_2(const char* path, int flags)
+{
+	int fd = realOpen64_2(path, DirectEmu::stripOpenFlags(flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpenat(int dirfd, const char* path, int flags, ...)
+{
+	int fd = realOpenat(dirfd, path, DirectEmu::stripOpenFlags(flags),
+		DIRECTEMU_GET_MODE(flags, flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpenat64(int dirfd, const char* path, int flags, ...)
+{
+	int fd = realOpenat64(dirfd, path, DirectEmu::stripOpenFlags(flags),
+		DIRECTEMU_GET_MODE(flags, flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpenat2(int dirfd, const char* path, int flags)
+{
+	int fd = realOpenat2(dirfd, path, DirectEmu::stripOpenFlags(flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuOpenat64_2(int dirfd, const char* path, int flags)
+{
+	int fd = realOpenat64_2(dirfd, path, DirectEmu::stripOpenFlags(flags) );
+	DirectEmu::setOpenResult(fd, flags);
+	return fd;
+}
+
+static int emuCreat(const char* path, mode_t mode)
+{
+	int fd = realCreat(path, mode);
+	DirectEmu::setOpenResult(fd, 0);
+	return fd;
+}
+
+static int emuCreat64(const char* path, mode_t mode)
+{
+	int fd = realCreat64(path, mode);
+	DirectEmu::setOpenResult(fd, 0);
+	return fd;
+}
+
+static ssize_t emuRead(int fd, void* buf, size_t count)
+{
+	if(DirectEmu::getIsDirect(fd) &&
+		!DirectEmu::checkIO(fd, buf, count, lseek64(fd, 0, SEEK_CUR) ) )
+		return -1;
+
+	return realRead(fd, buf, count);
+}
+
+static ssize_t emuWrite(int fd, const void* buf, size_t count)
+{
+	if(DirectEmu::getIsDirect(fd) &&
+		!DirectEmu::checkIO(fd, buf, count, lseek64(fd, 0, SEEK_CUR) ) )
+		return -1;
+
+	return realWrite(fd, buf, count);
+}
+
+static ssize_t emuPread(int fd, void* buf, size_t count, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIO(fd, buf, count, offset) )
+		return -1;
+
+	return realPread(fd, buf, count, offset);
+}
+
+static ssize_t emuPread64(int fd, void* buf, size_t count, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIO(fd, buf, count, offset) )
+		return -1;
+
+	return realPread64(fd, buf, count, offset);
+}
+
+static ssize_t emuPwrite(int fd, const void* buf, size_t count, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIO(fd, buf, count, offset) )
+		return -1;
+
+	return realPwrite(fd, buf, count, offset);
+}
+
+static ssize_t emuPwrite64(int fd, const void* buf, size_t count, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIO(fd, buf, count, offset) )
+		return -1;
+
+	return realPwrite64(fd, buf, count, offset);
+}
+
+static ssize_t emuReadv(int fd, const struct iovec* iov, int iovcnt)
+{
+	if(DirectEmu::getIsDirect(fd) &&
+		!DirectEmu::checkIOV(fd, iov, iovcnt, lseek64(fd, 0, SEEK_CUR) ) )
+		return -1;
+
+	return realReadv(fd, iov, iovcnt);
+}
+
+static ssize_t emuWritev(int fd, const struct iovec* iov, int iovcnt)
+{
+	if(DirectEmu::getIsDirect(fd) &&
+		!DirectEmu::checkIOV(fd, iov, iovcnt, lseek64(fd, 0, SEEK_CUR) ) )
+		return -1;
+
+	return realWritev(fd, iov, iovcnt);
+}
+
+static ssize_t emuPreadv(int fd, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt, offset) )
+		return -1;
+
+	return realPreadv(fd, iov, iovcnt, offset);
+}
+
+static ssize_t emuPreadv64(int fd, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt, offset) )
+		return -1;
+
+	return realPreadv64(fd, iov, iovcnt, offset);
+}
+
+static ssize_t emuPwritev(int fd, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt, offset) )
+		return -1;
+
+	return realPwritev(fd, iov, iovcnt, offset);
+}
+
+static ssize_t emuPwritev64(int fd, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt, offset) )
+		return -1;
+
+	return realPwritev64(fd, iov, iovcnt, offset);
+}
+
+// note: offset -1 (current file position) of the ...v2 functions is checked like any other offset
+
+static ssize_t emuPreadv2(int fd, const struct iovec* iov, int iovcnt, off64_t offset, int flags)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt,
+		(offset == -1) ? lseek64(fd, 0, SEEK_CUR) : offset) )
+		return -1;
+
+	return realPreadv2(fd, iov, iovcnt, offset, flags);
+}
+
+static ssize_t emuPreadv64v2(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt,
+		(offset == -1) ? lseek64(fd, 0, SEEK_CUR) : offset) )
+		return -1;
+
+	return realPreadv64v2(fd, iov, iovcnt, offset, flags);
+}
+
+static ssize_t emuPwritev2(int fd, const struct iovec* iov, int iovcnt, off64_t offset, int flags)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt,
+		(offset == -1) ? lseek64(fd, 0, SEEK_CUR) : offset) )
+		return -1;
+
+	return realPwritev2(fd, iov, iovcnt, offset, flags);
+}
+
+static ssize_t emuPwritev64v2(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags)
+{
+	if(DirectEmu::getIsDirect(fd) && !DirectEmu::checkIOV(fd, iov, iovcnt,
+		(offset == -1) ? lseek64(fd, 0, SEEK_CUR) : offset) )
+		return -1;
+
+	return realPwritev64v2(fd, iov, iovcnt, offset, flags);
+}
+
+static int emuClose(int fd)
+{
+	DirectEmu::setIsDirect(fd, false);
+
+	return realClose(fd);
+}
+
+static int emuFclose(FILE* stream)
+{
+	DirectEmu::setIsDirect(fileno(stream), false);
+
+	return realFclose(stream);
+}
+
+static int emuClosedir(DIR* dirp)
+{
+	DirectEmu::setIsDirect(dirfd(dirp), false);
+
+	return realClosedir(dirp);
+}
+
+
+/**
+ * Emulate the O_DIRECT flag for F_GETFL/F_SETFL, pass everything else through.
+ */
+static int emuFcntl(FcntlFunc fcntlFunc, int fd, int cmd, void* arg)
+{
+	if(cmd == F_GETFL)
+	{
+		int flags = fcntlFunc(fd, cmd);
+
+		if( (flags != -1) && DirectEmu::getIsDirect(fd) )
+			flags |= O_DIRECT;
+
+		return flags;
+	}
+
+	if(cmd == F_SETFL)
+	{
+		int flags = (int)(intptr_t)arg;
+
+		int setRes = fcntlFunc(fd, cmd, flags & ~O_DIRECT);
+
+		if(setRes != -1)
+			DirectEmu::setIsDirect(fd, flags & O_DIRECT);
+
+		return setRes;
+	}
+
+	return fcntlFunc(fd, cmd, arg);
+}
+
+/* fcntl is not intercepted otherwise, so it's interposed directly here to let the lib and the app
+	see the emulated O_DIRECT flag */
+
+extern "C" int fcntl(int fd, int cmd, ...)
+{
+	va_list args;
+	va_start(args, cmd);
+	void* arg = va_arg(args, void*); // all fcntl args fit into a pointer
+	va_end(args);
+
+	if(!realFcntl)
+		realFcntl = (FcntlFunc)dlsym(RTLD_NEXT, "fcntl");
+
+	return emuFcntl(realFcntl, fd, cmd, arg);
+}
+
+extern "C" int fcntl64(int fd, int cmd, ...)
+{
+	va_list args;
+	va_start(args, cmd);
+	void* arg = va_arg(args, void*);
+	va_end(args);
+
+	if(!realFcntl64)
+		realFcntl64 = (FcntlFunc)dlsym(RTLD_NEXT, "fcntl64");
+
+	return emuFcntl(realFcntl64 ? realFcntl64 : realFcntl, fd, cmd, arg);
+}
+
+
+/**
+ * Used by MAP_OR_FAIL to put the emulation between the interceptors and libc.
+ *
+ * @funcName name of the libc function.
+ * @realFunc libc function as returned by dlsym.
+ * @return emulation wrapper of the given function or realFunc if the function is not emulated.
+ */
+void* DirectEmu::wrapRealFunc(const char* funcName, void* realFunc)
+{
+	struct WrappedFunc
+	{
+		const char* name;
+		void* wrapper;
+		void** real;
+	};
+
+	static const WrappedFunc wrappedFuncs[] =
+	{
+		{"open", (void*)emuOpen, (void**)&realOpen},
+		{"open64", (void*)emuOpen64, (void**)&realOpen64},
+		{"__open_2", (void*)emuOpen2, (void**)&realOpen2},
+		{"__open64_2", (void*)emuOpen64_2, (void**)&realOpen64_2},
+		{"openat", (void*)emuOpenat, (void**)&realOpenat},
+		{"openat64", (void*)emuOpenat64, (void**)&realOpenat64},
+		{"__openat_2", (void*)emuOpenat2, (void**)&realOpenat2},
+		{"__openat64_2", (void*)emuOpenat64_2, (void**)&realOpenat64_2},
+		{"creat", (void*)emuCreat, (void**)&realCreat},
+		{"creat64", (void*)emuCreat64, (void**)&realCreat64},
+		{"read", (void*)emuRead, (void**)&realRead},
+		{"write", (void*)emuWrite, (void**)&realWrite},
+		{"pread", (void*)emuPread, (void**)&realPread},
+		{"pread64", (void*)emuPread64, (void**)&realPread64},
+		{"pwrite", (void*)emuPwrite, (void**)&realPwrite},
+		{"pwrite64", (void*)emuPwrite64, (void**)&realPwrite64},
+		{"readv", (void*)emuReadv, (void**)&realReadv},
+		{"writev", (void*)emuWritev, (void**)&realWritev},
+		{"preadv", (void*)emuPreadv, (void**)&realPreadv},
+		{"preadv64", (void*)emuPreadv64, (void**)&realPreadv64},
+		{"preadv2", (void*)emuPreadv2, (void**)&realPreadv2},
+		{"preadv64v2", (void*)emuPreadv64v2, (void**)&realPreadv64v2},
+		{"pwritev", (void*)emuPwritev, (void**)&realPwritev},
+		{"pwritev64", (void*)emuPwritev64, (void**)&realPwritev64},
+		{"pwritev2", (void*)emuPwritev2, (void**)&realPwritev2},
+		{"pwritev64v2", (void*)emuPwritev64v2, (void**)&realPwritev64v2},
+		{"close", (void*)emuClose, (void**)&realClose},
+		{"fclose", (void*)emuFclose, (void**)&realFclose},
+		{"closedir", (void*)emuClosedir, (void**)&realClosedir},
+	};
+
+	if(!realFunc)
+		return NULL;
+
+	for(const WrappedFunc& wrappedFunc : wrappedFuncs)
+	{
+		if(strcmp(funcName, wrappedFunc.name) )
+			continue;
+
+		__atomic_store_n(wrappedFunc.real, realFunc, __ATOMIC_RELEASE);
+
+		return wrappedFunc.wrapper;
+	}
+
+	return realFunc;
+}
+
+/**
+ * Set emulation parameters. (Before this, the emulation already works with default parameters.)
+ *
+ * @blockSize logical block size for alignment checks; must be a power of two.
+ * @delayUSecs delay that gets added to each read/write on an O_DIRECT fd.
+ */
+void DirectEmu::init(uint64_t blockSize, uint64_t delayUSecs)
+{
+	DirectEmu::blockSize = blockSize;
+	DirectEmu::delayUSecs = delayUSecs;
+}
+
+/**
+ * @return flags for the actual open, i.e. without O_DIRECT.
+ */
+int DirectEmu::stripOpenFlags(int flags)
+{
+	return flags & ~O_DIRECT;
+}
+
+/**
+ * Remember O_DIRECT state of a newly opened fd. (The fd number might have been used for an O_DIRECT
+ * file before, which was closed in a way that we didn't see.)
+ *
+ * @fd result of the open call; nothing happens if this is -1.
+ * @origFlags open flags as given by the caller (i.e. possibly with O_DIRECT).
+ */
+void DirectEmu::setOpenResult(int fd, int origFlags)
+{
+	int origErrno = errno;
+
+	setIsDirect(fd, origFlags & O_DIRECT);
+
+	errno = origErrno;
+}
+
+/**
+ * Check alignment of a read/write on an O_DIRECT fd and add the configured delay.
+ *
+ * @offset file offset of the read/write.
+ * @return false and errno EINVAL if the kernel would reject this on a real block device.
+ */
+bool DirectEmu::checkIO(int fd, const void* buf, size_t count, off64_t offset)
+{
+	if(!getIsAligned( (uintptr_t)buf) || !getIsAligned(count) ||
+		( (offset != -1) && !getIsAligned(offset) ) )
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	delay();
+
+	return true;
+}
+
+/**
+ * Same as checkIO() for all buffers of a vectored read/write.
+ */
+bool DirectEmu::checkIOV(int fd, const struct iovec* iov, int iovcnt, off64_t offset)
+{
+	if( (offset != -1) && !getIsAligned(offset) )
+	{
+		errno = EINVAL;
+		return false;
+	}
+
+	for(int i=0; i < iovcnt; i++)
+	{
+		if(!getIsAligned( (uintptr_t)iov[i].iov_base) || !getIsAligned(iov[i].iov_len) )
+		{
+			errno = EINVAL;
+			return false;
+		}
+	}
+
+	delay();
+
+	return true;
+}
+
+void DirectEmu::delay()
+{
+	if(!delayUSecs)
+		return;
+
+	struct timespec delayTime;
+
+	delayTime.tv_sec = delayUSecs / 1000000;
+	delayTime.tv_nsec = (delayUSecs % 1000000) * 1000;
+
+	while(clock_nanosleep(CLOCK_MONOTONIC, 0, &delayTime, &delayTime) == EINTR)
+		; // continue with remaining time
+}
+
+
+#endif // BUILD_DIRECT_EMULATION
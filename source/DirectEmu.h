@@ -0,0 +1,82 @@
+#ifndef DIRECTEMU_H_
+#define DIRECTEMU_H_
+
+#ifdef BUILD_DIRECT_EMULATION
+
+#include <atomic>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "Common.h"
+
+
+#define DIRECTEMU_MAX_FDS				65536 // fds beyond this never get emulated O_DIRECT
+#define DIRECTEMU_DEFAULT_BLOCK_SIZE	4096
+
+
+/**
+ * Test backend that emulates O_DIRECT on any filesystem (e.g. tmpfs), so that injection, ejection
+ * after EINVAL and split reads/writes can be tested without special mounts.
+ *
+ * The emulation sits beneath the __real_... function pointers of the interceptors (see
+ * MAP_OR_FAIL): O_DIRECT gets removed from the flags that reach the kernel and is instead
+ * remembered per fd. Reads and writes on such fds fail with EINVAL exactly where the kernel would
+ * fail them for a device with the configured logical block size, i.e. if buffer address, length or
+ * file offset are not aligned. fcntl() is interposed to report and set the emulated O_DIRECT flag.
+ *
+ * Limitations: The state is per fd, not per open file description (so dup'ed fds don't share it),
+ * reads/writes that glibc does internally (e.g. for stdio streams) are not checked, and neither are
+ * AIO requests (io_submit), which the kernel executes without O_DIRECT.
+ *
+ * Only compiled in with "make BUILD_DIRECT_EMULATION=1".
+ */
+class DirectEmu
+{
+	public:
+		static void init(uint64_t blockSize, uint64_t delayUSecs);
+		static void* wrapRealFunc(const char* funcName, void* realFunc);
+
+		static int stripOpenFlags(int flags);
+		static void setOpenResult(int fd, int origFlags);
+		static bool checkIO(int fd, const void* buf, size_t count, off64_t offset);
+		static bool checkIOV(int fd, const struct iovec* iov, int iovcnt, off64_t offset);
+
+	private:
+		DirectEmu() {}
+
+		static std::atomic<bool> directFDs[DIRECTEMU_MAX_FDS];
+		static uint64_t blockSize;
+		static uint64_t delayUSecs; // added to each read/write on an O_DIRECT fd
+
+		static void delay();
+
+
+		// inliners
+	public:
+		static bool getIsDirect(int fd)
+		{
+			return (fd >= 0) && (fd < DIRECTEMU_MAX_FDS) &&
+				directFDs[fd].load(std::memory_order_relaxed);
+		}
+
+		static void setIsDirect(int fd, bool isDirect)
+		{
+			if( (fd >= 0) && (fd < DIRECTEMU_MAX_FDS) )
+				directFDs[fd].store(isDirect, std::memory_order_relaxed);
+		}
+
+		static uint64_t getBlockSize()
+		{
+			return blockSize;
+		}
+
+	private:
+		static bool getIsAligned(uint64_t value)
+		{
+			return !(value & (blockSize - 1) );
+		}
+};
+
+
+#endif // BUILD_DIRECT_EMULATION
+
+#endif /* DIRECTEMU_H_ */
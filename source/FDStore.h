@@ -1,13 +1,44 @@
 #ifndef FDSTORE_H_
 #define FDSTORE_H_
 
+#include <algorithm>
 #include <map>
 #include <mutex>
 #include <string>
 #include "Common.h"
+#include "PathTree.h"
+#include "RealFuncs.h"
 
 
-typedef std::map<int, std::string> FDMap;
+#define FDSTORE_FLAG_DIRECT		1 // O_DIRECT is set on this fd (injected or by app)
+#define FDSTORE_FLAG_DIRTY		2 // buffered (non-O_DIRECT) write since last fsync/fdatasync
+#define FDSTORE_FLAG_NOSPLIT	4 // reads/writes of this fd can't be split (e.g. O_APPEND)
+#define FDSTORE_FLAG_MATCHED	8 // path matched a path file rule
+#define FDSTORE_FLAG_SPLITOPEN	16 // a thread is opening the extra fds for split reads/writes
+
+
+class ProfileFile;
+class ThrottleRule;
+
+
+class FDStoreEntry
+{
+	public:
+		FDStoreEntry() {}
+		FDStoreEntry(PathTreeNode* pathNode) : pathNode(pathNode) {}
+
+		PathTreeNode* pathNode{NULL}; // holds a reference of the pathTree node
+		int flags{0}; // FDSTORE_FLAG_...
+		IntVec splitFDs; // extra fds of the same file for split reads/writes (owned by the store)
+		uint64_t preallocExtent{0}; // size to fallocate ahead of writes; 0 if not preallocating
+		uint64_t preallocEnd{0}; // file offset up to which we preallocated; 0 if nothing to trim
+		ThrottleRule* throttleRule{NULL}; // limits of matching rule; NULL if unlimited
+		ProfileFile* profileFile{NULL}; // learn mode counters of the path; NULL if not learning
+		uint64_t profileNextOffset{0}; // end of last read/write for learn mode
+		uint32_t tracePathID{0}; // path ID in the I/O trace; 0 if not tracing
+};
+
+typedef std::map<int, FDStoreEntry> FDMap;
 typedef FDMap::iterator FDMapIter;
 typedef FDMap::const_iterator FDMapConstIter;
 
@@ -22,42 +53,262 @@ class FDStore
 
 		// inliners
 	public:
-		void addFD(int fd, std::string path)
+		/**
+		 * @pathNode the store takes over the caller's reference of this pathTree node.
+		 */
+		void addFD(int fd, PathTreeNode* pathNode)
 		{
-			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+			FDStoreEntry oldEntry; // fd number might have been reused without us seeing the close
+
+			{
+				std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+				FDStoreEntry& entry = fdMap[fd];
 
-			fdMap[fd] = path;
+				std::swap(oldEntry, entry);
+
+				entry.pathNode = pathNode;
+			}
+
+			releaseEntry(oldEntry);
 		}
 
 		void removeFD(int fd)
+		{
+			FDStoreEntry oldEntry;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+				FDMapIter iter = fdMap.find(fd);
+
+				if(iter == fdMap.end() )
+					return;
+
+				std::swap(oldEntry, iter->second);
+
+				fdMap.erase(iter);
+			}
+
+			releaseEntry(oldEntry);
+		}
+
+		bool getIsFDInStore(int fd)
 		{
 			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
 
-			fdMap.erase(fd);
+			return (fdMap.find(fd) != fdMap.end() );
 		}
 
-		void removeFD(int fd, std::string& outRemovedPath)
+		/**
+		 * @outString materialized path of the fd.
+		 * @return false if fd not found in store.
+		 */
+		bool getFD(int fd, std::string& outString)
 		{
 			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
 
 			FDMapConstIter iter = fdMap.find(fd);
 
 			if(iter == fdMap.end() )
+				return false;
+
+			// node can't go away while the entry exists, so no need for a reference here
+			outString = PathTree::materialize(iter->second.pathNode);
+
+			return true;
+		}
+
+		/**
+		 * @outPathNode path node of the fd with a reference for the caller (to be given back via
+		 * 		pathTree->release() ).
+		 * @return false if fd not found in store.
+		 */
+		bool getFDPathNode(int fd, PathTreeNode*& outPathNode)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapConstIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outPathNode = iter->second.pathNode;
+
+			pathTree->acquire(outPathNode);
+
+			return true;
+		}
+
+		/**
+		 * @outFlags FDSTORE_FLAG_... of the given fd.
+		 * @return false if fd not found in store.
+		 */
+		bool getFDFlags(int fd, int& outFlags)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapConstIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outFlags = iter->second.flags;
+
+			return true;
+		}
+
+		/**
+		 * @setFlags FDSTORE_FLAG_... to add; @unsetFlags FDSTORE_FLAG_... to remove.
+		 * @return false if fd not found in store.
+		 */
+		bool updateFDFlags(int fd, int setFlags, int unsetFlags)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			iter->second.flags = (iter->second.flags & ~unsetFlags) | setFlags;
+
+			return true;
+		}
+
+		/**
+		 * Set FDSTORE_FLAG_DIRTY if the fd is not in O_DIRECT mode.
+		 */
+		void markBufferedWrite(int fd)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if( (iter == fdMap.end() ) || (iter->second.flags & FDSTORE_FLAG_DIRECT) )
 				return;
 
-			outRemovedPath = iter->second;
+			iter->second.flags |= FDSTORE_FLAG_DIRTY;
+		}
+
+		/**
+		 * Remove FDSTORE_FLAG_DIRTY from the fd, so that writes from here on will set it again.
+		 *
+		 * @outFlags flags of the fd before the dirty flag was cleared.
+		 * @return false if fd not found in store.
+		 */
+		bool testAndClearDirty(int fd, int& outFlags)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outFlags = iter->second.flags;
+
+			iter->second.flags &= ~FDSTORE_FLAG_DIRTY;
 
-			fdMap.erase(iter);
+			return true;
 		}
 
-		bool getIsFDInStore(int fd)
+		/**
+		 * @outFlags FDSTORE_FLAG_... of the given fd.
+		 * @outSplitFDs extra fds for split reads/writes; empty if not opened yet.
+		 * @return false if fd not found in store.
+		 */
+		bool getSplitFDs(int fd, int& outFlags, IntVec& outSplitFDs)
 		{
 			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
 
-			return (fdMap.find(fd) != fdMap.end() );
+			FDMapConstIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outFlags = iter->second.flags;
+			outSplitFDs = iter->second.splitFDs;
+
+			return true;
 		}
 
-		bool getFD(int fd, std::string& outString)
+		/**
+		 * Claim opening of the extra fds for split reads/writes of the given fd, so that only a
+		 * single thread opens them. Otherwise a thread that lost the race would have to close its
+		 * extra fds again, which releases the POSIX record locks of the app on the file.
+		 *
+		 * @return true if the caller has to open the extra fds and pass them to setSplitFDs(); false
+		 * 		if fd not found in store or if the extra fds are open or being opened already.
+		 */
+		bool claimSplitFDs(int fd)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if( (iter == fdMap.end() ) || (iter->second.flags & FDSTORE_FLAG_SPLITOPEN) ||
+				!iter->second.splitFDs.empty() )
+				return false;
+
+			iter->second.flags |= FDSTORE_FLAG_SPLITOPEN;
+
+			return true;
+		}
+
+		/**
+		 * Hand over extra fds for split reads/writes to the store after claimSplitFDs(). The store
+		 * closes them together with the fd.
+		 *
+		 * @splitFDs empty if no extra fd could be opened, which marks the fd as not splittable.
+		 * @return false if the fd was closed (and maybe reused) in the meantime, in which case the
+		 * 		caller keeps ownership of the given splitFDs.
+		 */
+		bool setSplitFDs(int fd, const IntVec& splitFDs)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if( (iter == fdMap.end() ) || !(iter->second.flags & FDSTORE_FLAG_SPLITOPEN) )
+				return false;
+
+			iter->second.flags &= ~FDSTORE_FLAG_SPLITOPEN;
+
+			if(splitFDs.empty() )
+				iter->second.flags |= FDSTORE_FLAG_NOSPLIT;
+			else
+				iter->second.splitFDs = splitFDs;
+
+			return true;
+		}
+
+		/**
+		 * Set preallocation state of a newly created file (see PreallocTk).
+		 *
+		 * @return false if fd not found in store.
+		 */
+		bool setPrealloc(int fd, uint64_t preallocExtent, uint64_t preallocEnd)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			iter->second.preallocExtent = preallocExtent;
+			iter->second.preallocEnd = preallocEnd;
+
+			return true;
+		}
+
+		/**
+		 * @outPreallocExtent 0 if fd is not preallocating (anymore).
+		 * @outPreallocEnd 0 if nothing was preallocated.
+		 * @return false if fd not found in store.
+		 */
+		bool getPrealloc(int fd, uint64_t& outPreallocExtent, uint64_t& outPreallocEnd)
 		{
 			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
 
@@ -66,11 +317,222 @@ class FDStore
 			if(iter == fdMap.end() )
 				return false;
 
-			outString = iter->second;
+			outPreallocExtent = iter->second.preallocExtent;
+			outPreallocEnd = iter->second.preallocEnd;
+
+			return true;
+		}
+
+		/**
+		 * Reserve the next range to preallocate if the end of a write comes within half an extent
+		 * of the preallocated end. The preallocated end gets moved before the caller calls
+		 * fallocate, so that concurrent writers don't preallocate the same range.
+		 *
+		 * @outOffset @outLen range that the caller should fallocate.
+		 * @return false if nothing needs to be preallocated.
+		 */
+		bool reservePreallocRange(int fd, uint64_t writeOffset, uint64_t writeEnd,
+			uint64_t& outOffset, uint64_t& outLen)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() || !iter->second.preallocExtent)
+				return false;
+
+			const uint64_t extent = iter->second.preallocExtent;
+			uint64_t& preallocEnd = iter->second.preallocEnd;
+
+			if( (writeEnd + (extent / 2) ) <= preallocEnd)
+				return false;
+
+			// start at the write (e.g. after a seek) or where the last preallocation ended
+			outOffset = std::max(preallocEnd, writeOffset - (writeOffset % extent) );
+
+			preallocEnd = (writeEnd - (writeEnd % extent) ) + (2 * extent);
+
+			outLen = preallocEnd - outOffset;
 
 			return true;
 		}
 
+		/**
+		 * Stop further preallocation for this fd (e.g. if fallocate is not supported), but keep
+		 * the preallocated end for the trim on close.
+		 */
+		void disablePrealloc(int fd)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter != fdMap.end() )
+				iter->second.preallocExtent = 0;
+		}
+
+		/**
+		 * Set the limits of the rule that the fd matched (see ThrottleTk).
+		 *
+		 * @return false if fd not found in store.
+		 */
+		bool setThrottleRule(int fd, ThrottleRule* throttleRule)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			iter->second.throttleRule = throttleRule;
+
+			return true;
+		}
+
+		/**
+		 * @outThrottleRule NULL if the fd has no limits.
+		 * @return false if fd not found in store.
+		 */
+		bool getThrottleRule(int fd, ThrottleRule*& outThrottleRule)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapConstIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outThrottleRule = iter->second.throttleRule;
+
+			return true;
+		}
+
+		/**
+		 * Set the learn mode counters of the fd's path (see ProfileTk).
+		 *
+		 * @return false if fd not found in store.
+		 */
+		bool setProfileFile(int fd, ProfileFile* profileFile)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			iter->second.profileFile = profileFile;
+
+			return true;
+		}
+
+		/**
+		 * @outProfileFile NULL if the fd is not being learned.
+		 * @return false if fd not found in store.
+		 */
+		bool getProfileFile(int fd, ProfileFile*& outProfileFile)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapConstIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outProfileFile = iter->second.profileFile;
+
+			return true;
+		}
+
+		/**
+		 * Move the learn mode position of the fd behind the given read/write.
+		 *
+		 * @offset -1 for the current file position, which is assumed to be the end of the previous
+		 * 		read/write (lseek is not intercepted).
+		 * @count bytes actually read/written.
+		 * @outProfileFile NULL if the fd is not being learned.
+		 * @outOffset file offset of the read/write.
+		 * @outIsSequential true if the read/write started where the previous one ended.
+		 * @return false if fd not found in store.
+		 */
+		bool advanceProfileOffset(int fd, off64_t offset, size_t count,
+			ProfileFile*& outProfileFile, uint64_t& outOffset, bool& outIsSequential)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outProfileFile = iter->second.profileFile;
+
+			if(!outProfileFile)
+				return true;
+
+			uint64_t& nextOffset = iter->second.profileNextOffset;
+
+			outOffset = (offset == -1) ? nextOffset : offset;
+			outIsSequential = (outOffset == nextOffset);
+
+			nextOffset = outOffset + count;
+
+			return true;
+		}
+
+		/**
+		 * Set the path ID of the fd in the I/O trace (see TraceTk).
+		 *
+		 * @return false if fd not found in store.
+		 */
+		bool setTracePathID(int fd, uint32_t tracePathID)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			iter->second.tracePathID = tracePathID;
+
+			return true;
+		}
+
+		/**
+		 * @outTracePathID 0 if the fd has no path ID in the I/O trace.
+		 * @outFlags FDSTORE_FLAG_... of the given fd.
+		 * @return false if fd not found in store.
+		 */
+		bool getTraceInfo(int fd, uint32_t& outTracePathID, int& outFlags)
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			FDMapConstIter iter = fdMap.find(fd);
+
+			if(iter == fdMap.end() )
+				return false;
+
+			outTracePathID = iter->second.tracePathID;
+			outFlags = iter->second.flags;
+
+			return true;
+		}
+
+	private:
+		/**
+		 * Release the resources of an entry that was removed from the map.
+		 */
+		static void releaseEntry(FDStoreEntry& entry)
+		{
+			if(entry.pathNode)
+				pathTree->release(entry.pathNode);
+
+			for(int splitFD : entry.splitFDs)
+				RealFuncs::close(splitFD);
+		}
+
 };
 
 extern FDStore* fdStore;
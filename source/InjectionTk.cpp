@@ -1,6 +1,25 @@
-#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <climits>
+#include <dirent.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 #include "InjectionTk.h"
+#include "Prealloc.h"
+#include "Probes.h"
+#include "Profile.h"
+#include "RealFuncs.h"
+#include "Throttle.h"
+#include "Trace.h"
+
+std::atomic<uint64_t> InjectionTk::dirFDResolveWindowSec(0);
+std::atomic<unsigned> InjectionTk::dirFDResolveWindowCount(0);
+std::atomic<uint64_t> InjectionTk::numDirFDsResolved(0);
+std::atomic<uint64_t> InjectionTk::numDirFDsUnresolvable(0);
+std::atomic<uint64_t> InjectionTk::numDirFDsRateLimited(0);
+
 
 /**
  * Used after an open()-style operation to check for a path match to inject O_DIRECT and to add the
@@ -10,74 +29,435 @@
  *
  * @flags as in "open(const char *pathname, int flags, mode_t mode)"
  */
-void InjectionTk::injectAfterOpen(int fd, std::string path, int flags)
+void InjectionTk::injectAfterOpen(int fd, const char* path, int flags)
 {
-	if( (path.length() > 1) && (path[0] != '/') )
-	{ // path is relative to current working dir, so make it absolute
+	const bool normalize = !(libOpts & ENV_LIB_OPT_RAWPATHS);
+
+	PathTreeNode* pathNode;
+
+	if(path[0] == '/')
+		pathNode = pathTree->lookupAbsolute(path, normalize);
+	else
+	{ // path is relative to current working dir
 		char* cwdBuf = getcwd(NULL, 0);
 
-		std::string concatPathStr(cwdBuf);
+		if(!cwdBuf)
+			return; // can't resolve path (e.g. cwd was deleted)
+
+		PathTreeNode* cwdNode = pathTree->lookupAbsolute(cwdBuf, normalize);
 
 		free(cwdBuf);
 
-		if(concatPathStr != "/")
-			concatPathStr += "/";
+		pathNode = pathTree->lookupRelative(cwdNode, path, normalize);
+
+		pathTree->release(cwdNode);
+	}
+
+	injectAfterLookup(fd, path, pathNode, flags);
+}
+
+/**
+ * Add to fdStore and inject O_DIRECT if appropriate.
+ */
+void InjectionTk::injectAfterOpenat(int dirfd, int fd, const char* path, int flags)
+{
+	if( (path[0] == '/') || (dirfd == AT_FDCWD) )
+	{ // abs path ignores dirfd
+		injectAfterOpen(fd, path, flags);
+		return;
+	}
+
+	PathTreeNode* dirNode;
+
+	bool fdFound = fdStore->getFDPathNode(dirfd, dirNode) ||
+		resolveUnknownDirFD(dirfd, dirNode);
 
-		concatPathStr += path;
+	if(!fdFound)
+	{
+		PROBE(inject_skip, fd, path, flags, "unknowndirfd");
 
-		path = concatPathStr;
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
+			log_fprintf(stderr,
+				LOG_PREFIX "Skipping open inject due to openat dirfd not found in store: "
+				"dirfd: %d; fd: %d; path: %s\n", dirfd, fd, path);
+
+		return;
 	}
 
-	if(!(libOpts & ENV_LIB_OPT_RAWPATHS) )
-	{ // normalize path (e.g. remove ".." and "//")
-		boost::filesystem::path pathObj(path);
+	PathTreeNode* pathNode = pathTree->lookupRelative(dirNode, path,
+		!(libOpts & ENV_LIB_OPT_RAWPATHS) );
+
+	pathTree->release(dirNode);
+
+	injectAfterLookup(fd, path, pathNode, flags);
+}
+
+/**
+ * Fallback for openat() with a dirfd that is not in the fdStore, e.g. because it was inherited,
+ * opened before lib init or by a call that we don't intercept. Gets the dir path from /proc and adds
+ * the dirfd to the fdStore, so that this only happens once per dirfd. Rate-limited to
+ * INJECTIONTK_DIRFD_RESOLVE_PER_SEC lookups per second.
+ *
+ * Note: The path from /proc has symlinks resolved, so patterns that contain symlinks don't match
+ * files below such dirfds.
+ *
+ * @outDirNode path node of the dirfd with a reference for the caller (to be given back via
+ * 		pathTree->release() ).
+ * @return false if the dirfd could not be resolved or the rate limit was hit.
+ */
+bool InjectionTk::resolveUnknownDirFD(int dirfd, PathTreeNode*& outDirNode)
+{
+	struct timespec nowTime;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &nowTime);
+
+	uint64_t windowSec = dirFDResolveWindowSec.load(std::memory_order_relaxed);
 
-		std::string pathObjNormalizedStr = pathObj.lexically_normal().string();
+	if( ( (uint64_t)nowTime.tv_sec != windowSec) &&
+		dirFDResolveWindowSec.compare_exchange_strong(windowSec, nowTime.tv_sec) )
+		dirFDResolveWindowCount.store(0, std::memory_order_relaxed); // new window
 
-		// .normalize() leaves a trailing slashdot ("/.") when path ended with "/", so remove that
-		/* note: trailing slashdot is due to BOOST_FILESYSTEM_VERSION=3 def in Makefile. if this
-		 * ever gets changed to BOOST_FILESYSTEM_VERSION >3 or to C++17 std::filesystem then the
-		 * trailing slash remains but the trailing dot goes away. */
-		if( (pathObjNormalizedStr.length() > 2) &&
-			('/' == pathObjNormalizedStr[pathObjNormalizedStr.length() -2] ) &&
-			('.' == pathObjNormalizedStr[pathObjNormalizedStr.length() -1] ) )
-			pathObjNormalizedStr.resize(pathObjNormalizedStr.length() -2);
+	if(dirFDResolveWindowCount.fetch_add(1, std::memory_order_relaxed) >=
+		INJECTIONTK_DIRFD_RESOLVE_PER_SEC)
+	{
+		numDirFDsRateLimited.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
 
-		if( (libLogTopics & ENV_LOG_TOPIC_NORMALIZE) && (pathObj.string() != path) )
-			log_fprintf(stderr, LOG_PREFIX "Normalized path. fd: %d; old: %s; new: %s\n",
-				fd, path.c_str(), pathObjNormalizedStr.c_str() );
+	char linkBuf[PATH_MAX];
 
-		path = pathObjNormalizedStr;
+	if(!readFDLink(dirfd, linkBuf, sizeof(linkBuf) ) )
+	{
+		numDirFDsUnresolvable.fetch_add(1, std::memory_order_relaxed);
+		return false;
 	}
 
+	outDirNode = pathTree->lookupAbsolute(linkBuf, !(libOpts & ENV_LIB_OPT_RAWPATHS) );
+
+	pathTree->acquire(outDirNode); // one reference for the store, one for the caller
+
+	fdStore->addFD(dirfd, outDirNode);
+
+	numDirFDsResolved.fetch_add(1, std::memory_order_relaxed);
+
+	PROBE(dirfd_resolve, dirfd, linkBuf);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+		log_fprintf(stderr, LOG_PREFIX "Resolved unknown openat dirfd via /proc. "
+			"dirfd: %d; path: %s\n", dirfd, linkBuf);
+
+	return true;
+}
+
+/**
+ * Get the path of an fd from its link in /proc.
+ *
+ * @outLinkBuf zero-terminated path on success.
+ * @return false if the fd has no path (e.g. "anon_inode:...", "pipe:..."), the file was deleted or
+ * 		the path didn't fit into the buffer.
+ */
+bool InjectionTk::readFDLink(int fd, char* outLinkBuf, size_t bufLen)
+{
+	std::string procPath = INJECTIONTK_PROC_FD_PATH + std::to_string(fd);
+
+	int savedErrno = errno;
+
+	ssize_t linkLen = readlink(procPath.c_str(), outLinkBuf, bufLen);
+
+	errno = savedErrno;
+
+	// no trailing zero if truncated
+	if( (linkLen <= 0) || ( (size_t)linkLen == bufLen) || (outLinkBuf[0] != '/') )
+		return false;
+
+	outLinkBuf[linkLen] = 0;
+
+	const char deletedSuffix[] = " (deleted)";
+
+	return ( (size_t)linkLen < strlen(deletedSuffix) ) ||
+		strcmp(outLinkBuf + linkLen - strlen(deletedSuffix), deletedSuffix);
+}
+
+/**
+ * Called once at init (before initDone is set) to add the fds that the process got from its parent
+ * to the fdStore, e.g. dirs for openat() or shell redirections like "< /data/input.dat" and output
+ * files opened by a batch scheduler or MPI launcher.
+ *
+ * Only regular files and dirs are considered. Fds with the close-on-exec flag are skipped, because
+ * they can't have been inherited across exec (this also skips the lib's own files).
+ *
+ * @injectDirect also inject O_DIRECT into the matching fds. Not for stdin/stdout/stderr, because
+ * 		stdio reads and writes these internally without the EINVAL fallback of the interceptors.
+ * 		Note that an inherited fd shares its file status flags with the parent, so the parent sees
+ * 		O_DIRECT as well.
+ */
+void InjectionTk::trackInheritedFDs(bool injectDirect)
+{
+	struct timespec startTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	int savedErrno = errno;
+
+	int procDirFD = RealFuncs::open(INJECTIONTK_PROC_FD_PATH,
+		O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if(procDirFD == -1)
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Skipping scan of inherited fds. Opening %s failed: %s\n",
+				INJECTIONTK_PROC_FD_PATH, strerror(errno) );
+
+		errno = savedErrno;
+		return;
+	}
+
+	/* collect the fds first, so that fds opened during injection (e.g. for split I/O) don't show up
+		in the dir while we read it */
+	std::vector<int> fds;
+	char direntBuf[16384];
+	ssize_t readRes;
+
+	while( (readRes = syscall(SYS_getdents64, procDirFD, direntBuf, sizeof(direntBuf) ) ) > 0)
+	{
+		for(ssize_t bufPos = 0; bufPos < readRes; )
+		{
+			struct dirent64* dirent = (struct dirent64*)(direntBuf + bufPos);
+
+			bufPos += dirent->d_reclen;
+
+			if(dirent->d_name[0] == '.')
+				continue; // "." and ".."
+
+			int fd = atoi(dirent->d_name);
+
+			if( (fd != procDirFD) && (fds.size() < INJECTIONTK_INHERITED_FDS_MAX) )
+				fds.push_back(fd);
+		}
+	}
+
+	RealFuncs::close(procDirFD);
+
+	unsigned numTracked = 0;
+	char linkBuf[PATH_MAX];
+
+	for(int fd : fds)
+	{
+		struct stat statBuf;
+
+		if(fstat(fd, &statBuf) || (!S_ISREG(statBuf.st_mode) && !S_ISDIR(statBuf.st_mode) ) )
+			continue;
+
+		int fdFlags = fcntl(fd, F_GETFD);
+		int fileFlags = fcntl(fd, F_GETFL);
+
+		if( (fdFlags == -1) || (fdFlags & FD_CLOEXEC) || (fileFlags == -1) )
+			continue;
+
+		if(!readFDLink(fd, linkBuf, sizeof(linkBuf) ) )
+			continue;
+
+		if(S_ISDIR(statBuf.st_mode) )
+			fileFlags |= O_DIRECTORY; // (F_GETFL doesn't return this)
+
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+			log_fprintf(stderr, LOG_PREFIX "Found inherited fd. fd: %d; path: %s\n", fd, linkBuf);
+
+		PathTreeNode* pathNode = pathTree->lookupAbsolute(linkBuf,
+			!(libOpts & ENV_LIB_OPT_RAWPATHS) );
+
+		if(injectDirect && (fd > STDERR_FILENO) )
+			injectAfterLookup(fd, linkBuf, pathNode, fileFlags);
+		else
+			trackAfterLookup(fd, linkBuf, pathNode, fileFlags);
+
+		numTracked++;
+	}
+
+	errno = savedErrno;
+
+	struct timespec endTime;
+	clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Inherited fds: scanned: %zu; tracked: %u; usec: %lld\n",
+			fds.size(), numTracked,
+			(long long)( (endTime.tv_sec - startTime.tv_sec) * 1000000 +
+			(endTime.tv_nsec - startTime.tv_nsec) / 1000) );
+}
+
+/**
+ * Write the [dirfd] section of the stats report. Does nothing if no unknown dirfd was seen.
+ */
+void InjectionTk::writeReport(int fd)
+{
+	uint64_t numResolved = numDirFDsResolved.load(std::memory_order_relaxed);
+	uint64_t numUnresolvable = numDirFDsUnresolvable.load(std::memory_order_relaxed);
+	uint64_t numRateLimited = numDirFDsRateLimited.load(std::memory_order_relaxed);
+
+	if(!numResolved && !numUnresolvable && !numRateLimited)
+		return;
+
+	dprintf(fd, "\n[dirfd]\n");
+	dprintf(fd, "# unknown openat dirfds: resolved unresolvable ratelimited\n");
+	dprintf(fd, "%llu %llu %llu\n", (unsigned long long)numResolved,
+		(unsigned long long)numUnresolvable, (unsigned long long)numRateLimited);
+}
+
+/**
+ * Add the fd to the fdStore with the flags that it already has, without injecting O_DIRECT.
+ *
+ * @origPath path as given by the application (only for logging).
+ * @pathNode the fdStore takes over the caller's reference.
+ * @return the normalized path of pathNode.
+ */
+const std::string& InjectionTk::trackAfterLookup(int fd, const char* origPath,
+	PathTreeNode* pathNode, int flags)
+{
+	const std::string& path = PathTree::materialize(pathNode);
+
+	if( (libLogTopics & ENV_LOG_TOPIC_NORMALIZE) && (path != origPath) )
+		log_fprintf(stderr, LOG_PREFIX "Normalized path. fd: %d; old: %s; new: %s\n",
+			fd, origPath, path.c_str() );
+
 	/* always add to store because this could be a dir, which might be be needed for openat() later
 		even though the dir path does not match user-given paths */
-	fdStore->addFD(fd, path);
+	fdStore->addFD(fd, pathNode);
+
+	if(TraceTk::getIsActive() && !(flags & O_DIRECTORY) )
+		TraceTk::assignPathID(fd, path);
 
-	if(!pathMatchStore->checkPathMatch(path) )
+	int fdStoreFlags = 0;
+
+	if(flags & O_DIRECT)
+		fdStoreFlags |= FDSTORE_FLAG_DIRECT;
+
+	if(flags & O_APPEND)
+		fdStoreFlags |= FDSTORE_FLAG_NOSPLIT; // pwrite() ignores the offset with O_APPEND
+
+	if(fdStoreFlags)
+		fdStore->updateFDFlags(fd, fdStoreFlags, 0);
+
+	return path;
+}
+
+/**
+ * Second part of injectAfterOpen(), when the path node of the opened file is known.
+ *
+ * @origPath path as given by the application (only for logging).
+ * @pathNode the fdStore takes over the caller's reference.
+ */
+void InjectionTk::injectAfterLookup(int fd, const char* origPath, PathTreeNode* pathNode,
+	int flags)
+{
+	const std::string& path = trackAfterLookup(fd, origPath, pathNode, flags);
+
+	MountStoreLookupResult mountInfo;
+	bool mountLookupDone = false;
+	bool mountFound = false;
+
+	if(mountStore->getHasFSTypeFilter() )
+	{ // check fstype before pattern matching (to skip proc, tmpfs etc. early)
+		mountFound = mountStore->lookup(path, mountInfo);
+		mountLookupDone = true;
+
+		if(mountFound && !mountInfo.isFSTypeAllowed)
+		{
+			PROBE(inject_skip, fd, path.c_str(), flags, "fstype");
+
+			if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
+				log_fprintf(stderr, LOG_PREFIX "Skipping inject due to filesystem type. "
+					"fd: %d; path: %s; fstype: %s\n", fd, path.c_str(), mountInfo.fsType);
+			return;
+		}
+	}
+
+	const PathMatchImageRule* matchingRule = pathMatchStore->getMatchingRule(path,
+		PathMatchImage::openFlagsToAccessMode(flags) );
+
+	if(!matchingRule)
 	{
+		PROBE(inject_skip, fd, path.c_str(), flags, "mismatch");
+
 		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
 			log_fprintf(stderr, LOG_PREFIX "Skipping inject due to path mismatch. "
 				"fd: %d; path: %s\n", fd, path.c_str() );
 		return;
 	}
 
+	fdStore->updateFDFlags(fd, FDSTORE_FLAG_MATCHED, 0);
+
+	ThrottleTk::initAfterMatch(fd, matchingRule);
+
+	if(ProfileTk::getIsLearning() && !(flags & O_DIRECTORY) )
+		ProfileTk::learnAfterOpen(fd, path);
+
+	ProfilePolicy profilePolicy = {0, 0};
+
+	if(ProfileTk::getIsApplying() && !(flags & O_DIRECTORY) &&
+		ProfileTk::getPolicy(path, profilePolicy) )
+		ProfileTk::applyAfterOpen(fd, path.c_str(), profilePolicy);
+
+	if( (flags & O_CREAT) && ( (flags & O_ACCMODE) != O_RDONLY) )
+		PreallocTk::initAfterCreate(fd, path.c_str(), matchingRule->preallocExtent,
+			std::max(matchingRule->expectedSize, profilePolicy.expectedSize) );
+
+	if(!(matchingRule->actions & PATHMATCH_ACTION_DIRECT) )
+	{
+		pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_SKIP_NODIRECT);
+		PROBE(inject_skip, fd, path.c_str(), flags, "nodirect");
+
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
+			log_fprintf(stderr, LOG_PREFIX "Skipping inject due to nodirect rule. "
+				"fd: %d; path: %s\n", fd, path.c_str() );
+		return;
+	}
+
 	if(flags & O_DIRECTORY)
 	{
+		pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_SKIP_DIRECTORY);
+		PROBE(inject_skip, fd, path.c_str(), flags, "directory");
+
 		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
 			log_fprintf(stderr, LOG_PREFIX "Skipping inject due to O_DIRECTORY. "
 				"fd: %d; path: %s\n", fd, path.c_str() );
 		return;
 	}
 
+	if(profilePolicy.flags & PROFILE_POLICY_BUFFERED)
+	{
+		pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_SKIP_PROFILE);
+		PROBE(inject_skip, fd, path.c_str(), flags, "profile");
+
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
+			log_fprintf(stderr, LOG_PREFIX "Skipping inject due to buffered policy of I/O profile. "
+				"fd: %d; path: %s\n", fd, path.c_str() );
+		return;
+	}
+
 	if(flags & O_DIRECT)
 	{
+		pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_SKIP_ALREADYDIRECT);
+		PROBE(inject_skip, fd, path.c_str(), flags, "alreadydirect");
+
 		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
 			log_fprintf(stderr, LOG_PREFIX "Skipping inject due to O_DIRECT set already. "
 				"fd: %d; path: %s\n", fd, path.c_str() );
 		return;
 	}
 
+	if(!mountLookupDone)
+		mountFound = mountStore->lookup(path, mountInfo);
+
+	if(mountFound && (mountInfo.directSupport == MOUNTSTORE_DIRECT_UNSUPPORTED) )
+	{ // we already know that fcntl would fail
+		pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_SKIP_UNSUPPORTED);
+		PROBE(inject_skip, fd, path.c_str(), flags, "unsupported");
+
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP)
+			log_fprintf(stderr, LOG_PREFIX "Skipping inject due to O_DIRECT not supported by "
+				"filesystem. fd: %d; path: %s; fstype: %s\n", fd, path.c_str(), mountInfo.fsType);
+		return;
+	}
+
 	if(libLogTopics & ENV_LOG_TOPIC_INJECT)
 		log_fprintf(stderr, LOG_PREFIX "Injecting O_DIRECT. fd: %d; path: %s\n",
 			fd, path.c_str() );
@@ -85,59 +465,28 @@ void InjectionTk::injectAfterOpen(int fd, std::string path, int flags)
 	int fcntlRes = fcntl(fd, F_SETFL, flags | O_DIRECT);
 	if(fcntlRes == -1)
 	{
+		int fcntlErrno = errno;
+
+		pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_SKIP_FCNTLFAIL);
+		PROBE(inject_fail, fd, path.c_str(), flags, fcntlErrno);
+
 		if(libLogTopics & ENV_LOG_TOPIC_INJECT)
 			log_fprintf(stderr, LOG_PREFIX "Adding O_DIRECT failed. fd: %d; path: %s\n",
 				fd, path.c_str() );
-	}
-}
 
-/**
- * Add to fdStore and inject O_DIRECT if appropriate.
- */
-void InjectionTk::injectAfterOpenat(int dirfd, int fd, std::string path, int flags)
-{
-	if(path[0] == '/')
-		injectAfterOpen(fd, path, flags); // abs path ignores dirfd
-	else
-	{
-		if(dirfd == AT_FDCWD)
-		{ // path is relative to current working dir
-			char* cwdBuf = getcwd(NULL, 0);
+		if(mountFound && (fcntlErrno == EINVAL) )
+			mountStore->setDirectSupport(mountInfo.dev, false);
 
-			std::string concatPathStr(cwdBuf);
-
-			free(cwdBuf);
-
-			if(concatPathStr != "/")
-				concatPathStr += "/";
-
-			concatPathStr += path;
-
-			path = concatPathStr;
-		}
-		else
-		{
-			std::string dirPathStr;
-
-			bool fdFound = fdStore->getFD(dirfd, dirPathStr);
-
-			if(!fdFound & (libLogTopics & ENV_LOG_TOPIC_INJECT_SKIP) )
-			{
-				log_fprintf(stderr,
-					LOG_PREFIX "Skipping open inject due to openat dirfd not found in store: "
-					"dirfd: %d; fd: %d; path: %s\n", dirfd, fd, path.c_str());
-
-				return;
-			}
-
-			std::string concatPathStr(dirPathStr + "/" + path);
+		return;
+	}
 
-			path = concatPathStr;
-		}
+	if(mountFound && (mountInfo.directSupport == MOUNTSTORE_DIRECT_UNKNOWN) )
+		mountStore->setDirectSupport(mountInfo.dev, true);
 
+	fdStore->updateFDFlags(fd, FDSTORE_FLAG_DIRECT, 0);
 
-		injectAfterOpen(fd, path, flags);
-	}
+	pathMatchStore->countRuleOutcome(matchingRule, PATHMATCHSTATS_INJECTED);
+	PROBE(inject, fd, path.c_str(), flags);
 }
 
 /**
@@ -166,7 +515,14 @@ void InjectionTk::ejectAfterEinval(int fd)
 			"fd: %d; path: %s\n",
 			fd, removalPath.c_str() );
 
+	PROBE(eject, fd, removalPath.c_str(), flags);
+
+	if(ProfileTk::getIsLearning() )
+		ProfileTk::learnEject(fd);
+
 	fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+
+	fdStore->updateFDFlags(fd, 0, FDSTORE_FLAG_DIRECT);
 }
 
 /**
@@ -182,5 +538,101 @@ void InjectionTk::ejectBeforeClose(int fd)
 			pathFound ? pathStr.c_str() : "<not found>");
 	}
 
+	uint64_t preallocExtent;
+	uint64_t preallocEnd = 0;
+
+	if(PreallocTk::getIsActive() )
+		fdStore->getPrealloc(fd, preallocExtent, preallocEnd);
+
 	fdStore->removeFD(fd);
+
+	if(preallocEnd)
+		PreallocTk::trimBeforeClose(fd, preallocEnd);
+}
+
+/**
+ * Remember that a buffered (i.e. non-O_DIRECT) write happened on this fd, so that the next
+ * fsync/fdatasync can't be elided. Used after write()-style operations.
+ */
+void InjectionTk::markBufferedWrite(int fd)
+{
+	fdStore->markBufferedWrite(fd);
+}
+
+/**
+ * Run fsync/fdatasync according to the ENV_LIB_OPT_SYNC_... policy. If there were no buffered writes
+ * on this fd since the last sync (i.e. only O_DIRECT writes) then the sync gets downgraded to
+ * fdatasync or skipped. This is only the case for regular files in O_DIRECT mode that are tracked in
+ * the fdStore; e.g. dir fds (fsync after rename) and buffered fds (writes through mmap, sendfile
+ * etc. don't get marked as buffered writes) always get the real sync.
+ *
+ * Note: Dirty pages from other fds of the same file or from shared writable mmaps are not seen
+ * here, so elision is only safe if the application doesn't mix these with O_DIRECT fds.
+ *
+ * @isDataSync true for fdatasync, false for fsync.
+ * @return as fsync/fdatasync, errno is set accordingly.
+ */
+int InjectionTk::syncWithPolicy(int fd, bool isDataSync, SyncFunc fsyncFunc,
+	SyncFunc fdatasyncFunc)
+{
+	int fdFlags = 0;
+	bool fdFound = false;
+
+	if(libOpts & ENV_LIB_OPTS_SYNC_ELIDE)
+		fdFound = fdStore->testAndClearDirty(fd, fdFlags);
+
+	bool canElide = fdFound && (fdFlags & FDSTORE_FLAG_DIRECT) && !(fdFlags & FDSTORE_FLAG_DIRTY);
+
+	if(canElide)
+	{ // check file type, as the flags don't tell dirs from files
+		int savedErrno = errno;
+		struct stat statBuf;
+
+		canElide = !fstat(fd, &statBuf) && S_ISREG(statBuf.st_mode);
+
+		errno = savedErrno;
+	}
+
+	if(canElide)
+	{ // no buffered writes on this fd since the last sync
+		if(libOpts & ENV_LIB_OPT_SYNC_SKIP)
+		{
+			PROBE(sync, fd, (int)isDataSync, "skip");
+
+			if(libLogTopics & ENV_LOG_TOPIC_SYNC)
+				log_fprintf(stderr, LOG_PREFIX "Skipping %s without buffered writes. fd: %d\n",
+					isDataSync ? "fdatasync" : "fsync", fd);
+
+			return 0;
+		}
+
+		if(!isDataSync)
+		{
+			PROBE(sync, fd, (int)isDataSync, "downgrade");
+
+			if(libLogTopics & ENV_LOG_TOPIC_SYNC)
+				log_fprintf(stderr, LOG_PREFIX "Downgrading fsync without buffered writes to "
+					"fdatasync. fd: %d\n", fd);
+
+			isDataSync = true;
+		}
+	}
+
+	PROBE(sync, fd, (int)isDataSync, "sync");
+
+	SyncFunc syncFunc = isDataSync ? fdatasyncFunc : fsyncFunc;
+
+	int syncRes = (libOpts & ENV_LIB_OPT_SYNC_COALESCE) ?
+		syncCoalescer->sync(fd, isDataSync, syncFunc) : syncFunc(fd);
+
+	if( (syncRes == -1) && (fdFlags & FDSTORE_FLAG_DIRTY) )
+	{ // sync failed, so keep the fd dirty for the next attempt
+		int syncErrno = errno;
+
+		fdStore->updateFDFlags(fd, FDSTORE_FLAG_DIRTY, 0);
+
+		errno = syncErrno;
+	}
+
+	return syncRes;
 }
@@ -1,27 +1,56 @@
 #ifndef INJECTIONTK_H_
 #define INJECTIONTK_H_
 
+#include <atomic>
 #include <string.h>
 #include "Common.h"
 #include "Config.h"
 #include "FDStore.h"
 #include "Logger.h"
+#include "MountStore.h"
 #include "PathMatchStore.h"
+#include "PathTree.h"
+#include "SyncCoalescer.h"
+
+
+#define INJECTIONTK_PROC_FD_PATH			"/proc/self/fd/"
+#define INJECTIONTK_DIRFD_RESOLVE_PER_SEC	1000 // max lookups of unknown dirfds in /proc per sec
+#define INJECTIONTK_INHERITED_FDS_MAX		4096 // max fds to check in init scan of inherited fds
 
 
 /**
- * Toolkit to inject O_DIRECT on file open and to eject it on close or error.
+ * Toolkit to inject O_DIRECT on file open and to eject it on close or error. Also applies the sync
+ * policy that depends on the O_DIRECT state of an fd.
  */
 class InjectionTk
 {
 	public:
-		static void injectAfterOpen(int fd, std::string path, int flags);
-		static void injectAfterOpenat(int dirfd, int fd, std::string path, int flags);
+		static void injectAfterOpen(int fd, const char* path, int flags);
+		static void injectAfterOpenat(int dirfd, int fd, const char* path, int flags);
+		static void trackInheritedFDs(bool injectDirect);
 		static void ejectAfterEinval(int fd);
 		static void ejectBeforeClose(int fd);
+		static void markBufferedWrite(int fd);
+		static int syncWithPolicy(int fd, bool isDataSync, SyncFunc fsyncFunc,
+			SyncFunc fdatasyncFunc);
+		static void writeReport(int fd);
 
 	private:
 		InjectionTk() {}
+
+		// rate limit window and counters of resolveUnknownDirFD()
+		static std::atomic<uint64_t> dirFDResolveWindowSec;
+		static std::atomic<unsigned> dirFDResolveWindowCount;
+		static std::atomic<uint64_t> numDirFDsResolved;
+		static std::atomic<uint64_t> numDirFDsUnresolvable;
+		static std::atomic<uint64_t> numDirFDsRateLimited;
+
+		static void injectAfterLookup(int fd, const char* origPath, PathTreeNode* pathNode,
+			int flags);
+		static const std::string& trackAfterLookup(int fd, const char* origPath,
+			PathTreeNode* pathNode, int flags);
+		static bool resolveUnknownDirFD(int dirfd, PathTreeNode*& outDirNode);
+		static bool readFDLink(int fd, char* outLinkBuf, size_t bufLen);
 };
 
 
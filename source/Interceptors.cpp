@@ -32,752 +32,1114 @@
 #include <sys/time.h>
 #include <sys/vfs.h>
 
+#include "AsyncIO.h"
 #include "Common.h"
 #include "Config.h"
 #include "InjectionTk.h"
+#include "Latency.h"
 #include "Logger.h"
-
-
-FUNC_FORWARD_DECL(opendir,
-	DIR*, (const char *filename));
-FUNC_FORWARD_DECL(fopen, FILE*, (const char *path, const char *mode));
-FUNC_FORWARD_DECL(fopen64, FILE*, (const char *path, const char *mode));
-FUNC_FORWARD_DECL(open, int, (const char *path, int flags, ...));
-FUNC_FORWARD_DECL(open64, int, (const char *path, int flags, ...));
-FUNC_FORWARD_DECL(__open_2, int, (const char *path, int oflag));
-FUNC_FORWARD_DECL(__open64_2, int, (const char *path, int oflag));
-FUNC_FORWARD_DECL(openat, int, (int dirfd, const char *path, int flags, ...));
-FUNC_FORWARD_DECL(openat64, int, (int dirfd, const char *path, int flags, ...));
-FUNC_FORWARD_DECL(__openat_2, int, (int dirfd, const char *path, int flags));
-FUNC_FORWARD_DECL(__openat64_2, int, (int dirfd, const char *path, int flags));
-FUNC_FORWARD_DECL(creat, int, (const char* path, mode_t mode));
-FUNC_FORWARD_DECL(creat64, int, (const char* path, mode_t mode));
-FUNC_FORWARD_DECL(fread, size_t, (void *ptr, size_t size, size_t nmemb, FILE *stream));
-FUNC_FORWARD_DECL(read, ssize_t, (int fd, void *buf, size_t count));
-FUNC_FORWARD_DECL(fwrite, size_t, (const void *ptr, size_t size, size_t nmemb, FILE *stream));
-FUNC_FORWARD_DECL(write, ssize_t, (int fd, const void *buf, size_t count));
-FUNC_FORWARD_DECL(pread, ssize_t, (int fd, void *buf, size_t count, off_t offset));
-FUNC_FORWARD_DECL(pwrite, ssize_t, (int fd, const void *buf, size_t count, off_t offset));
-FUNC_FORWARD_DECL(pread64, ssize_t, (int fd, void *buf, size_t count, off64_t offset));
-FUNC_FORWARD_DECL(pwrite64, ssize_t, (int fd, const void *buf, size_t count, off64_t offset));
-FUNC_FORWARD_DECL(readv, ssize_t, (int fd, const struct iovec *iov, int iovcnt));
-FUNC_FORWARD_DECL(preadv, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset));
-FUNC_FORWARD_DECL(preadv64, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset));
-FUNC_FORWARD_DECL(preadv2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags));
-FUNC_FORWARD_DECL(preadv64v2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset, int flags));
-FUNC_FORWARD_DECL(writev, ssize_t, (int fd, const struct iovec *iov, int iovcnt));
-FUNC_FORWARD_DECL(pwritev, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset));
-FUNC_FORWARD_DECL(pwritev64, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset));
-FUNC_FORWARD_DECL(pwritev2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags));
-FUNC_FORWARD_DECL(pwritev64v2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset, int flags));
-FUNC_FORWARD_DECL(fsync, int, (int fd));
-FUNC_FORWARD_DECL(fdatasync, int, (int fd));
-FUNC_FORWARD_DECL(closedir, int, (DIR *dirp));
-FUNC_FORWARD_DECL(fclose, int, (FILE* stream));
-FUNC_FORWARD_DECL(close, int, (int fd));
-
-
-
-extern "C" DIR* INTERCEPT_FUNC_DECL(opendir)(const char *path)
+#include "Mmap.h"
+#include "Prealloc.h"
+#include "Probes.h"
+#include "Profile.h"
+#include "RealFuncs.h"
+#include "SplitIO.h"
+#include "Throttle.h"
+#include "Trace.h"
+#include "VectoredIO.h"
+
+
+/* real functions that RealFuncs::init() resolves at lib init. The pointers live in a page-aligned
+	table that initlib() write-protects when it's done (see RealFuncs::protect() ); the __real_...
+	names are references into the table. */
+#define REAL_FUNCS_TABLE(ENTRY) \
+	ENTRY(opendir, DIR*, (const char *filename)) \
+	ENTRY(fopen, FILE*, (const char *path, const char *mode)) \
+	ENTRY(fopen64, FILE*, (const char *path, const char *mode)) \
+	ENTRY(open, int, (const char *path, int flags, ...)) \
+	ENTRY(open64, int, (const char *path, int flags, ...)) \
+	ENTRY(__open_2, int, (const char *path, int oflag)) \
+	ENTRY(__open64_2, int, (const char *path, int oflag)) \
+	ENTRY(openat, int, (int dirfd, const char *path, int flags, ...)) \
+	ENTRY(openat64, int, (int dirfd, const char *path, int flags, ...)) \
+	ENTRY(__openat_2, int, (int dirfd, const char *path, int flags)) \
+	ENTRY(__openat64_2, int, (int dirfd, const char *path, int flags)) \
+	ENTRY(creat, int, (const char* path, mode_t mode)) \
+	ENTRY(creat64, int, (const char* path, mode_t mode)) \
+	ENTRY(fread, size_t, (void *ptr, size_t size, size_t nmemb, FILE *stream)) \
+	ENTRY(read, ssize_t, (int fd, void *buf, size_t count)) \
+	ENTRY(fwrite, size_t, (const void *ptr, size_t size, size_t nmemb, FILE *stream)) \
+	ENTRY(write, ssize_t, (int fd, const void *buf, size_t count)) \
+	ENTRY(pread, ssize_t, (int fd, void *buf, size_t count, off_t offset)) \
+	ENTRY(pwrite, ssize_t, (int fd, const void *buf, size_t count, off_t offset)) \
+	ENTRY(pread64, ssize_t, (int fd, void *buf, size_t count, off64_t offset)) \
+	ENTRY(pwrite64, ssize_t, (int fd, const void *buf, size_t count, off64_t offset)) \
+	ENTRY(readv, ssize_t, (int fd, const struct iovec *iov, int iovcnt)) \
+	ENTRY(preadv, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset)) \
+	ENTRY(preadv64, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset)) \
+	ENTRY(preadv2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)) \
+	ENTRY(preadv64v2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset, int flags)) \
+	ENTRY(writev, ssize_t, (int fd, const struct iovec *iov, int iovcnt)) \
+	ENTRY(pwritev, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset)) \
+	ENTRY(pwritev64, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset)) \
+	ENTRY(pwritev2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off_t offset, int flags)) \
+	ENTRY(pwritev64v2, ssize_t, (int fd, const struct iovec *iov, int iovcnt, off64_t offset, int flags)) \
+	ENTRY(fsync, int, (int fd)) \
+	ENTRY(fdatasync, int, (int fd)) \
+	ENTRY(mmap, void*, (void *addr, size_t length, int prot, int flags, int fd, off_t offset)) \
+	ENTRY(mmap64, void*, (void *addr, size_t length, int prot, int flags, int fd, off64_t offset)) \
+	ENTRY(munmap, int, (void *addr, size_t length)) \
+	ENTRY(madvise, int, (void *addr, size_t length, int advice)) \
+	ENTRY(closedir, int, (DIR *dirp)) \
+	ENTRY(fclose, int, (FILE* stream)) \
+	ENTRY(close, int, (int fd))
+
+#define REAL_FUNC_MEMBER(__func,__ret,__args) \
+	__ret (*real_ ## __func)__args;
+
+#define REAL_FUNC_REF(__func,__ret,__args) \
+	typedef __ret (*__real_ ## __func ## _TYPE)__args; \
+	static __real_ ## __func ## _TYPE& __real_ ## __func = realFuncsTable.real_ ## __func;
+
+struct alignas(REALFUNCS_TABLE_ALIGN) RealFuncsTable
 {
-	DIR* ret;
+	REAL_FUNCS_TABLE(REAL_FUNC_MEMBER)
+};
 
-	LOG_INTERCEPT_PATH(path);
+static RealFuncsTable realFuncsTable; // (zero-initialized)
+static bool realFuncsProtected = false; // table is read-only, see RealFuncs::protect()
 
-	MAP_OR_FAIL(opendir);
+REAL_FUNCS_TABLE(REAL_FUNC_REF)
 
-	ret = __real_opendir(path);
-
-	if(!initDone || (ret==NULL) )
-		return(ret);
+#undef REAL_FUNC_MEMBER
+#undef REAL_FUNC_REF
 
-	int fd = dirfd(ret);
-
-	InjectionTk::injectAfterOpen(fd, path, O_DIRECTORY);
+// libaio functions are resolved on first use, as libaio might only get loaded later
+FUNC_FORWARD_DECL(io_setup, int, (int maxevents, aio_context_t* ctxp));
+FUNC_FORWARD_DECL(io_destroy, int, (aio_context_t ctx));
+FUNC_FORWARD_DECL(io_submit, int, (aio_context_t ctx, long nr, struct iocb** iocbpp));
+FUNC_FORWARD_DECL(io_getevents, int, (aio_context_t ctx, long min_nr, long nr,
+	struct io_event* events, struct timespec* timeout));
 
-	return(ret);
-}
 
-extern "C" FILE* INTERCEPT_FUNC_DECL(fopen)(const char *path, const char *mode)
+/**
+ * Resolve the real functions of all interceptors, so that the interceptors don't need to do the
+ * lookup on first use. Functions that don't exist stay NULL and make the interceptor fail on first
+ * use (as it would without this). The libaio functions are not resolved here, because libaio might
+ * only get loaded later (see MAP_OR_SYSCALL).
+ */
+void RealFuncs::init()
 {
-	FILE* ret;
-
-	LOG_INTERCEPT_PATH(path);
+	#define REAL_FUNC_ENTRY(__func,__ret,__args)	{ #__func, (void**)&__real_ ## __func },
 
-	MAP_OR_FAIL(fopen);
+	static const struct
+	{
+		const char* name;
+		void** realFunc;
+	} realFuncs[] =
+	{
+		REAL_FUNCS_TABLE(REAL_FUNC_ENTRY)
+	};
 
-	ret = __real_fopen(path, mode);
+	#undef REAL_FUNC_ENTRY
 
-	if(!initDone || (ret==NULL) )
-		return(ret);
-
-	int fd = fileno(ret);
-	int flags = fcntl(fd, F_GETFL);
+	for(const auto& entry : realFuncs)
+	{
+		if(*entry.realFunc)
+			continue; // looked up already by an interceptor call before init
 
-	InjectionTk::injectAfterOpen(fd, path, flags);
+		*entry.realFunc = lookup(entry.name);
 
-	return(ret);
+		if(!*entry.realFunc && (libLogTopics & ENV_LOG_TOPIC_INIT) )
+			log_fprintf(stderr, LOG_PREFIX "Symbol not found: %s\n", entry.name);
+	}
 }
 
-extern "C" FILE* INTERCEPT_FUNC_DECL(fopen64)(const char *path, const char *mode)
+/**
+ * Write-protect the table of real functions, so that e.g. a stray write of the app can't redirect
+ * the interceptors. Called at the end of initlib(). Functions that are still missing after that are
+ * fatal on first use (see mapOrFail() ), as they were not found at init either.
+ */
+void RealFuncs::protect()
 {
-	FILE* ret;
-
-	LOG_INTERCEPT_PATH(path);
-
-	MAP_OR_FAIL(fopen64);
+	long pageSize = sysconf(_SC_PAGESIZE);
 
-	ret = __real_fopen64(path, mode);
+	if( (pageSize <= 0) || ( (uintptr_t)&realFuncsTable % pageSize) ||
+		(sizeof(realFuncsTable) % pageSize) )
+	{ // e.g. 64KiB pages on some ARM systems
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Not write-protecting real functions. Page size: %ld\n",
+				pageSize);
 
-	if(!initDone || (ret==NULL) )
-		return(ret);
-
-	int fd = fileno(ret);
-	int flags = fcntl(fd, F_GETFL);
-
-	InjectionTk::injectAfterOpen(fd, path, flags);
-
-	return(ret);
-}
-
-extern "C" int INTERCEPT_FUNC_DECL(open)(const char *path, int flags, ...)
-{
-	int mode = 0;
-	int ret;
-
-	LOG_INTERCEPT_PATH(path);
+		return;
+	}
 
-	MAP_OR_FAIL(open);
+	int protectRes = mprotect(&realFuncsTable, sizeof(realFuncsTable), PROT_READ);
 
-	if(flags & O_CREAT)
+	if(protectRes == -1)
 	{
-		va_list arg;
-		va_start(arg, flags);
-		mode = va_arg(arg, int);
-		va_end(arg);
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Write-protecting real functions failed: %s\n",
+				strerror(errno) );
 
-		ret = __real_open(path, flags, mode);
+		return;
 	}
-	else
-		ret = __real_open(path, flags);
-
-	if(!initDone || (ret == -1) )
-		return(ret);
-
-	InjectionTk::injectAfterOpen(ret, path, flags);
 
-	return(ret);
+	realFuncsProtected = true;
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(open64)(const char *path, int flags, ...)
+/**
+ * Lookup of the real function for the given name (i.e. REAL_FUNC_LOOKUP with a runtime name).
+ *
+ * @return NULL if not found.
+ */
+void* RealFuncs::lookup(const char* funcName)
 {
-	int mode = 0;
-	int ret;
+#ifdef BUILD_DIRECT_EMULATION
+	return DirectEmu::wrapRealFunc(funcName, dlsym(RTLD_NEXT, funcName) );
+#else
+	return dlsym(RTLD_NEXT, funcName);
+#endif
+}
 
-	LOG_INTERCEPT_PATH(path);
+/**
+ * Template version of MAP_OR_FAIL for the functions in the table of real functions.
+ * RealFuncs::init() resolved them already, so this only does the lookup for calls that come in
+ * before the lib is initialized, e.g. from constructors of other libs. After RealFuncs::protect(),
+ * the table is read-only and a missing function is fatal without another lookup.
+ */
+template<typename FuncT>
+static inline void mapOrFail(FuncT& realFunc, const char* funcName)
+{
+	if(__builtin_expect(realFunc != NULL, 1) )
+		return;
 
-	MAP_OR_FAIL(open64);
+	FuncT lookupFunc = realFuncsProtected ? NULL : (FuncT)RealFuncs::lookup(funcName);
 
-	if(flags & O_CREAT)
+	if(!lookupFunc)
 	{
-		va_list arg;
-		va_start(arg, flags);
-		mode = va_arg(arg, int);
-		va_end(arg);
-
-		ret = __real_open64(path, flags, mode);
+		log_fprintf(stderr, LOG_PREFIX "Failed to find symbol: %s\n", funcName);
+		exit(1);
 	}
-	else
-		ret = __real_open64(path, flags);
-
-	if(!initDone || (ret == -1) )
-		return(ret);
-
-	InjectionTk::injectAfterOpen(ret, path, flags);
 
-	return(ret);
+	realFunc = lookupFunc;
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(__open_2)(const char *path, int flags)
+int RealFuncs::open(const char* path, int flags, mode_t mode)
 {
-	int ret;
+	mapOrFail(__real_open, "open");
 
-	LOG_INTERCEPT_PATH(path);
-
-	MAP_OR_FAIL(__open_2);
-
-	ret = __real___open_2(path, flags);
-
-	if(!initDone || (ret == -1) )
-		return(ret);
+	return __real_open(path, flags, mode);
+}
 
-	InjectionTk::injectAfterOpen(ret, path, flags);
+int RealFuncs::close(int fd)
+{
+	mapOrFail(__real_close, "close");
 
-	return(ret);
+	return __real_close(fd);
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(__open64_2)(const char *path, int flags)
+ssize_t RealFuncs::read(int fd, void* buf, size_t count)
 {
-	int ret;
-
-	LOG_INTERCEPT_PATH(path);
+	mapOrFail(__real_read, "read");
 
-	MAP_OR_FAIL(__open64_2);
+	return __real_read(fd, buf, count);
+}
 
-	ret = __real___open64_2(path, flags);
+ssize_t RealFuncs::write(int fd, const void* buf, size_t count)
+{
+	mapOrFail(__real_write, "write");
 
-	if(!initDone || (ret == -1) )
-		return(ret);
+	return __real_write(fd, buf, count);
+}
 
-	InjectionTk::injectAfterOpen(ret, path, flags);
+ssize_t RealFuncs::pread(int fd, void* buf, size_t count, off_t offset)
+{
+	mapOrFail(__real_pread, "pread");
 
-	return(ret);
+	return __real_pread(fd, buf, count, offset);
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(openat)(int dirfd, const char *path, int flags, ...)
+ssize_t RealFuncs::pwrite(int fd, const void* buf, size_t count, off_t offset)
 {
-	int mode = 0;
-	int ret;
+	mapOrFail(__real_pwrite, "pwrite");
 
-	LOG_INTERCEPT_PATH(path);
+	return __real_pwrite(fd, buf, count, offset);
+}
 
-	MAP_OR_FAIL(openat);
 
-	if(flags & O_CREAT)
-	{
-		va_list arg;
-		va_start(arg, flags);
-		mode = va_arg(arg, int);
-		va_end(arg);
+/**
+ * Mark fd as having buffered writes (for fsync elision) if the write was successful.
+ */
+#define MARK_BUFFERED_WRITE(fd, writeRes) \
+	do \
+	{ \
+		if(initDone && ( (writeRes) > 0) && (libOpts & ENV_LIB_OPTS_SYNC_ELIDE) ) \
+			InjectionTk::markBufferedWrite(fd); \
+	} while(0)
 
-		ret = __real_openat(dirfd, path, flags, mode);
-	}
-	else
-		ret = __real_openat(dirfd, path, flags);
+/**
+ * Preallocate ahead of a write if the fd is a newly created file with preallocation (see PreallocTk).
+ *
+ * @offset -1 for the current file position.
+ */
+#define PREALLOC_BEFORE_WRITE(fd, offset, count) \
+	do \
+	{ \
+		if(initDone && PreallocTk::getIsActive() ) \
+			PreallocTk::extendBeforeWrite(fd, offset, count); \
+	} while(0)
 
-	if(!initDone || (ret == -1) )
-		return(ret);
+/**
+ * Vectored version of PREALLOC_BEFORE_WRITE.
+ */
+#define PREALLOC_BEFORE_WRITEV(fd, offset, iov, iovcnt) \
+	do \
+	{ \
+		if(initDone && PreallocTk::getIsActive() ) \
+			PreallocTk::extendBeforeWriteIOV(fd, offset, iov, iovcnt); \
+	} while(0)
 
-	InjectionTk::injectAfterOpenat(dirfd, ret, path, flags);
+/**
+ * Count a read/write for the I/O profile if learn mode is enabled (see ProfileTk).
+ */
+#define PROFILE_IO(fd, buf, count, offset, ioRes, isWrite) \
+	do \
+	{ \
+		if(initDone && ProfileTk::getIsLearning() ) \
+			ProfileTk::learnIO(fd, buf, count, offset, ioRes, isWrite); \
+	} while(0)
 
-	return(ret);
-}
+/**
+ * Vectored version of PROFILE_IO.
+ */
+#define PROFILE_IOV(fd, iov, iovcnt, offset, ioRes, isWrite) \
+	do \
+	{ \
+		if(initDone && ProfileTk::getIsLearning() ) \
+			ProfileTk::learnIOV(fd, iov, iovcnt, offset, ioRes, isWrite); \
+	} while(0)
 
-extern "C" int INTERCEPT_FUNC_DECL(openat64)(int dirfd, const char *path, int flags, ...)
-{
-	int mode = 0;
-	int ret;
+/**
+ * Check if a read/write should be split across helper threads and extra fds (see SplitIO).
+ *
+ * @outFDs IntVec to receive the fds to pass to the SplitIO::...Split() methods.
+ */
+#define CHECK_SPLIT_IO(fd, count, outFDs) \
+	(initDone && splitIO && ( (count) >= splitIO->getMinSplitSize() ) && \
+		splitIO->checkSplit(fd, count, outFDs) )
 
-	LOG_INTERCEPT_PATH(path);
 
-	MAP_OR_FAIL(openat64);
+/**
+ * Check if a vectored read/write needs its iovecs coalesced to work on an O_DIRECT fd (see
+ * VectoredIOTk).
+ *
+ * @offset -1 for the current file position.
+ */
+#define CHECK_COALESCE_IOV(fd, iov, iovcnt, offset, flags) \
+	(initDone && VectoredIOTk::getNeedsCoalesce(iov, iovcnt) && \
+		VectoredIOTk::checkCoalesce(fd, iov, iovcnt, offset, flags) )
 
-	if(flags & O_CREAT)
-	{
-		va_list arg;
-		va_start(arg, flags);
-		mode = va_arg(arg, int);
-		va_end(arg);
+/**
+ * Wait until a read/write fits into the "bw=" and "iops=" limits of the fd's rule (see ThrottleTk).
+ */
+#define THROTTLE_IO(fd, count) \
+	do \
+	{ \
+		if(initDone && ThrottleTk::getIsActive() ) \
+			ThrottleTk::throttleIO(fd, count); \
+	} while(0)
 
-		ret = __real_openat64(dirfd, path, flags, mode);
+/**
+ * Like MAP_OR_FAIL for libaio functions, but falls back to the given syscall wrapper if libaio is
+ * not loaded, e.g. because the app only looked up the symbol via dlsym() to probe for AIO support.
+ */
+#define MAP_OR_SYSCALL(__func, __syscallFunc) \
+	if(!(__real_ ## __func) ) \
+	{ \
+		__real_ ## __func = (__real_ ## __func ## _TYPE)REAL_FUNC_LOOKUP(__func); \
+		if(!(__real_ ## __func) ) \
+			__real_ ## __func = __syscallFunc; \
 	}
-	else
-		ret = __real_openat64(dirfd, path, flags);
 
-	if(!initDone || (ret == -1) )
-		return(ret);
-
-	InjectionTk::injectAfterOpenat(dirfd, ret, path, flags);
-
-	return(ret);
-}
-
-extern "C" int INTERCEPT_FUNC_DECL(__openat_2)(int dirfd, const char *path, int flags)
-{
-	int ret;
+/**
+ * Remove O_DIRECT and retry the given call if it failed with EINVAL (which is also the result of
+ * O_DIRECT alignment violations). Compiled out with BUILD_NO_EINVAL_RETRY, so that the app sees the
+ * EINVAL, e.g. to find misaligned I/O in tests.
+ *
+ * @ret variable with the result of the first call; gets the result of the retry.
+ */
+#ifdef BUILD_NO_EINVAL_RETRY
+	#define RETRY_AFTER_EINVAL(fd, ret, retryCall)	do {} while(0)
+#else
+	#define RETRY_AFTER_EINVAL(fd, ret, retryCall) \
+		do \
+		{ \
+			if( (ret == -1) && (errno == EINVAL) ) \
+			{ \
+				InjectionTk::ejectAfterEinval(fd); \
+				\
+				ret = retryCall; \
+			} \
+		} while(0)
+#endif
 
-	LOG_INTERCEPT_PATH(path);
+/**
+ * Declare modeVar with the mode argument of an open call with variable args, which is only given
+ * with O_CREAT.
+ */
+#define VA_OPEN_MODE(flags, modeVar) \
+	mode_t modeVar = 0; \
+	\
+	if(flags & O_CREAT) \
+	{ \
+		va_list arg; \
+		va_start(arg, flags); \
+		modeVar = va_arg(arg, int); \
+		va_end(arg); \
+	}
 
-	MAP_OR_FAIL(__openat_2);
 
-	ret = __real___openat_2(dirfd, path, flags);
+/* The templates below generate the bodies of the interceptor families (open, read/write, vectored
+	read/write, sync), so that the extern "C" interceptors are just calls with their real function.
+	Overloads of the callReal...() adapters get selected by the signature of the real function, so
+	that one template handles e.g. read() and pread() alike. */
 
-	if(!initDone || (ret == -1) )
-		return(ret);
+// I/O kinds of the read/write templates
+#define INTERCEPT_IO_READ			0
+#define INTERCEPT_IO_WRITE			1
 
-	InjectionTk::injectAfterOpenat(dirfd, ret, path, flags);
 
-	return(ret);
+/**
+ * @dirfd ignored if the real function doesn't have a dirfd argument.
+ * @mode only passed on with O_CREAT (or for creat() ).
+ */
+static inline int callRealOpen(int (*realFunc)(const char*, int, ...), int dirfd,
+	const char* path, int flags, mode_t mode)
+{
+	return (flags & O_CREAT) ? realFunc(path, flags, mode) : realFunc(path, flags);
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(__openat64_2)(int dirfd, const char *path, int flags)
+static inline int callRealOpen(int (*realFunc)(int, const char*, int, ...), int dirfd,
+	const char* path, int flags, mode_t mode)
 {
-	int ret;
-
-	LOG_INTERCEPT_PATH(path);
-
-	MAP_OR_FAIL(__openat64_2);
+	return (flags & O_CREAT) ?
+		realFunc(dirfd, path, flags, mode) : realFunc(dirfd, path, flags);
+}
 
-	ret = __real___openat64_2(dirfd, path, flags);
+static inline int callRealOpen(int (*realFunc)(const char*, int), int dirfd, const char* path,
+	int flags, mode_t mode)
+{
+	return realFunc(path, flags);
+}
 
-	if(!initDone || (ret == -1) )
-		return(ret);
+static inline int callRealOpen(int (*realFunc)(int, const char*, int), int dirfd,
+	const char* path, int flags, mode_t mode)
+{
+	return realFunc(dirfd, path, flags);
+}
 
-	InjectionTk::injectAfterOpenat(dirfd, ret, path, flags);
+static inline int callRealOpen(int (*realFunc)(const char*, mode_t), int dirfd, const char* path,
+	int flags, mode_t mode)
+{
+	return realFunc(path, mode);
+}
 
-	return(ret);
+/**
+ * @offset ignored if the real function doesn't have an offset argument.
+ */
+template<typename BufT>
+static inline ssize_t callRealIO(ssize_t (*realFunc)(int, BufT, size_t), int fd, BufT buf,
+	size_t count, off64_t offset)
+{
+	return realFunc(fd, buf, count);
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(creat)(const char* path, mode_t mode)
+template<typename BufT, typename OffT>
+static inline ssize_t callRealIO(ssize_t (*realFunc)(int, BufT, size_t, OffT), int fd, BufT buf,
+	size_t count, off64_t offset)
 {
-	int ret;
+	return realFunc(fd, buf, count, offset);
+}
 
-	LOG_INTERCEPT_PATH(path);
+/**
+ * Split version of callRealIO(). read()/write() don't get split (see interceptIO() ), their versions
+ * only exist so that interceptIO() compiles for them.
+ */
+static inline ssize_t callSplitIO(ssize_t (*realFunc)(int, void*, size_t), const IntVec& fds,
+	void* buf, size_t count, off64_t offset)
+{
+	return realFunc(fds[0], buf, count);
+}
 
-	MAP_OR_FAIL(creat);
+static inline ssize_t callSplitIO(ssize_t (*realFunc)(int, const void*, size_t),
+	const IntVec& fds, const void* buf, size_t count, off64_t offset)
+{
+	return realFunc(fds[0], buf, count);
+}
 
-	ret = __real_creat(path, mode);
+template<typename OffT>
+static inline ssize_t callSplitIO(ssize_t (*realFunc)(int, void*, size_t, OffT),
+	const IntVec& fds, void* buf, size_t count, off64_t offset)
+{
+	return splitIO->preadSplit(fds, buf, count, offset);
+}
 
-	if(!initDone || (ret == -1) )
-		return(ret);
+template<typename OffT>
+static inline ssize_t callSplitIO(ssize_t (*realFunc)(int, const void*, size_t, OffT),
+	const IntVec& fds, const void* buf, size_t count, off64_t offset)
+{
+	return splitIO->pwriteSplit(fds, buf, count, offset);
+}
 
-	/* note: "man 2 creat" says this is equivalent to "open() with flags equal to
-		O_CREAT|O_WRONLY|O_TRUNC" */
+/**
+ * @offset and @flags ignored if the real function doesn't have these arguments.
+ */
+static inline ssize_t callRealIOV(ssize_t (*realFunc)(int, const struct iovec*, int), int fd,
+	const struct iovec* iov, int iovcnt, off64_t offset, int flags)
+{
+	return realFunc(fd, iov, iovcnt);
+}
 
-	InjectionTk::injectAfterOpen(ret, path, O_CREAT | O_WRONLY | O_TRUNC);
+template<typename OffT>
+static inline ssize_t callRealIOV(ssize_t (*realFunc)(int, const struct iovec*, int, OffT),
+	int fd, const struct iovec* iov, int iovcnt, off64_t offset, int flags)
+{
+	return realFunc(fd, iov, iovcnt, offset);
+}
 
-	return(ret);
+template<typename OffT>
+static inline ssize_t callRealIOV(ssize_t (*realFunc)(int, const struct iovec*, int, OffT, int),
+	int fd, const struct iovec* iov, int iovcnt, off64_t offset, int flags)
+{
+	return realFunc(fd, iov, iovcnt, offset, flags);
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(creat64)(const char* path, mode_t mode)
+/**
+ * Body of the open() family.
+ *
+ * @dirfd AT_FDCWD for the calls without dirfd argument.
+ * @flags open flags for injection (i.e. O_CREAT | O_WRONLY | O_TRUNC for creat() ).
+ */
+template<typename RealFuncT>
+static inline int interceptOpen(const char* funcName, RealFuncT& realFunc, int dirfd,
+	const char* path, int flags, mode_t mode)
 {
 	int ret;
 
-	LOG_INTERCEPT_PATH(path);
+	LOG_INTERCEPT_PATH_FUNC(funcName, path);
 
-	MAP_OR_FAIL(creat64);
+	LATENCY_START(startTime);
+	TRACE_START(traceStartTime);
 
-	/* note: if we need to inject flags here, then "man 2 creat" says this is equivalent to
-		"open() with flags equal to O_CREAT_|O_WRONLY|O_TRUNC"
-		so we could forward to that or afterwards modify the fd to add O_DIRECT via fcntl */
+	mapOrFail(realFunc, funcName);
 
-	ret = __real_creat64(path, mode);
+	ret = callRealOpen(realFunc, dirfd, path, flags, mode);
 
-	if(!initDone || (ret == -1) )
-		return(ret);
+	if(initDone && (ret != -1) )
+		InjectionTk::injectAfterOpenat(dirfd, ret, path, flags);
 
-	/* note: "man 2 creat" says this is equivalent to "open() with flags equal to
-		O_CREAT|O_WRONLY|O_TRUNC" */
+	TRACE_END(TRACE_OP_OPEN, ret, NULL, flags, -1, ret, traceStartTime);
 
-	InjectionTk::injectAfterOpen(ret, path, O_CREAT | O_WRONLY | O_TRUNC);
+	PROBE(intercept_exit, funcName, ret, (long)ret);
+	LATENCY_END_FD(LATENCY_OP_OPEN, ret, startTime);
 
 	return(ret);
 }
 
-extern "C" size_t INTERCEPT_FUNC_DECL(fread)(void *ptr, size_t size, size_t nmemb, FILE *stream)
+/**
+ * Body of fopen() and fopen64().
+ */
+template<typename RealFuncT>
+static inline FILE* interceptFOpen(const char* funcName, RealFuncT& realFunc, const char* path,
+	const char* mode)
 {
-	size_t ret;
+	FILE* ret;
 
-	LOG_INTERCEPT_FD(fileno(stream) );
+	LOG_INTERCEPT_PATH_FUNC(funcName, path);
 
-	MAP_OR_FAIL(fread);
+	LATENCY_START(startTime);
+	TRACE_START(traceStartTime);
 
-	ret = __real_fread(ptr, size, nmemb, stream);
+	mapOrFail(realFunc, funcName);
 
-	// note: ferror does not provide a specific error code like EINVAL
+	ret = realFunc(path, mode);
 
-	if(ret || !ferror(stream) )
-		return(ret);
+	if(initDone && ret)
+	{
+		int fd = fileno(ret);
+		int flags = fcntl(fd, F_GETFL);
 
-	InjectionTk::ejectAfterEinval(fileno(stream) );
+		InjectionTk::injectAfterOpen(fd, path, flags);
 
-	clearerr(stream);
+		TRACE_END(TRACE_OP_OPEN, fd, NULL, flags, -1, fd, traceStartTime);
+	}
 
-	ret = __real_fread(ptr, size, nmemb, stream);
+	PROBE(intercept_exit, funcName, ret ? fileno(ret) : -1, (long)ret);
+	LATENCY_END_FD(LATENCY_OP_OPEN, ret ? fileno(ret) : -1, startTime);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(read)(int fd, void *buf, size_t count)
+/**
+ * Body of the read() and write() family.
+ *
+ * @ioKind INTERCEPT_IO_...
+ * @offset -1 for the calls without offset argument.
+ */
+template<int ioKind, typename RealFuncT, typename BufT>
+static inline ssize_t interceptIO(const char* funcName, RealFuncT& realFunc, unsigned latencyOp,
+	int fd, BufT buf, size_t count, off64_t offset)
 {
 	ssize_t ret;
 
-	LOG_INTERCEPT_FD(fd);
-
-	MAP_OR_FAIL(read);
+	LOG_INTERCEPT_FD_FUNC(funcName, fd);
 
-	ret = __real_read(fd, buf, count);
+	LATENCY_START(startTime);
+	TRACE_START(traceStartTime);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	mapOrFail(realFunc, funcName);
 
-	InjectionTk::ejectAfterEinval(fd);
+	THROTTLE_IO(fd, count);
 
-	ret = __real_read(fd, buf, count);
+	if(ioKind == INTERCEPT_IO_WRITE)
+		PREALLOC_BEFORE_WRITE(fd, offset, count);
 
-	return(ret);
-}
-
-extern "C" size_t INTERCEPT_FUNC_DECL(fwrite)(const void *ptr, size_t size, size_t nmemb,
-	FILE *stream)
-{
-	size_t ret;
-
-	LOG_INTERCEPT_FD(fileno(stream) );
+	IntVec splitFDs;
 
-	MAP_OR_FAIL(fwrite);
+	// no split without offset, as the job can't move the file position atomically like the kernel
+	if( (offset != -1) && CHECK_SPLIT_IO(fd, count, splitFDs) )
+		ret = callSplitIO(realFunc, splitFDs, buf, count, offset);
+	else
+		ret = callRealIO(realFunc, fd, buf, count, offset);
 
-	ret = __real_fwrite(ptr, size, nmemb, stream);
+	RETRY_AFTER_EINVAL(fd, ret, callRealIO(realFunc, fd, buf, count, offset) );
 
-	// note: ferror does not provide a specific error code like EINVAL
+	TRACE_END( (ioKind == INTERCEPT_IO_READ) ? TRACE_OP_READ : TRACE_OP_WRITE, fd, buf, count,
+		offset, ret, traceStartTime);
 
-	if(ret || !ferror(stream) )
-		return(ret);
-
-	InjectionTk::ejectAfterEinval(fileno(stream) );
+	PROFILE_IO(fd, buf, count, offset, ret, ioKind == INTERCEPT_IO_WRITE);
 
-	clearerr(stream);
+	if(ioKind == INTERCEPT_IO_WRITE)
+		MARK_BUFFERED_WRITE(fd, ret);
 
-	ret = __real_fwrite(ptr, size, nmemb, stream);
+	PROBE(intercept_exit, funcName, fd, (long)ret);
+	LATENCY_END_FD(latencyOp, fd, startTime);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(write)(int fd, const void *buf, size_t count)
+/**
+ * Body of the readv() and writev() family.
+ *
+ * @ioKind INTERCEPT_IO_...
+ * @offset -1 for the calls without offset argument.
+ * @flags 0 for the calls without flags argument.
+ */
+template<int ioKind, typename RealFuncT>
+static inline ssize_t interceptIOV(const char* funcName, RealFuncT& realFunc, unsigned latencyOp,
+	int fd, const struct iovec* iov, int iovcnt, off64_t offset, int flags)
 {
 	ssize_t ret;
 
-	LOG_INTERCEPT_FD(fd);
-
-	MAP_OR_FAIL(write);
+	LOG_INTERCEPT_FD_FUNC(funcName, fd);
 
-	ret = __real_write(fd, buf, count);
+	LATENCY_START(startTime);
+	TRACE_START(traceStartTime);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
-
-	InjectionTk::ejectAfterEinval(fd);
+	mapOrFail(realFunc, funcName);
 
-	ret = __real_write(fd, buf, count);
-
-	return(ret);
-}
+	// the bounce buffer path of VectoredIOTk always uses the most generic call of the family
+	if(ioKind == INTERCEPT_IO_READ)
+		mapOrFail(__real_preadv64v2, "preadv64v2");
+	else
+	{
+		mapOrFail(__real_pwritev64v2, "pwritev64v2");
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pread)(int fd, void *buf, size_t count, off_t offset)
-{
-	ssize_t ret;
+		PREALLOC_BEFORE_WRITEV(fd, offset, iov, iovcnt);
+	}
 
-	LOG_INTERCEPT_FD(fd);
+	if(!CHECK_COALESCE_IOV(fd, iov, iovcnt, offset, flags) )
+		ret = callRealIOV(realFunc, fd, iov, iovcnt, offset, flags);
+	else
+	if(ioKind == INTERCEPT_IO_READ)
+		ret = VectoredIOTk::readCoalesced(fd, iov, iovcnt, offset, flags, __real_preadv64v2);
+	else
+		ret = VectoredIOTk::writeCoalesced(fd, iov, iovcnt, offset, flags, __real_pwritev64v2);
 
-	MAP_OR_FAIL(pread);
+	RETRY_AFTER_EINVAL(fd, ret, callRealIOV(realFunc, fd, iov, iovcnt, offset, flags) );
 
-	ret = __real_pread(fd, buf, count, offset);
+	TRACE_END( (ioKind == INTERCEPT_IO_READ) ? TRACE_OP_READ : TRACE_OP_WRITE, fd, NULL,
+		VectoredIOTk::getTotalLen(iov, iovcnt), offset, ret, traceStartTime);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	PROFILE_IOV(fd, iov, iovcnt, offset, ret, ioKind == INTERCEPT_IO_WRITE);
 
-	InjectionTk::ejectAfterEinval(fd);
+	if(ioKind == INTERCEPT_IO_WRITE)
+		MARK_BUFFERED_WRITE(fd, ret);
 
-	ret = __real_pread(fd, buf, count, offset);
+	PROBE(intercept_exit, funcName, fd, (long)ret);
+	LATENCY_END_FD(latencyOp, fd, startTime);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pwrite)(int fd, const void *buf, size_t count, off_t offset)
+/**
+ * Body of fsync() and fdatasync().
+ */
+template<bool isDataSync>
+static inline int interceptSync(const char* funcName, int fd)
 {
-	ssize_t ret;
+	int ret;
 
-	LOG_INTERCEPT_FD(fd);
+	LOG_INTERCEPT_FD_FUNC(funcName, fd);
 
-	MAP_OR_FAIL(pwrite);
+	LATENCY_START(startTime);
+	TRACE_START(traceStartTime);
 
-	ret = __real_pwrite(fd, buf, count, offset);
+	mapOrFail(__real_fsync, "fsync");
+	mapOrFail(__real_fdatasync, "fdatasync");
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	if(!initDone || !(libOpts & ENV_LIB_OPTS_SYNC) )
+		ret = isDataSync ? __real_fdatasync(fd) : __real_fsync(fd);
+	else
+		ret = InjectionTk::syncWithPolicy(fd, isDataSync, __real_fsync, __real_fdatasync);
 
-	InjectionTk::ejectAfterEinval(fd);
+	TRACE_END(isDataSync ? TRACE_OP_FDATASYNC : TRACE_OP_FSYNC, fd, NULL, 0, -1, ret,
+		traceStartTime);
 
-	ret = __real_pwrite(fd, buf, count, offset);
+	PROBE(intercept_exit, funcName, fd, (long)ret);
+	LATENCY_END_FD(LATENCY_OP_FSYNC, fd, startTime);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pread64)(int fd, void *buf, size_t count, off64_t offset)
+
+extern "C" DIR* INTERCEPT_FUNC_DECL(opendir)(const char *path)
 {
-	ssize_t ret;
+	DIR* ret;
 
-	LOG_INTERCEPT_FD(fd);
+	LOG_INTERCEPT_PATH(path);
 
-	MAP_OR_FAIL(pread64);
+	mapOrFail(__real_opendir, "opendir");
 
-	ret = __real_pread64(fd, buf, count, offset);
+	ret = __real_opendir(path);
 
-	if( (ret != -1) || (errno != EINVAL) )
+	if(!initDone || (ret==NULL) )
 		return(ret);
 
-	InjectionTk::ejectAfterEinval(fd);
+	int fd = dirfd(ret);
 
-	ret = __real_pread64(fd, buf, count, offset);
+	InjectionTk::injectAfterOpen(fd, path, O_DIRECTORY);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pwrite64)(int fd, const void *buf, size_t count, off64_t offset)
+extern "C" FILE* INTERCEPT_FUNC_DECL(fopen)(const char *path, const char *mode)
 {
-	ssize_t ret;
+	return interceptFOpen(__func__, __real_fopen, path, mode);
+}
 
-	LOG_INTERCEPT_FD(fd);
+extern "C" FILE* INTERCEPT_FUNC_DECL(fopen64)(const char *path, const char *mode)
+{
+	return interceptFOpen(__func__, __real_fopen64, path, mode);
+}
 
-	MAP_OR_FAIL(pwrite64);
+extern "C" int INTERCEPT_FUNC_DECL(open)(const char *path, int flags, ...)
+{
+	VA_OPEN_MODE(flags, mode);
 
-	ret = __real_pwrite64(fd, buf, count, offset);
+	return interceptOpen(__func__, __real_open, AT_FDCWD, path, flags, mode);
+}
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+extern "C" int INTERCEPT_FUNC_DECL(open64)(const char *path, int flags, ...)
+{
+	VA_OPEN_MODE(flags, mode);
 
-	InjectionTk::ejectAfterEinval(fd);
+	return interceptOpen(__func__, __real_open64, AT_FDCWD, path, flags, mode);
+}
 
-	ret = __real_pwrite64(fd, buf, count, offset);
+extern "C" int INTERCEPT_FUNC_DECL(__open_2)(const char *path, int flags)
+{
+	return interceptOpen(__func__, __real___open_2, AT_FDCWD, path, flags, 0);
+}
 
-	return(ret);
+extern "C" int INTERCEPT_FUNC_DECL(__open64_2)(const char *path, int flags)
+{
+	return interceptOpen(__func__, __real___open64_2, AT_FDCWD, path, flags, 0);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(readv)(int fd, const struct iovec *iov, int iovcnt)
+extern "C" int INTERCEPT_FUNC_DECL(openat)(int dirfd, const char *path, int flags, ...)
 {
-	ssize_t ret;
+	VA_OPEN_MODE(flags, mode);
 
-	LOG_INTERCEPT_FD(fd);
+	return interceptOpen(__func__, __real_openat, dirfd, path, flags, mode);
+}
 
-	MAP_OR_FAIL(readv);
+extern "C" int INTERCEPT_FUNC_DECL(openat64)(int dirfd, const char *path, int flags, ...)
+{
+	VA_OPEN_MODE(flags, mode);
 
-	ret = __real_readv(fd, iov, iovcnt);
+	return interceptOpen(__func__, __real_openat64, dirfd, path, flags, mode);
+}
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+extern "C" int INTERCEPT_FUNC_DECL(__openat_2)(int dirfd, const char *path, int flags)
+{
+	return interceptOpen(__func__, __real___openat_2, dirfd, path, flags, 0);
+}
 
-	InjectionTk::ejectAfterEinval(fd);
+extern "C" int INTERCEPT_FUNC_DECL(__openat64_2)(int dirfd, const char *path, int flags)
+{
+	return interceptOpen(__func__, __real___openat64_2, dirfd, path, flags, 0);
+}
 
-	ret = __real_readv(fd, iov, iovcnt);
+/* note: "man 2 creat" says this is equivalent to "open() with flags equal to
+	O_CREAT|O_WRONLY|O_TRUNC", so these are the flags for injection */
 
-	return(ret);
+extern "C" int INTERCEPT_FUNC_DECL(creat)(const char* path, mode_t mode)
+{
+	return interceptOpen(__func__, __real_creat, AT_FDCWD, path, O_CREAT | O_WRONLY | O_TRUNC,
+		mode);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+extern "C" int INTERCEPT_FUNC_DECL(creat64)(const char* path, mode_t mode)
 {
-	ssize_t ret;
+	return interceptOpen(__func__, __real_creat64, AT_FDCWD, path, O_CREAT | O_WRONLY | O_TRUNC,
+		mode);
+}
 
-	LOG_INTERCEPT_FD(fd);
+extern "C" size_t INTERCEPT_FUNC_DECL(fread)(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	size_t ret;
 
-	MAP_OR_FAIL(preadv);
+	LOG_INTERCEPT_FD(fileno(stream) );
 
-	ret = __real_preadv(fd, iov, iovcnt, offset);
+	mapOrFail(__real_fread, "fread");
 
-	if( (ret != -1) || (errno != EINVAL) )
+	ret = __real_fread(ptr, size, nmemb, stream);
+
+#ifndef BUILD_NO_EINVAL_RETRY
+	// note: ferror does not provide a specific error code like EINVAL
+
+	if(ret || !ferror(stream) )
 		return(ret);
 
-	InjectionTk::ejectAfterEinval(fd);
+	InjectionTk::ejectAfterEinval(fileno(stream) );
 
-	ret = __real_preadv(fd, iov, iovcnt, offset);
+	clearerr(stream);
+
+	ret = __real_fread(ptr, size, nmemb, stream);
+#endif
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv64)(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+extern "C" size_t INTERCEPT_FUNC_DECL(fwrite)(const void *ptr, size_t size, size_t nmemb,
+	FILE *stream)
 {
-	ssize_t ret;
+	size_t ret;
 
-	LOG_INTERCEPT_FD(fd);
+	LOG_INTERCEPT_FD(fileno(stream) );
 
-	MAP_OR_FAIL(preadv64);
+	mapOrFail(__real_fwrite, "fwrite");
 
-	ret = __real_preadv64(fd, iov, iovcnt, offset);
+	ret = __real_fwrite(ptr, size, nmemb, stream);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+#ifndef BUILD_NO_EINVAL_RETRY
+	// note: ferror does not provide a specific error code like EINVAL
 
-	InjectionTk::ejectAfterEinval(fd);
+	if(!ret && ferror(stream) )
+	{
+		InjectionTk::ejectAfterEinval(fileno(stream) );
+
+		clearerr(stream);
 
-	ret = __real_preadv64(fd, iov, iovcnt, offset);
+		ret = __real_fwrite(ptr, size, nmemb, stream);
+	}
+#endif
+
+	MARK_BUFFERED_WRITE(fileno(stream), ret);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv2)(int fd, const struct iovec *iov, int iovcnt,
-	off_t offset, int flags)
+extern "C" ssize_t INTERCEPT_FUNC_DECL(read)(int fd, void *buf, size_t count)
 {
-	ssize_t ret;
+	return interceptIO<INTERCEPT_IO_READ>(__func__, __real_read, LATENCY_OP_READ, fd, buf, count,
+		-1);
+}
 
-	LOG_INTERCEPT_FD(fd);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(write)(int fd, const void *buf, size_t count)
+{
+	return interceptIO<INTERCEPT_IO_WRITE>(__func__, __real_write, LATENCY_OP_WRITE, fd, buf,
+		count, -1);
+}
 
-	MAP_OR_FAIL(preadv2);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pread)(int fd, void *buf, size_t count, off_t offset)
+{
+	return interceptIO<INTERCEPT_IO_READ>(__func__, __real_pread, LATENCY_OP_PREAD, fd, buf,
+		count, offset);
+}
 
-	ret = __real_preadv2(fd, iov, iovcnt, offset, flags);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pwrite)(int fd, const void *buf, size_t count, off_t offset)
+{
+	return interceptIO<INTERCEPT_IO_WRITE>(__func__, __real_pwrite, LATENCY_OP_PWRITE, fd, buf,
+		count, offset);
+}
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pread64)(int fd, void *buf, size_t count, off64_t offset)
+{
+	return interceptIO<INTERCEPT_IO_READ>(__func__, __real_pread64, LATENCY_OP_PREAD, fd, buf,
+		count, offset);
+}
 
-	InjectionTk::ejectAfterEinval(fd);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pwrite64)(int fd, const void *buf, size_t count, off64_t offset)
+{
+	return interceptIO<INTERCEPT_IO_WRITE>(__func__, __real_pwrite64, LATENCY_OP_PWRITE, fd, buf,
+		count, offset);
+}
 
-	ret = __real_preadv2(fd, iov, iovcnt, offset, flags);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(readv)(int fd, const struct iovec *iov, int iovcnt)
+{
+	return interceptIOV<INTERCEPT_IO_READ>(__func__, __real_readv, LATENCY_OP_READ, fd, iov,
+		iovcnt, -1, 0);
+}
 
-	return(ret);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv)(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return interceptIOV<INTERCEPT_IO_READ>(__func__, __real_preadv, LATENCY_OP_PREAD, fd, iov,
+		iovcnt, offset, 0);
+}
+
+extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv64)(int fd, const struct iovec *iov, int iovcnt, off64_t offset)
+{
+	return interceptIOV<INTERCEPT_IO_READ>(__func__, __real_preadv64, LATENCY_OP_PREAD, fd, iov,
+		iovcnt, offset, 0);
+}
+
+extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv2)(int fd, const struct iovec *iov, int iovcnt,
+	off_t offset, int flags)
+{
+	return interceptIOV<INTERCEPT_IO_READ>(__func__, __real_preadv2, LATENCY_OP_PREAD, fd, iov,
+		iovcnt, offset, flags);
 }
 
 extern "C" ssize_t INTERCEPT_FUNC_DECL(preadv64v2)(int fd, const struct iovec *iov, int iovcnt,
 	off64_t offset, int flags)
 {
-	ssize_t ret;
+	return interceptIOV<INTERCEPT_IO_READ>(__func__, __real_preadv64v2, LATENCY_OP_PREAD, fd, iov,
+		iovcnt, offset, flags);
+}
 
-	LOG_INTERCEPT_FD(fd);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(writev)(int fd, const struct iovec *iov, int iovcnt)
+{
+	return interceptIOV<INTERCEPT_IO_WRITE>(__func__, __real_writev, LATENCY_OP_WRITE, fd, iov,
+		iovcnt, -1, 0);
+}
 
-	MAP_OR_FAIL(preadv64v2);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev)(int fd, const struct iovec *iov, int iovcnt,
+	off_t offset)
+{
+	return interceptIOV<INTERCEPT_IO_WRITE>(__func__, __real_pwritev, LATENCY_OP_PWRITE, fd, iov,
+		iovcnt, offset, 0);
+}
 
-	ret = __real_preadv64v2(fd, iov, iovcnt, offset, flags);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev64)(int fd, const struct iovec *iov, int iovcnt,
+	off64_t offset)
+{
+	return interceptIOV<INTERCEPT_IO_WRITE>(__func__, __real_pwritev64, LATENCY_OP_PWRITE, fd,
+		iov, iovcnt, offset, 0);
+}
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev2)(int fd, const struct iovec *iov, int iovcnt,
+	off_t offset, int flags)
+{
+	return interceptIOV<INTERCEPT_IO_WRITE>(__func__, __real_pwritev2, LATENCY_OP_PWRITE, fd, iov,
+		iovcnt, offset, flags);
+}
 
-	InjectionTk::ejectAfterEinval(fd);
+extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev64v2)(int fd, const struct iovec *iov, int iovcnt,
+	off64_t offset, int flags)
+{
+	return interceptIOV<INTERCEPT_IO_WRITE>(__func__, __real_pwritev64v2, LATENCY_OP_PWRITE, fd,
+		iov, iovcnt, offset, flags);
+}
 
-	ret = __real_preadv64v2(fd, iov, iovcnt, offset, flags);
 
-	return(ret);
+extern "C" int INTERCEPT_FUNC_DECL(fsync)(int fd)
+{
+	return interceptSync<false>(__func__, fd);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(writev)(int fd, const struct iovec *iov, int iovcnt)
+extern "C" int INTERCEPT_FUNC_DECL(fdatasync)(int fd)
 {
-	ssize_t ret;
+	return interceptSync<true>(__func__, fd);
+}
 
-	LOG_INTERCEPT_FD(fd);
+/**
+ * Read-only private mappings of matched files might get served from direct reads (see MmapTk). This
+ * is also called for all anonymous mappings (e.g. by malloc), so the fast path is just a few checks.
+ */
+template<typename FuncT>
+static inline void* interceptMmap(const char* funcName, FuncT& realFunc, void* addr,
+	size_t length, int prot, int flags, int fd, off64_t offset)
+{
+	void* ret;
 
-	MAP_OR_FAIL(writev);
+	if(fd != -1)
+		LOG_INTERCEPT_FD_FUNC(funcName, fd);
 
-	ret = __real_writev(fd, iov, iovcnt);
+	// no lookup before RealFuncs::init(), because dlsym() might call mmap() again
+	if(__builtin_expect(!realFunc, 0) )
+		return MmapTk::syscallMmap(addr, length, prot, flags, fd, offset);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	if(initDone && MmapTk::getIsActive() &&
+		MmapTk::getIsCandidate(length, prot, flags, fd, offset) )
+	{
+		ret = MmapTk::mapWithDirectReads(length, prot, flags, fd, offset);
+
+		if(ret != MAP_FAILED)
+		{
+			PROBE(intercept_exit, funcName, fd, (long)ret);
+			return(ret);
+		}
+	}
 
-	InjectionTk::ejectAfterEinval(fd);
+	ret = realFunc(addr, length, prot, flags, fd, offset);
 
-	ret = __real_writev(fd, iov, iovcnt);
+	if(fd != -1)
+		PROBE(intercept_exit, funcName, fd, (long)ret);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev)(int fd, const struct iovec *iov, int iovcnt,
+extern "C" void* INTERCEPT_FUNC_DECL(mmap)(void *addr, size_t length, int prot, int flags, int fd,
 	off_t offset)
 {
-	ssize_t ret;
-
-	LOG_INTERCEPT_FD(fd);
-
-	MAP_OR_FAIL(pwritev);
-
-	ret = __real_pwritev(fd, iov, iovcnt, offset);
+	return interceptMmap(__func__, __real_mmap, addr, length, prot, flags, fd, offset);
+}
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+extern "C" void* INTERCEPT_FUNC_DECL(mmap64)(void *addr, size_t length, int prot, int flags,
+	int fd, off64_t offset)
+{
+	return interceptMmap(__func__, __real_mmap64, addr, length, prot, flags, fd, offset);
+}
 
-	InjectionTk::ejectAfterEinval(fd);
+extern "C" int INTERCEPT_FUNC_DECL(munmap)(void *addr, size_t length)
+{
+	// no lookup before RealFuncs::init(), see mmap()
+	if(__builtin_expect(!__real_munmap, 0) )
+		return MmapTk::syscallMunmap(addr, length);
 
-	ret = __real_pwritev(fd, iov, iovcnt, offset);
+	if(MmapTk::getHasRegions() )
+		MmapTk::unmapRegions(addr, length);
 
-	return(ret);
+	return __real_munmap(addr, length);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev64)(int fd, const struct iovec *iov, int iovcnt,
-	off64_t offset)
+/**
+ * Advice that discards page contents gets dropped for mappings that were served from direct reads,
+ * because their anonymous pages would read back as zeros instead of the file contents.
+ */
+extern "C" int INTERCEPT_FUNC_DECL(madvise)(void *addr, size_t length, int advice)
 {
-	ssize_t ret;
-
-	LOG_INTERCEPT_FD(fd);
+	// no lookup before RealFuncs::init(), see mmap()
+	if(__builtin_expect(!__real_madvise, 0) )
+		return MmapTk::syscallMadvise(addr, length, advice);
 
-	MAP_OR_FAIL(pwritev64);
+	if(!MmapTk::getHasRegions() || !MmapTk::getIsDiscardAdvice(advice) ||
+		( (uintptr_t)addr % MMAP_PAGE_SIZE) )
+		return __real_madvise(addr, length, advice);
 
-	ret = __real_pwritev64(fd, iov, iovcnt, offset);
+	MmapRangeVec unservedRanges;
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	if(!MmapTk::getUnservedRanges(addr, length, unservedRanges) )
+		return __real_madvise(addr, length, advice);
 
-	InjectionTk::ejectAfterEinval(fd);
+	if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+		log_fprintf(stderr, LOG_PREFIX "Dropped madvise for direct-read mmap. addr: %p; "
+			"length: %zu; advice: %d\n", addr, length, advice);
 
-	ret = __real_pwritev64(fd, iov, iovcnt, offset);
+	for(const MmapRange& range : unservedRanges)
+	{
+		int adviseRes = __real_madvise( (void*)range.first, range.second, advice);
+		if(adviseRes)
+			return adviseRes;
+	}
 
-	return(ret);
+	return 0;
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev2)(int fd, const struct iovec *iov, int iovcnt,
-	off_t offset, int flags)
+extern "C" int INTERCEPT_FUNC_DECL(io_setup)(int maxevents, aio_context_t* ctxp)
 {
-	ssize_t ret;
-
-	LOG_INTERCEPT_FD(fd);
+	int ret;
 
-	MAP_OR_FAIL(pwritev2);
+	LOG_INTERCEPT_AIO( (aio_context_t)0); // ctx not known yet
 
-	ret = __real_pwritev2(fd, iov, iovcnt, offset, flags);
+	MAP_OR_SYSCALL(io_setup, AsyncIOTk::syscallSetup);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	ret = __real_io_setup(maxevents, ctxp);
 
-	InjectionTk::ejectAfterEinval(fd);
+	if(initDone && !ret)
+		AsyncIOTk::countContext();
 
-	ret = __real_pwritev2(fd, iov, iovcnt, offset, flags);
+	PROBE(intercept_exit, __func__, -1, (long)ret);
 
 	return(ret);
 }
 
-extern "C" ssize_t INTERCEPT_FUNC_DECL(pwritev64v2)(int fd, const struct iovec *iov, int iovcnt,
-	off64_t offset, int flags)
+extern "C" int INTERCEPT_FUNC_DECL(io_destroy)(aio_context_t ctx)
 {
-	ssize_t ret;
-
-	LOG_INTERCEPT_FD(fd);
+	int ret;
 
-	MAP_OR_FAIL(pwritev64v2);
+	LOG_INTERCEPT_AIO(ctx);
 
-	ret = __real_pwritev64v2(fd, iov, iovcnt, offset, flags);
+	MAP_OR_SYSCALL(io_destroy, AsyncIOTk::syscallDestroy);
 
-	if( (ret != -1) || (errno != EINVAL) )
-		return(ret);
+	if(initDone)
+		AsyncIOTk::forgetContext(ctx);
 
-	InjectionTk::ejectAfterEinval(fd);
+	ret = __real_io_destroy(ctx);
 
-	ret = __real_pwritev64v2(fd, iov, iovcnt, offset, flags);
+	PROBE(intercept_exit, __func__, -1, (long)ret);
 
 	return(ret);
 }
 
-
-extern "C" int INTERCEPT_FUNC_DECL(fsync)(int fd)
+extern "C" int INTERCEPT_FUNC_DECL(io_submit)(aio_context_t ctx, long nr, struct iocb** iocbpp)
 {
 	int ret;
 
-	LOG_INTERCEPT_FD(fd);
+	LOG_INTERCEPT_AIO(ctx);
 
-	MAP_OR_FAIL(fsync);
+	MAP_OR_SYSCALL(io_submit, AsyncIOTk::syscallSubmit);
 
-	ret = __real_fsync(fd);
+	if(!initDone)
+		ret = __real_io_submit(ctx, nr, iocbpp);
+	else
+		ret = AsyncIOTk::submitWithPolicy(ctx, nr, iocbpp, __real_io_submit);
 
-	if(ret < 0)
-		return(ret);
+	PROBE(intercept_exit, __func__, -1, (long)ret);
 
 	return(ret);
 }
 
-extern "C" int INTERCEPT_FUNC_DECL(fdatasync)(int fd)
+extern "C" int INTERCEPT_FUNC_DECL(io_getevents)(aio_context_t ctx, long min_nr, long nr,
+	struct io_event* events, struct timespec* timeout)
 {
 	int ret;
 
-	LOG_INTERCEPT_FD(fd);
+	LOG_INTERCEPT_AIO(ctx);
 
-	MAP_OR_FAIL(fdatasync);
+	MAP_OR_SYSCALL(io_getevents, AsyncIOTk::syscallGetEvents);
+	MAP_OR_SYSCALL(io_submit, AsyncIOTk::syscallSubmit);
 
-	ret = __real_fdatasync(fd);
+	if(!initDone)
+		ret = __real_io_getevents(ctx, min_nr, nr, events, timeout);
+	else
+		ret = AsyncIOTk::getEventsWithPolicy(ctx, min_nr, nr, events, timeout,
+			__real_io_getevents, __real_io_submit);
 
-	if(ret < 0)
-		return(ret);
+	PROBE(intercept_exit, __func__, -1, (long)ret);
 
 	return(ret);
 }
@@ -793,7 +1155,7 @@ extern "C" int INTERCEPT_FUNC_DECL(closedir)(DIR *dirp)
 	if(initDone)
 		InjectionTk::ejectBeforeClose(fd);
 
-	MAP_OR_FAIL(closedir);
+	mapOrFail(__real_closedir, "closedir");
 
 	ret = __real_closedir(dirp);
 
@@ -808,13 +1170,24 @@ extern "C" int INTERCEPT_FUNC_DECL(fclose)(FILE* stream)
 
 	LOG_INTERCEPT_FD(fd);
 
+	LATENCY_START(startTime);
+
+	// fd class needs to be known before the fd gets removed from the store
+	unsigned fdClass = latencyClock ? LatencyTk::getFDClass(fd) : LATENCY_FDCLASS_UNMATCHED;
+
+	// path ID in the trace also needs to be known before the fd gets removed from the store
+	TRACE_END(TRACE_OP_CLOSE, fd, NULL, 0, -1, 0, 0);
+
 	if(initDone)
 		InjectionTk::ejectBeforeClose(fd);
 
-	MAP_OR_FAIL(fclose);
+	mapOrFail(__real_fclose, "fclose");
 
 	ret = __real_fclose(stream);
 
+	PROBE(intercept_exit, __func__, fd, (long)ret);
+	LATENCY_END_FDCLASS(LATENCY_OP_CLOSE, fdClass, startTime);
+
 	return(ret);
 }
 
@@ -824,12 +1197,23 @@ extern "C" int INTERCEPT_FUNC_DECL(close)(int fd)
 
 	LOG_INTERCEPT_FD(fd);
 
+	LATENCY_START(startTime);
+
+	// fd class needs to be known before the fd gets removed from the store
+	unsigned fdClass = latencyClock ? LatencyTk::getFDClass(fd) : LATENCY_FDCLASS_UNMATCHED;
+
+	// path ID in the trace also needs to be known before the fd gets removed from the store
+	TRACE_END(TRACE_OP_CLOSE, fd, NULL, 0, -1, 0, 0);
+
 	if(initDone)
 		InjectionTk::ejectBeforeClose(fd);
 
-	MAP_OR_FAIL(close);
+	mapOrFail(__real_close, "close");
 
 	ret = __real_close(fd);
 
+	PROBE(intercept_exit, __func__, fd, (long)ret);
+	LATENCY_END_FDCLASS(LATENCY_OP_CLOSE, fdClass, startTime);
+
 	return(ret);
 }
@@ -0,0 +1,371 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <pthread.h>
+#include "FDStore.h"
+#include "Latency.h"
+
+#define LATENCY_TSC_CALIBRATION_NS	(10*1000*1000) // min time to measure TSC frequency
+
+
+int latencyClock = LATENCY_CLOCK_DISABLED;
+
+/* the registry is allocated on init and deliberately never freed, because threads can still exit
+	(and thus unregister) after the lib destructor ran */
+std::mutex* LatencyTk::mutex = NULL;
+LatencyThreadHistogramsVec* LatencyTk::threadHistogramsVec = NULL;
+LatencyThreadHistograms* LatencyTk::exitedHistograms = NULL;
+
+pthread_key_t LatencyTk::threadKey;
+
+uint64_t LatencyTk::initTSC = 0;
+uint64_t LatencyTk::initMonotonicNS = 0;
+
+/* trivially destructible, so that they stay valid for calls from other thread_local destructors
+	and atexit handlers. The histograms get merged into exitedHistograms by the destructor of
+	threadKey, which doesn't run for the main thread, so its histograms just stay registered. */
+static thread_local LatencyThreadHistograms* threadHistograms = NULL; // NULL until first record
+static thread_local bool threadExited = false; // threadHistograms got merged and deleted
+
+
+/**
+ * Enable recording.
+ *
+ * @clock LATENCY_CLOCK_...
+ */
+void LatencyTk::init(int clock)
+{
+	mutex = new std::mutex();
+	threadHistogramsVec = new LatencyThreadHistogramsVec();
+	exitedHistograms = new LatencyThreadHistograms();
+
+	exitedHistograms->reset();
+
+	pthread_key_create(&threadKey, threadKeyDestructor);
+
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+
+	latencyClock = LATENCY_CLOCK_MONOTONIC;
+	initMonotonicNS = now();
+
+	#ifdef LATENCY_HAVE_TSC
+		initTSC = __rdtsc();
+	#endif
+
+	latencyClock = clock;
+}
+
+/**
+ * Add the duration since startTime to the histogram of the calling thread.
+ *
+ * @op LATENCY_OP_...
+ * @fdClass LATENCY_FDCLASS_...
+ * @startTime as returned by now() before the call.
+ */
+void LatencyTk::record(unsigned op, unsigned fdClass, uint64_t startTime)
+{
+	uint64_t endTime = now();
+
+	int savedErrno = errno; // interceptors return errno of the real call to the app
+
+	// TSC of different cores might be slightly off
+	uint64_t duration = (endTime > startTime) ? (endTime - startTime) : 0;
+
+	if(__builtin_expect(threadExited, 0) )
+	{ // calls from destructors during thread exit go directly to the merged histograms
+		std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+		addToHistogram(exitedHistograms->histograms[op][fdClass], duration);
+
+		errno = savedErrno;
+		return;
+	}
+
+	if(!threadHistograms)
+		threadHistograms = registerThread();
+
+	// single writer, so no need for atomic read-modify-write
+	addToHistogram(threadHistograms->histograms[op][fdClass], duration);
+
+	errno = savedErrno;
+}
+
+/**
+ * Add a value to a histogram that has only a single writer at a time.
+ */
+void LatencyTk::addToHistogram(LatencyHistogram& histogram, uint64_t duration)
+{
+	std::atomic<uint64_t>& bucket = histogram.buckets[valueToBucket(duration)];
+
+	bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+	histogram.sum.store(histogram.sum.load(std::memory_order_relaxed) + duration,
+		std::memory_order_relaxed);
+
+	if(duration > histogram.max.load(std::memory_order_relaxed) )
+		histogram.max.store(duration, std::memory_order_relaxed);
+}
+
+/**
+ * Same as record(), but determine the fd class from the fdStore.
+ */
+void LatencyTk::recordFD(unsigned op, int fd, uint64_t startTime)
+{
+	record(op, getFDClass(fd), startTime);
+}
+
+/**
+ * @return LATENCY_FDCLASS_MATCHED if the path of the fd matched a path file rule.
+ */
+unsigned LatencyTk::getFDClass(int fd)
+{
+	int fdFlags;
+
+	if(!initDone || (fd < 0) || !fdStore->getFDFlags(fd, fdFlags) )
+		return LATENCY_FDCLASS_UNMATCHED;
+
+	return (fdFlags & FDSTORE_FLAG_MATCHED) ?
+		LATENCY_FDCLASS_MATCHED : LATENCY_FDCLASS_UNMATCHED;
+}
+
+/**
+ * Allocate the histograms for the calling thread and add them to the registry.
+ */
+LatencyThreadHistograms* LatencyTk::registerThread()
+{
+	LatencyThreadHistograms* threadHistograms = new LatencyThreadHistograms();
+
+	threadHistograms->reset();
+
+	pthread_setspecific(threadKey, threadHistograms);
+
+	std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+	threadHistogramsVec->push_back(threadHistograms);
+
+	return threadHistograms;
+}
+
+/**
+ * Destructor of threadKey, called on exit of threads other than the main thread.
+ */
+void LatencyTk::threadKeyDestructor(void* threadKeyValue)
+{
+	threadExited = true;
+	threadHistograms = NULL;
+
+	unregisterThread( (LatencyThreadHistograms*)threadKeyValue);
+}
+
+/**
+ * Merge the histograms of an exiting thread into exitedHistograms and remove them from the registry.
+ */
+void LatencyTk::unregisterThread(LatencyThreadHistograms* threadHistograms)
+{
+	{
+		std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+		mergeHistograms(*threadHistograms, *exitedHistograms);
+
+		threadHistogramsVec->erase(std::remove(threadHistogramsVec->begin(),
+			threadHistogramsVec->end(), threadHistograms), threadHistogramsVec->end() );
+	}
+
+	delete threadHistograms;
+}
+
+/**
+ * Add all values of source to target.
+ */
+void LatencyTk::mergeHistograms(const LatencyThreadHistograms& source,
+	LatencyThreadHistograms& target)
+{
+	for(unsigned op = 0; op < LATENCY_NUM_OPS; op++)
+		for(unsigned fdClass = 0; fdClass < LATENCY_NUM_FDCLASSES; fdClass++)
+		{
+			const LatencyHistogram& sourceHistogram = source.histograms[op][fdClass];
+			LatencyHistogram& targetHistogram = target.histograms[op][fdClass];
+
+			for(unsigned i = 0; i < LATENCY_NUM_BUCKETS; i++)
+				targetHistogram.buckets[i].fetch_add(
+					sourceHistogram.buckets[i].load(std::memory_order_relaxed),
+					std::memory_order_relaxed);
+
+			targetHistogram.sum.fetch_add(sourceHistogram.sum.load(std::memory_order_relaxed),
+				std::memory_order_relaxed);
+
+			uint64_t sourceMax = sourceHistogram.max.load(std::memory_order_relaxed);
+
+			if(sourceMax > targetHistogram.max.load(std::memory_order_relaxed) )
+				targetHistogram.max.store(sourceMax, std::memory_order_relaxed);
+		}
+}
+
+/**
+ * @return factor to convert values of the configured clock to ns.
+ */
+double LatencyTk::getNSPerClockUnit()
+{
+	if(latencyClock != LATENCY_CLOCK_TSC)
+		return 1;
+
+	#ifdef LATENCY_HAVE_TSC
+		struct timespec currentTime;
+		uint64_t currentNS;
+
+		// busy wait for short runs to get a sufficiently precise measurement
+		do
+		{
+			clock_gettime(CLOCK_MONOTONIC, &currentTime);
+			currentNS = (currentTime.tv_sec * 1000000000ULL) + currentTime.tv_nsec;
+		} while( (currentNS - initMonotonicNS) < LATENCY_TSC_CALIBRATION_NS);
+
+		uint64_t elapsedTSC = __rdtsc() - initTSC;
+
+		return elapsedTSC ? ( (double)(currentNS - initMonotonicNS) / elapsedTSC) : 1;
+	#else
+		return 1;
+	#endif
+}
+
+/**
+ * Write merged histograms of all threads as "[latency]" (percentiles) and "[latency buckets]" (raw
+ * buckets, e.g. to merge reports of multiple processes) sections of the stats report.
+ */
+void LatencyTk::writeReport(int fd)
+{
+	if(latencyClock == LATENCY_CLOCK_DISABLED)
+		return;
+
+	const char* opNames[LATENCY_NUM_OPS] =
+		{ "open", "read", "write", "pread", "pwrite", "fsync", "close" };
+	const char* fdClassNames[LATENCY_NUM_FDCLASSES] = { "unmatched", "matched" };
+	const double percentiles[] = { 50, 90, 99, 99.9 };
+
+	double nsPerClockUnit = getNSPerClockUnit();
+
+	LatencyThreadHistograms* mergedHistograms = new LatencyThreadHistograms();
+
+	mergedHistograms->reset();
+
+	{
+		std::unique_lock<std::mutex> lock(*mutex); // L O C K (scoped)
+
+		mergeHistograms(*exitedHistograms, *mergedHistograms);
+
+		for(LatencyThreadHistograms* threadHistograms : *threadHistogramsVec)
+			mergeHistograms(*threadHistograms, *mergedHistograms);
+	}
+
+	dprintf(fd, "\n[latency]\n");
+	dprintf(fd, "# clock: %s; times in microseconds\n", clockToStr(latencyClock) );
+	dprintf(fd, "# op fds count mean p50 p90 p99 p99.9 max\n");
+
+	for(unsigned op = 0; op < LATENCY_NUM_OPS; op++)
+		for(unsigned fdClass = 0; fdClass < LATENCY_NUM_FDCLASSES; fdClass++)
+		{
+			const LatencyHistogram& histogram = mergedHistograms->histograms[op][fdClass];
+			uint64_t count = 0;
+
+			for(const std::atomic<uint64_t>& bucket : histogram.buckets)
+				count += bucket.load(std::memory_order_relaxed);
+
+			if(!count)
+				continue;
+
+			uint64_t max = histogram.max.load(std::memory_order_relaxed);
+
+			dprintf(fd, "%s %s %llu %.3f", opNames[op], fdClassNames[fdClass],
+				(unsigned long long)count,
+				(histogram.sum.load(std::memory_order_relaxed) * nsPerClockUnit) / count / 1000);
+
+			for(double percentile : percentiles)
+			{ // report upper end of the bucket that contains the percentile (but not beyond max)
+				uint64_t rank = (uint64_t)std::ceil(count * percentile / 100);
+				uint64_t currentCount = 0;
+				unsigned bucket = 0;
+
+				for( ; bucket < (LATENCY_NUM_BUCKETS - 1); bucket++)
+				{
+					currentCount += histogram.buckets[bucket].load(std::memory_order_relaxed);
+
+					if(currentCount >= rank)
+						break;
+				}
+
+				uint64_t value = (bucket < (LATENCY_NUM_BUCKETS - 1) ) ?
+					(bucketToValue(bucket + 1) - 1) : max;
+
+				dprintf(fd, " %.3f", (MIN(value, max) * nsPerClockUnit) / 1000);
+			}
+
+			dprintf(fd, " %.3f\n", (max * nsPerClockUnit) / 1000);
+		}
+
+	dprintf(fd, "\n[latency buckets]\n");
+	dprintf(fd, "# op fds bucket_start_ns count\n");
+
+	for(unsigned op = 0; op < LATENCY_NUM_OPS; op++)
+		for(unsigned fdClass = 0; fdClass < LATENCY_NUM_FDCLASSES; fdClass++)
+			for(unsigned bucket = 0; bucket < LATENCY_NUM_BUCKETS; bucket++)
+			{
+				uint64_t count = mergedHistograms->histograms[op][fdClass].buckets[bucket].load(
+					std::memory_order_relaxed);
+
+				if(count)
+					dprintf(fd, "%s %s %llu %llu\n", opNames[op], fdClassNames[fdClass],
+						(unsigned long long)(bucketToValue(bucket) * nsPerClockUnit),
+						(unsigned long long)count);
+			}
+
+	delete mergedHistograms;
+}
+
+/**
+ * @return name of a LATENCY_CLOCK_... value.
+ */
+const char* LatencyTk::clockToStr(int clock)
+{
+	switch(clock)
+	{
+		case LATENCY_CLOCK_MONOTONIC: return "monotonic";
+		case LATENCY_CLOCK_COARSE: return "coarse";
+		case LATENCY_CLOCK_TSC: return "tsc";
+		default: return "disabled";
+	}
+}
+
+/**
+ * @clockStr "monotonic", "coarse" or "tsc" (only on x86).
+ * @return LATENCY_CLOCK_... or -1 if clockStr is invalid.
+ */
+int LatencyTk::strToClock(const char* clockStr)
+{
+	if(!strcmp(clockStr, "monotonic") || !strcmp(clockStr, "1") )
+		return LATENCY_CLOCK_MONOTONIC;
+
+	if(!strcmp(clockStr, "coarse") )
+		return LATENCY_CLOCK_COARSE;
+
+	#ifdef LATENCY_HAVE_TSC
+		if(!strcmp(clockStr, "tsc") )
+			return LATENCY_CLOCK_TSC;
+	#endif
+
+	return -1;
+}
+
+void LatencyTk::forkPrepare()
+{
+	mutex->lock();
+}
+
+void LatencyTk::forkParent()
+{
+	mutex->unlock();
+}
+
+void LatencyTk::forkChild()
+{
+	mutex->unlock();
+}
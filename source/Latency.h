@@ -0,0 +1,221 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <atomic>
+#include <mutex>
+#include <pthread.h>
+#include <time.h>
+#include "Common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define LATENCY_HAVE_TSC
+#endif
+
+
+// clock sources (values of latencyClock)
+#define LATENCY_CLOCK_DISABLED		0
+#define LATENCY_CLOCK_MONOTONIC		1 // clock_gettime(CLOCK_MONOTONIC)
+#define LATENCY_CLOCK_COARSE		2 // clock_gettime(CLOCK_MONOTONIC_COARSE), resolution of a tick
+#define LATENCY_CLOCK_TSC			3 // rdtsc, converted to ns for the report (x86 only)
+
+// ops that get timed (several interceptors can share the same op, e.g. open/openat/creat)
+#define LATENCY_OP_OPEN				0
+#define LATENCY_OP_READ				1
+#define LATENCY_OP_WRITE			2
+#define LATENCY_OP_PREAD			3
+#define LATENCY_OP_PWRITE			4
+#define LATENCY_OP_FSYNC			5
+#define LATENCY_OP_CLOSE			6
+#define LATENCY_NUM_OPS				7
+
+#define LATENCY_FDCLASS_UNMATCHED	0 // fd path did not match a path file rule
+#define LATENCY_FDCLASS_MATCHED		1
+#define LATENCY_NUM_FDCLASSES		2
+
+/* log-linear buckets: 2^LATENCY_SUB_BUCKET_BITS linear sub-buckets per power of two, so that the
+	relative error of a bucket is at most 1/8. Values beyond 2^LATENCY_MAX_EXPONENT go into the last
+	bucket. */
+#define LATENCY_SUB_BUCKET_BITS		3
+#define LATENCY_SUB_BUCKETS			(1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_EXPONENT		47 // ~39h in ns, ~13h in TSC ticks at 3GHz
+#define LATENCY_NUM_BUCKETS \
+	( (LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) << LATENCY_SUB_BUCKET_BITS)
+
+
+extern int latencyClock; // LATENCY_CLOCK_...; checked by interceptors before anything else
+
+
+/**
+ * Latency histogram of a single op and fd class. Only written by its owner thread, so updates are
+ * plain relaxed load/store pairs (no atomic read-modify-write); atomics are only used so that the
+ * report can read concurrently.
+ */
+class LatencyHistogram
+{
+	public:
+		std::atomic<uint64_t> buckets[LATENCY_NUM_BUCKETS];
+		std::atomic<uint64_t> sum; // in clock units
+		std::atomic<uint64_t> max; // in clock units
+
+		void reset()
+		{
+			for(std::atomic<uint64_t>& bucket : buckets)
+				bucket.store(0, std::memory_order_relaxed);
+
+			sum.store(0, std::memory_order_relaxed);
+			max.store(0, std::memory_order_relaxed);
+		}
+};
+
+/**
+ * All histograms of a thread.
+ */
+class LatencyThreadHistograms
+{
+	public:
+		LatencyHistogram histograms[LATENCY_NUM_OPS][LATENCY_NUM_FDCLASSES];
+
+		void reset()
+		{
+			for(LatencyHistogram (&opHistograms)[LATENCY_NUM_FDCLASSES] : histograms)
+				for(LatencyHistogram& histogram : opHistograms)
+					histogram.reset();
+		}
+};
+
+typedef std::vector<LatencyThreadHistograms*> LatencyThreadHistogramsVec;
+
+
+/**
+ * Toolkit to record the durations of intercepted calls in per-thread log-linear histograms, which
+ * get merged for the stats report.
+ */
+class LatencyTk
+{
+	public:
+		static void init(int clock);
+		static void record(unsigned op, unsigned fdClass, uint64_t startTime);
+		static void recordFD(unsigned op, int fd, uint64_t startTime);
+		static unsigned getFDClass(int fd);
+		static void writeReport(int fd);
+
+		static const char* clockToStr(int clock);
+		static int strToClock(const char* clockStr);
+
+	private:
+		LatencyTk() {}
+
+		static std::mutex* mutex; // protects threadHistogramsVec and exitedHistograms
+		static LatencyThreadHistogramsVec* threadHistogramsVec; // histograms of running threads
+		static LatencyThreadHistograms* exitedHistograms; // merged histograms of exited threads
+		static pthread_key_t threadKey; // to unregister the histograms of a thread on exit
+
+		// start time of recording to convert TSC ticks to ns
+		static uint64_t initTSC;
+		static uint64_t initMonotonicNS;
+
+		static LatencyThreadHistograms* registerThread();
+		static void unregisterThread(LatencyThreadHistograms* threadHistograms);
+		static void threadKeyDestructor(void* threadKeyValue);
+		static void addToHistogram(LatencyHistogram& histogram, uint64_t duration);
+		static void mergeHistograms(const LatencyThreadHistograms& source,
+			LatencyThreadHistograms& target);
+		static double getNSPerClockUnit();
+
+		static void forkPrepare();
+		static void forkParent();
+		static void forkChild();
+
+
+		// inliners
+	public:
+		/**
+		 * @return current time in units of the configured clock (ns or TSC ticks).
+		 */
+		static uint64_t now()
+		{
+			#ifdef LATENCY_HAVE_TSC
+				if(latencyClock == LATENCY_CLOCK_TSC)
+					return __rdtsc();
+			#endif
+
+			struct timespec currentTime;
+
+			clock_gettime( (latencyClock == LATENCY_CLOCK_COARSE) ?
+				CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &currentTime);
+
+			return (currentTime.tv_sec * 1000000000ULL) + currentTime.tv_nsec;
+		}
+
+		static unsigned valueToBucket(uint64_t value)
+		{
+			if(value < LATENCY_SUB_BUCKETS)
+				return value;
+
+			unsigned exponent = 63 - __builtin_clzll(value);
+
+			if(exponent > LATENCY_MAX_EXPONENT)
+				return LATENCY_NUM_BUCKETS - 1;
+
+			return ( (exponent - LATENCY_SUB_BUCKET_BITS + 1) << LATENCY_SUB_BUCKET_BITS) +
+				( (value >> (exponent - LATENCY_SUB_BUCKET_BITS) ) & (LATENCY_SUB_BUCKETS - 1) );
+		}
+
+		/**
+		 * @return smallest value that falls into the given bucket.
+		 */
+		static uint64_t bucketToValue(unsigned bucket)
+		{
+			if(bucket < LATENCY_SUB_BUCKETS)
+				return bucket;
+
+			unsigned exponent = (bucket >> LATENCY_SUB_BUCKET_BITS) + LATENCY_SUB_BUCKET_BITS - 1;
+			uint64_t subBucket = bucket & (LATENCY_SUB_BUCKETS - 1);
+
+			return (1ULL << exponent) + (subBucket << (exponent - LATENCY_SUB_BUCKET_BITS) );
+		}
+};
+
+#ifdef BUILD_NO_LATENCY
+
+/* latency recording compiled out, so the interceptors don't even check latencyClock (which stays
+	LATENCY_CLOCK_DISABLED) */
+#define LATENCY_START(startTimeVar)							do {} while(0)
+#define LATENCY_END_FD(op, fd, startTimeVar)				do {} while(0)
+#define LATENCY_END_FDCLASS(op, fdClass, startTimeVar)		do { (void)(fdClass); } while(0)
+
+#else // BUILD_NO_LATENCY
+
+/**
+ * Start timing of an intercepted call. When latency recording is disabled, this is a single branch.
+ */
+#define LATENCY_START(startTimeVar) \
+	uint64_t startTimeVar = __builtin_expect(latencyClock, LATENCY_CLOCK_DISABLED) ? \
+		LatencyTk::now() : 0
+
+/**
+ * Record duration of an intercepted call on the given fd since LATENCY_START.
+ */
+#define LATENCY_END_FD(op, fd, startTimeVar) \
+	do \
+	{ \
+		if(__builtin_expect(latencyClock, LATENCY_CLOCK_DISABLED) ) \
+			LatencyTk::recordFD(op, fd, startTimeVar); \
+	} while(0)
+
+/**
+ * Record duration of an intercepted call for which the fd class was determined already (e.g. before
+ * close, after which the fd is gone from the fdStore).
+ */
+#define LATENCY_END_FDCLASS(op, fdClass, startTimeVar) \
+	do \
+	{ \
+		if(__builtin_expect(latencyClock, LATENCY_CLOCK_DISABLED) ) \
+			LatencyTk::record(op, fdClass, startTimeVar); \
+	} while(0)
+
+
+#endif // BUILD_NO_LATENCY
+
+#endif /* LATENCY_H_ */
@@ -3,6 +3,7 @@
 
 #include "Common.h"
 #include "Config.h"
+#include "Probes.h"
 
 #define ENV_LOG_TOPICS				"LD_VAST_LOG_TOPICS"
 #define ENV_LOG_TOPIC_INTERCEPT		1 // call intercepted
@@ -11,24 +12,57 @@
 #define ENV_LOG_TOPIC_INIT			8 // initialization info
 #define ENV_LOG_TOPIC_CLOSE			16 // close ops with path
 #define ENV_LOG_TOPIC_NORMALIZE		32 // normalized paths (if different from original)
+#define ENV_LOG_TOPIC_SYNC			64 // elided or downgraded fsync/fdatasync
+#define ENV_LOG_TOPIC_SPLIT			128 // split reads/writes
+#define ENV_LOG_TOPIC_PREALLOC		256 // preallocation of new files
+#define ENV_LOG_TOPIC_COALESCE		512 // vectored reads/writes through bounce buffer
+#define ENV_LOG_TOPIC_PROFILE		1024 // recorded I/O profile policies
 
 
 #define LOG_PREFIX		LIB_NAME ": "
 
-#define LOG_INTERCEPT_PATH(path) \
+/* intercepted calls are only logged if built without BUILD_NO_INTERCEPT_LOG; the probe is
+	independent of that (see BUILD_NO_PROBES). */
+#ifdef BUILD_NO_INTERCEPT_LOG
+	#define LOG_INTERCEPT_ENABLED		false
+#else
+	#define LOG_INTERCEPT_ENABLED		(libLogTopics & ENV_LOG_TOPIC_INTERCEPT)
+#endif
+
+#define LOG_INTERCEPT_PATH(path)		LOG_INTERCEPT_PATH_FUNC(__func__, path)
+#define LOG_INTERCEPT_FD(fd)			LOG_INTERCEPT_FD_FUNC(__func__, fd)
+
+/**
+ * Versions with explicit function name for the interceptor templates.
+ */
+#define LOG_INTERCEPT_PATH_FUNC(funcName, path) \
 	do \
 	{ \
-		if(libLogTopics & ENV_LOG_TOPIC_INTERCEPT) \
+		PROBE(intercept_entry, funcName, -1, path); \
+		\
+		if(LOG_INTERCEPT_ENABLED) \
 			log_fprintf(stderr, LOG_PREFIX "%s: %s %s\n", \
-			initDone ? "INTERCEPTING" : "not intercepting", __func__, path); \
+			initDone ? "INTERCEPTING" : "not intercepting", funcName, path); \
 	} while(0)
 
-#define LOG_INTERCEPT_FD(fd) \
+#define LOG_INTERCEPT_FD_FUNC(funcName, fd) \
 	do \
 	{ \
-		if(libLogTopics & ENV_LOG_TOPIC_INTERCEPT) \
+		PROBE(intercept_entry, funcName, fd, (const char*)NULL); \
+		\
+		if(LOG_INTERCEPT_ENABLED) \
 			log_fprintf(stderr, LOG_PREFIX "%s: %s; fd: %d\n", \
-			initDone ? "INTERCEPTING" : "not intercepting", __func__, fd); \
+			initDone ? "INTERCEPTING" : "not intercepting", funcName, fd); \
+	} while(0)
+
+#define LOG_INTERCEPT_AIO(ctx) \
+	do \
+	{ \
+		PROBE(intercept_entry, __func__, -1, (const char*)NULL); \
+		\
+		if(LOG_INTERCEPT_ENABLED) \
+			log_fprintf(stderr, LOG_PREFIX "%s: %s; aio ctx: %lu\n", \
+			initDone ? "INTERCEPTING" : "not intercepting", __func__, (unsigned long)ctx); \
 	} while(0)
 
 
@@ -1,12 +1,259 @@
+#include "AllocInterposer.h"
+#include "AsyncIO.h"
+#include "BufferPool.h"
 #include "Common.h"
+#include "DirectEmu.h"
 #include "FDStore.h"
+#include "InjectionTk.h"
+#include "Latency.h"
 #include "Logger.h"
+#include "Mmap.h"
+#include "MountStore.h"
+#include "Numa.h"
 #include "PathMatchStore.h"
+#include "PathTree.h"
+#include "Profile.h"
+#include "RealFuncs.h"
+#include "SplitIO.h"
+#include "Stats.h"
+#include "SyncCoalescer.h"
+#include "Throttle.h"
+#include "Trace.h"
 
 
 bool initDone = false; // set to true at end of initlib() to avoid intercepts during init
 
 
+/**
+ * Read a size from the given env variable. Exits the process if the value is invalid.
+ *
+ * @return the size or defaultSize if env variable is not set.
+ */
+static uint64_t getEnvSize(const char* envName, uint64_t defaultSize)
+{
+	const char* sizeStr = getenv(envName);
+	if(!sizeStr)
+		return defaultSize;
+
+	uint64_t size;
+
+	if(!parseSizeStr(sizeStr, size) )
+	{
+		log_fprintf(stderr, LOG_PREFIX "ERROR: Invalid size in %s: %s\n", envName, sizeStr);
+		exit(1);
+	}
+
+	return size;
+}
+
+/**
+ * Alloc splitIO if enabled via env variables.
+ */
+static void initSplitIO()
+{
+	uint64_t minSplitSize = getEnvSize(ENV_LIB_SPLIT_SIZE, 0);
+	if(!minSplitSize)
+		return; // splitting disabled
+
+	uint64_t chunkSize = getEnvSize(ENV_LIB_SPLIT_CHUNK, SPLITIO_DEFAULT_CHUNK_SIZE);
+	uint64_t numThreads = getEnvSize(ENV_LIB_SPLIT_THREADS, SPLITIO_DEFAULT_NUM_THREADS);
+	uint64_t numExtraFDs = getEnvSize(ENV_LIB_SPLIT_FDS, SPLITIO_DEFAULT_NUM_FDS);
+
+	int threadNode = -1;
+
+	const char* threadNodeStr = getenv(ENV_LIB_SPLIT_NODE);
+	if(threadNodeStr && *threadNodeStr)
+	{
+		if(!NumaTk::strToNode(threadNodeStr, threadNode) )
+		{
+			log_fprintf(stderr, LOG_PREFIX "ERROR: Invalid NUMA node or network interface in %s: "
+				"%s\n", ENV_LIB_SPLIT_NODE, threadNodeStr);
+			exit(1);
+		}
+	}
+
+	splitIO = new SplitIO(minSplitSize, chunkSize, numThreads, numExtraFDs, threadNode);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Split reads/writes: minSize: %llu; chunkSize: %llu; "
+			"numThreads: %llu; numExtraFDs: %llu; threadNode: %d\n",
+			(unsigned long long)minSplitSize, (unsigned long long)chunkSize,
+			(unsigned long long)numThreads, (unsigned long long)numExtraFDs, threadNode);
+}
+
+/**
+ * Alloc bufferPool unless disabled via env variable.
+ */
+static void initBufferPool()
+{
+	uint64_t maxSize = getEnvSize(ENV_LIB_BUFPOOL_SIZE, BUFFERPOOL_DEFAULT_MAX_SIZE);
+	if(maxSize < BUFFERPOOL_BUF_SIZE)
+		return; // pool disabled
+
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	bufferPool = new BufferPool(maxSize);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Buffer pool: maxSize: %llu; numaNodes: %u\n",
+			(unsigned long long)maxSize, NumaTk::getNumNodes() );
+}
+
+
+/**
+ * Enable the allocation interposer if requested via env variable.
+ */
+static void initAllocInterposer()
+{
+	uint64_t minAllocSize = getEnvSize(ENV_LIB_ALLOC_SIZE, 0);
+	if(!minAllocSize)
+		return; // interposer disabled
+
+#ifdef BUILD_ALLOC_INTERPOSER
+	bool useHugePages = (libOpts & ENV_LIB_OPT_ALLOC_HUGEPAGES);
+
+	bool enableRes = AllocInterposer::enable(minAllocSize, useHugePages);
+
+	if(!enableRes)
+		log_fprintf(stderr, LOG_PREFIX "Reserving address space for aligned allocations failed. "
+			"Continuing with regular allocations.\n");
+	else
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Aligned allocations: minSize: %llu; hugePages: %d\n",
+			(unsigned long long)minAllocSize, (int)useHugePages);
+#else
+	log_fprintf(stderr, LOG_PREFIX "Ignoring %s, because library was built without "
+		"BUILD_ALLOC_INTERPOSER.\n", ENV_LIB_ALLOC_SIZE);
+#endif
+}
+
+/**
+ * Apply O_DIRECT emulation parameters (only for builds with BUILD_DIRECT_EMULATION).
+ */
+static void initDirectEmu()
+{
+#ifdef BUILD_DIRECT_EMULATION
+	uint64_t blockSize = getEnvSize(ENV_LIB_EMU_BLOCKSIZE, DIRECTEMU_DEFAULT_BLOCK_SIZE);
+	uint64_t delayUSecs = getEnvSize(ENV_LIB_EMU_DELAY, 0);
+
+	if(!blockSize || (blockSize & (blockSize - 1) ) )
+	{
+		log_fprintf(stderr, LOG_PREFIX "ERROR: %s must be a power of two: %llu\n",
+			ENV_LIB_EMU_BLOCKSIZE, (unsigned long long)blockSize);
+		exit(1);
+	}
+
+	DirectEmu::init(blockSize, delayUSecs);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "O_DIRECT is emulated (test build). "
+			"Block size: %llu; Delay: %lluus\n",
+			(unsigned long long)blockSize, (unsigned long long)delayUSecs);
+#endif
+}
+
+/**
+ * Enable latency histograms if configured via ENV_LIB_LATENCY. They are only recorded if there is a
+ * stats file to write them to.
+ */
+static void initLatency(const char* statsFileStr)
+{
+	const char* latencyClockStr = getenv(ENV_LIB_LATENCY);
+	if(!latencyClockStr || !*latencyClockStr)
+		return;
+
+#ifdef BUILD_NO_LATENCY
+	log_fprintf(stderr, LOG_PREFIX "Ignoring %s because this build has no latency recording\n",
+		ENV_LIB_LATENCY);
+	return;
+#endif
+
+	int clock = LatencyTk::strToClock(latencyClockStr);
+	if(clock == -1)
+	{
+		log_fprintf(stderr, LOG_PREFIX "ERROR: Invalid value for %s: %s\n",
+			ENV_LIB_LATENCY, latencyClockStr);
+		exit(1);
+	}
+
+	if(!statsFileStr || !*statsFileStr)
+	{
+		log_fprintf(stderr, LOG_PREFIX "Ignoring %s because %s is not set\n",
+			ENV_LIB_LATENCY, ENV_LIB_STATSFILE);
+		return;
+	}
+
+	LatencyTk::init(clock);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Latency clock: %s\n", LatencyTk::clockToStr(clock) );
+}
+
+/**
+ * Enable serving of read-only mmaps from direct reads if configured via env variable.
+ */
+static void initMmap()
+{
+	uint64_t minMapSize = getEnvSize(ENV_LIB_MMAP_SIZE, 0);
+	if(!minMapSize)
+		return; // disabled
+
+	uint64_t maxMapSize = getEnvSize(ENV_LIB_MMAP_MAXSIZE, 0);
+
+	MmapTk::init(minMapSize, maxMapSize);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Read-only mmaps from direct reads: minSize: %llu; "
+			"maxSize: %llu\n", (unsigned long long)minMapSize, (unsigned long long)maxMapSize);
+}
+
+/**
+ * Enable learning and/or applying of I/O profiles if configured via env variables. Both can point
+ * to the same file to refresh the profile with each run.
+ */
+static void initProfile()
+{
+	const char* applyPathStr = getenv(ENV_LIB_PROFILE_APPLY);
+	if(applyPathStr && *applyPathStr)
+	{
+		// without a valid profile, we find out about misaligned I/O etc. at runtime as usual
+		if(!ProfileTk::initApply(applyPathStr) )
+			log_fprintf(stderr, LOG_PREFIX "Continuing without I/O profile policies.\n");
+		else
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Applying I/O profile: %s\n", applyPathStr);
+	}
+
+	const char* learnPathStr = getenv(ENV_LIB_PROFILE_LEARN);
+	if(learnPathStr && *learnPathStr)
+	{
+		ProfileTk::initLearn(learnPathStr);
+
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Learning I/O profile: %s\n", learnPathStr);
+	}
+}
+
+/**
+ * Enable the I/O trace if configured via ENV_LIB_TRACEFILE.
+ */
+static void initTrace()
+{
+	const char* traceFileStr = getenv(ENV_LIB_TRACEFILE);
+	if(!traceFileStr || !*traceFileStr)
+		return;
+
+#ifdef BUILD_NO_TRACE
+	log_fprintf(stderr, LOG_PREFIX "Ignoring %s because this build has no I/O tracing\n",
+		ENV_LIB_TRACEFILE);
+	return;
+#endif
+
+	TraceTk::init(traceFileStr);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Trace file: %s\n", traceFileStr);
+}
+
 /**
  * Called when the library is loaded to init basic data structures.
  *
@@ -33,13 +280,21 @@ static __attribute__((constructor)) void initlib(void)
 			log_fprintf(stderr, LOG_PREFIX "libOpts: %d\n", libOpts);
 	}
 
+	initAllocInterposer(); // early to also cover the allocations of the following init
+
+	initDirectEmu();
+
+	RealFuncs::init(); // after DirectEmu, which wraps the real functions
+
 	const char* libPathFileStr = getenv(ENV_LIB_PATHFILE);
 	if(libPathFileStr)
 	{
 		// needs to be alloc'ed here as it's otherwise not initialized as static var
 		pathMatchStore = new PathMatchStore();
 
-		bool loadRes = pathMatchStore->loadPathFile(libPathFileStr);
+		bool loadRes = (libOpts & ENV_LIB_OPT_SHARED_PATHS) ?
+			pathMatchStore->loadPathFileShared(libPathFileStr) :
+			pathMatchStore->loadPathFile(libPathFileStr);
 
 		if(!loadRes)
 		{
@@ -48,14 +303,76 @@ static __attribute__((constructor)) void initlib(void)
 			exit(1);
 		}
 
+		unsigned numDisabledRules = pathMatchStore->evalConditions();
+
+		if(numDisabledRules && (libLogTopics & ENV_LOG_TOPIC_INIT) )
+			log_fprintf(stderr, LOG_PREFIX "Path file rules not applying to this process: %u\n",
+				numDisabledRules);
+
+		ThrottleTk::init(pathMatchStore->getImage() );
 	}
 
 	if(libLogTopics & ENV_LOG_TOPIC_INIT)
 		log_fprintf(stderr, LOG_PREFIX "Loaded paths: %d\n", pathMatchStore->size() );
 
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	mountStore = new MountStore();
+
+	bool loadMountsRes = mountStore->loadMounts();
+
+	if(!loadMountsRes && (libLogTopics & ENV_LOG_TOPIC_INIT) )
+		log_fprintf(stderr, LOG_PREFIX "Mount table not available: %s\n",
+			MOUNTSTORE_MOUNTINFO_PATH);
+
+	const char* libFSTypesStr = getenv(ENV_LIB_FSTYPES);
+	if(libFSTypesStr)
+	{
+		mountStore->setAllowedFSTypes(libFSTypesStr);
+
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Filesystem types: %s\n", libFSTypesStr);
+	}
+
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	pathTree = new PathTree();
+
 	// needs to be alloc'ed here as it's otherwise not initialized as static var
 	fdStore = new FDStore();
 
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	syncCoalescer = new SyncCoalescer();
+
+	NumaTk::init();
+
+	initBufferPool();
+
+	initSplitIO();
+
+	AsyncIOTk::init();
+
+	initMmap(); // after initSplitIO(), as the reads go through the split helper threads
+
+	const char* libStatsFileStr = getenv(ENV_LIB_STATSFILE);
+	if(libStatsFileStr && *libStatsFileStr)
+	{
+		StatsTk::init(libStatsFileStr);
+
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Stats file: %s\n", libStatsFileStr);
+	}
+
+	initLatency(libStatsFileStr);
+
+	initProfile();
+
+	initTrace();
+
+	// after profile and trace init, so that these also cover inherited fds
+	if(pathMatchStore)
+		InjectionTk::trackInheritedFDs(libOpts & ENV_LIB_OPT_INHERITED_DIRECT);
+
+	RealFuncs::protect(); // last, as nothing resolves real functions after init
+
 	initDone = true; // signal to interceptors that they can be effective now
 
 	if(libLogTopics & ENV_LOG_TOPIC_INIT)
@@ -74,8 +391,18 @@ static __attribute__((destructor)) void uninitlib(void)
 	 	 process shutdown. */
 	initDone = false;
 
+	StatsTk::writeReport(); // before the stores that hold the counters get deleted
+	ProfileTk::writeProfile();
+	TraceTk::flush();
+
+	latencyClock = LATENCY_CLOCK_DISABLED; // no more recording, because fdStore goes away
+
 	SAFE_DELETE(pathMatchStore);
 	SAFE_DELETE(fdStore);
+	SAFE_DELETE(pathTree); // after fdStore, which references the nodes
+	SAFE_DELETE(syncCoalescer);
+	SAFE_DELETE(mountStore);
+	SAFE_DELETE(splitIO);
 
 	if(libLogTopics & ENV_LOG_TOPIC_INIT)
 		fprintf(stderr, LOG_PREFIX "Uninit complete\n");
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "FDStore.h"
+#include "Logger.h"
+#include "Mmap.h"
+#include "Probes.h"
+#include "RealFuncs.h"
+#include "SplitIO.h"
+
+uint64_t MmapTk::minMapSize = 0;
+uint64_t MmapTk::maxMapSize = 0;
+std::string MmapTk::cgroupPath;
+std::mutex MmapTk::mutex;
+MmapRegionMap* MmapTk::regions = NULL;
+std::atomic<size_t> MmapTk::numRegions(0);
+std::atomic<uint64_t> MmapTk::numMapped(0);
+std::atomic<uint64_t> MmapTk::numBytesRead(0);
+std::atomic<uint64_t> MmapTk::numFallbacks(0);
+std::atomic<uint64_t> MmapTk::numBytesCurrent(0);
+std::atomic<uint64_t> MmapTk::numAdviceDropped(0);
+
+
+/**
+ * Enable serving of read-only mmaps from direct reads.
+ *
+ * @minMapSize mappings smaller than this go to the real mmap(); 0 to disable.
+ * @maxMapSize mappings larger than this go to the real mmap(); 0 for no limit other than the
+ * 		available memory.
+ */
+void MmapTk::init(uint64_t minMapSize, uint64_t maxMapSize)
+{
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	regions = new MmapRegionMap();
+
+	// the cgroup v2 line is "0::<path>" (in hybrid mode after the lines of the v1 controllers)
+	char cgroupBuf[PATH_MAX];
+
+	int cgroupFD = RealFuncs::open(MMAP_PROC_CGROUP_PATH, O_RDONLY | O_CLOEXEC);
+	if(cgroupFD != -1)
+	{
+		ssize_t readRes = RealFuncs::read(cgroupFD, cgroupBuf, sizeof(cgroupBuf) - 1);
+
+		RealFuncs::close(cgroupFD);
+
+		cgroupBuf[std::max<ssize_t>(readRes, 0)] = 0;
+
+		char* lineStart = !strncmp(cgroupBuf, "0::", 3) ? cgroupBuf : strstr(cgroupBuf, "\n0::");
+
+		if(lineStart)
+		{
+			lineStart += (*lineStart == '\n') ? 4 : 3;
+			lineStart[strcspn(lineStart, "\n")] = 0;
+
+			cgroupPath = std::string(MMAP_CGROUP_ROOT_PATH) + lineStart;
+		}
+	}
+
+	MmapTk::maxMapSize = maxMapSize;
+	MmapTk::minMapSize = minMapSize;
+}
+
+/**
+ * Called by the mmap() interceptor for mappings that passed getIsCandidate(). Maps anonymous memory
+ * and fills it with reads through the given fd (and its extra fds for split reads), which needs to
+ * be in O_DIRECT mode.
+ *
+ * No separate fd gets opened for the reads, because closing it would release the POSIX record
+ * locks that the application holds on the file.
+ *
+ * @return the mapping or MAP_FAILED if the mapping is not for us or the reads failed, in which case
+ * 		the caller uses the real mmap(). errno is unchanged either way.
+ */
+void* MmapTk::mapWithDirectReads(size_t length, int prot, int flags, int fd, off64_t offset)
+{
+	int fdFlags;
+
+	if(!fdStore->getFDFlags(fd, fdFlags) || !(fdFlags & FDSTORE_FLAG_MATCHED) ||
+		!(fdFlags & FDSTORE_FLAG_DIRECT) )
+		return MAP_FAILED;
+
+	int savedErrno = errno;
+
+	int fileFlags = fcntl(fd, F_GETFL);
+	struct stat statBuf;
+
+	if( (fileFlags == -1) || ( (fileFlags & O_ACCMODE) != O_RDONLY) || fstat(fd, &statBuf) ||
+		!S_ISREG(statBuf.st_mode) || (offset >= statBuf.st_size) )
+	{ // (the real mmap() takes care of errors and SIGBUS beyond end of file)
+		errno = savedErrno;
+		return MAP_FAILED;
+	}
+
+	const size_t mapLen = (length + MMAP_PAGE_SIZE - 1) & ~(size_t)(MMAP_PAGE_SIZE - 1);
+	const size_t fileLen = std::min<uint64_t>(mapLen, statBuf.st_size - offset);
+
+	if( (maxMapSize && (mapLen > maxMapSize) ) ||
+		(mapLen > getAvailableMem() / MMAP_AVAILMEM_DIVISOR) )
+	{ // the whole mapping gets loaded into memory, which might get us OOM-killed
+		numFallbacks.fetch_add(1, std::memory_order_relaxed);
+
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+			log_fprintf(stderr, LOG_PREFIX "Mapping too large for direct reads. fd: %d; "
+				"length: %zu\n", fd, length);
+
+		errno = savedErrno;
+		return MAP_FAILED;
+	}
+
+	// direct reads need a length that is a multiple of the block size, also at the end of file
+	const size_t readLen = (fileLen + MMAP_PAGE_SIZE - 1) & ~(size_t)(MMAP_PAGE_SIZE - 1);
+
+	struct timespec startTime;
+	clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+	// the extra fds belong to the fdStore and only get closed together with the app's fd
+	IntVec fds;
+
+	if(!splitIO || !splitIO->checkSplit(fd, readLen, fds) )
+		fds.assign(1, fd);
+
+	char* region = allocRegion(mapLen);
+
+	if(!region || !readDirect(fds, region, readLen, offset) )
+	{
+		numFallbacks.fetch_add(1, std::memory_order_relaxed);
+
+		if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+			log_fprintf(stderr, LOG_PREFIX "Direct reads for mmap failed. fd: %d; length: %zu; "
+				"error: %s\n", fd, length, strerror(errno) );
+
+		if(region)
+			munmap(region, mapLen);
+
+		errno = savedErrno;
+		return MAP_FAILED;
+	}
+
+	mprotect(region, mapLen, prot);
+
+	{
+		std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+		(*regions)[(uintptr_t)region] = mapLen;
+		numRegions.store(regions->size(), std::memory_order_relaxed);
+	}
+
+	numMapped.fetch_add(1, std::memory_order_relaxed);
+	numBytesRead.fetch_add(fileLen, std::memory_order_relaxed);
+	numBytesCurrent.fetch_add(mapLen, std::memory_order_relaxed);
+
+	PROBE(mmap_direct, fd, length, (long)offset);
+
+	if(libLogTopics & ENV_LOG_TOPIC_INJECT)
+	{
+		struct timespec endTime;
+		clock_gettime(CLOCK_MONOTONIC, &endTime);
+
+		log_fprintf(stderr, LOG_PREFIX "Served mmap from direct reads. fd: %d; length: %zu; "
+			"offset: %lld; usec: %lld\n", fd, length, (long long)offset,
+			(long long)( (endTime.tv_sec - startTime.tv_sec) * 1000000 +
+			(endTime.tv_nsec - startTime.tv_nsec) / 1000) );
+	}
+
+	errno = savedErrno;
+
+	return region;
+}
+
+/**
+ * Called by the munmap() interceptor before the real munmap() to remove the unmapped range from the
+ * bookkeeping. Regions that are only partially unmapped keep their remaining parts.
+ */
+void MmapTk::unmapRegions(void* addr, size_t length)
+{
+	const uintptr_t unmapStart = (uintptr_t)addr;
+	const uintptr_t unmapEnd = (unmapStart + length + MMAP_PAGE_SIZE - 1) &
+		~(uintptr_t)(MMAP_PAGE_SIZE - 1); // the kernel also unmaps the rest of the last page
+
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	auto iter = regions->upper_bound(unmapStart);
+
+	if(iter != regions->begin() )
+		iter--; // previous region might overlap the start of the unmapped range
+
+	while( (iter != regions->end() ) && (iter->first < unmapEnd) )
+	{
+		const uintptr_t regionStart = iter->first;
+		const uintptr_t regionEnd = regionStart + iter->second;
+
+		if(regionEnd <= unmapStart)
+		{
+			iter++;
+			continue;
+		}
+
+		iter = regions->erase(iter);
+
+		if(regionStart < unmapStart)
+			(*regions)[regionStart] = unmapStart - regionStart;
+
+		if(regionEnd > unmapEnd)
+			(*regions)[unmapEnd] = regionEnd - unmapEnd;
+
+		numBytesCurrent.fetch_sub(std::min(regionEnd, unmapEnd) -
+			std::max(regionStart, unmapStart), std::memory_order_relaxed);
+	}
+
+	numRegions.store(regions->size(), std::memory_order_relaxed);
+}
+
+/**
+ * Called by the madvise() interceptor for advice that discards page contents. Anonymous pages read
+ * back as zeros after that, whereas the pages of a real file mapping would get faulted in from the
+ * file again, so the advice must not reach the regions.
+ *
+ * @outRanges the parts of the given range that are not covered by regions, to which the caller
+ * 		applies the advice as usual.
+ * @return false if the given range doesn't overlap any region (outRanges is not set in that case).
+ */
+bool MmapTk::getUnservedRanges(void* addr, size_t length, MmapRangeVec& outRanges)
+{
+	const uintptr_t adviseStart = (uintptr_t)addr;
+	const uintptr_t adviseEnd = (adviseStart + length + MMAP_PAGE_SIZE - 1) &
+		~(uintptr_t)(MMAP_PAGE_SIZE - 1);
+
+	uintptr_t gapStart = adviseStart;
+	bool overlapFound = false;
+
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	auto iter = regions->upper_bound(adviseStart);
+
+	if(iter != regions->begin() )
+		iter--; // previous region might overlap the start of the advised range
+
+	for( ; (iter != regions->end() ) && (iter->first < adviseEnd); iter++)
+	{
+		const uintptr_t regionStart = iter->first;
+		const uintptr_t regionEnd = regionStart + iter->second;
+
+		if(regionEnd <= adviseStart)
+			continue;
+
+		overlapFound = true;
+
+		if(regionStart > gapStart)
+			outRanges.push_back(MmapRange(gapStart, regionStart - gapStart) );
+
+		gapStart = regionEnd;
+	}
+
+	if(!overlapFound)
+		return false;
+
+	if(gapStart < adviseEnd)
+		outRanges.push_back(MmapRange(gapStart, adviseEnd - gapStart) );
+
+	numAdviceDropped.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
+
+/**
+ * Write the [mmap] section of the stats report. Does nothing if no mapping was served.
+ */
+void MmapTk::writeReport(int fd)
+{
+	uint64_t mapped = numMapped.load(std::memory_order_relaxed);
+	uint64_t fallbacks = numFallbacks.load(std::memory_order_relaxed);
+
+	if(!mapped && !fallbacks)
+		return;
+
+	dprintf(fd, "\n[mmap]\n");
+	dprintf(fd, "# read-only mmaps served from direct reads: mapped bytes_read fallbacks "
+		"bytes_mapped_now advice_dropped\n");
+	dprintf(fd, "%llu %llu %llu %llu %llu\n", (unsigned long long)mapped,
+		(unsigned long long)numBytesRead.load(std::memory_order_relaxed),
+		(unsigned long long)fallbacks,
+		(unsigned long long)numBytesCurrent.load(std::memory_order_relaxed),
+		(unsigned long long)numAdviceDropped.load(std::memory_order_relaxed) );
+}
+
+/**
+ * For mmap() calls before RealFuncs::init(). The real function doesn't get looked up in that case,
+ * because dlsym() might allocate memory and thus call mmap() again.
+ */
+void* MmapTk::syscallMmap(void* addr, size_t length, int prot, int flags, int fd,
+	off64_t offset)
+{
+	return (void*)syscall(SYS_mmap, addr, length, prot, flags, fd, offset);
+}
+
+/**
+ * For munmap() calls before RealFuncs::init(), see syscallMmap().
+ */
+int MmapTk::syscallMunmap(void* addr, size_t length)
+{
+	return syscall(SYS_munmap, addr, length);
+}
+
+/**
+ * For madvise() calls before RealFuncs::init(), see syscallMmap().
+ */
+int MmapTk::syscallMadvise(void* addr, size_t length, int advice)
+{
+	return syscall(SYS_madvise, addr, length, advice);
+}
+
+/**
+ * Map anonymous writable memory. Mappings of at least MMAP_HUGEPAGE_SIZE get aligned to the huge
+ * page size and advised to use transparent huge pages.
+ *
+ * @return NULL on error.
+ */
+char* MmapTk::allocRegion(size_t mapLen)
+{
+	if(mapLen < MMAP_HUGEPAGE_SIZE)
+	{
+		void* mapping = mmap(NULL, mapLen, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+		return (mapping == MAP_FAILED) ? NULL : (char*)mapping;
+	}
+
+	void* mapping = mmap(NULL, mapLen + MMAP_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+	if(mapping == MAP_FAILED)
+		return NULL;
+
+	uintptr_t alignedStart = ( (uintptr_t)mapping + MMAP_HUGEPAGE_SIZE - 1) &
+		~(uintptr_t)(MMAP_HUGEPAGE_SIZE - 1);
+	size_t headLen = alignedStart - (uintptr_t)mapping;
+
+	if(headLen)
+		munmap(mapping, headLen);
+
+	munmap( (char*)alignedStart + mapLen, MMAP_HUGEPAGE_SIZE - headLen);
+
+	madvise( (void*)alignedStart, mapLen, MADV_HUGEPAGE);
+
+	return (char*)alignedStart;
+}
+
+/**
+ * Memory that can be used for a new region without swapping or hitting the memory limit of our
+ * cgroup: MemAvailable of the node (which includes reclaimable page cache), or the headroom up to
+ * the cgroup limit if that is lower.
+ *
+ * @return available memory in bytes; UINT64_MAX if unknown.
+ */
+uint64_t MmapTk::getAvailableMem()
+{
+	uint64_t availableMem = UINT64_MAX;
+	uint64_t value;
+
+	if(readFileValue(MMAP_MEMINFO_PATH, "MemAvailable:", value) )
+		availableMem = value * 1024; // (meminfo is in KiB)
+
+	if(cgroupPath.empty() )
+		return availableMem;
+
+	uint64_t limitValue;
+	uint64_t usageValue;
+
+	// (memory.max is "max" if there is no limit, which doesn't parse)
+	if(readFileValue( (cgroupPath + "/memory.max").c_str(), NULL, limitValue) &&
+		readFileValue( (cgroupPath + "/memory.current").c_str(), NULL, usageValue) )
+		availableMem = std::min(availableMem,
+			(limitValue > usageValue) ? (limitValue - usageValue) : 0);
+
+	return availableMem;
+}
+
+/**
+ * Read a number from a small file in /proc or /sys.
+ *
+ * @key the number follows this string (e.g. "MemAvailable:"); NULL if the file is just a number.
+ * @return false if the file or key was not found or the value is not a number.
+ */
+bool MmapTk::readFileValue(const char* path, const char* key, uint64_t& outValue)
+{
+	char readBuf[4096];
+
+	int fd = RealFuncs::open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return false;
+
+	ssize_t readRes = RealFuncs::read(fd, readBuf, sizeof(readBuf) - 1);
+
+	RealFuncs::close(fd);
+
+	if(readRes <= 0)
+		return false;
+
+	readBuf[readRes] = 0;
+
+	const char* valueStr = readBuf;
+
+	if(key)
+	{
+		valueStr = strstr(readBuf, key);
+		if(!valueStr)
+			return false;
+
+		valueStr += strlen(key);
+	}
+
+	char* endPtr;
+
+	outValue = strtoull(valueStr, &endPtr, 10);
+
+	return (endPtr != valueStr);
+}
+
+/**
+ * Read the given range of the file completely (or up to end of file), either through the split I/O
+ * helper threads or as a series of large reads.
+ *
+ * @fds in O_DIRECT mode; the app's fd followed by its extra fds for split reads (if any).
+ * @return false on error (errno is set).
+ */
+bool MmapTk::readDirect(const IntVec& fds, char* buf, size_t len, off64_t offset)
+{
+	const int fd = fds[0];
+
+	for(size_t numDone = 0; numDone < len; )
+	{
+		ssize_t readRes = splitIO ?
+			splitIO->preadSplit(fds, buf + numDone, len - numDone, offset + numDone) :
+			RealFuncs::pread(fd, buf + numDone,
+				std::min<size_t>(len - numDone, MMAP_READ_CHUNK_SIZE), offset + numDone);
+
+		if(readRes == -1)
+		{
+			if(errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		if(!readRes)
+			break; // end of file (e.g. file got truncated after fstat)
+
+		numDone += readRes;
+
+		if(numDone % MMAP_PAGE_SIZE)
+			break; // end of file in the middle of a page; next direct read would be misaligned
+	}
+
+	return true;
+}
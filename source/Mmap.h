@@ -0,0 +1,119 @@
+#ifndef MMAP_H_
+#define MMAP_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+#include "Common.h"
+
+
+#define MMAP_PAGE_SIZE				4096 // mapping length gets rounded to a multiple of this
+#define MMAP_HUGEPAGE_SIZE			(2*1024*1024) // mappings of at least this size get huge pages
+#define MMAP_READ_CHUNK_SIZE		(8*1024*1024) // size of direct reads if splitting is disabled
+#define MMAP_AVAILMEM_DIVISOR		2 // a mapping may use at most this fraction of available memory
+
+#define MMAP_MEMINFO_PATH			"/proc/meminfo"
+#define MMAP_PROC_CGROUP_PATH		"/proc/self/cgroup"
+#define MMAP_CGROUP_ROOT_PATH		"/sys/fs/cgroup" // cgroup v2 unified hierarchy
+
+#ifndef MAP_FIXED_NOREPLACE
+	#define MAP_FIXED_NOREPLACE		0x100000 // not defined by older glibc versions
+#endif
+
+
+typedef std::map<uintptr_t, size_t> MmapRegionMap; // start address => length
+typedef std::pair<uintptr_t, size_t> MmapRange; // start address, length
+typedef std::vector<MmapRange> MmapRangeVec;
+
+
+/**
+ * Toolkit to serve read-only private mmaps of matched files from anonymous memory that gets filled
+ * by large O_DIRECT reads (see ENV_LIB_MMAP_SIZE), instead of faulting the file in page by page
+ * through the page cache with small readahead.
+ *
+ * The mapping gets populated eagerly before mmap() returns, so mappings that don't fit into the
+ * available memory of the node or cgroup (see getAvailableMem() ) or that exceed the configured max
+ * size go to the real mmap(), which can evict clean page cache pages instead of getting OOM-killed. The reads go through the split I/O
+ * helper threads if splitting is enabled. As the memory is anonymous, munmap(), mprotect() etc. work
+ * as usual; the interceptor of munmap() only updates the region bookkeeping. The interceptor of
+ * madvise() drops advice that would discard the contents of regions (see getUnservedRanges() ).
+ * Shared, writable, executable and fixed-address mappings always go to the real mmap().
+ */
+class MmapTk
+{
+	public:
+		static void init(uint64_t minMapSize, uint64_t maxMapSize);
+		static void* mapWithDirectReads(size_t length, int prot, int flags, int fd,
+			off64_t offset);
+		static void unmapRegions(void* addr, size_t length);
+		static bool getUnservedRanges(void* addr, size_t length, MmapRangeVec& outRanges);
+		static void writeReport(int fd);
+
+		static void* syscallMmap(void* addr, size_t length, int prot, int flags, int fd,
+			off64_t offset);
+		static int syscallMunmap(void* addr, size_t length);
+		static int syscallMadvise(void* addr, size_t length, int advice);
+
+	private:
+		MmapTk() {}
+
+		static uint64_t minMapSize; // 0 if disabled
+		static uint64_t maxMapSize; // 0 for no limit other than available memory
+		static std::string cgroupPath; // dir of our cgroup (v2); empty if not available
+		static std::mutex mutex; // for regions
+		static MmapRegionMap* regions;
+		static std::atomic<size_t> numRegions; // to skip the lock in munmap() if there are none
+		static std::atomic<uint64_t> numMapped;
+		static std::atomic<uint64_t> numBytesRead;
+		static std::atomic<uint64_t> numFallbacks; // failed direct reads => real mmap()
+		static std::atomic<uint64_t> numBytesCurrent; // currently mapped bytes of regions
+		static std::atomic<uint64_t> numAdviceDropped; // madvise() calls that overlapped regions
+
+		static char* allocRegion(size_t mapLen);
+		static uint64_t getAvailableMem();
+		static bool readFileValue(const char* path, const char* key, uint64_t& outValue);
+		static bool readDirect(const IntVec& fds, char* buf, size_t len, off64_t offset);
+
+
+		// inliners
+	public:
+		static bool getIsActive()
+		{
+			return (minMapSize != 0);
+		}
+
+		static bool getHasRegions()
+		{
+			return (numRegions.load(std::memory_order_relaxed) != 0);
+		}
+
+		/**
+		 * Check if the given madvise() advice discards page contents (see getUnservedRanges() ).
+		 */
+		static bool getIsDiscardAdvice(int advice)
+		{
+			#ifdef MADV_DONTNEED_LOCKED
+				if(advice == MADV_DONTNEED_LOCKED)
+					return true;
+			#endif
+
+			return (advice == MADV_DONTNEED) || (advice == MADV_FREE) || (advice == MADV_REMOVE);
+		}
+
+		/**
+		 * Quick check of the mmap() args before the fd gets looked up.
+		 */
+		static bool getIsCandidate(size_t length, int prot, int flags, int fd, off64_t offset)
+		{
+			return (length >= minMapSize) && (fd != -1) && (prot == PROT_READ) &&
+				( (flags & MAP_TYPE) == MAP_PRIVATE) &&
+				!(flags & (MAP_ANONYMOUS | MAP_FIXED | MAP_FIXED_NOREPLACE) ) &&
+				!(offset % MMAP_PAGE_SIZE);
+		}
+};
+
+
+#endif /* MMAP_H_ */
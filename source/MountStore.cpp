@@ -0,0 +1,333 @@
+#include <boost/algorithm/string.hpp>
+#include <fcntl.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include "Logger.h"
+#include "MountStore.h"
+#include "RealFuncs.h"
+
+MountStore* mountStore = NULL;
+
+
+MountStore::~MountStore()
+{
+	if( (mountInfoFD != -1) && checkMountInfoFD() )
+		RealFuncs::close(mountInfoFD);
+}
+
+/**
+ * Initial load of the mount table. Keeps mountinfo open to detect changes later.
+ *
+ * @return false if mountinfo is not available (e.g. /proc not mounted).
+ */
+bool MountStore::loadMounts()
+{
+	mountInfoFD = RealFuncs::open(MOUNTSTORE_MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+	if(mountInfoFD == -1)
+		return false;
+
+	if(fstat(mountInfoFD, &mountInfoStat) == -1)
+	{
+		RealFuncs::close(mountInfoFD);
+		mountInfoFD = -1;
+		return false;
+	}
+
+	return reloadMounts();
+}
+
+/**
+ * Set the fstypes for which injection is allowed.
+ *
+ * @fsTypesListStr comma-separated list of fstypes (as in /proc/self/mountinfo), e.g. "nfs,nfs4".
+ */
+void MountStore::setAllowedFSTypes(std::string fsTypesListStr)
+{
+	StringVec fsTypesVec;
+
+	boost::split(fsTypesVec, fsTypesListStr, boost::is_any_of(", "), boost::token_compress_on);
+
+	std::unique_lock<std::shared_timed_mutex> lock(rwlock); // L O C K (scoped)
+
+	allowedFSTypes.clear();
+
+	for(const std::string& fsType : fsTypesVec)
+		if(!fsType.empty() )
+			allowedFSTypes.insert(fsType);
+
+	hasFSTypeFilter = !allowedFSTypes.empty();
+}
+
+/**
+ * Find the mount of the given path via longest prefix match.
+ *
+ * @path absolute path.
+ * @return false if no mount found, e.g. because the mount table is not available.
+ */
+bool MountStore::lookup(const std::string& path, MountStoreLookupResult& outResult)
+{
+	static thread_local std::string componentStr; // reused to avoid heap allocs
+
+	refreshIfChanged();
+
+	std::shared_lock<std::shared_timed_mutex> lock(rwlock); // R E A D L O C K (scoped)
+
+	if(nodes.empty() )
+		return false;
+
+	size_t nodeIndex = 0;
+	int mountIndex = nodes[0].mountIndex;
+	size_t componentStart = 0;
+
+	while(componentStart < path.length() )
+	{
+		size_t componentEnd = path.find('/', componentStart);
+		if(componentEnd == std::string::npos)
+			componentEnd = path.length();
+
+		if(componentEnd != componentStart)
+		{ // skip empty components, e.g. from leading slash
+			componentStr.assign(path, componentStart, componentEnd - componentStart);
+
+			const MountStoreNode& node = nodes[nodeIndex];
+			std::map<std::string, size_t>::const_iterator iter = node.children.find(componentStr);
+
+			if(iter == node.children.end() )
+				break; // no deeper mountpoint below this dir
+
+			nodeIndex = iter->second;
+
+			if(nodes[nodeIndex].mountIndex != -1)
+				mountIndex = nodes[nodeIndex].mountIndex;
+		}
+
+		componentStart = componentEnd + 1;
+	}
+
+	if(mountIndex == -1)
+		return false;
+
+	const MountStoreEntry& mount = mounts[mountIndex];
+
+	outResult.dev = mount.dev;
+	outResult.isFSTypeAllowed = allowedFSTypes.empty() || allowedFSTypes.count(mount.fsType);
+
+	MountDirectSupportMap::const_iterator directIter = directSupportMap.find(mount.dev);
+	outResult.directSupport = (directIter == directSupportMap.end() ) ?
+		MOUNTSTORE_DIRECT_UNKNOWN : directIter->second;
+
+	snprintf(outResult.fsType, sizeof(outResult.fsType), "%s", mount.fsType.c_str() );
+
+	return true;
+}
+
+/**
+ * Remember whether O_DIRECT can be set on files of the given mount device.
+ */
+void MountStore::setDirectSupport(dev_t dev, bool isSupported)
+{
+	std::unique_lock<std::shared_timed_mutex> lock(rwlock); // L O C K (scoped)
+
+	directSupportMap[dev] =
+		isSupported ? MOUNTSTORE_DIRECT_SUPPORTED : MOUNTSTORE_DIRECT_UNSUPPORTED;
+}
+
+/**
+ * Check (rate-limited) if mountinfo signals a change and reload the mount table in that case.
+ */
+void MountStore::refreshIfChanged()
+{
+	if(mountInfoFD == -1)
+		return;
+
+	struct timespec nowTime;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &nowTime);
+
+	uint64_t nowMS = (uint64_t)nowTime.tv_sec * 1000 + nowTime.tv_nsec / 1000000;
+	uint64_t lastCheckMS = lastRefreshCheckMS.load(std::memory_order_relaxed);
+
+	if( (nowMS - lastCheckMS) < MOUNTSTORE_REFRESH_CHECK_MS)
+		return;
+
+	if(!lastRefreshCheckMS.compare_exchange_strong(lastCheckMS, nowMS) )
+		return; // another thread is doing the check
+
+	if(!checkMountInfoFD() )
+	{ // app closed our fd (e.g. to close all inherited fds), so the fd number is not ours anymore
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Mount table fd was closed. Disabling refresh.\n");
+
+		mountInfoFD = -1;
+		return;
+	}
+
+	struct pollfd pollFD;
+	pollFD.fd = mountInfoFD;
+	pollFD.events = POLLPRI;
+	pollFD.revents = 0;
+
+	int pollRes = poll(&pollFD, 1, 0);
+	if( (pollRes <= 0) || !(pollFD.revents & (POLLERR | POLLPRI) ) )
+		return; // no change
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Mount table changed. Reloading.\n");
+
+	reloadMounts();
+}
+
+/**
+ * Check if mountInfoFD still refers to the file that we opened.
+ */
+bool MountStore::checkMountInfoFD()
+{
+	struct stat currentStat;
+
+	return (fstat(mountInfoFD, &currentStat) != -1) &&
+		(currentStat.st_dev == mountInfoStat.st_dev) &&
+		(currentStat.st_ino == mountInfoStat.st_ino);
+}
+
+/**
+ * Read mountinfo and replace the current mount table.
+ *
+ * @return false on error.
+ */
+bool MountStore::reloadMounts()
+{
+	std::string mountInfoStr;
+	char readBuf[16*1024];
+
+	if(lseek(mountInfoFD, 0, SEEK_SET) == -1)
+		return false;
+
+	for( ; ; )
+	{
+		ssize_t readRes = RealFuncs::read(mountInfoFD, readBuf, sizeof(readBuf) );
+		if(readRes < 0)
+			return false;
+
+		if(!readRes)
+			break;
+
+		mountInfoStr.append(readBuf, readRes);
+	}
+
+	MountStoreEntryVec newMounts;
+
+	parseMountInfo(mountInfoStr, newMounts);
+
+	MountStoreNodeVec newNodes(1); // root node
+
+	for(size_t mountIndex = 0; mountIndex < newMounts.size(); mountIndex++)
+	{
+		const std::string& mountPoint = newMounts[mountIndex].mountPoint;
+		StringVec componentsVec;
+		size_t nodeIndex = 0;
+
+		boost::split(componentsVec, mountPoint, boost::is_any_of("/"), boost::token_compress_on);
+
+		for(const std::string& componentStr : componentsVec)
+		{
+			if(componentStr.empty() )
+				continue;
+
+			std::map<std::string, size_t>::const_iterator iter =
+				newNodes[nodeIndex].children.find(componentStr);
+
+			if(iter != newNodes[nodeIndex].children.end() )
+			{
+				nodeIndex = iter->second;
+				continue;
+			}
+
+			newNodes.push_back(MountStoreNode() );
+			newNodes[nodeIndex].children[componentStr] = newNodes.size() - 1;
+			nodeIndex = newNodes.size() - 1;
+		}
+
+		// (mountinfo is in mount order, so later mounts on the same mountpoint hide earlier ones)
+		newNodes[nodeIndex].mountIndex = mountIndex;
+	}
+
+	std::unique_lock<std::shared_timed_mutex> lock(rwlock); // L O C K (scoped)
+
+	mounts.swap(newMounts);
+	nodes.swap(newNodes);
+
+	return true;
+}
+
+/**
+ * Parse contents of mountinfo. See "man 5 proc" for the line format:
+ * "36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue"
+ *
+ * @outMounts parsed mounts in mountinfo order.
+ */
+void MountStore::parseMountInfo(const std::string& mountInfoStr, MountStoreEntryVec& outMounts)
+{
+	std::istringstream mountInfoStream(mountInfoStr);
+	std::string lineStr;
+
+	while(std::getline(mountInfoStream, lineStr) )
+	{
+		StringVec fieldsVec;
+
+		boost::split(fieldsVec, lineStr, boost::is_any_of(" "), boost::token_compress_on);
+
+		if(fieldsVec.size() < 7)
+			continue; // invalid line
+
+		// fstype is the first field after the "-" separator (optional fields before can vary)
+
+		size_t separatorIndex = 6;
+
+		while( (separatorIndex < fieldsVec.size() ) && (fieldsVec[separatorIndex] != "-") )
+			separatorIndex++;
+
+		if( (separatorIndex + 1) >= fieldsVec.size() )
+			continue; // invalid line
+
+		unsigned devMajor;
+		unsigned devMinor;
+
+		if(sscanf(fieldsVec[2].c_str(), "%u:%u", &devMajor, &devMinor) != 2)
+			continue; // invalid line
+
+		MountStoreEntry mount;
+
+		mount.dev = makedev(devMajor, devMinor);
+		mount.mountPoint = unescapeMountInfoStr(fieldsVec[4]);
+		mount.fsType = fieldsVec[separatorIndex + 1];
+
+		outMounts.push_back(mount);
+	}
+}
+
+/**
+ * Mountinfo escapes space, tab, newline and backslash as octal "\ooo".
+ */
+std::string MountStore::unescapeMountInfoStr(const std::string& escapedStr)
+{
+	std::string unescapedStr;
+
+	for(size_t i=0; i < escapedStr.length(); i++)
+	{
+		if( (escapedStr[i] == '\\') && ( (i + 3) < escapedStr.length() ) &&
+			(escapedStr[i+1] >= '0') && (escapedStr[i+1] <= '3') &&
+			(escapedStr[i+2] >= '0') && (escapedStr[i+2] <= '7') &&
+			(escapedStr[i+3] >= '0') && (escapedStr[i+3] <= '7') )
+		{
+			unescapedStr += (char)( ( (escapedStr[i+1] - '0') << 6) |
+				( (escapedStr[i+2] - '0') << 3) | (escapedStr[i+3] - '0') );
+			i += 3;
+			continue;
+		}
+
+		unescapedStr += escapedStr[i];
+	}
+
+	return unescapedStr;
+}
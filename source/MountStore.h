@@ -0,0 +1,103 @@
+#ifndef MOUNTSTORE_H_
+#define MOUNTSTORE_H_
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "Common.h"
+
+
+#define MOUNTSTORE_MOUNTINFO_PATH		"/proc/self/mountinfo"
+#define MOUNTSTORE_REFRESH_CHECK_MS		1000 // min interval between mountinfo change checks
+
+#define MOUNTSTORE_DIRECT_UNKNOWN		0 // O_DIRECT support of mount not known yet
+#define MOUNTSTORE_DIRECT_SUPPORTED		1
+#define MOUNTSTORE_DIRECT_UNSUPPORTED	2 // setting O_DIRECT failed with EINVAL on this mount
+
+#define MOUNTSTORE_FSTYPE_BUFLEN		32
+
+
+class MountStoreEntry
+{
+	public:
+		dev_t dev; // major:minor from mountinfo (same as st_dev of files on this mount)
+		std::string fsType;
+		std::string mountPoint;
+};
+
+/**
+ * Node of the mount prefix tree. Each node is a path component.
+ */
+class MountStoreNode
+{
+	public:
+		std::map<std::string, size_t> children; // key is child name, value is node index
+		int mountIndex{-1}; // index in mount vector if this dir is a mountpoint, -1 otherwise
+};
+
+/**
+ * Result of MountStore::lookup().
+ */
+class MountStoreLookupResult
+{
+	public:
+		dev_t dev;
+		bool isFSTypeAllowed; // false if LD_VAST_FSTYPES is set and doesn't contain this fstype
+		int directSupport; // MOUNTSTORE_DIRECT_...
+		char fsType[MOUNTSTORE_FSTYPE_BUFLEN]; // (truncated if too long)
+};
+
+typedef std::vector<MountStoreEntry> MountStoreEntryVec;
+typedef std::vector<MountStoreNode> MountStoreNodeVec;
+typedef std::map<dev_t, int> MountDirectSupportMap; // value is MOUNTSTORE_DIRECT_...
+
+
+/**
+ * Mount table as a longest-prefix tree, to find the mount of a path without a syscall. Gets
+ * refreshed lazily when /proc/self/mountinfo signals a change.
+ *
+ * Paths are resolved lexically (i.e. symlinks are not followed), like for the path file patterns.
+ */
+class MountStore
+{
+	public:
+		MountStore() {}
+		~MountStore();
+
+		bool loadMounts();
+		void setAllowedFSTypes(std::string fsTypesListStr);
+		bool lookup(const std::string& path, MountStoreLookupResult& outResult);
+		void setDirectSupport(dev_t dev, bool isSupported);
+
+		// inliners
+	public:
+		bool getHasFSTypeFilter()
+		{
+			return hasFSTypeFilter;
+		}
+
+	private:
+		MountStoreEntryVec mounts;
+		MountStoreNodeVec nodes; // node 0 is the root dir
+		StringSet allowedFSTypes; // empty means all fstypes are allowed
+		bool hasFSTypeFilter{false}; // true if allowedFSTypes is not empty
+		MountDirectSupportMap directSupportMap; // survives refreshes of the mount table
+		std::shared_timed_mutex rwlock;
+		std::atomic<int> mountInfoFD{-1}; // kept open to poll for changes
+		struct stat mountInfoStat; // to detect if app closed mountInfoFD and reused the fd number
+		std::atomic<uint64_t> lastRefreshCheckMS{0}; // CLOCK_MONOTONIC_COARSE time of last check
+
+		bool reloadMounts();
+		bool checkMountInfoFD();
+		void refreshIfChanged();
+		static void parseMountInfo(const std::string& mountInfoStr, MountStoreEntryVec& outMounts);
+		static std::string unescapeMountInfoStr(const std::string& escapedStr);
+};
+
+extern MountStore* mountStore;
+
+#endif /* MOUNTSTORE_H_ */
@@ -0,0 +1,185 @@
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "Numa.h"
+
+unsigned NumaTk::numNodes = 1;
+unsigned char NumaTk::cpuToNode[NUMA_MAX_CPUS]; // zero-initialized => all on node 0
+cpu_set_t NumaTk::nodeCPUSets[NUMA_MAX_NODES];
+
+
+/**
+ * Read the NUMA topology from sysfs. Nodes need to be numbered consecutively (as sysfs shows them
+ * on all common systems); otherwise everything is treated as a single node.
+ */
+void NumaTk::init()
+{
+	unsigned numFoundNodes = 0;
+
+	for(unsigned node = 0; node < NUMA_MAX_NODES; node++)
+	{
+		std::string cpuListPath = std::string(NUMA_SYSFS_NODES_PATH "/node") +
+			std::to_string(node) + "/cpulist";
+
+		FILE* cpuListFile = fopen(cpuListPath.c_str(), "r");
+		if(!cpuListFile)
+			break;
+
+		char cpuListStr[4096] = "";
+
+		bool readRes = fgets(cpuListStr, sizeof(cpuListStr), cpuListFile);
+
+		fclose(cpuListFile);
+
+		if(!readRes || !parseCPUList(cpuListStr, nodeCPUSets[node]) )
+			return; // fall back to single node
+
+		numFoundNodes++;
+	}
+
+	if(numFoundNodes <= 1)
+		return;
+
+	for(unsigned node = 0; node < numFoundNodes; node++)
+		for(unsigned cpu = 0; cpu < NUMA_MAX_CPUS; cpu++)
+			if(CPU_ISSET(cpu, &nodeCPUSets[node]) )
+				cpuToNode[cpu] = node;
+
+	numNodes = numFoundNodes;
+}
+
+/**
+ * @nodeStr node number or name of a network interface (e.g. "eth0"), which means the node that
+ * 		the interface is attached to.
+ * @outNode the node; -1 if the given interface has no NUMA affinity (e.g. virtual interfaces).
+ * @return false if nodeStr is neither a valid node nor an existing interface.
+ */
+bool NumaTk::strToNode(const char* nodeStr, int& outNode)
+{
+	if(!*nodeStr)
+		return false;
+
+	char* endPtr;
+	long node = strtol(nodeStr, &endPtr, 10);
+
+	if(*endPtr)
+	{ // not a number, so should be an interface name
+		std::string interfacePath = std::string(NUMA_SYSFS_NET_PATH "/") + nodeStr;
+
+		if(access(interfacePath.c_str(), F_OK) )
+			return false;
+
+		outNode = -1;
+
+		FILE* numaNodeFile = fopen( (interfacePath + "/device/numa_node").c_str(), "r");
+		if(!numaNodeFile)
+			return true; // virtual interface
+
+		int scanRes = fscanf(numaNodeFile, "%ld", &node);
+
+		fclose(numaNodeFile);
+
+		if( (scanRes != 1) || (node < 0) || ( (unsigned long)node >= numNodes) )
+			return true; // -1 means no NUMA affinity
+
+		outNode = node;
+
+		return true;
+	}
+
+	if( (node < 0) || ( (unsigned long)node >= numNodes) )
+		return false;
+
+	outNode = node;
+
+	return true;
+}
+
+/**
+ * Restrict the calling thread to the CPUs of the given node. Nothing to do on single node systems.
+ *
+ * @return false if the affinity could not be set.
+ */
+bool NumaTk::bindThreadToNode(unsigned node)
+{
+	if(numNodes == 1)
+		return true;
+
+	if(node >= numNodes)
+		return false;
+
+	return !pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &nodeCPUSets[node]);
+}
+
+/**
+ * Prefer the given node for the memory pages of the given range. Must be called before the pages
+ * are touched for the first time.
+ *
+ * @return false if the memory policy could not be set.
+ */
+bool NumaTk::bindMemToNode(void* addr, size_t len, unsigned node)
+{
+	if( (numNodes == 1) || (node >= numNodes) )
+		return false;
+
+	unsigned long nodeMask[(NUMA_MAX_NODES + (sizeof(long) * CHAR_BIT) - 1) /
+		(sizeof(long) * CHAR_BIT)] = {};
+
+	nodeMask[node / (sizeof(long) * CHAR_BIT)] |= 1UL << (node % (sizeof(long) * CHAR_BIT) );
+
+	int savedErrno = errno;
+
+	long mbindRes = syscall(__NR_mbind, addr, len, MPOL_PREFERRED, nodeMask, NUMA_MAX_NODES + 1,
+		0);
+
+	errno = savedErrno;
+
+	return !mbindRes;
+}
+
+/**
+ * Parse a sysfs CPU list such as "0-3,8-11".
+ *
+ * @return false on parse error.
+ */
+bool NumaTk::parseCPUList(const char* cpuListStr, cpu_set_t& outCPUSet)
+{
+	CPU_ZERO(&outCPUSet);
+
+	const char* currentPos = cpuListStr;
+
+	while(*currentPos && (*currentPos != '\n') )
+	{
+		char* endPtr;
+		long firstCPU = strtol(currentPos, &endPtr, 10);
+
+		if(endPtr == currentPos)
+			return false;
+
+		long lastCPU = firstCPU;
+
+		if(*endPtr == '-')
+		{
+			currentPos = endPtr + 1;
+			lastCPU = strtol(currentPos, &endPtr, 10);
+
+			if(endPtr == currentPos)
+				return false;
+		}
+
+		if( (firstCPU < 0) || (lastCPU >= NUMA_MAX_CPUS) || (firstCPU > lastCPU) )
+			return false;
+
+		for(long cpu = firstCPU; cpu <= lastCPU; cpu++)
+			CPU_SET(cpu, &outCPUSet);
+
+		currentPos = (*endPtr == ',') ? endPtr + 1 : endPtr;
+	}
+
+	return true;
+}
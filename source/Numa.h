@@ -0,0 +1,58 @@
+#ifndef NUMA_H_
+#define NUMA_H_
+
+#include <sched.h>
+#include "Common.h"
+
+
+#define NUMA_MAX_NODES			64
+#define NUMA_MAX_CPUS			CPU_SETSIZE
+#define NUMA_SYSFS_NODES_PATH	"/sys/devices/system/node"
+#define NUMA_SYSFS_NET_PATH		"/sys/class/net"
+
+
+/**
+ * Toolkit for NUMA topology from sysfs, so that the lib doesn't depend on libnuma. On systems
+ * without NUMA info in sysfs, everything is on node 0.
+ */
+class NumaTk
+{
+	public:
+		static void init();
+		static bool strToNode(const char* nodeStr, int& outNode);
+		static bool bindThreadToNode(unsigned node);
+		static bool bindMemToNode(void* addr, size_t len, unsigned node);
+
+	private:
+		NumaTk() {}
+
+		static unsigned numNodes;
+		static unsigned char cpuToNode[NUMA_MAX_CPUS];
+		static cpu_set_t nodeCPUSets[NUMA_MAX_NODES];
+
+		static bool parseCPUList(const char* cpuListStr, cpu_set_t& outCPUSet);
+
+
+		// inliners
+	public:
+		static unsigned getNumNodes()
+		{
+			return numNodes;
+		}
+
+		/**
+		 * @return NUMA node of the CPU that the calling thread currently runs on.
+		 */
+		static unsigned getThreadNode()
+		{
+			if(numNodes == 1)
+				return 0;
+
+			int cpu = sched_getcpu(); // vDSO, so no syscall
+
+			return ( (cpu >= 0) && (cpu < NUMA_MAX_CPUS) ) ? cpuToNode[cpu] : 0;
+		}
+};
+
+
+#endif /* NUMA_H_ */
@@ -0,0 +1,394 @@
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cstdlib>
+#include <map>
+#include "PathMatchImage.h"
+
+#define PATHMATCHIMAGE_SECTION_ALIGN	8 // alignment of sections inside the image
+
+
+/**
+ * Round up offset to the next section alignment.
+ */
+static size_t alignSectionOffset(size_t offset)
+{
+	return (offset + PATHMATCHIMAGE_SECTION_ALIGN - 1) & ~(size_t)(PATHMATCHIMAGE_SECTION_ALIGN - 1);
+}
+
+/**
+ * Compile the given rules into a self-contained image.
+ *
+ * @ruleSpecs rules in path file order, duplicates of rules without conditions must already have
+ * 		been removed.
+ * @sourceStat stat of the path file from which the rules were loaded (to detect changes).
+ * @sourceContentHash hash of the path file contents.
+ * @outImage the compiled image; existing contents will be replaced.
+ */
+void PathMatchImage::build(const PathMatchRuleSpecVec& ruleSpecs, const struct stat& sourceStat,
+	uint64_t sourceContentHash, std::vector<char>& outImage)
+{
+	typedef std::map<std::string, std::vector<uint32_t> > PrefixGroupMap;
+
+	PrefixGroupMap prefixGroupMap; // key is dir prefix, value is list of rule indices
+	size_t stringsLen = 0;
+
+	for(size_t i=0; i < ruleSpecs.size(); i++)
+	{
+		const std::string& pattern = ruleSpecs[i].pattern;
+
+		size_t literalPrefixLen = std::min(pattern.find_first_of("*?"), pattern.length() );
+		size_t dirPrefixLen = pattern.rfind('/', literalPrefixLen ? literalPrefixLen-1 : 0) + 1;
+
+		prefixGroupMap[pattern.substr(0, dirPrefixLen)].push_back(i);
+
+		stringsLen += pattern.length() + 1; // +1 for trailing zero to ease debugging
+
+		for(const std::string* conditionStr :
+			{&ruleSpecs[i].exePattern, &ruleSpecs[i].rankList, &ruleSpecs[i].localRankList} )
+			stringsLen += conditionStr->empty() ? 0 : (conditionStr->length() + 1);
+	}
+
+	uint32_t numSlots = 1;
+
+	while(numSlots < (2 * prefixGroupMap.size() ) )
+		numSlots *= 2;
+
+	const size_t rulesOffset = alignSectionOffset(sizeof(PathMatchImageHeader) );
+	const size_t groupsOffset = alignSectionOffset(rulesOffset +
+		(ruleSpecs.size() * sizeof(PathMatchImageRule) ) );
+	const size_t slotsOffset = alignSectionOffset(groupsOffset +
+		(prefixGroupMap.size() * sizeof(PathMatchImagePrefixGroup) ) );
+	const size_t ruleListOffset = alignSectionOffset(slotsOffset + (numSlots * sizeof(uint32_t) ) );
+	const size_t stringsOffset = alignSectionOffset(ruleListOffset +
+		(ruleSpecs.size() * sizeof(uint32_t) ) );
+
+	outImage.assign(stringsOffset + stringsLen, 0);
+
+	PathMatchImageHeader* header = (PathMatchImageHeader*)outImage.data();
+
+	header->magic = PATHMATCHIMAGE_MAGIC;
+	header->version = PATHMATCHIMAGE_VERSION;
+	header->imageLen = outImage.size();
+	header->sourceDev = sourceStat.st_dev;
+	header->sourceIno = sourceStat.st_ino;
+	header->sourceSize = sourceStat.st_size;
+	header->sourceMTimeNSec =
+		(uint64_t)sourceStat.st_mtim.tv_sec * 1000000000 + sourceStat.st_mtim.tv_nsec;
+	header->sourceCTimeNSec =
+		(uint64_t)sourceStat.st_ctim.tv_sec * 1000000000 + sourceStat.st_ctim.tv_nsec;
+	header->sourceContentHash = sourceContentHash;
+	header->numRules = ruleSpecs.size();
+	header->rulesOffset = rulesOffset;
+	header->numGroups = prefixGroupMap.size();
+	header->groupsOffset = groupsOffset;
+	header->numSlots = numSlots;
+	header->slotsOffset = slotsOffset;
+	header->ruleListLen = ruleSpecs.size();
+	header->ruleListOffset = ruleListOffset;
+	header->stringsOffset = stringsOffset;
+	header->stringsLen = stringsLen;
+
+	PathMatchImageRule* rules = (PathMatchImageRule*)(outImage.data() + rulesOffset);
+	char* strings = outImage.data() + stringsOffset;
+	size_t currentStringOffset = 0;
+
+	for(size_t i=0; i < ruleSpecs.size(); i++)
+	{
+		const std::string& pattern = ruleSpecs[i].pattern;
+		size_t literalPrefixLen = std::min(pattern.find_first_of("*?"), pattern.length() );
+
+		rules[i].patternOffset = currentStringOffset;
+		rules[i].patternLen = pattern.length();
+		rules[i].literalPrefixLen = literalPrefixLen;
+		rules[i].dirPrefixLen =
+			pattern.rfind('/', literalPrefixLen ? literalPrefixLen-1 : 0) + 1;
+		rules[i].actions = ruleSpecs[i].actions;
+		rules[i].lineNum = ruleSpecs[i].lineNum;
+		rules[i].preallocExtent = ruleSpecs[i].preallocExtent;
+		rules[i].expectedSize = ruleSpecs[i].expectedSize;
+		rules[i].bwLimit = ruleSpecs[i].bwLimit;
+		rules[i].iopsLimit = ruleSpecs[i].iopsLimit;
+
+		rules[i].accessModes = ruleSpecs[i].accessModes;
+
+		memcpy(strings + currentStringOffset, pattern.c_str(), pattern.length() + 1);
+
+		currentStringOffset += pattern.length() + 1;
+
+		struct { const std::string& str; uint32_t& offset; uint32_t& len; } conditions[] =
+		{
+			{ ruleSpecs[i].exePattern, rules[i].exeOffset, rules[i].exeLen },
+			{ ruleSpecs[i].rankList, rules[i].rankOffset, rules[i].rankLen },
+			{ ruleSpecs[i].localRankList, rules[i].localRankOffset, rules[i].localRankLen },
+		};
+
+		for(const auto& condition : conditions)
+		{
+			if(condition.str.empty() )
+				continue; // offset and len stay 0
+
+			condition.offset = currentStringOffset;
+			condition.len = condition.str.length();
+
+			memcpy(strings + currentStringOffset, condition.str.c_str(), condition.str.length() + 1);
+
+			currentStringOffset += condition.str.length() + 1;
+		}
+	}
+
+	PathMatchImagePrefixGroup* groups =
+		(PathMatchImagePrefixGroup*)(outImage.data() + groupsOffset);
+	uint32_t* slots = (uint32_t*)(outImage.data() + slotsOffset);
+	uint32_t* ruleList = (uint32_t*)(outImage.data() + ruleListOffset);
+	uint32_t groupIndex = 0;
+	uint32_t ruleListIndex = 0;
+
+	for(PrefixGroupMap::const_iterator iter = prefixGroupMap.begin();
+		iter != prefixGroupMap.end();
+		iter++, groupIndex++)
+	{
+		PathMatchImagePrefixGroup& group = groups[groupIndex];
+
+		group.prefixHash = hashFNV1a(iter->first.c_str(), iter->first.length() );
+		group.prefixLen = iter->first.length();
+		group.firstRule = iter->second.front();
+		group.ruleListIndex = ruleListIndex;
+		group.numRules = iter->second.size();
+
+		for(uint32_t ruleIndex : iter->second)
+			ruleList[ruleListIndex++] = ruleIndex;
+
+		// insert into hash slots (open addressing with linear probing)
+
+		uint32_t slotIndex = group.prefixHash & (numSlots - 1);
+
+		while(slots[slotIndex])
+			slotIndex = (slotIndex + 1) & (numSlots - 1);
+
+		slots[slotIndex] = groupIndex + 1;
+	}
+}
+
+/**
+ * Check that an image (e.g. one that was mapped from a file) is consistent, so that it can be
+ * evaluated without further bounds checks. This is only a linear scan of the tables, no parsing.
+ *
+ * @return true if image is valid.
+ */
+bool PathMatchImage::verify(const void* image, size_t imageLen)
+{
+	if(imageLen < sizeof(PathMatchImageHeader) )
+		return false;
+
+	const PathMatchImageHeader* header = (const PathMatchImageHeader*)image;
+
+	if( (header->magic != PATHMATCHIMAGE_MAGIC) ||
+		(header->version != PATHMATCHIMAGE_VERSION) ||
+		(header->imageLen != imageLen) )
+		return false;
+
+	// check that all sections are aligned and inside the image
+
+	struct { uint64_t offset; uint64_t len; } sections[] =
+	{
+		{ header->rulesOffset, (uint64_t)header->numRules * sizeof(PathMatchImageRule) },
+		{ header->groupsOffset,
+			(uint64_t)header->numGroups * sizeof(PathMatchImagePrefixGroup) },
+		{ header->slotsOffset, (uint64_t)header->numSlots * sizeof(uint32_t) },
+		{ header->ruleListOffset, (uint64_t)header->ruleListLen * sizeof(uint32_t) },
+		{ header->stringsOffset, header->stringsLen },
+	};
+
+	for(const auto& section : sections)
+	{
+		if( (section.offset < sizeof(PathMatchImageHeader) ) ||
+			(section.offset % PATHMATCHIMAGE_SECTION_ALIGN) ||
+			(section.offset + section.len > imageLen) )
+			return false;
+	}
+
+	if(!header->numSlots || (header->numSlots & (header->numSlots - 1) ) ||
+		(header->numGroups >= header->numSlots) ) // at least one empty slot to end probing
+		return false;
+
+	const PathMatchImageRule* rules = getRules(header);
+
+	for(uint32_t i=0; i < header->numRules; i++)
+	{
+		if( ( (uint64_t)rules[i].patternOffset + rules[i].patternLen >= header->stringsLen) ||
+			(rules[i].literalPrefixLen > rules[i].patternLen) ||
+			(rules[i].dirPrefixLen > rules[i].literalPrefixLen) ||
+			( (uint64_t)rules[i].exeOffset + rules[i].exeLen > header->stringsLen) ||
+			( (uint64_t)rules[i].rankOffset + rules[i].rankLen > header->stringsLen) ||
+			( (uint64_t)rules[i].localRankOffset + rules[i].localRankLen > header->stringsLen) ||
+			(rules[i].accessModes & ~PATHMATCH_MODE_ALL) )
+			return false;
+	}
+
+	const PathMatchImagePrefixGroup* groups = getGroups(header);
+
+	for(uint32_t i=0; i < header->numGroups; i++)
+	{
+		if( (groups[i].firstRule >= header->numRules) ||
+			(groups[i].prefixLen > rules[groups[i].firstRule].patternLen) ||
+			( (uint64_t)groups[i].ruleListIndex + groups[i].numRules > header->ruleListLen) )
+			return false;
+	}
+
+	const uint32_t* slots = getSlots(header);
+
+	for(uint32_t i=0; i < header->numSlots; i++)
+	{
+		if(slots[i] > header->numGroups)
+			return false;
+	}
+
+	const uint32_t* ruleList = getRuleList(header);
+
+	for(uint32_t i=0; i < header->ruleListLen; i++)
+	{
+		if(ruleList[i] >= header->numRules)
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Check if an image was built from the path file with the given stat.
+ *
+ * @return true if image matches the path file.
+ */
+bool PathMatchImage::checkSourceIdentity(const PathMatchImageHeader* header,
+	const struct stat& sourceStat)
+{
+	return (header->sourceDev == (uint64_t)sourceStat.st_dev) &&
+		(header->sourceIno == (uint64_t)sourceStat.st_ino) &&
+		(header->sourceSize == (uint64_t)sourceStat.st_size) &&
+		(header->sourceMTimeNSec ==
+			(uint64_t)sourceStat.st_mtim.tv_sec * 1000000000 + sourceStat.st_mtim.tv_nsec) &&
+		(header->sourceCTimeNSec ==
+			(uint64_t)sourceStat.st_ctim.tv_sec * 1000000000 + sourceStat.st_ctim.tv_nsec);
+}
+
+/**
+ * Find the first rule (in path file order) that matches the given path. Only the rules of the
+ * prefix groups of the path's parent dirs are evaluated.
+ *
+ * @stats to count rule evaluations; may be NULL.
+ * @ruleAccessModes PATHMATCH_MODE_... flags per rule for which the rule's conditions hold in this
+ * 		process (see PathMatchStore::evalConditions() ); NULL to ignore conditions.
+ * @accessMode PATHMATCH_MODE_... flag of the open() call.
+ * @return index of matching rule or -1 if no rule matches.
+ */
+int PathMatchImage::findMatchingRule(const PathMatchImageHeader* header, const char* path,
+	size_t pathLen, PathMatchStats* stats, const uint8_t* ruleAccessModes, unsigned accessMode)
+{
+	const PathMatchImageRule* rules = getRules(header);
+	const PathMatchImagePrefixGroup* groups = getGroups(header);
+	const uint32_t* slots = getSlots(header);
+	const uint32_t* ruleList = getRuleList(header);
+	const uint32_t slotMask = header->numSlots - 1;
+
+	uint32_t bestRuleIndex = header->numRules; // numRules means no match found yet
+	uint64_t prefixHash = hashFNV1a(NULL, 0);
+	size_t hashedLen = 0;
+
+	for(size_t prefixLen = 1; prefixLen <= pathLen; prefixLen++)
+	{
+		if(path[prefixLen-1] != '/')
+			continue; // dir prefixes always end with a slash
+
+		prefixHash = hashFNV1a(path + hashedLen, prefixLen - hashedLen, prefixHash);
+		hashedLen = prefixLen;
+
+		// find group of this prefix
+
+		const PathMatchImagePrefixGroup* group = NULL;
+
+		for(uint32_t slotIndex = prefixHash & slotMask, numProbes = 0;
+			slots[slotIndex] && (numProbes < header->numSlots);
+			slotIndex = (slotIndex + 1) & slotMask, numProbes++)
+		{
+			const PathMatchImagePrefixGroup* currentGroup = &groups[slots[slotIndex] - 1];
+
+			if( (currentGroup->prefixHash == prefixHash) &&
+				(currentGroup->prefixLen == prefixLen) &&
+				!memcmp(getPattern(header, rules[currentGroup->firstRule]), path, prefixLen) )
+			{
+				group = currentGroup;
+				break;
+			}
+		}
+
+		if(!group)
+			continue;
+
+		// check group rules that precede the best match so far (rule list is in ascending order)
+
+		for(uint32_t i=0; i < group->numRules; i++)
+		{
+			uint32_t ruleIndex = ruleList[group->ruleListIndex + i];
+
+			if(ruleIndex >= bestRuleIndex)
+				break;
+
+			if(ruleAccessModes && !(ruleAccessModes[ruleIndex] & accessMode) )
+				continue; // conditions of this rule don't hold
+
+			if(stats)
+				stats->increment(ruleIndex, PATHMATCHSTATS_EVALUATIONS);
+
+			if(checkRuleMatch(header, rules[ruleIndex], path, pathLen) )
+			{
+				bestRuleIndex = ruleIndex;
+				break;
+			}
+		}
+
+		if(!bestRuleIndex)
+			break; // can't get better than the first rule
+	}
+
+	return (bestRuleIndex == header->numRules) ? -1 : (int)bestRuleIndex;
+}
+
+/**
+ * Check if a rank is in the list of a "rank=" or "localrank=" condition. The list consists of ranks
+ * and ranges joined by "+", e.g. "0-3+8".
+ *
+ * @rank -1 if the rank of this process is unknown, which is not in any list.
+ * @return false if the list is invalid.
+ */
+bool PathMatchImage::checkRankList(const std::string& rankList, int rank, bool& outIsInList)
+{
+	StringVec itemsVec;
+
+	boost::split(itemsVec, rankList, boost::is_any_of("+") );
+
+	outIsInList = false;
+
+	for(const std::string& itemStr : itemsVec)
+	{
+		size_t dashPos = itemStr.find('-');
+		std::string firstStr = itemStr.substr(0, dashPos);
+		std::string lastStr = (dashPos == std::string::npos) ?
+			firstStr : itemStr.substr(dashPos + 1);
+
+		if(firstStr.empty() || lastStr.empty() ||
+			(firstStr.find_first_not_of("0123456789") != std::string::npos) ||
+			(lastStr.find_first_not_of("0123456789") != std::string::npos) )
+			return false;
+
+		long long first = atoll(firstStr.c_str() );
+		long long last = atoll(lastStr.c_str() );
+
+		if(first > last)
+			return false;
+
+		if( (rank >= first) && (rank <= last) )
+			outIsInList = true;
+	}
+
+	return true;
+}
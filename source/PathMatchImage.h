@@ -0,0 +1,303 @@
+#ifndef PATHMATCHIMAGE_H_
+#define PATHMATCHIMAGE_H_
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Common.h"
+#include "PathMatchStats.h"
+
+
+#define PATHMATCHIMAGE_MAGIC		0x4c505356 // "VSPL" in little endian
+#define PATHMATCHIMAGE_VERSION		5
+
+#define PATHMATCH_ACTION_DIRECT		1 // inject O_DIRECT (default, disabled by "nodirect" option)
+#define PATHMATCH_ACTION_SHAREDLIMIT	2 // "bw=" and "iops=" limits are node-wide ("sharedlimit")
+
+// access modes of the "mode=" condition, bit index is the O_ACCMODE part of the open flags
+#define PATHMATCH_MODE_RDONLY		1 // "ro"
+#define PATHMATCH_MODE_WRONLY		2 // "wo"
+#define PATHMATCH_MODE_RDWR			4 // "rw"
+#define PATHMATCH_MODE_ALL			(PATHMATCH_MODE_RDONLY | PATHMATCH_MODE_WRONLY | \
+	PATHMATCH_MODE_RDWR)
+
+
+/**
+ * Header at the beginning of a compiled path match image. The image is a single position-independent
+ * block of memory, so that it can be shared between processes through a read-only mapping and
+ * stored as a binary path file.
+ *
+ * Layout: header, rule table, prefix group table, prefix hash slots, rule list, string blob.
+ */
+struct PathMatchImageHeader
+{
+	uint32_t magic; // PATHMATCHIMAGE_MAGIC
+	uint32_t version; // PATHMATCHIMAGE_VERSION
+	uint64_t imageLen; // total length including this header
+
+	// identity of the source path file to detect changes
+	uint64_t sourceDev;
+	uint64_t sourceIno;
+	uint64_t sourceSize;
+	uint64_t sourceMTimeNSec;
+	uint64_t sourceCTimeNSec;
+	uint64_t sourceContentHash;
+
+	uint32_t numRules;
+	uint32_t rulesOffset; // offset of PathMatchImageRule array relative to image start
+	uint32_t numGroups;
+	uint32_t groupsOffset; // offset of PathMatchImagePrefixGroup array
+	uint32_t numSlots; // power of two
+	uint32_t slotsOffset; // offset of uint32_t hash slots (group index + 1, 0 for empty slot)
+	uint32_t ruleListLen;
+	uint32_t ruleListOffset; // offset of uint32_t rule indices, referenced by prefix groups
+	uint32_t stringsOffset; // offset of string blob
+	uint32_t stringsLen;
+};
+
+/**
+ * A single rule (wildcard pattern and actions) in the rule table of a compiled image. Rules are in
+ * path file order, the first matching rule wins.
+ */
+struct PathMatchImageRule
+{
+	uint32_t patternOffset; // relative to string blob
+	uint32_t patternLen; // without trailing zero
+	uint32_t literalPrefixLen; // length of pattern part before the first wildcard
+	uint32_t dirPrefixLen; // length of literal prefix up to and including its last "/"
+	uint32_t actions; // PATHMATCH_ACTION_... flags
+	uint32_t lineNum; // line in source path file (1-based, 0 if unknown) for reports
+	uint64_t preallocExtent; // "prealloc=" size to fallocate ahead of writes to new files; 0 if off
+	uint64_t expectedSize; // "expectsize=" size to fallocate on creation of new files; 0 if off
+	uint64_t bwLimit; // "bw=" max bytes per sec of reads+writes on matched fds; 0 if unlimited
+	uint64_t iopsLimit; // "iops=" max reads+writes per sec on matched fds; 0 if unlimited
+
+	/* conditions under which the rule applies. Process conditions (exe, ranks) are kept as strings
+		and get evaluated at lib init, as a shared image is used by different processes. */
+	uint32_t accessModes; // PATHMATCH_MODE_... flags of "mode="; PATHMATCH_MODE_ALL if not given
+	uint32_t exeOffset; // "exe=" wildcard pattern relative to string blob
+	uint32_t exeLen; // 0 if not given
+	uint32_t rankOffset; // "rank=" list of ranks and ranges (e.g. "0-3+8") relative to string blob
+	uint32_t rankLen; // 0 if not given
+	uint32_t localRankOffset; // "localrank=" list relative to string blob
+	uint32_t localRankLen; // 0 if not given
+	uint32_t reserved;
+};
+
+/**
+ * All rules that share the same directory prefix (the literal part of their pattern up to the last
+ * "/" before the first wildcard). A path can only match rules of which the directory prefix is a
+ * prefix of the path, so matching only needs to look at the groups of the path's parent dirs.
+ */
+struct PathMatchImagePrefixGroup
+{
+	uint64_t prefixHash; // hashFNV1a() of prefix
+	uint32_t prefixLen;
+	uint32_t firstRule; // a rule with this prefix, to compare the actual prefix string
+	uint32_t ruleListIndex; // start of this group's rules in the rule list
+	uint32_t numRules; // number of rules of this group in the rule list (in ascending order)
+};
+
+/**
+ * A rule as parsed from a text path file, i.e. before compilation into an image.
+ */
+class PathMatchRuleSpec
+{
+	public:
+		std::string pattern;
+		unsigned actions{PATHMATCH_ACTION_DIRECT};
+		unsigned lineNum{0}; // line in source path file (1-based)
+		uint64_t preallocExtent{0};
+		uint64_t expectedSize{0};
+		uint64_t bwLimit{0};
+		uint64_t iopsLimit{0};
+		unsigned accessModes{PATHMATCH_MODE_ALL};
+		std::string exePattern;
+		std::string rankList;
+		std::string localRankList;
+};
+
+typedef std::vector<PathMatchRuleSpec> PathMatchRuleSpecVec;
+
+
+/**
+ * Toolkit to build, verify and evaluate compiled path match images.
+ */
+class PathMatchImage
+{
+	public:
+		static void build(const PathMatchRuleSpecVec& ruleSpecs, const struct stat& sourceStat,
+			uint64_t sourceContentHash, std::vector<char>& outImage);
+		static bool verify(const void* image, size_t imageLen);
+		static bool checkSourceIdentity(const PathMatchImageHeader* header,
+			const struct stat& sourceStat);
+		static int findMatchingRule(const PathMatchImageHeader* header, const char* path,
+			size_t pathLen, PathMatchStats* stats = NULL, const uint8_t* ruleAccessModes = NULL,
+			unsigned accessMode = PATHMATCH_MODE_ALL);
+		static bool checkRankList(const std::string& rankList, int rank, bool& outIsInList);
+
+	private:
+		PathMatchImage() {}
+
+
+		// inliners
+	public:
+
+		static const PathMatchImageRule* getRules(const PathMatchImageHeader* header)
+		{
+			return (const PathMatchImageRule*)( (const char*)header + header->rulesOffset);
+		}
+
+		static const PathMatchImagePrefixGroup* getGroups(const PathMatchImageHeader* header)
+		{
+			return (const PathMatchImagePrefixGroup*)( (const char*)header + header->groupsOffset);
+		}
+
+		static const uint32_t* getSlots(const PathMatchImageHeader* header)
+		{
+			return (const uint32_t*)( (const char*)header + header->slotsOffset);
+		}
+
+		static const uint32_t* getRuleList(const PathMatchImageHeader* header)
+		{
+			return (const uint32_t*)( (const char*)header + header->ruleListOffset);
+		}
+
+		static const char* getStrings(const PathMatchImageHeader* header)
+		{
+			return (const char*)header + header->stringsOffset;
+		}
+
+		static const char* getPattern(const PathMatchImageHeader* header,
+			const PathMatchImageRule& rule)
+		{
+			return getStrings(header) + rule.patternOffset;
+		}
+
+		/**
+		 * @return empty string if the rule has no "exe=" condition.
+		 */
+		static std::string getExePattern(const PathMatchImageHeader* header,
+			const PathMatchImageRule& rule)
+		{
+			return std::string(getStrings(header) + rule.exeOffset, rule.exeLen);
+		}
+
+		static std::string getRankList(const PathMatchImageHeader* header,
+			const PathMatchImageRule& rule)
+		{
+			return std::string(getStrings(header) + rule.rankOffset, rule.rankLen);
+		}
+
+		static std::string getLocalRankList(const PathMatchImageHeader* header,
+			const PathMatchImageRule& rule)
+		{
+			return std::string(getStrings(header) + rule.localRankOffset, rule.localRankLen);
+		}
+
+		/**
+		 * @openFlags as given to open().
+		 * @return PATHMATCH_MODE_... flag.
+		 */
+		static unsigned openFlagsToAccessMode(int openFlags)
+		{
+			// (O_ACCMODE value 3 is a special mode for ioctl-only opens; treat like O_RDWR)
+			return std::min(1U << (openFlags & O_ACCMODE), (unsigned)PATHMATCH_MODE_RDWR);
+		}
+
+		/**
+		 * 64-bit FNV-1a hash. Can be calculated incrementally by passing the previous result as hash.
+		 */
+		static uint64_t hashFNV1a(const char* buf, size_t len,
+			uint64_t hash = 0xcbf29ce484222325ULL)
+		{
+			for(size_t i=0; i < len; i++)
+			{
+				hash ^= (unsigned char)buf[i];
+				hash *= 0x100000001b3ULL;
+			}
+
+			return hash;
+		}
+
+		/**
+		 * Check if a path matches a wildcard pattern. "*" matches any number of chars (including
+		 * slashes), "?" matches a single char. Like "." in the regular expressions that were
+		 * previously generated from the patterns, the wildcards don't match line terminators.
+		 */
+		static bool wildcardMatch(const char* pattern, size_t patternLen, const char* str,
+			size_t strLen)
+		{
+			size_t patternPos = 0;
+			size_t strPos = 0;
+			size_t starPatternPos = (size_t)-1; // position after the last seen "*"
+			size_t starStrPos = 0; // str position where the last seen "*" started matching
+
+			while(strPos < strLen)
+			{
+				if(patternPos < patternLen)
+				{
+					char patternChar = pattern[patternPos];
+
+					if(patternChar == '*')
+					{
+						starPatternPos = ++patternPos;
+						starStrPos = strPos;
+						continue;
+					}
+
+					if( (patternChar == '?') ?
+						!isLineTerminator(str[strPos]) : (patternChar == str[strPos]) )
+					{
+						patternPos++;
+						strPos++;
+						continue;
+					}
+				}
+
+				// mismatch, so let the last "*" consume one more char if possible
+
+				if( (starPatternPos == (size_t)-1) || isLineTerminator(str[starStrPos]) )
+					return false;
+
+				patternPos = starPatternPos;
+				strPos = ++starStrPos;
+			}
+
+			// str consumed, remaining pattern may only consist of "*"
+
+			while( (patternPos < patternLen) && (pattern[patternPos] == '*') )
+				patternPos++;
+
+			return (patternPos == patternLen);
+		}
+
+		/**
+		 * Check if a path matches the given rule of an image.
+		 */
+		static bool checkRuleMatch(const PathMatchImageHeader* header,
+			const PathMatchImageRule& rule, const char* path, size_t pathLen)
+		{
+			const char* pattern = getPattern(header, rule);
+
+			// quick check of literal prefix before the full wildcard match
+
+			if( (pathLen < rule.literalPrefixLen) ||
+				memcmp(path, pattern, rule.literalPrefixLen) )
+				return false;
+
+			return wildcardMatch(
+				pattern + rule.literalPrefixLen, rule.patternLen - rule.literalPrefixLen,
+				path + rule.literalPrefixLen, pathLen - rule.literalPrefixLen);
+		}
+
+	private:
+
+		static bool isLineTerminator(char c)
+		{
+			return (c == '\n') || (c == '\r');
+		}
+};
+
+
+#endif /* PATHMATCHIMAGE_H_ */
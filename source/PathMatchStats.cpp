@@ -0,0 +1,46 @@
+#include "PathMatchStats.h"
+
+#define PATHMATCHSTATS_CACHELINE_COUNTERS	(64 / sizeof(uint64_t) )
+
+
+PathMatchStats::PathMatchStats(uint32_t numRules) : numRules(numRules)
+{
+	size_t numShardCounters = (size_t)numRules * PATHMATCHSTATS_NUM_COUNTERS;
+
+	// round up, so that each shard starts on its own cache line
+	shardStride = (numShardCounters + PATHMATCHSTATS_CACHELINE_COUNTERS - 1) &
+		~(PATHMATCHSTATS_CACHELINE_COUNTERS - 1);
+
+	counters = new std::atomic<uint64_t>[shardStride * PATHMATCHSTATS_NUM_SHARDS]();
+}
+
+PathMatchStats::~PathMatchStats()
+{
+	delete[] counters;
+}
+
+/**
+ * @counter PATHMATCHSTATS_...
+ * @return sum of the given counter of a rule over all shards.
+ */
+uint64_t PathMatchStats::getSum(uint32_t ruleIndex, unsigned counter) const
+{
+	uint64_t sum = 0;
+
+	for(unsigned shard = 0; shard < PATHMATCHSTATS_NUM_SHARDS; shard++)
+		sum += counters[(shard * shardStride) + (ruleIndex * PATHMATCHSTATS_NUM_COUNTERS) +
+			counter].load(std::memory_order_relaxed);
+
+	return sum;
+}
+
+/**
+ * @return shard of the calling thread, assigned round-robin on first use.
+ */
+unsigned PathMatchStats::getThreadShard()
+{
+	static std::atomic<unsigned> nextShard(0);
+	static thread_local unsigned threadShard = nextShard++ % PATHMATCHSTATS_NUM_SHARDS;
+
+	return threadShard;
+}
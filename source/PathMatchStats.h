@@ -0,0 +1,61 @@
+#ifndef PATHMATCHSTATS_H_
+#define PATHMATCHSTATS_H_
+
+#include <atomic>
+#include "Common.h"
+
+
+// counters per rule
+#define PATHMATCHSTATS_EVALUATIONS			0 // rule pattern was checked against a path
+#define PATHMATCHSTATS_MATCHES				1 // rule was the first matching rule of a path
+#define PATHMATCHSTATS_INJECTED				2 // O_DIRECT was injected
+#define PATHMATCHSTATS_SKIP_NODIRECT		3 // not injected: "nodirect" rule
+#define PATHMATCHSTATS_SKIP_DIRECTORY		4 // not injected: opened with O_DIRECTORY
+#define PATHMATCHSTATS_SKIP_ALREADYDIRECT	5 // not injected: app set O_DIRECT already
+#define PATHMATCHSTATS_SKIP_UNSUPPORTED		6 // not injected: mount known not to support O_DIRECT
+#define PATHMATCHSTATS_SKIP_FCNTLFAIL		7 // not injected: fcntl(F_SETFL, O_DIRECT) failed
+#define PATHMATCHSTATS_SKIP_PROFILE			8 // not injected: buffered policy of I/O profile
+#define PATHMATCHSTATS_NUM_COUNTERS			9
+
+#define PATHMATCHSTATS_NUM_SHARDS			16 // threads get spread over shards round-robin
+
+
+/**
+ * Per-rule counters of a path match image. Each thread increments the counters of its own shard,
+ * so that threads on different shards don't contend for the same cache lines. The shards get summed
+ * up only for the report.
+ */
+class PathMatchStats
+{
+	public:
+		PathMatchStats(uint32_t numRules);
+		~PathMatchStats();
+
+		uint64_t getSum(uint32_t ruleIndex, unsigned counter) const;
+
+	private:
+		uint32_t numRules;
+		size_t shardStride; // number of counters per shard (padded to full cache lines)
+		std::atomic<uint64_t>* counters; // [shard][rule][counter]
+
+		static unsigned getThreadShard();
+
+
+		// inliners
+	public:
+		void increment(uint32_t ruleIndex, unsigned counter)
+		{
+			std::atomic<uint64_t>& value = counters[(getThreadShard() * shardStride) +
+				(ruleIndex * PATHMATCHSTATS_NUM_COUNTERS) + counter];
+
+			value.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		uint32_t getNumRules() const
+		{
+			return numRules;
+		}
+};
+
+
+#endif /* PATHMATCHSTATS_H_ */
@@ -1,47 +1,645 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iterator>
+#include <sstream>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "PathMatchStore.h"
 
+#define PATHMATCHSTORE_SHM_DIR		"/dev/shm" // location of node-wide shared images
+
+#define PATHMATCHSTORE_PROC_EXE		"/proc/self/exe"
+#define PATHMATCHSTORE_PROC_CMDLINE	"/proc/self/cmdline"
+
 PathMatchStore* pathMatchStore = NULL;
 
+// env variables of common MPI launchers and schedulers for "rank=", first one that is set wins
+static const char* const rankEnvNames[] =
+{
+	"OMPI_COMM_WORLD_RANK", "PMIX_RANK", "PMI_RANK", "MV2_COMM_WORLD_RANK", "PALS_RANKID",
+	"SLURM_PROCID",
+};
+
+// env variables of common MPI launchers and schedulers for "localrank="
+static const char* const localRankEnvNames[] =
+{
+	"OMPI_COMM_WORLD_LOCAL_RANK", "MPI_LOCALRANKID", "MV2_COMM_WORLD_LOCAL_RANK",
+	"PALS_LOCAL_RANKID", "SLURM_LOCALID",
+};
+
+
+PathMatchStore::~PathMatchStore()
+{
+	if(mappedImage)
+		munmap(mappedImage, mappedImageLen);
+
+	SAFE_DELETE(stats);
+}
+
 /**
- * Read newline-separated paths from given file.
+ * Evaluate the process conditions ("exe=", "rank=", "localrank=") of all rules for this process and
+ * combine them with the "mode=" conditions into a table of access modes per rule, so that matching
+ * only needs a table lookup per rule. Must be called after a path file was loaded and before matching
+ * is used by multiple threads. Without this, conditions are ignored (e.g. in the tools).
  *
- * @return number of loaded paths, -1 on error (e.g. file not found or not readable).
+ * @return number of rules that don't apply in this process.
+ */
+unsigned PathMatchStore::evalConditions()
+{
+	if(!image)
+		return 0;
+
+	const PathMatchImageRule* rules = PathMatchImage::getRules(image);
+	bool haveConditions = false;
+
+	for(uint32_t i=0; i < image->numRules; i++)
+		if( (rules[i].accessModes != PATHMATCH_MODE_ALL) || rules[i].exeLen || rules[i].rankLen ||
+			rules[i].localRankLen)
+			haveConditions = true;
+
+	if(!haveConditions)
+		return 0; // keep table empty, so that matching doesn't look at it
+
+	// exe path from /proc has symlinks resolved, argv[0] is what the user typed
+	char exeBuf[PATH_MAX];
+	ssize_t exeLen = readlink(PATHMATCHSTORE_PROC_EXE, exeBuf, sizeof(exeBuf) - 1);
+	std::string exePath( (exeLen > 0) ? std::string(exeBuf, exeLen) : "");
+
+	std::string argv0;
+	std::ifstream cmdlineStream(PATHMATCHSTORE_PROC_CMDLINE);
+	std::getline(cmdlineStream, argv0, '\0');
+
+	const StringVec exeNames = { exePath, exePath.substr(exePath.rfind('/') + 1), argv0,
+		argv0.substr(argv0.rfind('/') + 1) };
+
+	const int rank = getRankFromEnv(rankEnvNames,
+		sizeof(rankEnvNames) / sizeof(rankEnvNames[0]) );
+	const int localRank = getRankFromEnv(localRankEnvNames,
+		sizeof(localRankEnvNames) / sizeof(localRankEnvNames[0]) );
+
+	unsigned numDisabled = 0;
+
+	ruleAccessModes.assign(image->numRules, 0);
+
+	for(uint32_t i=0; i < image->numRules; i++)
+	{
+		bool isInList;
+
+		if(rules[i].exeLen)
+		{
+			std::string exePattern = PathMatchImage::getExePattern(image, rules[i]);
+
+			isInList = std::any_of(exeNames.begin(), exeNames.end(),
+				[&exePattern](const std::string& exeName)
+				{
+					return !exeName.empty() && PathMatchImage::wildcardMatch(exePattern.c_str(),
+						exePattern.length(), exeName.c_str(), exeName.length() );
+				} );
+
+			if(!isInList)
+			{
+				numDisabled++;
+				continue;
+			}
+		}
+
+		if(rules[i].rankLen &&
+			(!PathMatchImage::checkRankList(PathMatchImage::getRankList(image, rules[i]), rank,
+				isInList) || !isInList) )
+		{
+			numDisabled++;
+			continue;
+		}
+
+		if(rules[i].localRankLen &&
+			(!PathMatchImage::checkRankList(PathMatchImage::getLocalRankList(image, rules[i]),
+				localRank, isInList) || !isInList) )
+		{
+			numDisabled++;
+			continue;
+		}
+
+		ruleAccessModes[i] = rules[i].accessModes;
+	}
+
+	return numDisabled;
+}
+
+/**
+ * @envNames env variables to check in this order.
+ * @return rank from the first env variable that is set; -1 if none is set.
+ */
+int PathMatchStore::getRankFromEnv(const char* const* envNames, size_t numEnvNames)
+{
+	for(size_t i=0; i < numEnvNames; i++)
+	{
+		const char* rankStr = getenv(envNames[i]);
+
+		if(rankStr && *rankStr)
+			return atoi(rankStr);
+	}
+
+	return -1;
+}
+
+/**
+ * Enable per-rule counters. Must be called after a path file was loaded and before matching is
+ * used by multiple threads.
+ */
+void PathMatchStore::enableStats()
+{
+	if(!stats && image)
+		stats = new PathMatchStats(image->numRules);
+}
+
+/**
+ * Load paths from given file, which is either a text file with newline-separated paths or a binary
+ * file that was compiled from a text file (see checkIsBinaryPathFile()).
+ *
+ * @return false on error (e.g. file not found or not readable).
  */
 bool PathMatchStore::loadPathFile(std::string path)
+{
+	if(checkIsBinaryPathFile(path) )
+	{
+		bool mapRes = mapImageFile(path, NULL);
+		if(!mapRes)
+		{
+			log_fprintf(stderr, LOG_PREFIX "ERROR: Binary path file is invalid or was compiled "
+				"for a different version: %s\n", path.c_str() );
+			return false;
+		}
+
+		return true;
+	}
+
+	bool parseRes = parsePathFile(path, privateImage);
+	if(!parseRes)
+		return false;
+
+	image = (const PathMatchImageHeader*)privateImage.data();
+
+	return true;
+}
+
+/**
+ * Like loadPathFile(), but share the compiled paths with other processes on the same node: The first
+ * process compiles the path file into an image in shared memory and later processes map that image
+ * without parsing the path file. The image gets rebuilt when the path file changes.
+ *
+ * Falls back to a private image if the shared memory dir is not usable or if the lock file is not
+ * exclusively ours (e.g. created by another user to block or redirect us). Binary path files are
+ * mapped directly, as they are already shared through the page cache.
+ *
+ * @return false on error (e.g. file not found or not readable).
+ */
+bool PathMatchStore::loadPathFileShared(std::string path)
+{
+	struct stat sourceStat;
+
+	int statRes = stat(path.c_str(), &sourceStat);
+	if(statRes == -1)
+	{
+		log_fprintf(stderr, LOG_PREFIX "ERROR: Open of path file failed: %s\n",
+			path.c_str() );
+		return false;
+	}
+
+	if(checkIsBinaryPathFile(path) )
+		return loadPathFile(path);
+
+	std::string imagePath = getSharedImagePath(path);
+
+	if(mapImageFile(imagePath, &sourceStat) )
+		return true; // existing image is up-to-date
+
+	// serialize compilation, so that not all processes on this node parse the path file
+
+	std::string lockPath = imagePath + ".lock";
+
+	int lockFD = openSharedLockFile(lockPath);
+	if(lockFD == -1)
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Using private path image. Lock file not usable: %s\n",
+				lockPath.c_str() );
+
+		return loadPathFile(path);
+	}
+
+	flock(lockFD, LOCK_EX);
+
+	bool mapRes = mapImageFile(imagePath, &sourceStat); // maybe built while we waited for lock
+
+	if(!mapRes)
+	{
+		bool parseRes = parsePathFile(path, privateImage);
+		if(!parseRes)
+		{
+			close(lockFD);
+			return false;
+		}
+
+		image = (const PathMatchImageHeader*)privateImage.data();
+
+		if(writeImageFile(imagePath) )
+			mapRes = mapImageFile(imagePath, &sourceStat);
+
+		/* note: mapRes can still be false here, e.g. if path file changed after we parsed it. we
+			just use our private image in this case and the next process will rebuild. */
+
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Compiled shared path image: %s\n",
+				mapRes ? imagePath.c_str() : "<failed>");
+	}
+
+	close(lockFD); // (also releases flock)
+
+	if(mapRes)
+		privateImage.clear();
+
+	return true;
+}
+
+/**
+ * Open (or create) the lock file that serializes compilation of a shared image. The name in the
+ * shared memory dir is predictable, so only a regular file that is owned by us and not writable by
+ * others is accepted; otherwise other users could make us block in flock() or follow a symlink.
+ *
+ * @return fd of the lock file or -1 if it is not usable (errno is set).
+ */
+int PathMatchStore::openSharedLockFile(std::string lockPath)
+{
+	int lockFD = open(lockPath.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if(lockFD == -1)
+		return -1;
+
+	struct stat lockStat;
+
+	int statRes = fstat(lockFD, &lockStat);
+
+	if( (statRes == -1) || !S_ISREG(lockStat.st_mode) || (lockStat.st_uid != geteuid() ) ||
+		(lockStat.st_mode & (S_IWGRP | S_IWOTH) ) )
+	{
+		close(lockFD);
+		errno = EPERM;
+		return -1;
+	}
+
+	return lockFD;
+}
+
+/**
+ * Atomically write the current image to the given file, e.g. to create a binary path file.
+ *
+ * @return false on error.
+ */
+bool PathMatchStore::writeImageFile(std::string path)
+{
+	std::string tmpPath = path + ".tmp";
+
+	unlink(tmpPath.c_str() );
+
+	int tmpFD = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if(tmpFD == -1)
+		return false;
+
+	const char* writeBuf = (const char*)image;
+	size_t numBytesLeft = image->imageLen;
+
+	while(numBytesLeft)
+	{
+		ssize_t writeRes = write(tmpFD, writeBuf, numBytesLeft);
+		if(writeRes <= 0)
+		{
+			close(tmpFD);
+			unlink(tmpPath.c_str() );
+			return false;
+		}
+
+		writeBuf += writeRes;
+		numBytesLeft -= writeRes;
+	}
+
+	close(tmpFD);
+
+	int renameRes = rename(tmpPath.c_str(), path.c_str() );
+	if(renameRes == -1)
+	{
+		unlink(tmpPath.c_str() );
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Check if the given file starts with the magic number of a compiled image.
+ *
+ * @return true if file is a binary path file.
+ */
+bool PathMatchStore::checkIsBinaryPathFile(std::string path)
+{
+	uint32_t magic = 0;
+
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return false;
+
+	ssize_t readRes = read(fd, &magic, sizeof(magic) );
+
+	close(fd);
+
+	return (readRes == sizeof(magic) ) && (magic == PATHMATCHIMAGE_MAGIC);
+}
+
+/**
+ * Parse newline-separated paths from given file and compile them into an image.
+ *
+ * @return false on error (e.g. file not found or not readable).
+ */
+bool PathMatchStore::parsePathFile(std::string path, std::vector<char>& outImage)
 {
 	std::string lineStr;
 	unsigned lineNum = 0;
+	struct stat sourceStat;
+	PathMatchRuleSpecVec ruleSpecs;
+	StringSet patternSet; // patterns of rules without conditions to skip duplicates
 
 	std::ifstream fileStream(path.c_str() );
-	if(!fileStream)
+	if(!fileStream || (stat(path.c_str(), &sourceStat) == -1) )
 	{
 		log_fprintf(stderr, LOG_PREFIX "ERROR: Open of path file failed: %s\n",
 			path.c_str() );
 		return false;
 	}
 
+	std::string fileContents( (std::istreambuf_iterator<char>(fileStream) ),
+		std::istreambuf_iterator<char>() );
+	std::istringstream contentsStream(fileContents);
+
 	// process each line in input file
-	for( ; std::getline(fileStream, lineStr); lineNum++)
+	for( ; std::getline(contentsStream, lineStr); lineNum++)
 	{
+		PathMatchRuleSpec ruleSpec;
+		std::string errStr;
+
 		boost::trim(lineStr);
 
-		if(lineStr.empty() )
-			continue; // nothing to do for empty lines
+		if(lineStr.empty() || (lineStr[0] == '#') )
+			continue; // nothing to do for empty lines and comments
 
-		if(lineStr[0] != '/')
+		if(!parseRuleLine(lineStr, ruleSpec, errStr) )
 		{
-			log_fprintf(stderr, LOG_PREFIX
-				"ERROR: Path file contains a path that is not absolute: "
-				"%s (Line: %d; File: %s)\n",
-				lineStr.c_str(), lineNum+1, path.c_str() );
+			log_fprintf(stderr, LOG_PREFIX "ERROR: %s: %s (Line: %d; File: %s)\n",
+				errStr.c_str(), lineStr.c_str(), lineNum+1, path.c_str() );
+
+			return false;
+		}
 
+		if(patternSet.count(ruleSpec.pattern) )
+			continue; // earlier rule with this pattern has no conditions, so it always wins
+
+		if(ruleSpec.exePattern.empty() && ruleSpec.rankList.empty() &&
+			ruleSpec.localRankList.empty() && (ruleSpec.accessModes == PATHMATCH_MODE_ALL) )
+			patternSet.insert(ruleSpec.pattern);
+
+		ruleSpec.lineNum = lineNum + 1;
+
+		ruleSpecs.push_back(ruleSpec);
+	}
+
+	PathMatchImage::build(ruleSpecs, sourceStat,
+		PathMatchImage::hashFNV1a(fileContents.c_str(), fileContents.length() ), outImage);
+
+	return true;
+}
+
+/**
+ * Parse a single non-empty trimmed line of a text path file: "[option option=value ...] /path".
+ *
+ * @outErrStr reason if line is invalid.
+ * @return false if line is invalid.
+ */
+bool PathMatchStore::parseRuleLine(std::string lineStr, PathMatchRuleSpec& outRuleSpec,
+	std::string& outErrStr)
+{
+	if(lineStr[0] == '[')
+	{ // line starts with list of options
+		size_t closingPos = lineStr.find(']');
+		if(closingPos == std::string::npos)
+		{
+			outErrStr = "Path file contains an option list without closing bracket";
 			return false;
 		}
 
-		PathMatchStoreElem newElem(wildcardStrToRegex(lineStr), lineStr);
+		std::string optionsStr = lineStr.substr(1, closingPos - 1);
+		StringVec optionsVec;
 
-		pathMap.insert(newElem);
+		boost::split(optionsVec, optionsStr, boost::is_any_of(" \t,"), boost::token_compress_on);
+
+		for(const std::string& optionStr : optionsVec)
+		{
+			if(optionStr.empty() )
+				continue;
+
+			size_t equalsPos = optionStr.find('=');
+			std::string keyStr = optionStr.substr(0, equalsPos);
+			std::string valueStr = (equalsPos == std::string::npos) ?
+				"" : optionStr.substr(equalsPos + 1);
+
+			if(keyStr == "direct")
+				outRuleSpec.actions |= PATHMATCH_ACTION_DIRECT;
+			else
+			if(keyStr == "nodirect")
+				outRuleSpec.actions &= ~PATHMATCH_ACTION_DIRECT;
+			else
+			if(keyStr == "sharedlimit")
+				outRuleSpec.actions |= PATHMATCH_ACTION_SHAREDLIMIT;
+			else
+			if(keyStr == "exe")
+			{
+				if(valueStr.empty() )
+				{
+					outErrStr = "Path file contains an empty pattern in option \"" + optionStr +
+						"\"";
+					return false;
+				}
+
+				outRuleSpec.exePattern = valueStr;
+			}
+			else
+			if(keyStr == "mode")
+			{
+				StringVec modesVec;
+
+				boost::split(modesVec, valueStr, boost::is_any_of("+") );
+
+				outRuleSpec.accessModes = 0;
+
+				for(const std::string& modeStr : modesVec)
+				{
+					if(modeStr == "ro")
+						outRuleSpec.accessModes |= PATHMATCH_MODE_RDONLY;
+					else
+					if(modeStr == "wo")
+						outRuleSpec.accessModes |= PATHMATCH_MODE_WRONLY;
+					else
+					if(modeStr == "rw")
+						outRuleSpec.accessModes |= PATHMATCH_MODE_RDWR;
+					else
+					{
+						outErrStr = "Path file contains an invalid access mode in option \"" +
+							optionStr + "\"";
+						return false;
+					}
+				}
+			}
+			else
+			if( (keyStr == "rank") || (keyStr == "localrank") )
+			{
+				bool ignoredIsInList;
+
+				if(!PathMatchImage::checkRankList(valueStr, -1, ignoredIsInList) )
+				{
+					outErrStr = "Path file contains an invalid rank list in option \"" + optionStr +
+						"\"";
+					return false;
+				}
+
+				if(keyStr == "rank")
+					outRuleSpec.rankList = valueStr;
+				else
+					outRuleSpec.localRankList = valueStr;
+			}
+			else
+			if( (keyStr == "prealloc") || (keyStr == "expectsize") || (keyStr == "bw") ||
+				(keyStr == "iops") )
+			{
+				uint64_t size;
+
+				if(valueStr.empty() || !parseSizeStr(valueStr.c_str(), size) )
+				{
+					outErrStr = "Path file contains an invalid size in option \"" + optionStr +
+						"\"";
+					return false;
+				}
+
+				if(keyStr == "prealloc")
+					outRuleSpec.preallocExtent = size;
+				else
+				if(keyStr == "expectsize")
+					outRuleSpec.expectedSize = size;
+				else
+				if(keyStr == "bw")
+					outRuleSpec.bwLimit = size;
+				else
+					outRuleSpec.iopsLimit = size;
+			}
+			else
+			{
+				outErrStr = "Path file contains an unknown option \"" + optionStr + "\"";
+				return false;
+			}
+		}
+
+		lineStr = boost::trim_copy(lineStr.substr(closingPos + 1) );
+	}
+
+	if(lineStr.empty() || (lineStr[0] != '/') )
+	{
+		outErrStr = "Path file contains a path that is not absolute";
+		return false;
 	}
 
+	outRuleSpec.pattern = lineStr;
+
 	return true;
 }
+
+/**
+ * Map an existing image file if it is valid. Shared images additionally need to be owned by us
+ * and up-to-date.
+ *
+ * @sourceStat stat of the path file from which a shared image was built; NULL if imagePath is a
+ * 	binary path file given by the user.
+ * @return true if image was mapped and is now the active image.
+ */
+bool PathMatchStore::mapImageFile(std::string imagePath, const struct stat* sourceStat)
+{
+	struct stat imageStat;
+
+	int imageFD = open(imagePath.c_str(), O_RDONLY | O_CLOEXEC | (sourceStat ? O_NOFOLLOW : 0) );
+	if(imageFD == -1)
+		return false;
+
+	int statRes = fstat(imageFD, &imageStat);
+
+	if( (statRes == -1) || !S_ISREG(imageStat.st_mode) || !imageStat.st_size)
+	{
+		close(imageFD);
+		return false;
+	}
+
+	/* only trust shared images that nobody else could have modified */
+	if(sourceStat &&
+		( (imageStat.st_uid != geteuid() ) || (imageStat.st_mode & (S_IWGRP | S_IWOTH) ) ) )
+	{
+		close(imageFD);
+		return false;
+	}
+
+	void* mapping = mmap(NULL, imageStat.st_size, PROT_READ, MAP_SHARED, imageFD, 0);
+
+	close(imageFD);
+
+	if(mapping == MAP_FAILED)
+		return false;
+
+	if(!PathMatchImage::verify(mapping, imageStat.st_size) ||
+		(sourceStat && !PathMatchImage::checkSourceIdentity(
+			(const PathMatchImageHeader*)mapping, *sourceStat) ) )
+	{
+		munmap(mapping, imageStat.st_size);
+		return false;
+	}
+
+	if(mappedImage)
+		munmap(mappedImage, mappedImageLen);
+
+	mappedImage = mapping;
+	mappedImageLen = imageStat.st_size;
+	image = (const PathMatchImageHeader*)mappedImage;
+
+	if(libLogTopics & ENV_LOG_TOPIC_INIT)
+		log_fprintf(stderr, LOG_PREFIX "Mapped path image: %s\n", imagePath.c_str() );
+
+	return true;
+}
+
+/**
+ * Get path of the shared image for the given path file. The name contains the uid, because images
+ * of other users are not trusted, and a hash of the canonical path of the path file, so that a
+ * relative path gets the same image in all working dirs only if it refers to the same file.
+ */
+std::string PathMatchStore::getSharedImagePath(std::string path)
+{
+	char nameBuf[128];
+	char* canonicalPath = realpath(path.c_str(), NULL);
+
+	if(canonicalPath)
+	{
+		path = canonicalPath;
+		free(canonicalPath);
+	}
+
+	snprintf(nameBuf, sizeof(nameBuf), PATHMATCHSTORE_SHM_DIR "/" LIB_NAME ".%u.%016llx.paths",
+		(unsigned)geteuid(),
+		(unsigned long long)PathMatchImage::hashFNV1a(path.c_str(), path.length() ) );
+
+	return nameBuf;
+}
@@ -3,98 +3,105 @@
 
 #include <boost/algorithm/string.hpp>
 #include <fstream>
-#include <mutex>
-#include <regex>
-#include <set>
 #include <string>
 #include "Common.h"
 #include "Logger.h"
+#include "PathMatchImage.h"
 
-class PathMatchStoreElem
-{
-	public:
-		PathMatchStoreElem(std::regex regex, std::string regexStr) :
-			regex(regex), regexStr(regexStr) {}
-
-		std::regex regex;
-		std::string regexStr;
-
-
-	bool operator< (const PathMatchStoreElem& rhs) const
-	{
-		return this->regexStr < rhs.regexStr;
-	}
-};
-
-typedef std::set<PathMatchStoreElem> PathMatchMap;
-typedef PathMatchMap::iterator PathMatchMapIter;
 
 /**
  * Store paths with wildcards ("*", "?") and check if other paths match against these.
+ *
+ * The paths are kept as a compiled PathMatchImage, either in private memory or mapped read-only (from
+ * a binary path file or from a node-wide shared memory file), so that the text path file only needs
+ * to be parsed once.
+ *
+ * Lines of text path files may start with a list of options in brackets, e.g. "[nodirect] /data/*".
+ * Options can also be conditions (e.g. "[exe=trainer mode=ro] /data/*"), so that a rule only applies
+ * to certain processes or opens.
  */
 class PathMatchStore
 {
 	public:
+		~PathMatchStore();
+
 		bool loadPathFile(std::string path);
+		bool loadPathFileShared(std::string path);
+		bool writeImageFile(std::string path);
+		void enableStats();
+		unsigned evalConditions();
+
+		static bool checkIsBinaryPathFile(std::string path);
 
 	private:
-		PathMatchMap pathMap;
+		std::vector<char> privateImage; // image buffer if not mapped
+		void* mappedImage{NULL}; // read-only mapping of image file
+		size_t mappedImageLen{0};
+		const PathMatchImageHeader* image{NULL}; // points to privateImage or mappedImage
+		PathMatchStats* stats{NULL}; // per-rule counters; NULL if disabled
+		std::vector<uint8_t> ruleAccessModes; // see evalConditions(); empty if no conditions
+
+		bool parsePathFile(std::string path, std::vector<char>& outImage);
+		bool parseRuleLine(std::string lineStr, PathMatchRuleSpec& outRuleSpec,
+			std::string& outErrStr);
+		bool mapImageFile(std::string imagePath, const struct stat* sourceStat);
+		std::string getSharedImagePath(std::string path);
+		int openSharedLockFile(std::string lockPath);
+
+		static int getRankFromEnv(const char* const* envNames, size_t numEnvNames);
 
 		// inliners
 	public:
 
-		bool checkPathMatch(std::string path)
+		/**
+		 * @accessMode PATHMATCH_MODE_... flag of the open() call for "mode=" conditions; the default
+		 * 		matches rules that apply to any access mode.
+		 * @return first matching rule in path file order or NULL if no rule matches.
+		 */
+		const PathMatchImageRule* getMatchingRule(const std::string& path,
+			unsigned accessMode = PATHMATCH_MODE_ALL)
 		{
-			for(const PathMatchStoreElem& currentMapElem : pathMap)
-			{
-				bool isMatch = std::regex_match(path, currentMapElem.regex);
+			int ruleIndex = PathMatchImage::findMatchingRule(image, path.c_str(), path.length(),
+				stats, ruleAccessModes.empty() ? NULL : ruleAccessModes.data(), accessMode);
 
-				if(isMatch)
-					return true;
-			}
+			if(ruleIndex < 0)
+				return NULL;
 
-			return false; // no match found
+			if(stats)
+				stats->increment(ruleIndex, PATHMATCHSTATS_MATCHES);
+
+			return &PathMatchImage::getRules(image)[ruleIndex];
+		}
+
+		/**
+		 * Count what happened to a path after it matched the given rule.
+		 *
+		 * @counter PATHMATCHSTATS_INJECTED or PATHMATCHSTATS_SKIP_...
+		 */
+		void countRuleOutcome(const PathMatchImageRule* rule, unsigned counter)
+		{
+			if(stats)
+				stats->increment(rule - PathMatchImage::getRules(image), counter);
+		}
+
+		bool checkPathMatch(const std::string& path)
+		{
+			return (getMatchingRule(path) != NULL);
 		}
 
 		int size()
 		{
-			return pathMap.size();
+			return image ? image->numRules : 0;
 		}
 
-	private:
+		const PathMatchImageHeader* getImage()
+		{
+			return image;
+		}
 
-		/**
-		 * Convert given string with wildcards ("*", "?") to std::regex.
-		 *
-		 * See https://stackoverflow.com/a/65851545/14419626
-		 */
-		std::regex wildcardStrToRegex(std::string wildcardStr, bool caseSensitive = true)
+		const PathMatchStats* getStats()
 		{
-			std::string regexStr(wildcardStr);
-
-			// escape all regex special chars
-
-			regexStr = std::regex_replace(regexStr, std::regex("\\\\"), "\\\\");
-			regexStr = std::regex_replace(regexStr, std::regex("\\^"), "\\^");
-			regexStr = std::regex_replace(regexStr, std::regex("\\."), "\\.");
-			regexStr = std::regex_replace(regexStr, std::regex("\\$"), "\\$");
-			regexStr = std::regex_replace(regexStr, std::regex("\\|"), "\\|");
-			regexStr = std::regex_replace(regexStr, std::regex("\\("), "\\(");
-			regexStr = std::regex_replace(regexStr, std::regex("\\)"), "\\)");
-			regexStr = std::regex_replace(regexStr, std::regex("\\{"), "\\{");
-			regexStr = std::regex_replace(regexStr, std::regex("\\{"), "\\}");
-			regexStr = std::regex_replace(regexStr, std::regex("\\["), "\\[");
-			regexStr = std::regex_replace(regexStr, std::regex("\\]"), "\\]");
-			regexStr = std::regex_replace(regexStr, std::regex("\\+"), "\\+");
-			regexStr = std::regex_replace(regexStr, std::regex("\\/"), "\\/");
-
-			// convert wildcard specific chars ("*", "?") to their regex equivalents
-
-			regexStr = std::regex_replace(regexStr, std::regex("\\?"), ".");
-			regexStr = std::regex_replace(regexStr, std::regex("\\*"), ".*");
-
-			return std::regex(regexStr,
-				caseSensitive ? std::regex_constants::ECMAScript : std::regex_constants::icase);
+			return stats;
 		}
 
 };
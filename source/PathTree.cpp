@@ -0,0 +1,209 @@
+#include "PathMatchImage.h"
+#include "PathTree.h"
+
+PathTree* pathTree = NULL;
+
+
+size_t PathTreeKeyHash::operator()(const PathTreeKey& key) const
+{
+	uint64_t parentHash = (uintptr_t)key.parent;
+
+	return PathMatchImage::hashFNV1a(key.name, key.nameLen, parentHash);
+}
+
+PathTree::PathTree()
+{
+	root.parent = NULL;
+	root.pathLen = 1; // "/"
+	root.refCount = 1; // root never gets deleted
+}
+
+PathTree::~PathTree()
+{
+	for(PathTreeNodeMap::value_type& mapPair : nodeMap)
+		delete mapPair.second;
+}
+
+/**
+ * Find or add the node of an absolute path.
+ *
+ * @path absolute path (i.e. starting with "/").
+ * @return node with a reference for the caller (to be given back via release() ).
+ */
+PathTreeNode* PathTree::lookupAbsolute(const char* path, bool normalize)
+{
+	// skip root slash, so that path "/" is root and "/a" is child "a" of root
+	return lookupComponents(&root, path + 1, normalize);
+}
+
+/**
+ * Find or add the node of a path relative to baseNode.
+ *
+ * @baseNode node of the dir to which path is relative; the caller needs to hold a reference.
+ * @path relative path; absolute paths ignore baseNode.
+ * @return node with a reference for the caller (to be given back via release() ).
+ */
+PathTreeNode* PathTree::lookupRelative(PathTreeNode* baseNode, const char* path, bool normalize)
+{
+	if(path[0] == '/')
+		return lookupAbsolute(path, normalize);
+
+	return lookupComponents(baseNode, path, normalize);
+}
+
+/**
+ * Walk the components of path starting at baseNode and add missing nodes.
+ */
+PathTreeNode* PathTree::lookupComponents(PathTreeNode* baseNode, const char* path, bool normalize)
+{
+	struct Component
+	{
+		const char* name;
+		size_t nameLen;
+	};
+
+	/* with normalization, ".." needs to remove the previous component, so collect all components
+		first to add only nodes that are part of the final path */
+	static thread_local std::vector<Component> components;
+
+	components.clear();
+
+	PathTreeNode* startNode = baseNode;
+
+	for(const char* componentStart = path; ; )
+	{
+		const char* componentEnd = strchrnul(componentStart, '/');
+		size_t componentLen = componentEnd - componentStart;
+
+		// raw mode: "/a/" is components "a" and "", but "/" alone has no components
+		bool isRootOnly = !*componentEnd && !componentLen && (componentStart == path);
+
+		if(!normalize)
+		{
+			if(!isRootOnly)
+				components.push_back( {componentStart, componentLen} );
+		}
+		else
+		if( !componentLen || ( (componentLen == 1) && (componentStart[0] == '.') ) )
+		{ // skip "//" and "/./"
+		}
+		else
+		if( (componentLen == 2) && (componentStart[0] == '.') && (componentStart[1] == '.') )
+		{ // ".." removes previous component (and stays at root like the kernel)
+			if(!components.empty() )
+				components.pop_back();
+			else
+			if(startNode->parent)
+				startNode = startNode->parent;
+		}
+		else
+			components.push_back( {componentStart, componentLen} );
+
+		if(!*componentEnd)
+			break;
+
+		componentStart = componentEnd + 1;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	PathTreeNode* currentNode = startNode;
+
+	for(const Component& component : components)
+		currentNode = getOrAddChild(currentNode, component.name, component.nameLen);
+
+	currentNode->refCount++; // reference for caller
+
+	return currentNode;
+}
+
+/**
+ * Find or add a child node. Caller must hold the mutex.
+ */
+PathTreeNode* PathTree::getOrAddChild(PathTreeNode* parent, const char* name, size_t nameLen)
+{
+	PathTreeKey lookupKey = {parent, name, nameLen};
+
+	PathTreeNodeMap::const_iterator iter = nodeMap.find(lookupKey);
+
+	if(iter != nodeMap.end() )
+		return iter->second;
+
+	PathTreeNode* child = new PathTreeNode();
+
+	child->parent = parent;
+	child->name.assign(name, nameLen);
+	child->pathLen = parent->pathLen + ( (parent == &root) ? 0 : 1) + nameLen;
+
+	parent->refCount++; // reference of child
+
+	// key name points to the node's own copy, which is immutable
+	nodeMap.emplace(PathTreeKey{parent, child->name.c_str(), nameLen}, child);
+
+	return child;
+}
+
+/**
+ * Add a reference to a node, of which the caller already holds a reference.
+ */
+void PathTree::acquire(PathTreeNode* node)
+{
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	node->refCount++;
+}
+
+/**
+ * Give back a reference. Nodes without references get deleted, which releases the reference to the
+ * parent node.
+ */
+void PathTree::release(PathTreeNode* node)
+{
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	releaseUnlocked(node);
+}
+
+void PathTree::releaseUnlocked(PathTreeNode* node)
+{
+	while(node && !--node->refCount)
+	{
+		PathTreeNode* parent = node->parent;
+
+		nodeMap.erase(PathTreeKey{parent, node->name.c_str(), node->name.length()} );
+
+		delete node;
+
+		node = parent;
+	}
+}
+
+/**
+ * Get the full path of a node.
+ *
+ * @node the caller needs to hold a reference.
+ * @return thread-local buffer, which is only valid until the next call in the same thread.
+ */
+const std::string& PathTree::materialize(const PathTreeNode* node)
+{
+	static thread_local std::string pathBuf;
+
+	pathBuf.resize(node->pathLen); // buffer capacity is kept across calls
+
+	// fill from the end, because we walk from the leaf up to root
+
+	char* bufPos = &pathBuf[0] + node->pathLen;
+
+	for( ; node->parent; node = node->parent)
+	{
+		bufPos -= node->name.length();
+		memcpy(bufPos, node->name.data(), node->name.length() );
+
+		if(node->parent->parent)
+			*--bufPos = '/'; // separator, except for children of root
+	}
+
+	pathBuf[0] = '/'; // root
+
+	return pathBuf;
+}
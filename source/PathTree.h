@@ -0,0 +1,104 @@
+#ifndef PATHTREE_H_
+#define PATHTREE_H_
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Common.h"
+
+
+/**
+ * A path component. The full path of a node is only materialized on demand (see
+ * PathTree::materialize() ), so that fds of the same dir tree share the memory of their common
+ * parent dirs.
+ *
+ * Nodes are immutable after creation, except for refCount.
+ */
+class PathTreeNode
+{
+	public:
+		PathTreeNode* parent; // NULL for root
+		std::string name;
+		size_t pathLen; // length of the materialized full path
+		unsigned refCount{0}; // number of children plus external references; protected by tree mutex
+};
+
+/**
+ * Key of a child in the tree: parent node and name. The name is not owned by the key, so that
+ * lookups don't need a string copy.
+ */
+class PathTreeKey
+{
+	public:
+		const PathTreeNode* parent;
+		const char* name;
+		size_t nameLen;
+
+		bool operator==(const PathTreeKey& other) const
+		{
+			return (parent == other.parent) && (nameLen == other.nameLen) &&
+				!memcmp(name, other.name, nameLen);
+		}
+};
+
+class PathTreeKeyHash
+{
+	public:
+		size_t operator()(const PathTreeKey& key) const;
+};
+
+typedef std::unordered_map<PathTreeKey, PathTreeNode*, PathTreeKeyHash> PathTreeNodeMap;
+
+
+/**
+ * Interned tree of the paths of tracked fds. Each path is a reference-counted node, which references
+ * its parent dir node.
+ *
+ * With normalization, "." and empty components (as in "//") are skipped and ".." is resolved
+ * lexically. Without normalization, all components are kept as they are, so that the materialized
+ * path is the same string that was looked up.
+ */
+class PathTree
+{
+	public:
+		PathTree();
+		~PathTree();
+
+		PathTreeNode* lookupAbsolute(const char* path, bool normalize);
+		PathTreeNode* lookupRelative(PathTreeNode* baseNode, const char* path, bool normalize);
+		void acquire(PathTreeNode* node);
+		void release(PathTreeNode* node);
+
+		static const std::string& materialize(const PathTreeNode* node);
+
+	private:
+		PathTreeNode root;
+		PathTreeNodeMap nodeMap; // all nodes except root
+		std::mutex mutex;
+
+		PathTreeNode* lookupComponents(PathTreeNode* baseNode, const char* path, bool normalize);
+		PathTreeNode* getOrAddChild(PathTreeNode* parent, const char* name, size_t nameLen);
+		void releaseUnlocked(PathTreeNode* node);
+
+
+		// inliners
+	public:
+		const PathTreeNode* getRoot() const
+		{
+			return &root;
+		}
+
+		/**
+		 * @return number of nodes (excluding root).
+		 */
+		size_t size()
+		{
+			std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+			return nodeMap.size();
+		}
+};
+
+extern PathTree* pathTree;
+
+#endif /* PATHTREE_H_ */
@@ -0,0 +1,174 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "FDStore.h"
+#include "Logger.h"
+#include "Prealloc.h"
+#include "Probes.h"
+
+std::atomic<bool> PreallocTk::isActive(false);
+
+
+/**
+ * Called after a file was opened with O_CREAT for writing and its path matched a rule. Does
+ * nothing if neither the rule nor the I/O profile ask for preallocation.
+ *
+ * @path for logging.
+ * @preallocExtent "prealloc=" of the rule; 0 for none.
+ * @expectedSize "expectsize=" of the rule or learned size from the I/O profile; 0 for none.
+ */
+void PreallocTk::initAfterCreate(int fd, const char* path, uint64_t preallocExtent,
+	uint64_t expectedSize)
+{
+	if(!preallocExtent && !expectedSize)
+		return;
+
+	uint64_t preallocEnd = 0;
+
+	if(expectedSize)
+	{
+		int savedErrno = errno;
+
+		int fallocRes = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expectedSize);
+		int fallocErrno = (fallocRes == -1) ? errno : 0;
+
+		errno = savedErrno;
+
+		PROBE(prealloc, fd, 0L, (long)expectedSize, fallocErrno);
+
+		if(libLogTopics & ENV_LOG_TOPIC_PREALLOC)
+			log_fprintf(stderr, LOG_PREFIX "Preallocating expected size. "
+				"fd: %d; path: %s; size: %llu; result: %s\n",
+				fd, path, (unsigned long long)expectedSize,
+				fallocErrno ? strerror(fallocErrno) : "success");
+
+		if(fallocErrno)
+			return; // fallocate not supported, so no use trying again later
+
+		preallocEnd = expectedSize;
+	}
+
+	fdStore->setPrealloc(fd, preallocExtent, preallocEnd);
+
+	isActive.store(true, std::memory_order_relaxed);
+}
+
+/**
+ * Preallocate the next extent if the given write comes close to the preallocated end of its fd.
+ * Called before write()-style operations.
+ *
+ * @offset file offset of the write; -1 for the current file position (write(), writev() ).
+ */
+void PreallocTk::extendBeforeWrite(int fd, off64_t offset, size_t count)
+{
+	if(offset == -1)
+	{ // only do the lseek if the fd is preallocating
+		uint64_t preallocExtent;
+		uint64_t preallocEnd;
+
+		if(!fdStore->getPrealloc(fd, preallocExtent, preallocEnd) || !preallocExtent)
+			return;
+
+		int savedErrno = errno;
+
+		offset = lseek(fd, 0, SEEK_CUR);
+
+		errno = savedErrno;
+
+		if(offset == -1)
+			return; // e.g. a pipe
+	}
+
+	uint64_t fallocOffset;
+	uint64_t fallocLen;
+
+	if(!fdStore->reservePreallocRange(fd, offset, offset + count, fallocOffset, fallocLen) )
+		return;
+
+	int savedErrno = errno;
+
+	int fallocRes = fallocate(fd, FALLOC_FL_KEEP_SIZE, fallocOffset, fallocLen);
+	int fallocErrno = (fallocRes == -1) ? errno : 0;
+
+	errno = savedErrno;
+
+	PROBE(prealloc, fd, (long)fallocOffset, (long)fallocLen, fallocErrno);
+
+	if(libLogTopics & ENV_LOG_TOPIC_PREALLOC)
+		log_fprintf(stderr, LOG_PREFIX "Preallocating ahead of write. "
+			"fd: %d; offset: %llu; len: %llu; result: %s\n",
+			fd, (unsigned long long)fallocOffset, (unsigned long long)fallocLen,
+			fallocErrno ? strerror(fallocErrno) : "success");
+
+	if(fallocErrno && (fallocErrno != ENOSPC) )
+		fdStore->disablePrealloc(fd); // e.g. EOPNOTSUPP, so no use trying again
+}
+
+/**
+ * Punch out the space that was preallocated beyond the end of the file. Called before close, after
+ * the fd was removed from the fdStore (which also closes its split fds).
+ *
+ * @preallocEnd file offset up to which the fd preallocated.
+ */
+void PreallocTk::trimBeforeClose(int fd, uint64_t preallocEnd)
+{
+	int savedErrno = errno; // close() must not return with errno of our internal calls
+
+	/* a write lease can only be taken if no other fd has the file open. a conflicting open while we
+		hold the lease would send us SIGIO, which terminates the process by default, so use a
+		signal that is ignored by default. */
+
+	int origLeaseSignal = fcntl(fd, F_GETSIG);
+
+	fcntl(fd, F_SETSIG, SIGURG);
+
+	int leaseRes = fcntl(fd, F_SETLEASE, F_WRLCK);
+
+	if(leaseRes == -1)
+	{
+		int leaseErrno = errno;
+
+		fcntl(fd, F_SETSIG, origLeaseSignal);
+
+		PROBE(prealloc_trim, fd, (long)preallocEnd, 0L, leaseErrno);
+
+		if(libLogTopics & ENV_LOG_TOPIC_PREALLOC)
+			log_fprintf(stderr, LOG_PREFIX "Skipping trim of preallocated space, as file might "
+				"be open elsewhere. fd: %d; reason: %s\n", fd, strerror(leaseErrno) );
+
+		errno = savedErrno;
+		return;
+	}
+
+	struct stat statBuf;
+	int trimErrno = 0;
+	uint64_t trimLen = 0;
+
+	if(fstat(fd, &statBuf) == -1)
+		trimErrno = errno;
+	else
+	if(preallocEnd > (uint64_t)statBuf.st_size)
+	{
+		trimLen = preallocEnd - statBuf.st_size;
+
+		int punchRes = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			statBuf.st_size, trimLen);
+
+		if(punchRes == -1)
+			trimErrno = errno;
+	}
+
+	fcntl(fd, F_SETLEASE, F_UNLCK);
+	fcntl(fd, F_SETSIG, origLeaseSignal);
+
+	PROBE(prealloc_trim, fd, (long)(preallocEnd - trimLen), (long)trimLen, trimErrno);
+
+	if(libLogTopics & ENV_LOG_TOPIC_PREALLOC)
+		log_fprintf(stderr, LOG_PREFIX "Trimming preallocated space. "
+			"fd: %d; offset: %llu; len: %llu; result: %s\n",
+			fd, (unsigned long long)(preallocEnd - trimLen), (unsigned long long)trimLen,
+			trimErrno ? strerror(trimErrno) : "success");
+
+	errno = savedErrno;
+}
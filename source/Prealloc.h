@@ -0,0 +1,64 @@
+#ifndef PREALLOC_H_
+#define PREALLOC_H_
+
+#include <atomic>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "Common.h"
+#include "PathMatchImage.h"
+
+
+/**
+ * Toolkit to preallocate disk space for newly created files of path file rules with "prealloc=" or
+ * "expectsize=" option, so that extending writes don't need to allocate blocks and files end up less
+ * fragmented.
+ *
+ * Preallocation uses fallocate(FALLOC_FL_KEEP_SIZE), so the file size that readers see is only
+ * changed by the actual writes. "expectsize=" preallocates on creation, "prealloc=" preallocates
+ * another extent whenever a write comes within half an extent of the preallocated end. Space that
+ * was preallocated beyond the end of the file gets trimmed on close, but only if no other process
+ * has the file open (checked via a write lease), because a concurrent writer might just be writing
+ * into this range.
+ */
+class PreallocTk
+{
+	public:
+		static void initAfterCreate(int fd, const char* path, uint64_t preallocExtent,
+			uint64_t expectedSize);
+		static void extendBeforeWrite(int fd, off64_t offset, size_t count);
+		static void trimBeforeClose(int fd, uint64_t preallocEnd);
+
+	private:
+		PreallocTk() {}
+
+		static std::atomic<bool> isActive; // true after first fd with preallocation was created
+
+
+		// inliners
+	public:
+		/**
+		 * @return true if any fd might have preallocation enabled, so that writes and closes
+		 * 		without preallocation don't need to check the fdStore.
+		 */
+		static bool getIsActive()
+		{
+			return isActive.load(std::memory_order_relaxed);
+		}
+
+		/**
+		 * Same as extendBeforeWrite() for vectored writes.
+		 */
+		static void extendBeforeWriteIOV(int fd, off64_t offset, const struct iovec* iov,
+			int iovcnt)
+		{
+			size_t count = 0;
+
+			for(int i=0; i < iovcnt; i++)
+				count += iov[i].iov_len;
+
+			extendBeforeWrite(fd, offset, count);
+		}
+};
+
+
+#endif /* PREALLOC_H_ */
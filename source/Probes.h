@@ -0,0 +1,49 @@
+#ifndef PROBES_H_
+#define PROBES_H_
+
+/**
+ * USDT (user-level statically defined tracing) probes to trace the decisions of the lib in live
+ * processes, e.g. with bpftrace:
+ * 		bpftrace -e 'usdt:/usr/lib/libvastpreload.so:vastpreload:inject_skip
+ * 			{ printf("%d %s %s\n", arg0, str(arg1), str(arg3) ); }'
+ *
+ * A probe is a single nop in the code (plus an ELF note) when no tracer is attached. Probes compile
+ * to nothing if <sys/sdt.h> (from systemtap-sdt-dev/systemtap-sdt-devel) is not available or if
+ * BUILD_NO_PROBES is defined.
+ *
+ * Probes and their arguments:
+ * 		intercept_entry(const char* func, int fd, const char* path) - fd -1 or path NULL if unknown
+ * 		intercept_exit(const char* func, int fd, long result)
+ * 		inject(int fd, const char* path, int flags) - O_DIRECT was added to the fd
+ * 		inject_skip(int fd, const char* path, int flags, const char* reason)
+ * 		inject_fail(int fd, const char* path, int flags, int errno) - fcntl(F_SETFL) failed
+ * 		eject(int fd, const char* path, int flags) - O_DIRECT removed after EINVAL
+ * 		sync(int fd, int isDataSync, const char* action) - action: "skip", "downgrade", "sync"
+ * 		split(int fd, size_t count, int numFDs) - read/write gets split
+ * 		split_fallback(int fd, int errno) - extra fds could not be opened, fd won't be split
+ * 		prealloc(int fd, long offset, long len, int errno) - fallocate ahead of writes
+ * 		prealloc_trim(int fd, long offset, long len, int errno) - preallocation beyond EOF punched
+ * 			out on close; errno of the lease check if file might be open elsewhere
+ * 		coalesce(int fd, int iovcnt, size_t count) - misaligned iovecs go through bounce buffer
+ * 		aio_resubmit(int fd, int opcode, long result) - AIO iocb resubmitted after EINVAL completion
+ * 		dirfd_resolve(int dirfd, const char* path) - unknown openat dirfd resolved via /proc
+ * 		throttle(int fd, size_t count, long waitNSec) - read/write delayed by "bw=" or "iops=" limit
+ * 		mmap_direct(int fd, size_t length, long offset) - read-only mmap served from direct reads
+ */
+
+#if defined(__has_include) && !defined(BUILD_NO_PROBES)
+	#if __has_include(<sys/sdt.h>)
+		#include <sys/sdt.h>
+		#define PROBES_ENABLED
+	#endif
+#endif
+
+
+#ifdef PROBES_ENABLED
+	#define PROBE(name, ...)		STAP_PROBEV(vastpreload, name, ##__VA_ARGS__)
+#else
+	#define PROBE(name, ...)		do {} while(0)
+#endif
+
+
+#endif /* PROBES_H_ */
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include "FDStore.h"
+#include "Logger.h"
+#include "Profile.h"
+#include "RealFuncs.h"
+#include "Stats.h"
+
+char* ProfileTk::learnPath = NULL;
+std::mutex ProfileTk::learnMutex;
+ProfileFileMap* ProfileTk::learnFiles = NULL;
+ProfilePolicyMap* ProfileTk::applyPolicies = NULL;
+
+
+/**
+ * Enable learn mode. Must be called before any fd gets opened.
+ *
+ * @profilePath path of profile file to write on exit; STATS_PATH_PID_PLACEHOLDER gets replaced by
+ * 		the pid, as for the stats file.
+ */
+void ProfileTk::initLearn(const char* profilePath)
+{
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	learnFiles = new ProfileFileMap();
+
+	learnPath = strdup(profilePath);
+}
+
+/**
+ * Enable apply mode by loading a profile file. Multiple profile files (e.g. of different processes)
+ * can be concatenated into a single file, in which case the counters of the same path get summed up.
+ *
+ * @return false if the file could not be read or contains invalid lines; details get logged. A
+ * 		missing file is not an error (e.g. on the first run with the same file for learn and apply).
+ */
+bool ProfileTk::initApply(const char* profilePath)
+{
+	FILE* profileFile = fopen(profilePath, "r");
+	if(!profileFile && (errno == ENOENT) )
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Profile file does not exist yet: %s\n", profilePath);
+
+		return true;
+	}
+
+	if(!profileFile)
+	{
+		log_fprintf(stderr, LOG_PREFIX "Opening profile file failed: %s; Error: %s\n",
+			profilePath, strerror(errno) );
+		return false;
+	}
+
+	std::unordered_map<std::string, ProfileCounters> fileCounters;
+	std::unordered_map<std::string, ProfileCounters> dirCounters; // with trailing "/"
+
+	char* line = NULL;
+	size_t lineBufLen = 0;
+	unsigned lineNum = 0;
+	bool parseRes = true;
+
+	while(getline(&line, &lineBufLen, profileFile) != -1)
+	{
+		lineNum++;
+
+		if( (line[0] == '#') || (line[0] == '\n') || !line[0] )
+			continue;
+
+		ProfileCounters counters;
+		std::string path;
+
+		parseRes = parseProfileLine(line, counters, path);
+		if(!parseRes)
+		{
+			log_fprintf(stderr, LOG_PREFIX "Invalid line in profile file: %s; Line: %u\n",
+				profilePath, lineNum);
+			break;
+		}
+
+		ProfileCounters& fileSum = fileCounters[path]; // zero-initialized if new
+		addCounters(fileSum, counters);
+
+		ProfileCounters& dirSum = dirCounters[path.substr(0, path.rfind('/') + 1)];
+		addCounters(dirSum, counters);
+	}
+
+	free(line);
+	fclose(profileFile);
+
+	if(!parseRes)
+		return false;
+
+	ProfilePolicyMap* policies = new ProfilePolicyMap();
+
+	for(const auto& fileIter : fileCounters)
+		(*policies)[fileIter.first] = choosePolicy(fileIter.second);
+
+	for(const auto& dirIter : dirCounters)
+		(*policies)[dirIter.first] = choosePolicy(dirIter.second);
+
+	if(libLogTopics & ENV_LOG_TOPIC_PROFILE)
+		for(const auto& policyIter : *policies)
+			log_fprintf(stderr, LOG_PREFIX "Profile policy. path: %s; buffered: %d; "
+				"readahead: %s; expectsize: %llu\n", policyIter.first.c_str(),
+				(policyIter.second.flags & PROFILE_POLICY_BUFFERED) ? 1 : 0,
+				(policyIter.second.flags & PROFILE_POLICY_SEQUENTIAL) ? "sequential" :
+				(policyIter.second.flags & PROFILE_POLICY_RANDOM) ? "random" : "default",
+				(unsigned long long)policyIter.second.expectedSize);
+
+	applyPolicies = policies;
+
+	return true;
+}
+
+/**
+ * Start counting the reads and writes of a newly opened fd that matched a path file rule.
+ */
+void ProfileTk::learnAfterOpen(int fd, const std::string& path)
+{
+	ProfileFile* file;
+
+	{
+		std::unique_lock<std::mutex> lock(learnMutex); // L O C K (scoped)
+
+		ProfileFile*& mapFile = (*learnFiles)[path];
+
+		if(!mapFile)
+			mapFile = new ProfileFile();
+
+		file = mapFile;
+	}
+
+	file->counters[PROFILE_COUNTER_OPENS].fetch_add(1, std::memory_order_relaxed);
+
+	fdStore->setProfileFile(fd, file);
+}
+
+/**
+ * Count a read/write. Does nothing for fds that are not being learned.
+ *
+ * @buf NULL if alignment of the buffer doesn't matter (e.g. vectored I/O, which gets coalesced).
+ * @count requested bytes.
+ * @offset -1 for the current file position.
+ * @ioRes result of the read/write.
+ */
+void ProfileTk::learnIO(int fd, const void* buf, size_t count, off64_t offset, ssize_t ioRes,
+	bool isWrite)
+{
+	const size_t numDone = (ioRes > 0) ? ioRes : 0;
+
+	ProfileFile* file;
+	uint64_t ioOffset;
+	bool isSequential;
+
+	if(!fdStore->advanceProfileOffset(fd, offset, numDone, file, ioOffset, isSequential) ||
+		!file)
+		return;
+
+	std::atomic<uint64_t>* counters = file->counters;
+
+	counters[isWrite ? PROFILE_COUNTER_WRITES : PROFILE_COUNTER_READS].fetch_add(1,
+		std::memory_order_relaxed);
+	counters[isWrite ? PROFILE_COUNTER_WRITEBYTES : PROFILE_COUNTER_READBYTES].fetch_add(numDone,
+		std::memory_order_relaxed);
+
+	if(isSequential)
+		counters[PROFILE_COUNTER_SEQOPS].fetch_add(1, std::memory_order_relaxed);
+
+	if( (count | ioOffset | (uintptr_t)buf) & (PROFILE_ALIGN - 1) )
+		counters[PROFILE_COUNTER_UNALIGNED].fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t endOffset = ioOffset + numDone;
+	uint64_t oldEndOffset = counters[PROFILE_COUNTER_ENDOFFSET].load(std::memory_order_relaxed);
+
+	while( (endOffset > oldEndOffset) &&
+		!counters[PROFILE_COUNTER_ENDOFFSET].compare_exchange_weak(oldEndOffset, endOffset,
+			std::memory_order_relaxed) )
+		; // another thread changed the end offset, so check again
+}
+
+/**
+ * Count the removal of O_DIRECT after an EINVAL error.
+ */
+void ProfileTk::learnEject(int fd)
+{
+	ProfileFile* file;
+
+	if(!fdStore->getProfileFile(fd, file) || !file)
+		return;
+
+	file->counters[PROFILE_COUNTER_EJECTS].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Get the policy of the given path from the loaded profile. Falls back to the policy of the parent
+ * directory for paths that are not in the profile.
+ *
+ * @return false if neither the path nor its parent directory are in the profile.
+ */
+bool ProfileTk::getPolicy(const std::string& path, ProfilePolicy& outPolicy)
+{
+	ProfilePolicyMap::const_iterator iter = applyPolicies->find(path);
+
+	if(iter == applyPolicies->end() )
+		iter = applyPolicies->find(path.substr(0, path.rfind('/') + 1) );
+
+	if(iter == applyPolicies->end() )
+		return false;
+
+	outPolicy = iter->second;
+
+	return true;
+}
+
+/**
+ * Apply the readahead hint of a policy to a newly opened fd. O_DIRECT and buffered decision and
+ * preallocation are left to the caller.
+ *
+ * @path for logging.
+ */
+void ProfileTk::applyAfterOpen(int fd, const char* path, const ProfilePolicy& policy)
+{
+	int advice;
+
+	if(policy.flags & PROFILE_POLICY_SEQUENTIAL)
+		advice = POSIX_FADV_SEQUENTIAL;
+	else
+	if(policy.flags & PROFILE_POLICY_RANDOM)
+		advice = POSIX_FADV_RANDOM;
+	else
+		return;
+
+	// returns the error instead of setting errno
+	int adviseRes = posix_fadvise(fd, 0, 0, advice);
+
+	if(libLogTopics & ENV_LOG_TOPIC_PROFILE)
+		log_fprintf(stderr, LOG_PREFIX "Applying profile readahead hint. fd: %d; path: %s; "
+			"readahead: %s; result: %s\n", fd, path,
+			(advice == POSIX_FADV_SEQUENTIAL) ? "sequential" : "random",
+			adviseRes ? strerror(adviseRes) : "success");
+}
+
+/**
+ * Write the learned counters to the profile file. Called on process exit. Paths without any reads
+ * or writes (e.g. only opened for stat) are left out.
+ *
+ * The file gets written under a temporary name and then renamed, so that a concurrent run in apply
+ * mode never sees a partial file.
+ */
+void ProfileTk::writeProfile()
+{
+	if(!learnPath)
+		return;
+
+	std::string profilePath = StatsTk::replacePIDPlaceholder(learnPath);
+	std::string tmpPath = profilePath + ".tmp." + std::to_string(getpid() );
+
+	int fd = RealFuncs::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd == -1)
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			dprintf(STDERR_FILENO, LOG_PREFIX "Opening profile file failed: %s; Error: %s\n",
+				tmpPath.c_str(), strerror(errno) );
+		return;
+	}
+
+	dprintf(fd, PROFILE_FILE_HEADER "\n");
+	dprintf(fd, "# opens reads writes read_bytes write_bytes seq_ops unaligned_ops ejects "
+		"end_offset path\n");
+
+	std::unique_lock<std::mutex> lock(learnMutex); // L O C K (scoped)
+
+	std::vector<const ProfileFileMap::value_type*> sortedFiles; // sorted for diffable profiles
+
+	for(const auto& fileIter : *learnFiles)
+		sortedFiles.push_back(&fileIter);
+
+	std::sort(sortedFiles.begin(), sortedFiles.end(),
+		[](const ProfileFileMap::value_type* a, const ProfileFileMap::value_type* b)
+		{ return a->first < b->first; } );
+
+	for(const ProfileFileMap::value_type* file : sortedFiles)
+	{
+		const std::atomic<uint64_t>* counters = file->second->counters;
+
+		if(!counters[PROFILE_COUNTER_READS].load(std::memory_order_relaxed) &&
+			!counters[PROFILE_COUNTER_WRITES].load(std::memory_order_relaxed) )
+			continue;
+
+		for(unsigned counter = 0; counter < PROFILE_NUM_COUNTERS; counter++)
+			dprintf(fd, "%llu ",
+				(unsigned long long)counters[counter].load(std::memory_order_relaxed) );
+
+		dprintf(fd, "%s\n", file->first.c_str() );
+	}
+
+	RealFuncs::close(fd);
+
+	if(rename(tmpPath.c_str(), profilePath.c_str() ) == -1)
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			dprintf(STDERR_FILENO, LOG_PREFIX "Renaming profile file failed: %s; Error: %s\n",
+				profilePath.c_str(), strerror(errno) );
+
+		unlink(tmpPath.c_str() );
+	}
+}
+
+/**
+ * Parse a line of counters and path as written by writeProfile().
+ *
+ * @return false if the line is invalid.
+ */
+bool ProfileTk::parseProfileLine(const char* line, ProfileCounters& outCounters,
+	std::string& outPath)
+{
+	const char* currentPos = line;
+
+	for(unsigned counter = 0; counter < PROFILE_NUM_COUNTERS; counter++)
+	{
+		char* endPtr;
+
+		outCounters.counters[counter] = strtoull(currentPos, &endPtr, 10);
+
+		if( (endPtr == currentPos) || (*endPtr != ' ') )
+			return false;
+
+		currentPos = endPtr + 1;
+	}
+
+	if(*currentPos != '/')
+		return false;
+
+	outPath = currentPos;
+
+	if(outPath.back() == '\n')
+		outPath.pop_back();
+
+	return true;
+}
+
+/**
+ * Add counters to a sum, except for the end offset, which is the max.
+ */
+void ProfileTk::addCounters(ProfileCounters& sum, const ProfileCounters& counters)
+{
+	for(unsigned counter = 0; counter < PROFILE_NUM_COUNTERS; counter++)
+		if(counter == PROFILE_COUNTER_ENDOFFSET)
+			sum.counters[counter] = std::max(sum.counters[counter], counters.counters[counter]);
+		else
+			sum.counters[counter] += counters.counters[counter];
+}
+
+/**
+ * Choose the policy for a path or directory based on its learned counters:
+ * - Buffered if O_DIRECT got ejected before, if most reads/writes were misaligned or small (the page
+ * 		cache does better there) or if a read-only file got reopened and fits into the page cache.
+ * - Readahead hint if the reads were mostly sequential or mostly random.
+ * - Preallocation of the learned size if the file was written sequentially.
+ */
+ProfilePolicy ProfileTk::choosePolicy(const ProfileCounters& counters)
+{
+	const uint64_t* values = counters.counters;
+	const uint64_t numOps = values[PROFILE_COUNTER_READS] + values[PROFILE_COUNTER_WRITES];
+
+	ProfilePolicy policy = {0, 0};
+
+	if(!numOps)
+		return policy;
+
+	const uint64_t avgSize =
+		(values[PROFILE_COUNTER_READBYTES] + values[PROFILE_COUNTER_WRITEBYTES]) / numOps;
+	const uint64_t seqPercent = (values[PROFILE_COUNTER_SEQOPS] * 100) / numOps;
+
+	const bool isReread = (values[PROFILE_COUNTER_OPENS] > 1) &&
+		!values[PROFILE_COUNTER_WRITES] &&
+		(values[PROFILE_COUNTER_ENDOFFSET] <= PROFILE_MAX_REREAD_SIZE);
+
+	if(values[PROFILE_COUNTER_EJECTS] || ( (values[PROFILE_COUNTER_UNALIGNED] * 2) > numOps) ||
+		(avgSize < PROFILE_MIN_DIRECT_SIZE) || isReread)
+		policy.flags |= PROFILE_POLICY_BUFFERED;
+
+	if(values[PROFILE_COUNTER_READS] && (seqPercent >= PROFILE_SEQ_PERCENT) )
+		policy.flags |= PROFILE_POLICY_SEQUENTIAL;
+	else
+	if(values[PROFILE_COUNTER_READS] && (seqPercent <= PROFILE_RANDOM_PERCENT) )
+		policy.flags |= PROFILE_POLICY_RANDOM;
+
+	if(values[PROFILE_COUNTER_WRITES] && (seqPercent >= PROFILE_SEQ_PERCENT) )
+		policy.expectedSize = values[PROFILE_COUNTER_ENDOFFSET];
+
+	return policy;
+}
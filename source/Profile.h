@@ -0,0 +1,131 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <atomic>
+#include <mutex>
+#include <sys/uio.h>
+#include <unordered_map>
+#include "Common.h"
+
+
+#define PROFILE_FILE_HEADER			"# " LIB_NAME " profile v1"
+#define PROFILE_ALIGN				4096 // reads/writes not aligned to this would fail with O_DIRECT
+#define PROFILE_MIN_DIRECT_SIZE		(64*1024) // smaller avg read/write size => stay buffered
+#define PROFILE_SEQ_PERCENT			80 // min percentage of sequential ops for sequential policy
+#define PROFILE_RANDOM_PERCENT		20 // max percentage of sequential ops for random policy
+#define PROFILE_MAX_REREAD_SIZE		(1024ULL*1024*1024) // max size of reread files to keep buffered
+
+#define PROFILE_COUNTER_OPENS		0 // times the file was opened
+#define PROFILE_COUNTER_READS		1 // read()-style ops
+#define PROFILE_COUNTER_WRITES		2 // write()-style ops
+#define PROFILE_COUNTER_READBYTES	3 // bytes read
+#define PROFILE_COUNTER_WRITEBYTES	4 // bytes written
+#define PROFILE_COUNTER_SEQOPS		5 // ops that started where the previous op of the fd ended
+#define PROFILE_COUNTER_UNALIGNED	6 // ops with offset, length or buffer not aligned for O_DIRECT
+#define PROFILE_COUNTER_EJECTS		7 // O_DIRECT removed after EINVAL
+#define PROFILE_COUNTER_ENDOFFSET	8 // max end offset of a read/write (max instead of sum)
+#define PROFILE_NUM_COUNTERS		9
+
+#define PROFILE_POLICY_BUFFERED		1 // don't inject O_DIRECT
+#define PROFILE_POLICY_SEQUENTIAL	2 // reads with POSIX_FADV_SEQUENTIAL (more readahead)
+#define PROFILE_POLICY_RANDOM		4 // reads with POSIX_FADV_RANDOM (no readahead)
+
+
+/**
+ * Learn mode counters of a file path. Shared by all fds of the path.
+ */
+class ProfileFile
+{
+	public:
+		std::atomic<uint64_t> counters[PROFILE_NUM_COUNTERS] {};
+};
+
+/**
+ * Counters of a file path or directory as read from a profile file.
+ */
+struct ProfileCounters
+{
+	uint64_t counters[PROFILE_NUM_COUNTERS];
+};
+
+/**
+ * Policy of a file path or directory, chosen from the counters of a profile file.
+ */
+struct ProfilePolicy
+{
+	int flags; // PROFILE_POLICY_...
+	uint64_t expectedSize; // size to preallocate when the file gets created; 0 for none
+};
+
+typedef std::unordered_map<std::string, ProfileFile*> ProfileFileMap;
+typedef std::unordered_map<std::string, ProfilePolicy> ProfilePolicyMap;
+
+
+/**
+ * Toolkit for recorded I/O profiles (see ENV_LIB_PROFILE_LEARN and ENV_LIB_PROFILE_APPLY).
+ *
+ * In learn mode, the reads and writes of fds that matched a path file rule get counted per path and
+ * the counters get written to the profile file on process exit.
+ *
+ * In apply mode, a profile file gets loaded on init and a policy gets chosen for each path from its
+ * counters, so that the next run of the same job doesn't need to rediscover e.g. that a file gets
+ * read with small misaligned requests and thus ends up with O_DIRECT ejection anyways. Counters also
+ * get summed up per parent directory, which provides the policy for new files in a directory (e.g.
+ * with a date in their name).
+ */
+class ProfileTk
+{
+	public:
+		static void initLearn(const char* profilePath);
+		static bool initApply(const char* profilePath);
+		static void learnAfterOpen(int fd, const std::string& path);
+		static void learnIO(int fd, const void* buf, size_t count, off64_t offset, ssize_t ioRes,
+			bool isWrite);
+		static void learnEject(int fd);
+		static bool getPolicy(const std::string& path, ProfilePolicy& outPolicy);
+		static void applyAfterOpen(int fd, const char* path, const ProfilePolicy& policy);
+		static void writeProfile();
+
+	private:
+		ProfileTk() {}
+
+		static char* learnPath; // strdup'ed; NULL if not learning
+		static std::mutex learnMutex; // for learnFiles
+		static ProfileFileMap* learnFiles; // path => counters; never deleted, as I/O might continue
+		static ProfilePolicyMap* applyPolicies; // path (dirs with trailing "/") => policy
+
+		static bool parseProfileLine(const char* line, ProfileCounters& outCounters,
+			std::string& outPath);
+		static void addCounters(ProfileCounters& sum, const ProfileCounters& counters);
+		static ProfilePolicy choosePolicy(const ProfileCounters& counters);
+
+
+		// inliners
+	public:
+		static bool getIsLearning()
+		{
+			return (learnPath != NULL);
+		}
+
+		static bool getIsApplying()
+		{
+			return (applyPolicies != NULL);
+		}
+
+		/**
+		 * Same as learnIO() for vectored reads/writes.
+		 */
+		static void learnIOV(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+			ssize_t ioRes, bool isWrite)
+		{
+			size_t count = 0;
+
+			for(int i=0; i < iovcnt; i++)
+				count += iov[i].iov_len;
+
+			learnIO(fd, NULL, count, offset, ioRes, isWrite);
+		}
+};
+
+
+#endif /* PROFILE_H_ */
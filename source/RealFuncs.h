@@ -0,0 +1,38 @@
+#ifndef REALFUNCS_H_
+#define REALFUNCS_H_
+
+#include <sys/types.h>
+#include "Common.h"
+
+
+#define REALFUNCS_TABLE_ALIGN	4096 // page alignment of the table of real functions (see protect() )
+
+
+/**
+ * Access to the real (i.e. not intercepted) libc functions for internal use of the library, e.g. to
+ * open files that should neither be tracked in the fdStore nor trigger injection.
+ *
+ * Implemented in Interceptors.cpp, where the real function pointers live. init() resolves all of
+ * them at lib init, so that the interceptors only look them up for calls before that. protect()
+ * makes the table of pointers read-only at the end of lib init.
+ */
+class RealFuncs
+{
+	public:
+		static void init();
+		static void protect();
+		static void* lookup(const char* funcName);
+
+		static int open(const char* path, int flags, mode_t mode = 0);
+		static int close(int fd);
+		static ssize_t read(int fd, void* buf, size_t count);
+		static ssize_t write(int fd, const void* buf, size_t count);
+		static ssize_t pread(int fd, void* buf, size_t count, off_t offset);
+		static ssize_t pwrite(int fd, const void* buf, size_t count, off_t offset);
+
+	private:
+		RealFuncs() {}
+};
+
+
+#endif /* REALFUNCS_H_ */
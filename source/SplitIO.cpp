@@ -0,0 +1,374 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <system_error>
+#include <thread>
+#include "FDStore.h"
+#include "Logger.h"
+#include "Numa.h"
+#include "Probes.h"
+#include "RealFuncs.h"
+#include "SplitIO.h"
+
+SplitIO* splitIO = NULL;
+
+
+/**
+ * Called in the child process after fork().
+ */
+static void splitIOAtForkChild()
+{
+	if(splitIO)
+		splitIO->resetAfterFork();
+}
+
+/**
+ * @chunkSize gets rounded up to a multiple of SPLITIO_CHUNK_ALIGN.
+ * @numExtraFDs number of fds that get opened per file in addition to the fd of the application.
+ * @threadNode NUMA node to pin the helper threads to; -1 for no pinning.
+ */
+SplitIO::SplitIO(uint64_t minSplitSize, uint64_t chunkSize, unsigned numThreads,
+	unsigned numExtraFDs, int threadNode) :
+	minSplitSize(minSplitSize), numThreads(numThreads), numExtraFDs(numExtraFDs),
+	threadNode(threadNode)
+{
+	this->chunkSize = chunkSize ?
+		(chunkSize + SPLITIO_CHUNK_ALIGN - 1) & ~(uint64_t)(SPLITIO_CHUNK_ALIGN - 1) :
+		SPLITIO_DEFAULT_CHUNK_SIZE;
+
+	queue = new SplitIOQueue();
+
+	pthread_atfork(NULL, NULL, splitIOAtForkChild);
+}
+
+/**
+ * Check if a read/write of the given size on the given fd should be split. Opens the extra fds of
+ * the file on first use.
+ *
+ * @outFDs the given fd followed by its extra fds, to be passed to the ...Split() methods.
+ * @return true if the read/write should be split.
+ */
+bool SplitIO::checkSplit(int fd, size_t count, IntVec& outFDs)
+{
+	if(count < minSplitSize)
+		return false;
+
+	int fdFlags;
+	IntVec splitFDs;
+
+	bool fdFound = fdStore->getSplitFDs(fd, fdFlags, splitFDs);
+
+	if(!fdFound || !(fdFlags & FDSTORE_FLAG_DIRECT) || (fdFlags & FDSTORE_FLAG_NOSPLIT) )
+		return false;
+
+	if(splitFDs.empty() && numExtraFDs && !openSplitFDs(fd, splitFDs) )
+		return false;
+
+	PROBE(split, fd, count, (int)splitFDs.size() + 1);
+
+	outFDs.reserve(splitFDs.size() + 1);
+	outFDs.push_back(fd);
+	outFDs.insert(outFDs.end(), splitFDs.begin(), splitFDs.end() );
+
+	return true;
+}
+
+/**
+ * Open the extra fds of the file of the given fd via /proc/self/fd and hand them over to the
+ * fdStore. If no extra fd can be opened (e.g. because the file mode doesn't allow it) then the fd
+ * gets marked as not splittable. If another thread is already opening the extra fds then this
+ * call doesn't split, and later calls use the fds of the other thread.
+ *
+ * @outFDs the extra fds.
+ * @return false if no extra fds are available.
+ */
+bool SplitIO::openSplitFDs(int fd, IntVec& outFDs)
+{
+	// note: O_CREAT, O_TRUNC etc. are not returned by F_GETFL, so this is safe for reopen
+	const int reopenFlagsMask = O_ACCMODE | O_DIRECT | O_NOATIME | O_SYNC | O_DSYNC | O_LARGEFILE;
+
+	if(!fdStore->claimSplitFDs(fd) )
+		return false;
+
+	int fdFlags = fcntl(fd, F_GETFL);
+	if(fdFlags == -1)
+	{
+		fdStore->updateFDFlags(fd, 0, FDSTORE_FLAG_SPLITOPEN);
+		return false;
+	}
+
+	std::string procPath = "/proc/self/fd/" + std::to_string(fd);
+	IntVec newFDs;
+
+	for(unsigned i=0; i < numExtraFDs; i++)
+	{
+		int newFD = RealFuncs::open(procPath.c_str(), (fdFlags & reopenFlagsMask) | O_CLOEXEC);
+		if(newFD == -1)
+		{
+			PROBE(split_fallback, fd, errno);
+
+			if(libLogTopics & ENV_LOG_TOPIC_SPLIT)
+				log_fprintf(stderr, LOG_PREFIX "Opening extra fd for split reads/writes failed. "
+					"fd: %d; error: %s\n", fd, strerror(errno) );
+
+			break;
+		}
+
+		newFDs.push_back(newFD);
+	}
+
+	if(!fdStore->setSplitFDs(fd, newFDs) )
+	{ // fd closed in the meantime (which released the app's record locks anyway)
+		for(int newFD : newFDs)
+			RealFuncs::close(newFD);
+
+		return false;
+	}
+
+	if(newFDs.empty() )
+		return false; // (fd got marked as not splittable by setSplitFDs)
+
+	if(libLogTopics & ENV_LOG_TOPIC_SPLIT)
+		log_fprintf(stderr, LOG_PREFIX "Opened extra fds for split reads/writes. "
+			"fd: %d; numExtraFDs: %zu\n", fd, newFDs.size() );
+
+	outFDs.swap(newFDs);
+
+	return true;
+}
+
+/**
+ * Split pread.
+ *
+ * @fds as returned by checkSplit().
+ * @return as pread, errno is set accordingly.
+ */
+ssize_t SplitIO::preadSplit(const IntVec& fds, void* buf, size_t count, off_t offset)
+{
+	return runJob(false, fds, buf, count, offset);
+}
+
+/**
+ * Split pwrite.
+ *
+ * @fds as returned by checkSplit().
+ * @return as pwrite, errno is set accordingly.
+ */
+ssize_t SplitIO::pwriteSplit(const IntVec& fds, const void* buf, size_t count, off_t offset)
+{
+	return runJob(true, fds, (void*)buf, count, offset);
+}
+
+/**
+ * Split the request into chunks, let the helper threads and the calling thread process them and
+ * assemble the results.
+ *
+ * Note: The chunks run concurrently, so if a chunk fails or is short then later chunks might
+ * already have been transferred, i.e. data beyond the returned count may have been read into buf
+ * or written to the file.
+ *
+ * @return as pread/pwrite (count of the contiguous prefix of complete chunks), errno is set
+ * 		accordingly.
+ */
+ssize_t SplitIO::runJob(bool isWrite, const IntVec& fds, void* buf, size_t count, off_t offset)
+{
+	SplitIOJobPtr job = std::make_shared<SplitIOJob>();
+
+	job->isWrite = isWrite;
+	job->buf = (char*)buf;
+	job->count = count;
+	job->offset = offset;
+	job->fds = fds;
+	job->chunkSize = chunkSize;
+
+	const uint64_t firstChunkLen =
+		std::min<uint64_t>(count, chunkSize - ( (uint64_t)offset % chunkSize) );
+
+	job->numChunks = 1 + ( (count - firstChunkLen) + chunkSize - 1) / chunkSize;
+	job->chunkResults.resize(job->numChunks, 0);
+	job->chunkErrnos.resize(job->numChunks, 0);
+
+	if(libLogTopics & ENV_LOG_TOPIC_SPLIT)
+		log_fprintf(stderr, LOG_PREFIX "Splitting %s. fd: %d; count: %zu; offset: %lld; "
+			"numChunks: %zu\n", isWrite ? "write" : "read", fds[0], count, (long long)offset,
+			job->numChunks);
+
+	if(job->numChunks > 1)
+	{ // hand over to helper threads
+		SplitIOQueue* currentQueue = queue;
+		unsigned numHelpers = std::min<size_t>(numThreads, job->numChunks - 1);
+
+		startThreads(currentQueue);
+
+		std::unique_lock<std::mutex> queueLock(currentQueue->mutex); // L O C K (scoped)
+
+		numHelpers = std::min(numHelpers, currentQueue->numThreads);
+
+		for(unsigned i=0; i < numHelpers; i++)
+			currentQueue->jobs.push_back(job);
+
+		queueLock.unlock(); // U N L O C K
+
+		if(numHelpers == 1)
+			currentQueue->jobsAvailableCondition.notify_one();
+		else
+		if(numHelpers)
+			currentQueue->jobsAvailableCondition.notify_all();
+	}
+
+	// calling thread processes chunks as well and waits for the rest
+
+	runChunks(*job);
+
+	{
+		std::unique_lock<std::mutex> jobLock(job->mutex); // L O C K (scoped)
+
+		while(job->numChunksDone < job->numChunks)
+			job->doneCondition.wait(jobLock);
+	}
+
+	// assemble result (contiguous prefix of completely processed chunks)
+
+	ssize_t totalRes = 0;
+
+	for(size_t i=0; i < job->numChunks; i++)
+	{
+		ssize_t chunkRes = job->chunkResults[i];
+
+		if(chunkRes == -1)
+		{
+			if(!totalRes)
+			{
+				errno = job->chunkErrnos[i];
+				return -1;
+			}
+
+			break;
+		}
+
+		totalRes += chunkRes;
+
+		off_t chunkOffset;
+		size_t chunkLen;
+
+		job->getChunkRange(i, chunkOffset, chunkLen);
+
+		if( (size_t)chunkRes < chunkLen)
+			break; // short read/write
+	}
+
+	return totalRes;
+}
+
+/**
+ * Start helper threads if not done yet. Failure to start a thread is not an error, because the
+ * calling thread processes the chunks of its job as well.
+ */
+void SplitIO::startThreads(SplitIOQueue* currentQueue)
+{
+	std::unique_lock<std::mutex> lock(currentQueue->mutex); // L O C K (scoped)
+
+	if(currentQueue->numThreads >= numThreads)
+		return;
+
+	// start all threads at once, so that this happens only once
+
+	try
+	{
+		while(currentQueue->numThreads < numThreads)
+		{
+			std::thread(threadLoop, currentQueue, threadNode).detach();
+
+			currentQueue->numThreads++;
+		}
+	}
+	catch(const std::system_error& e)
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_SPLIT)
+			log_fprintf(stderr, LOG_PREFIX "Starting helper thread for split reads/writes failed. "
+				"numThreads: %u; error: %s\n", currentQueue->numThreads, e.what() );
+
+		numThreads = currentQueue->numThreads; // don't try again
+	}
+}
+
+/**
+ * Main loop of a helper thread.
+ *
+ * @threadNode NUMA node to run on; -1 to run anywhere.
+ */
+void SplitIO::threadLoop(SplitIOQueue* queue, int threadNode)
+{
+	if( (threadNode != -1) && !NumaTk::bindThreadToNode(threadNode) &&
+		(libLogTopics & ENV_LOG_TOPIC_SPLIT) )
+		log_fprintf(stderr, LOG_PREFIX "Pinning helper thread for split reads/writes failed. "
+			"node: %d\n", threadNode);
+
+	// signals are for the application threads
+	sigset_t signalSet;
+	sigfillset(&signalSet);
+	pthread_sigmask(SIG_BLOCK, &signalSet, NULL);
+
+	for( ; ; )
+	{
+		SplitIOJobPtr job;
+
+		{
+			std::unique_lock<std::mutex> lock(queue->mutex); // L O C K (scoped)
+
+			while(queue->jobs.empty() )
+				queue->jobsAvailableCondition.wait(lock);
+
+			job = queue->jobs.front();
+
+			queue->jobs.pop_front();
+		}
+
+		runChunks(*job);
+	}
+}
+
+/**
+ * Pick and process chunks of the given job until none are left.
+ */
+void SplitIO::runChunks(SplitIOJob& job)
+{
+	for( ; ; )
+	{
+		size_t chunkIndex = job.nextChunk.fetch_add(1);
+
+		if(chunkIndex >= job.numChunks)
+			return;
+
+		off_t chunkOffset;
+		size_t chunkLen;
+
+		job.getChunkRange(chunkIndex, chunkOffset, chunkLen);
+
+		char* chunkBuf = job.buf + (chunkOffset - job.offset);
+		int chunkFD = job.fds[chunkIndex % job.fds.size()];
+
+		ssize_t chunkRes = job.isWrite ?
+			RealFuncs::pwrite(chunkFD, chunkBuf, chunkLen, chunkOffset) :
+			RealFuncs::pread(chunkFD, chunkBuf, chunkLen, chunkOffset);
+
+		job.chunkResults[chunkIndex] = chunkRes;
+		job.chunkErrnos[chunkIndex] = (chunkRes == -1) ? errno : 0;
+
+		std::unique_lock<std::mutex> lock(job.mutex); // L O C K (scoped)
+
+		if(++job.numChunksDone == job.numChunks)
+			job.doneCondition.notify_all();
+	}
+}
+
+/**
+ * Start over with a new queue in the child process after fork(). The old queue is leaked on
+ * purpose, because its mutex might have been locked by one of the helper threads, which don't
+ * exist in the child.
+ */
+void SplitIO::resetAfterFork()
+{
+	queue = new SplitIOQueue();
+}
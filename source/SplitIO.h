@@ -0,0 +1,127 @@
+#ifndef SPLITIO_H_
+#define SPLITIO_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include "Common.h"
+
+
+#define SPLITIO_CHUNK_ALIGN				4096 // chunk size gets rounded to a multiple of this
+
+#define SPLITIO_DEFAULT_CHUNK_SIZE		(8*1024*1024)
+#define SPLITIO_DEFAULT_NUM_THREADS		8
+#define SPLITIO_DEFAULT_NUM_FDS			3
+
+
+/**
+ * A single split read or write. Its chunks get picked by the calling thread and by the helper
+ * threads until none are left.
+ */
+class SplitIOJob
+{
+	public:
+		bool isWrite;
+		char* buf;
+		size_t count;
+		off_t offset;
+		IntVec fds; // fd of the caller and extra fds of the same file; chunk i uses fds[i % size]
+
+		uint64_t chunkSize;
+		size_t numChunks;
+		std::atomic<size_t> nextChunk{0}; // index of next chunk to be picked
+
+		std::vector<ssize_t> chunkResults; // return value per chunk
+		IntVec chunkErrnos; // errno per chunk (if result is -1)
+
+		std::mutex mutex;
+		std::condition_variable doneCondition;
+		size_t numChunksDone{0}; // protected by mutex
+
+		/**
+		 * Get file offset and length of a chunk. Chunk boundaries are at multiples of chunkSize,
+		 * so the first and last chunk might be shorter.
+		 */
+		void getChunkRange(size_t chunkIndex, off_t& outOffset, size_t& outLen) const
+		{
+			outOffset = chunkIndex ?
+				(offset - (offset % chunkSize) ) + (chunkIndex * chunkSize) : offset;
+			outLen = std::min<uint64_t>(chunkSize - (outOffset % chunkSize),
+				(offset + count) - outOffset);
+		}
+};
+
+typedef std::shared_ptr<SplitIOJob> SplitIOJobPtr;
+
+/**
+ * Queue of the helper threads. Allocated separately from SplitIO, so that a child process after
+ * fork() can start over with a new queue (the helper threads don't exist in the child and the old
+ * queue mutex might have been locked at the time of the fork).
+ */
+class SplitIOQueue
+{
+	public:
+		std::deque<SplitIOJobPtr> jobs;
+		std::mutex mutex;
+		std::condition_variable jobsAvailableCondition;
+		unsigned numThreads{0}; // number of started helper threads
+};
+
+
+/**
+ * Split large reads/writes on O_DIRECT fds into chunks that get issued concurrently by helper
+ * threads over multiple fds of the same file. This spreads a single large request over multiple
+ * connections e.g. of the kernel NFS client, which otherwise processes it as a single stream.
+ *
+ * Only calls with an explicit offset get split. read()/write() update the file position atomically
+ * in the kernel, which a split job can't do, so concurrent calls on the same file description would
+ * get the same start offset.
+ *
+ * Chunk boundaries are at file offsets that are a multiple of the chunk size. The return value
+ * follows the normal short read/write semantics: it covers the chunks up to the first one that
+ * returned less than requested.
+ */
+class SplitIO
+{
+	public:
+		SplitIO(uint64_t minSplitSize, uint64_t chunkSize, unsigned numThreads,
+			unsigned numExtraFDs, int threadNode);
+
+		bool checkSplit(int fd, size_t count, IntVec& outFDs);
+		ssize_t preadSplit(const IntVec& fds, void* buf, size_t count, off_t offset);
+		ssize_t pwriteSplit(const IntVec& fds, const void* buf, size_t count, off_t offset);
+
+		void resetAfterFork();
+
+	private:
+		uint64_t minSplitSize;
+		uint64_t chunkSize;
+		unsigned numThreads;
+		unsigned numExtraFDs;
+		int threadNode; // NUMA node to pin helper threads to; -1 for no pinning
+
+		SplitIOQueue* queue; // intentionally never deleted, see resetAfterFork()
+
+		ssize_t runJob(bool isWrite, const IntVec& fds, void* buf, size_t count, off_t offset);
+		bool openSplitFDs(int fd, IntVec& outFDs);
+		void startThreads(SplitIOQueue* currentQueue);
+
+		static void threadLoop(SplitIOQueue* queue, int threadNode);
+		static void runChunks(SplitIOJob& job);
+
+
+		// inliners
+	public:
+		uint64_t getMinSplitSize() const
+		{
+			return minSplitSize;
+		}
+};
+
+extern SplitIO* splitIO; // NULL if splitting is disabled
+
+#endif /* SPLITIO_H_ */
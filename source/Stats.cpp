@@ -0,0 +1,142 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "AsyncIO.h"
+#include "BufferPool.h"
+#include "InjectionTk.h"
+#include "Latency.h"
+#include "Logger.h"
+#include "Mmap.h"
+#include "PathMatchStore.h"
+#include "RealFuncs.h"
+#include "Stats.h"
+#include "Throttle.h"
+
+char* StatsTk::statsFilePath = NULL;
+
+
+/**
+ * Write the stats report now instead of waiting for process exit, e.g. from a debugger:
+ * gdb -p <pid> -batch -ex "call (void)vastpreload_write_stats()"
+ */
+extern "C" __attribute__((visibility("default") ) ) void vastpreload_write_stats(void)
+{
+	StatsTk::writeReport();
+}
+
+
+/**
+ * Enable stats collection. Must be called after the path file was loaded.
+ *
+ * @statsFilePath path of report file; STATS_PATH_PID_PLACEHOLDER gets replaced by the pid at the
+ * 	time of the report, so that forked children don't overwrite the report of their parent.
+ */
+void StatsTk::init(const char* statsFilePath)
+{
+	StatsTk::statsFilePath = strdup(statsFilePath);
+
+	if(pathMatchStore)
+		pathMatchStore->enableStats();
+
+	AsyncIOTk::enableStats();
+}
+
+/**
+ * Write the report file. Called on process exit, so the report gets written through a plain fd
+ * (stdio streams might be closed already by the app).
+ */
+void StatsTk::writeReport()
+{
+	if(!statsFilePath)
+		return;
+
+	std::string reportPath = replacePIDPlaceholder(statsFilePath);
+
+	int fd = RealFuncs::open(reportPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd == -1)
+	{
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			dprintf(STDERR_FILENO, LOG_PREFIX "Opening stats file failed: %s; Error: %s\n",
+				reportPath.c_str(), strerror(errno) );
+		return;
+	}
+
+	dprintf(fd, "# " LIB_NAME " stats (pid: %d)\n", (int)getpid() );
+
+	writeRuleStats(fd);
+	InjectionTk::writeReport(fd);
+	AsyncIOTk::writeReport(fd);
+	MmapTk::writeReport(fd);
+
+	if(bufferPool)
+		bufferPool->writeReport(fd);
+
+	ThrottleTk::writeReport(fd);
+	LatencyTk::writeReport(fd);
+
+	RealFuncs::close(fd);
+}
+
+/**
+ * @return path with STATS_PATH_PID_PLACEHOLDER replaced by the current pid.
+ */
+std::string StatsTk::replacePIDPlaceholder(const char* path)
+{
+	std::string reportPath(path);
+	std::string pidStr = std::to_string(getpid() );
+
+	for(size_t pos = reportPath.find(STATS_PATH_PID_PLACEHOLDER); pos != std::string::npos;
+		pos = reportPath.find(STATS_PATH_PID_PLACEHOLDER, pos + pidStr.length() ) )
+		reportPath.replace(pos, strlen(STATS_PATH_PID_PLACEHOLDER), pidStr);
+
+	return reportPath;
+}
+
+/**
+ * Write per-rule counters and the list of rules that never matched any path.
+ */
+void StatsTk::writeRuleStats(int fd)
+{
+	if(!pathMatchStore || !pathMatchStore->getStats() )
+		return;
+
+	const PathMatchImageHeader* image = pathMatchStore->getImage();
+	const PathMatchImageRule* rules = PathMatchImage::getRules(image);
+	const PathMatchStats* stats = pathMatchStore->getStats();
+
+	dprintf(fd, "\n[rules]\n");
+	dprintf(fd, "# rule line evaluations matches injected skip_nodirect skip_directory "
+		"skip_alreadydirect skip_unsupported skip_fcntlfail skip_profile pattern\n");
+
+	unsigned numUnusedRules = 0;
+
+	for(uint32_t i = 0; i < image->numRules; i++)
+	{
+		dprintf(fd, "%u %u", i, rules[i].lineNum);
+
+		for(unsigned counter = 0; counter < PATHMATCHSTATS_NUM_COUNTERS; counter++)
+			dprintf(fd, " %llu", (unsigned long long)stats->getSum(i, counter) );
+
+		dprintf(fd, " %s\n", PathMatchImage::getPattern(image, rules[i]) );
+
+		if(!stats->getSum(i, PATHMATCHSTATS_MATCHES) )
+			numUnusedRules++;
+	}
+
+	dprintf(fd, "\n[unused rules]\n");
+	dprintf(fd, "# rules that never matched a path: %u of %u\n", numUnusedRules,
+		image->numRules);
+
+	for(uint32_t i = 0; i < image->numRules; i++)
+	{
+		if(stats->getSum(i, PATHMATCHSTATS_MATCHES) )
+			continue;
+
+		/* a rule that was evaluated but never matched might be a typo, while a rule that was never
+			evaluated had no paths below its dir prefix (or only paths of earlier matching rules) */
+		dprintf(fd, "line %u: %s (%s)\n", rules[i].lineNum,
+			PathMatchImage::getPattern(image, rules[i]),
+			stats->getSum(i, PATHMATCHSTATS_EVALUATIONS) ? "evaluated" : "never evaluated");
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "Common.h"
+
+
+#define STATS_PATH_PID_PLACEHOLDER		"%p" // gets replaced by pid in stats file path
+
+
+/**
+ * Toolkit to write the stats report file (see ENV_LIB_STATSFILE) on process exit.
+ */
+class StatsTk
+{
+	public:
+		static void init(const char* statsFilePath);
+		static void writeReport();
+		static std::string replacePIDPlaceholder(const char* path);
+
+	private:
+		StatsTk() {}
+
+		static char* statsFilePath; // strdup'ed; NULL if stats are disabled
+
+		static void writeRuleStats(int fd);
+
+
+		// inliners
+	public:
+		static bool getIsEnabled()
+		{
+			return (statsFilePath != NULL);
+		}
+};
+
+
+#endif /* STATS_H_ */
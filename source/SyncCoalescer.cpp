@@ -0,0 +1,77 @@
+#include <cerrno>
+#include "SyncCoalescer.h"
+
+SyncCoalescer* syncCoalescer = NULL;
+
+/**
+ * Flush the file of the given fd via syncFunc or wait for another thread's flush that covers this
+ * request.
+ *
+ * @isDataSync true for fdatasync, false for fsync; both are coalesced separately.
+ * @return as syncFunc, errno is set accordingly.
+ */
+int SyncCoalescer::sync(int fd, bool isDataSync, SyncFunc syncFunc)
+{
+	struct stat statBuf;
+
+	int statRes = fstat(fd, &statBuf);
+	if(statRes == -1)
+		return syncFunc(fd); // let the real sync function report the error (e.g. EBADF)
+
+	SyncCoalescerKey key(statBuf.st_dev, statBuf.st_ino, isDataSync);
+
+	std::unique_lock<std::mutex> lock(mutex); // L O C K
+
+	SyncCoalescerFileState& state = stateMap[key];
+
+	state.numUsers++;
+
+	const uint64_t requestSeq = ++state.lastRequestedSeq;
+
+	while(state.lastCompletedSeq < requestSeq)
+	{
+		if(state.isFlushInProgress)
+		{ // flush in progress might have started before our request, so wait for the next one
+			state.flushDoneCondition.wait(lock);
+			continue;
+		}
+
+		// no flush in progress, so we do it on behalf of all requests up to now
+
+		const uint64_t flushSeq = state.lastRequestedSeq;
+
+		state.isFlushInProgress = true;
+
+		lock.unlock(); // U N L O C K
+
+		int flushRes = syncFunc(fd);
+		int flushErrno = errno;
+
+		lock.lock(); // L O C K
+
+		state.isFlushInProgress = false;
+		state.flushResults[flushSeq] = {flushRes, flushErrno, flushSeq - state.lastCompletedSeq};
+		state.lastCompletedSeq = flushSeq;
+
+		state.flushDoneCondition.notify_all();
+	}
+
+	// the first flush that ended at or after our request is the one that covered it
+	auto resultIter = state.flushResults.lower_bound(requestSeq);
+
+	int res = resultIter->second.res;
+	int resErrno = resultIter->second.resErrno;
+
+	if(!--resultIter->second.numRequests)
+		state.flushResults.erase(resultIter);
+
+	if(!--state.numUsers)
+		stateMap.erase(key);
+
+	lock.unlock(); // U N L O C K
+
+	if(res == -1)
+		errno = resErrno;
+
+	return res;
+}
@@ -0,0 +1,61 @@
+#ifndef SYNCCOALESCER_H_
+#define SYNCCOALESCER_H_
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <sys/stat.h>
+#include <tuple>
+#include "Common.h"
+
+
+typedef int (*SyncFunc)(int fd); // signature of fsync() and fdatasync()
+
+/**
+ * Result of a completed flush.
+ */
+struct SyncCoalescerFlushResult
+{
+	int res; // return value of the flush
+	int resErrno; // errno of the flush
+	uint64_t numRequests; // covered requests that didn't pick up the result yet
+};
+
+typedef std::map<uint64_t, SyncCoalescerFlushResult> SyncCoalescerFlushResultMap; // key is flush seq
+
+/**
+ * Group commit state of a single file.
+ */
+class SyncCoalescerFileState
+{
+	public:
+		uint64_t lastRequestedSeq{0}; // seq number of the latest sync request
+		uint64_t lastCompletedSeq{0}; // requests up to this seq are covered by a completed flush
+		bool isFlushInProgress{false};
+		SyncCoalescerFlushResultMap flushResults; // kept per flush, as a later flush might complete
+			// before all waiters of an earlier one woke up (and errors are reported only once)
+		unsigned numUsers{0}; // number of threads referencing this state
+		std::condition_variable flushDoneCondition;
+};
+
+typedef std::tuple<dev_t, ino_t, bool> SyncCoalescerKey; // (st_dev, st_ino, isDataSync)
+typedef std::map<SyncCoalescerKey, SyncCoalescerFileState> SyncCoalescerMap;
+
+/**
+ * Coalesce concurrent fsync/fdatasync calls for the same file from different threads into a single
+ * flush. A caller only joins a flush that started after its own request, so that everything the
+ * caller wrote before its sync call is covered.
+ */
+class SyncCoalescer
+{
+	public:
+		int sync(int fd, bool isDataSync, SyncFunc syncFunc);
+
+	private:
+		SyncCoalescerMap stateMap;
+		std::mutex mutex;
+};
+
+extern SyncCoalescer* syncCoalescer;
+
+#endif /* SYNCCOALESCER_H_ */
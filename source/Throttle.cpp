@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "FDStore.h"
+#include "Logger.h"
+#include "Probes.h"
+#include "RealFuncs.h"
+#include "Throttle.h"
+
+bool ThrottleTk::isActive = false;
+const PathMatchImageRule* ThrottleTk::imageRules = NULL;
+ThrottleRule* ThrottleTk::rules = NULL;
+uint32_t ThrottleTk::numRules = 0;
+
+
+/**
+ * Set up the buckets of all rules with limits. Must be called after the path file was loaded and
+ * before any fd gets opened. Nothing to do if no rule has limits.
+ */
+void ThrottleTk::init(const PathMatchImageHeader* image)
+{
+	const PathMatchImageRule* imageRules = PathMatchImage::getRules(image);
+	bool haveLimits = false;
+
+	for(uint32_t i = 0; i < image->numRules; i++)
+		if(imageRules[i].bwLimit || imageRules[i].iopsLimit)
+			haveLimits = true;
+
+	if(!haveLimits)
+		return;
+
+	rules = new ThrottleRule[image->numRules]; // never deleted, as I/O might still be in flight
+
+	for(uint32_t i = 0; i < image->numRules; i++)
+	{
+		if(!imageRules[i].bwLimit && !imageRules[i].iopsLimit)
+			continue;
+
+		rules[i].bwLimit = imageRules[i].bwLimit;
+		rules[i].iopsLimit = imageRules[i].iopsLimit;
+
+		if(imageRules[i].actions & PATHMATCH_ACTION_SHAREDLIMIT)
+			rules[i].bucket = mapSharedBucket(image, imageRules[i]);
+
+		if(!rules[i].bucket)
+			rules[i].bucket = new ThrottleBucket{ {0}, {0} };
+
+		if(libLogTopics & ENV_LOG_TOPIC_INIT)
+			log_fprintf(stderr, LOG_PREFIX "Rule limits. line: %u; bw: %llu; iops: %llu; "
+				"shared: %s\n", imageRules[i].lineNum, (unsigned long long)rules[i].bwLimit,
+				(unsigned long long)rules[i].iopsLimit,
+				(imageRules[i].actions & PATHMATCH_ACTION_SHAREDLIMIT) ? "yes" : "no");
+	}
+
+	ThrottleTk::imageRules = imageRules;
+	numRules = image->numRules;
+
+	isActive = true;
+}
+
+/**
+ * Called after the path of an fd matched the given rule. Does nothing if the rule has no limits.
+ */
+void ThrottleTk::initAfterMatch(int fd, const PathMatchImageRule* rule)
+{
+	if(!isActive)
+		return;
+
+	ThrottleRule* throttleRule = &rules[rule - imageRules];
+
+	if(throttleRule->bucket)
+		fdStore->setThrottleRule(fd, throttleRule);
+}
+
+/**
+ * Wait until the given read/write fits into the limits of the rule that the fd matched. Returns
+ * immediately for fds without limits.
+ *
+ * @count bytes of the read/write.
+ */
+void ThrottleTk::throttleIO(int fd, size_t count)
+{
+	ThrottleRule* rule;
+
+	if(!fdStore->getThrottleRule(fd, rule) || !rule)
+		return;
+
+	rule->numOps.fetch_add(1, std::memory_order_relaxed);
+
+	uint64_t nowNSec = getNowNSec();
+	uint64_t dueNSec = 0;
+
+	if(rule->bwLimit)
+		dueNSec = reserve(rule->bucket->bytesTAT,
+			(unsigned __int128)count * 1000000000 / rule->bwLimit, nowNSec);
+
+	if(rule->iopsLimit)
+		dueNSec = std::max(dueNSec,
+			reserve(rule->bucket->opsTAT, 1000000000 / rule->iopsLimit, nowNSec) );
+
+	if(dueNSec <= nowNSec)
+		return;
+
+	uint64_t waitNSec = dueNSec - nowNSec;
+
+	rule->numWaits.fetch_add(1, std::memory_order_relaxed);
+	rule->waitNSec.fetch_add(waitNSec, std::memory_order_relaxed);
+
+	PROBE(throttle, fd, count, (long)waitNSec);
+
+	struct timespec dueTime;
+
+	dueTime.tv_sec = dueNSec / 1000000000;
+	dueTime.tv_nsec = dueNSec % 1000000000;
+
+	// returns the error instead of setting errno
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &dueTime, NULL) == EINTR)
+		; // signal handler interrupted us, so continue waiting
+}
+
+/**
+ * Write the [throttle] section of the stats report. Does nothing if no rule has limits.
+ */
+void ThrottleTk::writeReport(int fd)
+{
+	if(!isActive)
+		return;
+
+	dprintf(fd, "\n[throttle]\n");
+	dprintf(fd, "# rule line bw_limit iops_limit ops waits wait_usec\n");
+
+	for(uint32_t i = 0; i < numRules; i++)
+	{
+		if(!rules[i].bucket)
+			continue;
+
+		dprintf(fd, "%u %u %llu %llu %llu %llu %llu\n", i, imageRules[i].lineNum,
+			(unsigned long long)rules[i].bwLimit,
+			(unsigned long long)rules[i].iopsLimit,
+			(unsigned long long)rules[i].numOps.load(std::memory_order_relaxed),
+			(unsigned long long)rules[i].numWaits.load(std::memory_order_relaxed),
+			(unsigned long long)rules[i].waitNSec.load(std::memory_order_relaxed) / 1000);
+	}
+}
+
+/**
+ * Map the node-wide bucket of a "sharedlimit" rule. The bucket file name is derived from pattern
+ * and limits, so that all processes with the same rule share a bucket, even if their path files
+ * differ otherwise. Files are per user, as they need to be writable. As the name is predictable, a
+ * bucket file is only used if it is a regular file (no symlink) that is owned by us and not
+ * writable by others, like shared path images.
+ *
+ * @return NULL if the bucket file could not be opened, in which case the limits are per process.
+ */
+ThrottleBucket* ThrottleTk::mapSharedBucket(const PathMatchImageHeader* image,
+	const PathMatchImageRule& rule)
+{
+	uint64_t hash = PathMatchImage::hashFNV1a(PathMatchImage::getPattern(image, rule),
+		rule.patternLen);
+	hash = PathMatchImage::hashFNV1a( (const char*)&rule.bwLimit, sizeof(rule.bwLimit), hash);
+	hash = PathMatchImage::hashFNV1a( (const char*)&rule.iopsLimit, sizeof(rule.iopsLimit), hash);
+
+	char hashStr[17];
+	snprintf(hashStr, sizeof(hashStr), "%016llx", (unsigned long long)hash);
+
+	std::string bucketPath = std::string(THROTTLE_SHM_PATH_PREFIX) +
+		std::to_string(geteuid() ) + "-" + hashStr;
+
+	int savedErrno = errno;
+	void* mapping = MAP_FAILED;
+
+	int fd = RealFuncs::open(bucketPath.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		0600);
+	if(fd != -1)
+	{
+		struct stat statBuf;
+
+		if(fstat(fd, &statBuf) )
+			; // errno is set for the log message below
+		else
+		if(!S_ISREG(statBuf.st_mode) || (statBuf.st_uid != geteuid() ) ||
+			(statBuf.st_mode & (S_IWGRP | S_IWOTH) ) )
+			errno = EPERM; // pre-created by somebody else, so don't trust it
+		else
+		if( (statBuf.st_size >= (off_t)sizeof(ThrottleBucket) ) ||
+			!ftruncate(fd, sizeof(ThrottleBucket) ) )
+		{ // the file is zero-filled, which is a valid empty bucket, so creation is race-free
+			mapping = mmap(NULL, sizeof(ThrottleBucket), PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+				0);
+		}
+
+		RealFuncs::close(fd);
+	}
+
+	if( (mapping == MAP_FAILED) && (libLogTopics & ENV_LOG_TOPIC_INIT) )
+		log_fprintf(stderr, LOG_PREFIX "Shared limit bucket not available, so limits are per "
+			"process. path: %s; error: %s\n", bucketPath.c_str(), strerror(errno) );
+
+	errno = savedErrno;
+
+	return (mapping == MAP_FAILED) ? NULL : (ThrottleBucket*)mapping;
+}
+
+/**
+ * Reserve the given cost in a bucket.
+ *
+ * @tat the bucket's theoretical arrival time.
+ * @cost in nsec.
+ * @return time at which the caller may do its I/O.
+ */
+uint64_t ThrottleTk::reserve(std::atomic<uint64_t>& tat, uint64_t cost, uint64_t nowNSec)
+{
+	uint64_t oldTAT = tat.load(std::memory_order_relaxed);
+	uint64_t newTAT;
+
+	do
+	{
+		newTAT = std::max(oldTAT, nowNSec) + cost;
+	} while(!tat.compare_exchange_weak(oldTAT, newTAT, std::memory_order_relaxed) );
+
+	return newTAT - std::min<uint64_t>(newTAT, THROTTLE_BURST_NSEC);
+}
+
+uint64_t ThrottleTk::getNowNSec()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
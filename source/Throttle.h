@@ -0,0 +1,85 @@
+#ifndef THROTTLE_H_
+#define THROTTLE_H_
+
+#include <atomic>
+#include "Common.h"
+#include "PathMatchImage.h"
+
+
+#define THROTTLE_BURST_NSEC			(50*1000*1000) // credit that an idle bucket can build up
+#define THROTTLE_SHM_PATH_PREFIX	"/dev/shm/" LIB_NAME "-throttle-"
+
+
+/**
+ * Token bucket state of a rule as "theoretical arrival times" (GCRA), i.e. the CLOCK_MONOTONIC
+ * time at which the bucket would be empty again if no further I/O happened. Lives in a shared file
+ * mapping for rules with "sharedlimit", so that all processes on the node draw from the same bucket.
+ */
+struct ThrottleBucket
+{
+	std::atomic<uint64_t> bytesTAT;
+	std::atomic<uint64_t> opsTAT;
+};
+
+
+/**
+ * Limits and counters of a path file rule with "bw=" or "iops=".
+ */
+class ThrottleRule
+{
+	public:
+		uint64_t bwLimit{0};
+		uint64_t iopsLimit{0};
+		ThrottleBucket* bucket{NULL}; // local or shared; NULL if rule has no limits
+
+		std::atomic<uint64_t> numOps{0};
+		std::atomic<uint64_t> numWaits{0};
+		std::atomic<uint64_t> waitNSec{0};
+};
+
+
+/**
+ * Toolkit to limit the bandwidth and IOPS of the reads and writes on fds that matched a path file
+ * rule with "bw=" or "iops=" option.
+ *
+ * Each limited rule has a bucket for bytes and one for ops. An I/O reserves its cost in both buckets
+ * via compare-and-swap (no lock) and then sleeps until the reservation is due, so concurrent
+ * threads queue up in the order of their reservations. An idle bucket allows a burst of
+ * THROTTLE_BURST_NSEC worth of I/O without waiting.
+ */
+class ThrottleTk
+{
+	public:
+		static void init(const PathMatchImageHeader* image);
+		static void initAfterMatch(int fd, const PathMatchImageRule* rule);
+		static void throttleIO(int fd, size_t count);
+		static void writeReport(int fd);
+
+	private:
+		ThrottleTk() {}
+
+		static bool isActive; // true if any rule has limits
+		static const PathMatchImageRule* imageRules; // to get index of matching rule
+		static ThrottleRule* rules; // array of image->numRules; NULL if not active
+		static uint32_t numRules;
+
+		static ThrottleBucket* mapSharedBucket(const PathMatchImageHeader* image,
+			const PathMatchImageRule& rule);
+		static uint64_t reserve(std::atomic<uint64_t>& tat, uint64_t cost, uint64_t nowNSec);
+		static uint64_t getNowNSec();
+
+
+		// inliners
+	public:
+		/**
+		 * @return true if any rule has limits, so that I/O without limits doesn't need to check the
+		 * 		fdStore.
+		 */
+		static bool getIsActive()
+		{
+			return isActive;
+		}
+};
+
+
+#endif /* THROTTLE_H_ */
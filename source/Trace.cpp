@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "FDStore.h"
+#include "Logger.h"
+#include "RealFuncs.h"
+#include "Stats.h"
+#include "Trace.h"
+
+bool TraceTk::isActive = false;
+char* TraceTk::tracePath = NULL;
+std::string TraceTk::traceFilePath;
+int TraceTk::traceFD = -1;
+uint64_t TraceTk::traceStartNSec = 0;
+std::mutex TraceTk::mutex;
+char* TraceTk::buf = NULL;
+size_t TraceTk::bufLen = 0;
+TracePathIDMap* TraceTk::pathIDs = NULL;
+
+
+/**
+ * Open the trace file and enable tracing. Must be called before any fd gets opened.
+ *
+ * @tracePath STATS_PATH_PID_PLACEHOLDER gets replaced by the pid, as for the stats file.
+ */
+void TraceTk::init(const char* tracePath)
+{
+	TraceTk::tracePath = strdup(tracePath);
+
+	// needs to be alloc'ed here as it's otherwise not initialized as static var
+	buf = new char[TRACE_BUF_SIZE];
+	pathIDs = new TracePathIDMap();
+	traceFilePath = StatsTk::replacePIDPlaceholder(tracePath);
+
+	traceStartNSec = now();
+
+	if(!openTraceFile() )
+		return;
+
+	pthread_atfork(forkPrepare, forkParent, forkChild);
+
+	isActive = true;
+}
+
+/**
+ * Assign the path ID of a newly opened fd. Paths get their ID on first use and keep it for the rest
+ * of the trace.
+ */
+void TraceTk::assignPathID(int fd, const std::string& path)
+{
+	uint32_t pathID;
+
+	{
+		std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+		uint32_t& mapPathID = (*pathIDs)[path];
+
+		if(!mapPathID)
+		{
+			mapPathID = pathIDs->size(); // first ID is 1, so 0 stays TRACE_PATHID_NONE
+
+			appendPathLocked(mapPathID, path);
+		}
+
+		pathID = mapPathID;
+	}
+
+	fdStore->setTracePathID(fd, pathID);
+}
+
+/**
+ * Add a record for a call on a tracked fd. Calls on fds that are not in the fdStore (e.g. pipes and
+ * sockets) are not recorded.
+ *
+ * @buf NULL if the buffer address is unknown (e.g. vectored calls).
+ * @offset -1 for the current file position.
+ * @result return value of the call; -errno on error.
+ * @startNSec from now() before the call; 0 for calls that are recorded without duration.
+ */
+void TraceTk::record(unsigned op, int fd, const void* buf, size_t count, off64_t offset,
+	int64_t result, uint64_t startNSec)
+{
+	const uint64_t endNSec = startNSec ? now() : 0;
+
+	uint32_t pathID;
+	int fdFlags;
+
+	if(!fdStore->getTraceInfo(fd, pathID, fdFlags) || (pathID == TRACE_PATHID_NONE) )
+		return;
+
+	TraceRecord record = {};
+
+	record.startNSec = (startNSec ? startNSec : now() ) - traceStartNSec;
+	record.offset = (offset == -1) ? TRACE_OFFSET_NONE : offset;
+	record.count = count;
+	record.result = result;
+	record.durationNSec = std::min<uint64_t>(endNSec - startNSec, UINT32_MAX);
+	record.pathID = pathID;
+	record.fd = fd;
+	record.op = op;
+	record.bufAlignShift = buf ?
+		std::min(__builtin_ctzll( (uintptr_t)buf | (1ULL << TRACE_MAX_BUFALIGN_SHIFT) ),
+			TRACE_MAX_BUFALIGN_SHIFT) : TRACE_MAX_BUFALIGN_SHIFT;
+
+	if(fdFlags & FDSTORE_FLAG_MATCHED)
+		record.flags |= TRACE_FLAG_MATCHED;
+
+	if(fdFlags & FDSTORE_FLAG_DIRECT)
+		record.flags |= TRACE_FLAG_DIRECT;
+
+	if( ( (op == TRACE_OP_READ) || (op == TRACE_OP_WRITE) ) && !buf)
+		record.flags |= TRACE_FLAG_VECTORED;
+
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	if(isActive)
+		appendLocked(&record, sizeof(record) );
+}
+
+/**
+ * Write out buffered records. Called on process exit.
+ */
+void TraceTk::flush()
+{
+	if(!isActive)
+		return;
+
+	std::unique_lock<std::mutex> lock(mutex); // L O C K (scoped)
+
+	flushLocked();
+}
+
+/**
+ * Create traceFilePath and write the header.
+ *
+ * @return false on error (which gets logged).
+ */
+bool TraceTk::openTraceFile()
+{
+	int savedErrno = errno;
+
+	traceFD = RealFuncs::open(traceFilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		0644);
+
+	if(traceFD == -1)
+	{
+		log_fprintf(stderr, LOG_PREFIX "Opening trace file failed: %s; Error: %s\n",
+			traceFilePath.c_str(), strerror(errno) );
+
+		errno = savedErrno;
+		return false;
+	}
+
+	errno = savedErrno;
+
+	struct timespec nowReal;
+	clock_gettime(CLOCK_REALTIME, &nowReal);
+
+	TraceFileHeader header = {};
+
+	memcpy(header.magic, TRACEFILE_MAGIC, sizeof(header.magic) );
+	header.version = TRACEFILE_VERSION;
+	header.recordLen = sizeof(TraceRecord);
+	header.startRealSec = nowReal.tv_sec;
+	header.pid = getpid();
+
+	appendLocked(&header, sizeof(header) );
+
+	return true;
+}
+
+/**
+ * Add a TRACE_OP_PATH record followed by the zero-padded path.
+ */
+void TraceTk::appendPathLocked(uint32_t pathID, const std::string& path)
+{
+	TraceRecord record = {};
+
+	record.op = TRACE_OP_PATH;
+	record.pathID = pathID;
+	record.count = path.length();
+
+	appendLocked(&record, sizeof(record) );
+	appendLocked(path.c_str(), path.length() );
+
+	const char padding[TRACE_PATH_PADDING] = {};
+
+	appendLocked(padding, (TRACE_PATH_PADDING - (path.length() % TRACE_PATH_PADDING) ) %
+		TRACE_PATH_PADDING);
+}
+
+void TraceTk::appendLocked(const void* data, size_t len)
+{
+	if( (bufLen + len) > TRACE_BUF_SIZE)
+		flushLocked();
+
+	memcpy(buf + bufLen, data, len);
+	bufLen += len;
+}
+
+void TraceTk::flushLocked()
+{
+	int savedErrno = errno;
+
+	for(size_t numWritten = 0; numWritten < bufLen; )
+	{
+		ssize_t writeRes = RealFuncs::write(traceFD, buf + numWritten, bufLen - numWritten);
+
+		if( (writeRes == -1) && (errno == EINTR) )
+			continue;
+
+		if(writeRes <= 0)
+		{
+			log_fprintf(stderr, LOG_PREFIX "Writing trace file failed. Stopping trace: %s; "
+				"Error: %s\n", traceFilePath.c_str(), strerror(errno) );
+
+			isActive = false;
+			break;
+		}
+
+		numWritten += writeRes;
+	}
+
+	bufLen = 0;
+
+	errno = savedErrno;
+}
+
+/**
+ * Called in the parent before fork, so that the child doesn't inherit a locked mutex.
+ */
+void TraceTk::forkPrepare()
+{
+	mutex.lock();
+}
+
+void TraceTk::forkParent()
+{
+	mutex.unlock();
+}
+
+/**
+ * Continue in a new trace file, because the records of the parent still in the buffer are for the
+ * parent's file. The new file gets all path definitions again, as the child inherits the fds.
+ */
+void TraceTk::forkChild()
+{
+	bufLen = 0;
+
+	RealFuncs::close(traceFD);
+
+	std::string parentTraceFilePath = traceFilePath;
+
+	traceFilePath = StatsTk::replacePIDPlaceholder(tracePath);
+
+	// without pid placeholder in the path, the child would overwrite the parent's trace
+	isActive = (traceFilePath != parentTraceFilePath) && openTraceFile();
+
+	if(isActive)
+		for(const auto& pathIter : *pathIDs)
+			appendPathLocked(pathIter.second, pathIter.first);
+
+	mutex.unlock();
+}
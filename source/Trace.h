@@ -0,0 +1,106 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <mutex>
+#include <unordered_map>
+#include "Common.h"
+#include "TraceFile.h"
+
+
+#define TRACE_BUF_SIZE		(1024*1024) // records get written to the trace file in chunks of this
+
+
+typedef std::unordered_map<std::string, uint32_t> TracePathIDMap;
+
+
+/**
+ * Toolkit to capture the intercepted calls on tracked fds into a binary trace file (see
+ * ENV_LIB_TRACEFILE and TraceFile.h), e.g. to replay them with different path files through the
+ * replay tool.
+ *
+ * Records get collected in a buffer under a mutex and written out when the buffer is full, so that
+ * tracing costs a lock and a memcpy per call. Forked children continue in their own trace file if
+ * the trace path contains the pid placeholder and stop tracing otherwise.
+ */
+class TraceTk
+{
+	public:
+		static void init(const char* tracePath);
+		static void assignPathID(int fd, const std::string& path);
+		static void record(unsigned op, int fd, const void* buf, size_t count, off64_t offset,
+			int64_t result, uint64_t startNSec);
+		static void flush();
+
+	private:
+		TraceTk() {}
+
+		static bool isActive;
+		static char* tracePath; // strdup'ed; with pid placeholder
+		static std::string traceFilePath; // tracePath of the current process
+		static int traceFD;
+		static uint64_t traceStartNSec;
+		static std::mutex mutex; // for all of the following
+		static char* buf; // TRACE_BUF_SIZE
+		static size_t bufLen;
+		static TracePathIDMap* pathIDs;
+
+		static bool openTraceFile();
+		static void appendPathLocked(uint32_t pathID, const std::string& path);
+		static void appendLocked(const void* data, size_t len);
+		static void flushLocked();
+		static void forkPrepare();
+		static void forkParent();
+		static void forkChild();
+
+
+		// inliners
+	public:
+		static bool getIsActive()
+		{
+			return isActive;
+		}
+
+		static uint64_t now()
+		{
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+		}
+};
+
+
+#ifdef BUILD_NO_TRACE
+
+// tracing compiled out, so the interceptors don't even check whether it's active
+#define TRACE_START(startTimeVar)											do {} while(0)
+#define TRACE_END(op, fd, buf, count, offset, result, startTimeVar)		do {} while(0)
+
+#else // BUILD_NO_TRACE
+
+/**
+ * Start timing of an intercepted call for the trace. When tracing is disabled, this is a single
+ * branch.
+ */
+#define TRACE_START(startTimeVar) \
+	uint64_t startTimeVar = __builtin_expect(TraceTk::getIsActive(), false) ? TraceTk::now() : 0
+
+/**
+ * Record an intercepted call that was started with TRACE_START.
+ *
+ * @offset -1 for the current file position.
+ * @result return value of the call (errno gets recorded for -1).
+ */
+#define TRACE_END(op, fd, buf, count, offset, result, startTimeVar) \
+	do \
+	{ \
+		if(__builtin_expect(TraceTk::getIsActive(), false) && initDone) \
+			TraceTk::record(op, fd, buf, count, offset, ( (result) == -1) ? -errno : (result), \
+				startTimeVar); \
+	} while(0)
+
+#endif // BUILD_NO_TRACE
+
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,59 @@
+#ifndef TRACEFILE_H_
+#define TRACEFILE_H_
+
+#include <stdint.h>
+
+
+/* Binary format of I/O trace files (see ENV_LIB_TRACEFILE), shared by the lib and the replay tool.
+	A trace file is a TraceFileHeader followed by TraceRecords in the order in which the calls
+	completed. Paths are defined once by a TRACE_OP_PATH record before the first record that refers to
+	them. All values are in host byte order. */
+
+#define TRACEFILE_MAGIC				"VPTRACE" // 8 bytes including the trailing zero
+#define TRACEFILE_VERSION			1
+
+#define TRACE_OP_PATH				1 // path definition: pathID; count: length of path that follows
+#define TRACE_OP_OPEN				2 // count: open flags; result: fd
+#define TRACE_OP_READ				3
+#define TRACE_OP_WRITE				4
+#define TRACE_OP_FSYNC				5
+#define TRACE_OP_FDATASYNC			6
+#define TRACE_OP_CLOSE				7 // recorded before the real close, so without duration
+
+#define TRACE_FLAG_MATCHED			1 // path matched a path file rule
+#define TRACE_FLAG_DIRECT			2 // fd was in O_DIRECT mode after the call
+#define TRACE_FLAG_VECTORED			4 // readv/writev-style call; count is the total of all iovecs
+
+#define TRACE_PATHID_NONE			0 // fd not tracked; path IDs start at 1
+#define TRACE_OFFSET_NONE			(~0ULL) // read/write at current file position
+#define TRACE_MAX_BUFALIGN_SHIFT	12 // buffer alignment of 4KiB and more is recorded as 4KiB
+#define TRACE_PATH_PADDING			8 // paths get zero-padded to a multiple of this
+
+
+struct TraceFileHeader
+{
+	char magic[8]; // TRACEFILE_MAGIC
+	uint32_t version; // TRACEFILE_VERSION
+	uint32_t recordLen; // sizeof(TraceRecord)
+	uint64_t startRealSec; // CLOCK_REALTIME seconds at trace start (for humans)
+	uint32_t pid;
+	uint32_t reserved;
+};
+
+struct TraceRecord
+{
+	uint64_t startNSec; // CLOCK_MONOTONIC nanoseconds since trace start
+	uint64_t offset; // file offset; TRACE_OFFSET_NONE for the current file position
+	uint64_t count; // requested bytes (or as noted for the op)
+	int64_t result; // return value of the call; -errno on error
+	uint32_t durationNSec; // saturated at UINT32_MAX
+	uint32_t pathID;
+	int32_t fd;
+	uint8_t op; // TRACE_OP_...
+	uint8_t bufAlignShift; // log2 of buffer address alignment, up to TRACE_MAX_BUFALIGN_SHIFT
+	uint8_t flags; // TRACE_FLAG_...
+	uint8_t reserved;
+};
+
+
+#endif /* TRACEFILE_H_ */
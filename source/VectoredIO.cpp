@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <cerrno>
+#include "Config.h"
+#include "FDStore.h"
+#include "Logger.h"
+#include "Probes.h"
+#include "VectoredIO.h"
+
+
+/**
+ * Check if a vectored read/write that failed getNeedsCoalesce() can be coalesced, i.e. whether the
+ * fd is in O_DIRECT mode and file offset and total length are aligned.
+ *
+ * @offset -1 for the current file position.
+ * @flags RWF_... flags of preadv2/pwritev2; 0 for the other calls.
+ */
+bool VectoredIOTk::checkCoalesce(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags)
+{
+#ifdef RWF_APPEND
+	if(flags & RWF_APPEND)
+		return false; // offset unknown
+#endif
+
+	int fdFlags;
+
+	if(!fdStore->getFDFlags(fd, fdFlags) || !(fdFlags & FDSTORE_FLAG_DIRECT) ||
+		(fdFlags & FDSTORE_FLAG_NOSPLIT) )
+		return false;
+
+	size_t count = 0;
+
+	for(int i=0; i < iovcnt; i++)
+		count += iov[i].iov_len;
+
+	if(offset == -1)
+	{
+		int savedErrno = errno;
+
+		offset = lseek(fd, 0, SEEK_CUR);
+
+		errno = savedErrno;
+
+		if(offset == -1)
+			return false;
+	}
+
+	if( (count | offset) & (VECTOREDIO_ALIGN - 1) )
+		return false; // bounce buffer wouldn't help, so leave it to the EINVAL fallback
+
+	PROBE(coalesce, fd, iovcnt, count);
+
+	if(libLogTopics & ENV_LOG_TOPIC_COALESCE)
+		log_fprintf(stderr, LOG_PREFIX "Coalescing vectored I/O. "
+			"fd: %d; iovcnt: %d; offset: %lld; count: %zu\n",
+			fd, iovcnt, (long long)offset, count);
+
+	return true;
+}
+
+/**
+ * Vectored read through the bounce buffer, for requests that passed checkCoalesce().
+ *
+ * @offset -1 for the current file position.
+ * @readFunc preadv64v2 of the real lib.
+ * @return same as the read function.
+ */
+ssize_t VectoredIOTk::readCoalesced(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags, VectoredIOFunc readFunc)
+{
+	if(getIsAligned(iov, iovcnt) )
+		return transferBatched(fd, iov, iovcnt, offset, flags, readFunc);
+
+	unsigned bufNode;
+	char* buf = bufferPool ? bufferPool->acquire(bufNode) : NULL;
+	if(!buf)
+		return readFunc(fd, iov, iovcnt, offset, flags);
+
+	size_t count = 0;
+
+	for(int i=0; i < iovcnt; i++)
+		count += iov[i].iov_len;
+
+	size_t numDone = 0;
+	ssize_t errorRes = 0; // result of failed read if nothing was read before
+	int iovIndex = 0; // scatter position
+	size_t iovPos = 0; // scatter position within iov[iovIndex]
+
+	while(numDone < count)
+	{
+		struct iovec bufIOV;
+
+		bufIOV.iov_base = buf;
+		bufIOV.iov_len = std::min<size_t>(count - numDone, BUFFERPOOL_BUF_SIZE);
+
+		ssize_t readRes = readFunc(fd, &bufIOV, 1, (offset == -1) ? -1 : offset + numDone,
+			flags);
+
+		if(readRes <= 0)
+		{
+			errorRes = readRes;
+			break;
+		}
+
+		for(size_t bufPos = 0; bufPos < (size_t)readRes; )
+		{
+			size_t copyLen = std::min(iov[iovIndex].iov_len - iovPos, readRes - bufPos);
+
+			memcpy( (char*)iov[iovIndex].iov_base + iovPos, buf + bufPos, copyLen);
+
+			bufPos += copyLen;
+			iovPos += copyLen;
+
+			if(iovPos == iov[iovIndex].iov_len)
+			{
+				iovIndex++;
+				iovPos = 0;
+			}
+		}
+
+		numDone += readRes;
+
+		if( (size_t)readRes < bufIOV.iov_len)
+			break; // end of file
+	}
+
+	bufferPool->release(buf, bufNode);
+
+	return numDone ? numDone : errorRes;
+}
+
+/**
+ * Vectored write through the bounce buffer, for requests that passed checkCoalesce().
+ *
+ * @offset -1 for the current file position.
+ * @writeFunc pwritev64v2 of the real lib.
+ * @return same as the write function.
+ */
+ssize_t VectoredIOTk::writeCoalesced(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags, VectoredIOFunc writeFunc)
+{
+	if(getIsAligned(iov, iovcnt) )
+		return transferBatched(fd, iov, iovcnt, offset, flags, writeFunc);
+
+	unsigned bufNode;
+	char* buf = bufferPool ? bufferPool->acquire(bufNode) : NULL;
+	if(!buf)
+		return writeFunc(fd, iov, iovcnt, offset, flags);
+
+	size_t numDone = 0;
+	ssize_t errorRes = 0; // result of failed write if nothing was written before
+	int iovIndex = 0; // gather position
+	size_t iovPos = 0; // gather position within iov[iovIndex]
+
+	for( ; ; )
+	{
+		struct iovec bufIOV;
+
+		bufIOV.iov_base = buf;
+		bufIOV.iov_len = 0;
+
+		while( (bufIOV.iov_len < BUFFERPOOL_BUF_SIZE) && (iovIndex < iovcnt) )
+		{
+			size_t copyLen = std::min(iov[iovIndex].iov_len - iovPos,
+				BUFFERPOOL_BUF_SIZE - bufIOV.iov_len);
+
+			memcpy(buf + bufIOV.iov_len, (char*)iov[iovIndex].iov_base + iovPos, copyLen);
+
+			bufIOV.iov_len += copyLen;
+			iovPos += copyLen;
+
+			if(iovPos == iov[iovIndex].iov_len)
+			{
+				iovIndex++;
+				iovPos = 0;
+			}
+		}
+
+		if(!bufIOV.iov_len)
+			break; // all written
+
+		ssize_t writeRes = writeFunc(fd, &bufIOV, 1, (offset == -1) ? -1 : offset + numDone,
+			flags);
+
+		if(writeRes <= 0)
+		{
+			errorRes = writeRes;
+			break;
+		}
+
+		numDone += writeRes;
+
+		if( (size_t)writeRes < bufIOV.iov_len)
+			break; // short write, e.g. disk full
+	}
+
+	bufferPool->release(buf, bufNode);
+
+	return numDone ? numDone : errorRes;
+}
+
+/**
+ * Pass on an aligned iovec list in batches of IOV_MAX iovecs.
+ */
+ssize_t VectoredIOTk::transferBatched(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags, VectoredIOFunc transferFunc)
+{
+	size_t numDone = 0;
+
+	for(int batchStart = 0; batchStart < iovcnt; batchStart += IOV_MAX)
+	{
+		int batchIOVCnt = std::min(iovcnt - batchStart, IOV_MAX);
+		size_t batchLen = 0;
+
+		for(int i = batchStart; i < (batchStart + batchIOVCnt); i++)
+			batchLen += iov[i].iov_len;
+
+		ssize_t transferRes = transferFunc(fd, &iov[batchStart], batchIOVCnt,
+			(offset == -1) ? -1 : offset + numDone, flags);
+
+		if(transferRes <= 0)
+			return numDone ? numDone : transferRes;
+
+		numDone += transferRes;
+
+		if( (size_t)transferRes < batchLen)
+			break;
+	}
+
+	return numDone;
+}
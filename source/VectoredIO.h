@@ -0,0 +1,87 @@
+#ifndef VECTOREDIO_H_
+#define VECTOREDIO_H_
+
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "BufferPool.h"
+#include "Common.h"
+
+
+#define VECTOREDIO_ALIGN			4096 // required alignment of buffers, lengths and offsets
+
+
+/* preadv64v2/pwritev64v2 are used for all transfers, because offset -1 means the current file
+	position there, so that they also cover readv/writev. */
+typedef ssize_t (*VectoredIOFunc)(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+	int flags);
+
+
+/**
+ * Toolkit to make vectored reads/writes with misaligned iovecs work on O_DIRECT fds. The kernel
+ * requires each iovec to be aligned for O_DIRECT, so e.g. the many small iovecs of serialization
+ * libraries would fail with EINVAL and thus lead to O_DIRECT being removed from the fd.
+ *
+ * If only the iovecs are misaligned, but file offset and total length are aligned, the iovecs get
+ * gathered into an aligned bounce buffer (from the BufferPool), which gets written as a
+ * single iovec or read into and scattered back to the iovecs. Requests larger than the bounce
+ * buffer get transferred in multiple chunks. Aligned lists that have more than IOV_MAX iovecs get
+ * passed on in batches of IOV_MAX iovecs without copying.
+ *
+ * Requests that don't qualify (or if no pool buffer is available) get passed on unmodified and thus still fall back to ejection.
+ * Transfers in multiple chunks or batches are not atomic with regard to concurrent writers of the
+ * same range.
+ */
+class VectoredIOTk
+{
+	public:
+		static bool checkCoalesce(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+			int flags);
+		static ssize_t readCoalesced(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+			int flags, VectoredIOFunc readFunc);
+		static ssize_t writeCoalesced(int fd, const struct iovec* iov, int iovcnt, off64_t offset,
+			int flags, VectoredIOFunc writeFunc);
+
+	private:
+		VectoredIOTk() {}
+
+		static ssize_t transferBatched(int fd, const struct iovec* iov, int iovcnt,
+			off64_t offset, int flags, VectoredIOFunc transferFunc);
+
+
+		// inliners
+	public:
+		/**
+		 * Cheap pre-check without fdStore access, so that aligned requests only cost a scan of the
+		 * iovecs.
+		 *
+		 * @return true if the given iovecs could not be passed to the kernel on an O_DIRECT fd.
+		 */
+		static bool getNeedsCoalesce(const struct iovec* iov, int iovcnt)
+		{
+			return (iovcnt > IOV_MAX) || !getIsAligned(iov, iovcnt);
+		}
+
+		static size_t getTotalLen(const struct iovec* iov, int iovcnt)
+		{
+			size_t totalLen = 0;
+
+			for(int i=0; i < iovcnt; i++)
+				totalLen += iov[i].iov_len;
+
+			return totalLen;
+		}
+
+	private:
+		static bool getIsAligned(const struct iovec* iov, int iovcnt)
+		{
+			for(int i=0; i < iovcnt; i++)
+				if( ( (uintptr_t)iov[i].iov_base | iov[i].iov_len) & (VECTOREDIO_ALIGN - 1) )
+					return false;
+
+			return true;
+		}
+};
+
+
+#endif /* VECTOREDIO_H_ */
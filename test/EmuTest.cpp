@@ -0,0 +1,494 @@
+/*
+ * Tests of the O_DIRECT code paths against the O_DIRECT emulation backend (see source/DirectEmu.h),
+ * so that they run on any filesystem: injection and ejection & retry after EINVAL, split
+ * pread/pwrite, coalescing of misaligned vectored reads/writes and mmaps served from direct reads.
+ * Each test checks the results, the file position and the O_DIRECT state of the fd.
+ *
+ * It is used with a dir as argument, which needs to be matched by the path file, and with the env
+ * variables of "make check-emu" (see test/Makefile), which the sizes below need to match.
+ *
+ * Example, called from the source root directory:
+ * $ make test
+ * $ mkdir /tmp/emu-test && echo '/tmp/emu-test/*' > /tmp/pathfile
+ * $ LD_VAST_PATHFILE=/tmp/pathfile LD_VAST_SPLIT_SIZE=128K LD_VAST_SPLIT_CHUNK=64K \
+ * 	LD_VAST_SPLIT_FDS=2 LD_VAST_MMAP_SIZE=1M LD_PRELOAD=test/libvastpreload-emu.so \
+ * 	test/emu-test /tmp/emu-test
+ */
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <limits.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+#define EMUTEST_BLOCK_SIZE		4096
+#define EMUTEST_MISALIGNED_LEN	100
+#define EMUTEST_SPLIT_CHUNK		(64*1024) // LD_VAST_SPLIT_CHUNK of check-emu
+#define EMUTEST_SPLIT_LEN		(5 * EMUTEST_SPLIT_CHUNK / 2) // >= LD_VAST_SPLIT_SIZE of check-emu
+#define EMUTEST_MMAP_LEN		(2*1024*1024 + EMUTEST_MISALIGNED_LEN) // >= LD_VAST_MMAP_SIZE
+
+
+static bool checkDirect(int fd, bool expectDirect, const char* stepName)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if( (flags == -1) || ( (bool)(flags & O_DIRECT) != expectDirect) )
+	{
+		std::cerr << "ERROR: " << stepName << ": O_DIRECT " <<
+			(expectDirect ? "not set" : "still set") << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+static bool checkPosition(int fd, off_t expectPos, const char* stepName)
+{
+	off_t pos = lseek(fd, 0, SEEK_CUR);
+
+	if(pos != expectPos)
+	{
+		std::cerr << "ERROR: " << stepName << ": File position is " << pos << " instead of " <<
+			expectPos << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+static void fillPattern(char* buf, size_t len, unsigned seed)
+{
+	for(size_t i = 0; i < len; i++)
+		buf[i] = (char)( (i * 7 + seed) % 251);
+}
+
+/**
+ * Open a file in the test dir and check that it got O_DIRECT injected.
+ *
+ * @return -1 on error.
+ */
+static int openDirect(std::string path, int flags)
+{
+	int fd = open(path.c_str(), flags, 0644);
+	if(fd == -1)
+	{
+		std::cerr << "ERROR: Opening file failed: " << path << "; " <<
+			"Error: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	if(!checkDirect(fd, true, "open") )
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * @return number of open fds of this process that refer to the given file, e.g. to find out
+ * 		whether the lib opened extra fds for split reads/writes.
+ */
+static unsigned countFileFDs(std::string path)
+{
+	char realPath[PATH_MAX];
+	char linkBuf[PATH_MAX];
+	unsigned numFDs = 0;
+
+	if(!realpath(path.c_str(), realPath) )
+		return 0;
+
+	DIR* dir = opendir("/proc/self/fd");
+	if(!dir)
+		return 0;
+
+	while(struct dirent* dirent = readdir(dir) )
+	{
+		std::string linkPath = std::string("/proc/self/fd/") + dirent->d_name;
+
+		ssize_t linkLen = readlink(linkPath.c_str(), linkBuf, sizeof(linkBuf) - 1);
+		if(linkLen <= 0)
+			continue;
+
+		linkBuf[linkLen] = 0;
+
+		if(!strcmp(linkBuf, realPath) )
+			numFDs++;
+	}
+
+	closedir(dir);
+
+	return numFDs;
+}
+
+/**
+ * @return true if the given address is in an anonymous mapping, i.e. an mmap that the lib served
+ * 		from direct reads instead of a file mapping.
+ */
+static bool checkIsAnonMapping(const void* addr)
+{
+	FILE* mapsFile = fopen("/proc/self/maps", "r");
+	if(!mapsFile)
+		return false;
+
+	char lineBuf[PATH_MAX + 256];
+	bool isAnon = false;
+
+	while(fgets(lineBuf, sizeof(lineBuf), mapsFile) )
+	{
+		unsigned long start;
+		unsigned long end;
+		unsigned long inode;
+
+		if(sscanf(lineBuf, "%lx-%lx %*s %*s %*s %lu", &start, &end, &inode) != 3)
+			continue;
+
+		if( ( (unsigned long)addr >= start) && ( (unsigned long)addr < end) )
+		{
+			isAnon = !inode;
+			break;
+		}
+	}
+
+	fclose(mapsFile);
+
+	return isAnon;
+}
+
+/**
+ * Aligned write keeps O_DIRECT, misaligned write gets EINVAL, so that the lib removes O_DIRECT and
+ * retries.
+ */
+static bool testInjectEject(std::string dirPath)
+{
+	char* buf;
+
+	if(posix_memalign( (void**)&buf, EMUTEST_BLOCK_SIZE, 2 * EMUTEST_BLOCK_SIZE) )
+	{
+		std::cerr << "ERROR: Buffer allocation failed" << std::endl;
+		return false;
+	}
+
+	memset(buf, 'a', 2 * EMUTEST_BLOCK_SIZE);
+
+	int fd = openDirect(dirPath + "/inject.dat", O_RDWR | O_CREAT | O_TRUNC);
+	if(fd == -1)
+		return false;
+
+	// aligned write keeps O_DIRECT
+
+	if(pwrite(fd, buf, EMUTEST_BLOCK_SIZE, 0) != EMUTEST_BLOCK_SIZE)
+	{
+		std::cerr << "ERROR: Aligned write failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(!checkDirect(fd, true, "aligned write") )
+		return false;
+
+	// misaligned write gets EINVAL, so the lib removes O_DIRECT and retries
+
+	memset(buf + 1, 'b', EMUTEST_MISALIGNED_LEN);
+
+	if(pwrite(fd, buf + 1, EMUTEST_MISALIGNED_LEN, EMUTEST_BLOCK_SIZE) !=
+		EMUTEST_MISALIGNED_LEN)
+	{
+		std::cerr << "ERROR: Misaligned write failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(!checkDirect(fd, false, "misaligned write") )
+		return false;
+
+	char readBuf[EMUTEST_MISALIGNED_LEN];
+
+	if( (pread(fd, readBuf, sizeof(readBuf), EMUTEST_BLOCK_SIZE) != sizeof(readBuf) ) ||
+		memcmp(readBuf, buf + 1, sizeof(readBuf) ) )
+	{
+		std::cerr << "ERROR: Reading back misaligned write failed" << std::endl;
+		return false;
+	}
+
+	if(fsync(fd) )
+	{
+		std::cerr << "ERROR: fsync failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	close(fd);
+	free(buf);
+
+	return true;
+}
+
+/**
+ * Split pwrite and split pread with a short read at end of file, which ends in the middle of a
+ * chunk.
+ */
+static bool testSplit(std::string dirPath)
+{
+	std::string path = dirPath + "/split.dat";
+	char* buf;
+	char* readBuf;
+
+	if(posix_memalign( (void**)&buf, EMUTEST_BLOCK_SIZE, EMUTEST_SPLIT_LEN) ||
+		posix_memalign( (void**)&readBuf, EMUTEST_BLOCK_SIZE, 2 * EMUTEST_SPLIT_LEN) )
+	{
+		std::cerr << "ERROR: Buffer allocation failed" << std::endl;
+		return false;
+	}
+
+	fillPattern(buf, EMUTEST_SPLIT_LEN, 1);
+
+	int fd = openDirect(path, O_RDWR | O_CREAT | O_TRUNC);
+	if(fd == -1)
+		return false;
+
+	if(pwrite(fd, buf, EMUTEST_SPLIT_LEN, 0) != EMUTEST_SPLIT_LEN)
+	{
+		std::cerr << "ERROR: Split write failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(!checkDirect(fd, true, "split write") || !checkPosition(fd, 0, "split write") )
+		return false;
+
+	if(countFileFDs(path) < 2)
+	{
+		std::cerr << "ERROR: split write: No extra fds opened" << std::endl;
+		return false;
+	}
+
+	memset(readBuf, 0, 2 * EMUTEST_SPLIT_LEN);
+
+	ssize_t readRes = pread(fd, readBuf, 2 * EMUTEST_SPLIT_LEN, 0);
+
+	if(readRes != EMUTEST_SPLIT_LEN)
+	{
+		std::cerr << "ERROR: Split read: Result is " << readRes << " instead of " <<
+			EMUTEST_SPLIT_LEN << "; Error: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(memcmp(readBuf, buf, EMUTEST_SPLIT_LEN) )
+	{
+		std::cerr << "ERROR: Split read: Data mismatch" << std::endl;
+		return false;
+	}
+
+	if(!checkDirect(fd, true, "split read") || !checkPosition(fd, 0, "split read") )
+		return false;
+
+	close(fd);
+	free(buf);
+	free(readBuf);
+
+	return true;
+}
+
+/**
+ * Misaligned iovecs at aligned offsets get coalesced, so that the fd keeps O_DIRECT.
+ */
+static bool testVectored(std::string dirPath)
+{
+	char* buf;
+	char* readBuf;
+	char expectBuf[EMUTEST_BLOCK_SIZE];
+
+	if(posix_memalign( (void**)&buf, EMUTEST_BLOCK_SIZE, 2 * EMUTEST_BLOCK_SIZE) ||
+		posix_memalign( (void**)&readBuf, EMUTEST_BLOCK_SIZE, 2 * EMUTEST_BLOCK_SIZE) )
+	{
+		std::cerr << "ERROR: Buffer allocation failed" << std::endl;
+		return false;
+	}
+
+	fillPattern(buf, 2 * EMUTEST_BLOCK_SIZE, 2);
+
+	// misaligned addresses and lengths, but the total is a full block
+	const struct iovec writeIOV[] =
+		{ {buf + 1, 1000}, {buf + 1100, 2000}, {buf + 3200, EMUTEST_BLOCK_SIZE - 3000} };
+	const struct iovec readIOV[] =
+		{ {readBuf + 3, EMUTEST_BLOCK_SIZE / 2}, {readBuf + 3000, EMUTEST_BLOCK_SIZE / 2} };
+
+	size_t expectLen = 0;
+
+	for(const struct iovec& iov : writeIOV)
+	{
+		memcpy(expectBuf + expectLen, iov.iov_base, iov.iov_len);
+		expectLen += iov.iov_len;
+	}
+
+	int fd = openDirect(dirPath + "/vectored.dat", O_RDWR | O_CREAT | O_TRUNC);
+	if(fd == -1)
+		return false;
+
+	if(writev(fd, writeIOV, 3) != EMUTEST_BLOCK_SIZE)
+	{
+		std::cerr << "ERROR: writev failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(!checkDirect(fd, true, "writev") || !checkPosition(fd, EMUTEST_BLOCK_SIZE, "writev") )
+		return false;
+
+	if(pwritev(fd, writeIOV, 3, EMUTEST_BLOCK_SIZE) != EMUTEST_BLOCK_SIZE)
+	{
+		std::cerr << "ERROR: pwritev failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(!checkDirect(fd, true, "pwritev") || !checkPosition(fd, EMUTEST_BLOCK_SIZE, "pwritev") )
+		return false;
+
+	lseek(fd, 0, SEEK_SET);
+
+	for(int i = 0; i < 2; i++)
+	{ // readv at file position, then preadv of the second block
+		const char* stepName = i ? "preadv" : "readv";
+
+		memset(readBuf, 0, 2 * EMUTEST_BLOCK_SIZE);
+
+		ssize_t readRes = i ? preadv(fd, readIOV, 2, EMUTEST_BLOCK_SIZE) : readv(fd, readIOV, 2);
+
+		if( (readRes != EMUTEST_BLOCK_SIZE) ||
+			memcmp(readIOV[0].iov_base, expectBuf, readIOV[0].iov_len) ||
+			memcmp(readIOV[1].iov_base, expectBuf + readIOV[0].iov_len, readIOV[1].iov_len) )
+		{
+			std::cerr << "ERROR: " << stepName << ": Result or data mismatch" << std::endl;
+			return false;
+		}
+
+		if(!checkDirect(fd, true, stepName) || !checkPosition(fd, EMUTEST_BLOCK_SIZE, stepName) )
+			return false;
+	}
+
+	close(fd);
+	free(buf);
+	free(readBuf);
+
+	return true;
+}
+
+/**
+ * Read-only mmap gets served from direct reads and keeps the file contents after
+ * madvise(MADV_DONTNEED). The file ends in the middle of a page.
+ */
+static bool testMmap(std::string dirPath)
+{
+	std::string path = dirPath + "/mmap.dat";
+	char* buf = (char*)malloc(EMUTEST_MMAP_LEN);
+
+	if(!buf)
+	{
+		std::cerr << "ERROR: Buffer allocation failed" << std::endl;
+		return false;
+	}
+
+	fillPattern(buf, EMUTEST_MMAP_LEN, 3);
+
+	int writeFD = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if( (writeFD == -1) || (write(writeFD, buf, EMUTEST_MMAP_LEN) != EMUTEST_MMAP_LEN) )
+	{
+		std::cerr << "ERROR: Creating mmap file failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	close(writeFD);
+
+	int fd = openDirect(path, O_RDONLY);
+	if(fd == -1)
+		return false;
+
+	const size_t mapLen = (EMUTEST_MMAP_LEN + EMUTEST_BLOCK_SIZE - 1) & ~(EMUTEST_BLOCK_SIZE - 1);
+
+	char* mapping = (char*)mmap(NULL, EMUTEST_MMAP_LEN, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if(mapping == MAP_FAILED)
+	{
+		std::cerr << "ERROR: mmap failed: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if(!checkIsAnonMapping(mapping) )
+	{
+		std::cerr << "ERROR: mmap: Not served from direct reads" << std::endl;
+		return false;
+	}
+
+	for(int i = 0; i < 2; i++)
+	{ // check contents after mmap and again after madvise
+		const char* stepName = i ? "madvise" : "mmap";
+
+		if(i && madvise(mapping, EMUTEST_MMAP_LEN, MADV_DONTNEED) )
+		{
+			std::cerr << "ERROR: madvise failed: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		if(memcmp(mapping, buf, EMUTEST_MMAP_LEN) )
+		{
+			std::cerr << "ERROR: " << stepName << ": Data mismatch" << std::endl;
+			return false;
+		}
+
+		for(size_t pos = EMUTEST_MMAP_LEN; pos < mapLen; pos++)
+			if(mapping[pos])
+			{
+				std::cerr << "ERROR: " << stepName << ": Not zero beyond end of file" << std::endl;
+				return false;
+			}
+
+		if(!checkDirect(fd, true, stepName) || !checkPosition(fd, 0, stepName) )
+			return false;
+	}
+
+	munmap(mapping, EMUTEST_MMAP_LEN);
+	close(fd);
+	free(buf);
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc != 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <dir>" << std::endl;
+		return 1;
+	}
+
+	const std::string dirPath = argv[1];
+
+	const struct
+	{
+		const char* name;
+		bool (*testFunc)(std::string dirPath);
+	} tests[] =
+	{
+		{"inject/eject", testInjectEject},
+		{"split", testSplit},
+		{"vectored", testVectored},
+		{"mmap", testMmap},
+	};
+
+	for(const auto& test : tests)
+	{
+		if(!test.testFunc(dirPath) )
+		{
+			std::cerr << "ERROR: Test failed: " << test.name << std::endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,682 @@
+/**
+ * pathmatch-bench: Benchmark of the path matcher and of the path normalization in
+ * InjectionTk::injectAfterOpen(), to get evidence for (or against) changes of PathMatchStore and
+ * PathTree.
+ *
+ * Pattern sets of different sizes get generated from the path corpus (literal paths and dirs,
+ * "*" suffix globs, mid-path wildcards and "?") and loaded through a text path file. The corpus gets
+ * replayed through checkPathMatch() and through PathTree lookup & materialize (with "//", "/./" and
+ * ".." inserted). Reported are build time, image memory and ns per lookup.
+ *
+ * Every result is cross-checked against reference semantics: The first rule in path file order of
+ * which the pattern matches as an ECMAScript std::regex ("?" as ".", "*" as ".*", like in the
+ * regex-based matcher of earlier versions) and a string-based lexical normalization. Any mismatch
+ * is printed and makes the benchmark exit with 1.
+ *
+ * Examples:
+ * $ make bench
+ * $ find /data -xdev > /tmp/paths.txt
+ * $ test/pathmatch-bench -p /tmp/paths.txt -r 10,1000,100000
+ */
+
+#include <chrono>
+#include <getopt.h>
+#include <memory>
+#include <random>
+#include <regex>
+#include <unordered_map>
+#include "PathMatchStore.h"
+#include "PathTree.h"
+
+#define BENCH_DEFAULT_RULE_COUNTS	"10,100,1000,10000,100000"
+#define BENCH_DEFAULT_NUM_PATHS		100000
+#define BENCH_DEFAULT_DEPTH			8
+#define BENCH_DEFAULT_ITERATIONS	3
+#define BENCH_DIR_FANOUT			12 // subdirs per dir of the synthetic tree
+#define BENCH_MAX_PRINTED_ERRORS	10
+
+
+typedef std::chrono::steady_clock BenchClock;
+typedef std::vector<size_t> SizeTVec;
+
+/**
+ * Reference implementation of the path file semantics. Intentionally simple and independent of
+ * PathMatchImage, so it's slow; only the candidate selection by literal prefix avoids evaluating
+ * all regexes for each path.
+ */
+class ReferenceMatcher
+{
+	public:
+		ReferenceMatcher(const StringVec& patterns) : patterns(patterns), regexes(patterns.size() )
+		{
+			for(size_t i=0; i < patterns.size(); i++)
+				literalPrefixMap[patterns[i].substr(0, patterns[i].find_first_of("*?") )].push_back(
+					i);
+		}
+
+		/**
+		 * @return index of first matching pattern or -1 if no pattern matches.
+		 */
+		int findMatchingRule(const std::string& path)
+		{
+			int bestRuleIndex = -1;
+			std::string prefix;
+
+			// a rule can only match if its literal prefix is a prefix of path
+
+			for(size_t prefixLen = 0; prefixLen <= path.length(); prefixLen++)
+			{
+				prefix.assign(path, 0, prefixLen);
+
+				std::unordered_map<std::string, SizeTVec>::const_iterator iter =
+					literalPrefixMap.find(prefix);
+
+				if(iter == literalPrefixMap.end() )
+					continue;
+
+				for(size_t ruleIndex : iter->second) // (ascending)
+				{
+					if( (bestRuleIndex != -1) && (ruleIndex >= (size_t)bestRuleIndex) )
+						break;
+
+					if(std::regex_match(path, getRegex(ruleIndex) ) )
+					{
+						bestRuleIndex = ruleIndex;
+						break;
+					}
+				}
+			}
+
+			return bestRuleIndex;
+		}
+
+		/**
+		 * Lexical normalization: skip empty and "." components, ".." removes the previous component
+		 * and stays at root.
+		 */
+		static std::string normalize(const std::string& path)
+		{
+			StringVec components;
+			StringVec resultComponents;
+
+			boost::split(components, path, boost::is_any_of("/") );
+
+			for(const std::string& component : components)
+			{
+				if(component.empty() || (component == ".") )
+					continue;
+
+				if(component == "..")
+				{
+					if(!resultComponents.empty() )
+						resultComponents.pop_back();
+
+					continue;
+				}
+
+				resultComponents.push_back(component);
+			}
+
+			return "/" + boost::join(resultComponents, "/");
+		}
+
+	private:
+		const StringVec& patterns;
+		std::vector<std::unique_ptr<std::regex> > regexes; // compiled on first use
+		std::unordered_map<std::string, SizeTVec> literalPrefixMap; // value: rule indices
+
+		const std::regex& getRegex(size_t ruleIndex)
+		{
+			if(!regexes[ruleIndex])
+				regexes[ruleIndex].reset(new std::regex(wildcardStrToRegexStr(patterns[ruleIndex]),
+					std::regex_constants::ECMAScript) );
+
+			return *regexes[ruleIndex];
+		}
+
+		static std::string wildcardStrToRegexStr(const std::string& wildcardStr)
+		{
+			std::string regexStr;
+
+			for(char c : wildcardStr)
+			{
+				if(c == '?')
+					regexStr += ".";
+				else
+				if(c == '*')
+					regexStr += ".*";
+				else
+				if(strchr("\\^$.|+()[]{}/", c) )
+				{
+					regexStr += '\\';
+					regexStr += c;
+				}
+				else
+					regexStr += c;
+			}
+
+			return regexStr;
+		}
+};
+
+
+static void printUsage(const char* progName)
+{
+	std::cout <<
+		"Usage: " << progName << " [-p FILE] [-n NUM] [-d NUM] [-r LIST] [-i NUM] [-s NUM]" <<
+		std::endl <<
+		std::endl <<
+		"Benchmark path matching & normalization and cross-check all results against the" <<
+		std::endl <<
+		"reference semantics. Exits with 1 on any mismatch." << std::endl <<
+		std::endl <<
+		"Options:" << std::endl <<
+		"  -p FILE  Path corpus, one absolute path per line (e.g. output of \"find\")." <<
+		std::endl <<
+		"           Default: generated deep dir tree." << std::endl <<
+		"  -n NUM   Number of paths of generated tree. (Default: " <<
+			BENCH_DEFAULT_NUM_PATHS << ")" << std::endl <<
+		"  -d NUM   Max depth of generated tree. (Default: " << BENCH_DEFAULT_DEPTH << ")" <<
+			std::endl <<
+		"  -r LIST  Comma-separated numbers of rules. (Default: " <<
+			BENCH_DEFAULT_RULE_COUNTS << ")" << std::endl <<
+		"  -i NUM   Timed passes over the corpus. (Default: " << BENCH_DEFAULT_ITERATIONS << ")" <<
+			std::endl <<
+		"  -s NUM   Random seed. (Default: 1)" << std::endl <<
+		"  -h       Print this help." << std::endl;
+}
+
+static uint64_t getElapsedNS(BenchClock::time_point startTime)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		BenchClock::now() - startTime).count();
+}
+
+/**
+ * @return resident set size of this process in bytes.
+ */
+static size_t getRSS()
+{
+	size_t numPages = 0;
+	size_t numResidentPages = 0;
+
+	FILE* file = fopen("/proc/self/statm", "r");
+	if(!file)
+		return 0;
+
+	if(fscanf(file, "%zu %zu", &numPages, &numResidentPages) != 2)
+		numResidentPages = 0;
+
+	fclose(file);
+
+	return numResidentPages * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Generate paths of a dir tree with random depth, including some names with regex special chars
+ * and a line break (which wildcards don't match).
+ */
+static void generateTreeCorpus(size_t numPaths, unsigned maxDepth, std::mt19937_64& random,
+	StringVec& outPaths)
+{
+	const char* specialNames[] = { "a+b", "(x)", "$y", "{z}", "[w]", "dot.name", "q^", "p|q",
+		"back\\slash", "nl\nname", "sp ace" };
+	const char* extensions[] = { "dat", "log", "h5", "tmp" };
+	const size_t numSpecialNames = sizeof(specialNames) / sizeof(specialNames[0]);
+
+	for(size_t i=0; i < numPaths; i++)
+	{
+		unsigned depth = 1 + (random() % maxDepth);
+		std::string path = "/bench";
+
+		for(unsigned level = 0; level < depth; level++)
+		{
+			if(!(random() % 50) )
+				path += std::string("/") + specialNames[random() % numSpecialNames];
+			else
+				path += "/d" + std::to_string(random() % BENCH_DIR_FANOUT);
+		}
+
+		path += "/file" + std::to_string(random() % 100) + "." + extensions[random() % 4];
+
+		outPaths.push_back(path);
+	}
+}
+
+/**
+ * @return false if file could not be read or contains no absolute paths.
+ */
+static bool loadCorpusFile(std::string path, StringVec& outPaths)
+{
+	std::ifstream fileStream(path.c_str() );
+	std::string lineStr;
+
+	if(!fileStream)
+	{
+		std::cerr << "ERROR: Open of corpus file failed: " << path << std::endl;
+		return false;
+	}
+
+	while(std::getline(fileStream, lineStr) )
+	{
+		if(!lineStr.empty() && (lineStr[0] == '/') )
+			outPaths.push_back(lineStr);
+	}
+
+	if(outPaths.empty() )
+	{
+		std::cerr << "ERROR: Corpus file contains no absolute paths: " << path << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Generate a pattern from a random corpus path. Kinds rotate through literal paths and dirs (30%),
+ * "*" suffix globs (40%), partial name globs, mid-path "*" and "?" (10% each).
+ *
+ * @return empty string if the path can't be turned into a valid path file line.
+ */
+static std::string generatePattern(const StringVec& corpus, size_t patternIndex,
+	std::mt19937_64& random)
+{
+	std::string path = corpus[random() % corpus.size()];
+	StringVec components;
+
+	boost::split(components, path, boost::is_any_of("/") ); // (components[0] is empty)
+
+	size_t numComponents = components.size();
+
+	if(numComponents < 2)
+		return "";
+
+	/* drop up to two trailing components, but keep at least two (plus the leading empty one) to
+		avoid that a few very coarse patterns like "/bench/*" match everything */
+	size_t minKept = std::min(numComponents, (size_t)3);
+
+	components.resize(std::max(minKept, numComponents - (random() % 3) ) );
+
+	// wildcards go into the deeper half of the path, like in typical path files
+	size_t minWildcardIndex = std::max( (size_t)2, components.size() / 2);
+
+	switch(patternIndex % 10)
+	{
+		case 0:
+		case 1:
+		case 2: // literal path or dir
+			break;
+
+		case 3:
+		case 4:
+		case 5:
+		case 6: // suffix glob
+			components.push_back("*");
+			break;
+
+		case 7: // partial name suffix glob
+		{
+			std::string& lastComponent = components.back();
+
+			lastComponent = lastComponent.substr(0, random() % (lastComponent.length() + 1) ) +
+				"*";
+		} break;
+
+		case 8: // mid-path wildcard
+		{
+			if(components.size() > minWildcardIndex)
+				components[minWildcardIndex +
+					(random() % (components.size() - minWildcardIndex) )] = "*";
+
+			components.push_back( (random() % 2) ? "*" : "*.dat");
+		} break;
+
+		case 9: // single char wildcards
+		{
+			for(unsigned i=0; (i < 2) && (components.size() > minWildcardIndex); i++)
+			{
+				std::string& component = components[minWildcardIndex +
+					(random() % (components.size() - minWildcardIndex) )];
+
+				if(!component.empty() )
+					component[random() % component.length()] = '?';
+			}
+		} break;
+	}
+
+	std::string pattern = boost::join(components, "/");
+
+	// must survive path file parsing unchanged
+
+	if( (pattern.length() < 2) || (pattern != boost::trim_copy(pattern) ) ||
+		(pattern.find_first_of("\n\r") != std::string::npos) )
+		return "";
+
+	return pattern;
+}
+
+/**
+ * Insert "//", "/./" and "dir/.." at random places and occasionally append "/" or "/.".
+ */
+static std::string messUpPath(const std::string& path, std::mt19937_64& random)
+{
+	std::string messyPath;
+
+	for(char c : path)
+	{
+		messyPath += c;
+
+		if(c != '/')
+			continue;
+
+		switch(random() % 8)
+		{
+			case 0: messyPath += "/"; break;
+			case 1: messyPath += "./"; break;
+			case 2: messyPath += "tmp/../"; break;
+			default: break;
+		}
+	}
+
+	switch(random() % 8)
+	{
+		case 0: messyPath += "/"; break;
+		case 1: messyPath += "/."; break;
+		default: break;
+	}
+
+	return messyPath;
+}
+
+/**
+ * Print the result line of a rule count and cross-check all matches.
+ *
+ * @return number of mismatches.
+ */
+static size_t benchMatch(const StringVec& corpus, size_t numRules, unsigned numIterations,
+	std::mt19937_64& random)
+{
+	StringVec patterns;
+	StringSet patternSet;
+
+	for(size_t i=0; (patterns.size() < numRules) && (i < (numRules * 10) ); i++)
+	{
+		std::string pattern = generatePattern(corpus, patterns.size(), random);
+
+		if(!pattern.empty() && patternSet.insert(pattern).second)
+			patterns.push_back(pattern);
+	}
+
+	char pathFileTemplate[] = "/tmp/pathmatch-bench.XXXXXX";
+
+	int pathFileFD = mkstemp(pathFileTemplate);
+	if(pathFileFD == -1)
+	{
+		std::cerr << "ERROR: Creation of temporary path file failed: " << strerror(errno) <<
+			std::endl;
+		return 1;
+	}
+
+	std::string pathFileContents = boost::join(patterns, "\n") + "\n";
+
+	bool writeRes = (write(pathFileFD, pathFileContents.data(), pathFileContents.length() ) ==
+		(ssize_t)pathFileContents.length() );
+
+	close(pathFileFD);
+
+	PathMatchStore store;
+
+	size_t rssBeforeLoad = getRSS();
+	BenchClock::time_point loadStartTime = BenchClock::now();
+
+	bool loadRes = writeRes && store.loadPathFile(pathFileTemplate);
+
+	uint64_t loadNS = getElapsedNS(loadStartTime);
+	size_t rssAfterLoad = getRSS();
+
+	unlink(pathFileTemplate);
+
+	if(!loadRes || ( (size_t)store.size() != patterns.size() ) )
+	{
+		std::cerr << "ERROR: Loading of generated path file failed. Rules: " << patterns.size() <<
+			std::endl;
+		return 1;
+	}
+
+	// timed passes
+
+	size_t numHits = 0;
+	uint64_t matchNS = 0;
+
+	for(unsigned iteration = 0; iteration < numIterations; iteration++)
+	{
+		BenchClock::time_point startTime = BenchClock::now();
+
+		for(const std::string& path : corpus)
+			numHits += store.checkPathMatch(path);
+
+		matchNS += getElapsedNS(startTime);
+	}
+
+	// cross-check
+
+	ReferenceMatcher reference(patterns);
+	size_t numMismatches = 0;
+
+	for(const std::string& path : corpus)
+	{
+		const PathMatchImageRule* rule = store.getMatchingRule(path);
+
+		int ruleIndex = rule ? (rule - PathMatchImage::getRules(store.getImage() ) ) : -1;
+		int referenceRuleIndex = reference.findMatchingRule(path);
+
+		if(ruleIndex == referenceRuleIndex)
+			continue;
+
+		if(numMismatches++ < BENCH_MAX_PRINTED_ERRORS)
+			std::cerr << "MISMATCH: path: " << path << "; " <<
+				"rule: " << ( (ruleIndex < 0) ? "<none>" : patterns[ruleIndex]) << "; " <<
+				"reference rule: " <<
+					( (referenceRuleIndex < 0) ? "<none>" : patterns[referenceRuleIndex]) <<
+				std::endl;
+	}
+
+	const PathMatchImageHeader* image = store.getImage();
+	size_t numLookups = corpus.size() * numIterations;
+
+	printf("%8zu %10.2f %10.1f %8u %8.1f %10.1f %7.1f%% %s\n",
+		patterns.size(), loadNS / 1e6, image->imageLen / 1024.0, image->numGroups,
+		(rssAfterLoad - std::min(rssBeforeLoad, rssAfterLoad) ) / 1048576.0,
+		numLookups ? ( (double)matchNS / numLookups) : 0,
+		numLookups ? (100.0 * numHits / numLookups) : 0,
+		numMismatches ? "MISMATCH" : "OK");
+
+	return numMismatches;
+}
+
+/**
+ * Time lookup & materialize of messed up corpus paths in a PathTree, first with an empty tree and
+ * then with all nodes existing, and cross-check against the reference normalization.
+ *
+ * @return number of mismatches.
+ */
+static size_t benchNormalize(const StringVec& corpus, std::mt19937_64& random)
+{
+	StringVec messyPaths;
+
+	for(const std::string& path : corpus)
+		messyPaths.push_back(messUpPath(path, random) );
+
+	PathTree tree;
+	std::vector<PathTreeNode*> nodes;
+	std::vector<PathTreeNode*> warmNodes;
+	size_t numMismatches = 0;
+	size_t materializedLenSum = 0; // to avoid that materialize gets optimized away
+
+	nodes.reserve(messyPaths.size() );
+	warmNodes.reserve(messyPaths.size() );
+
+	size_t rssBeforeTree = getRSS();
+	BenchClock::time_point coldStartTime = BenchClock::now();
+
+	for(const std::string& path : messyPaths)
+	{
+		PathTreeNode* node = tree.lookupAbsolute(path.c_str(), true);
+
+		materializedLenSum += PathTree::materialize(node).length();
+		nodes.push_back(node);
+	}
+
+	uint64_t coldNS = getElapsedNS(coldStartTime);
+	size_t rssAfterTree = getRSS();
+	BenchClock::time_point warmStartTime = BenchClock::now();
+
+	for(const std::string& path : messyPaths)
+	{
+		PathTreeNode* node = tree.lookupAbsolute(path.c_str(), true);
+
+		materializedLenSum += PathTree::materialize(node).length();
+		warmNodes.push_back(node);
+	}
+
+	uint64_t warmNS = getElapsedNS(warmStartTime);
+	size_t numNodes = tree.size();
+
+	for(size_t i=0; i < messyPaths.size(); i++)
+	{
+		const std::string& materializedPath = PathTree::materialize(nodes[i]);
+		std::string referencePath = ReferenceMatcher::normalize(messyPaths[i]);
+
+		if(materializedPath != referencePath)
+		{
+			if(numMismatches++ < BENCH_MAX_PRINTED_ERRORS)
+				std::cerr << "MISMATCH: normalized path: " << messyPaths[i] << "; " <<
+					"result: " << materializedPath << "; " <<
+					"reference: " << referencePath << std::endl;
+		}
+
+		// raw mode needs to keep the path exactly as it was given
+
+		PathTreeNode* rawNode = tree.lookupAbsolute(messyPaths[i].c_str(), false);
+
+		if(PathTree::materialize(rawNode) != messyPaths[i])
+		{
+			if(numMismatches++ < BENCH_MAX_PRINTED_ERRORS)
+				std::cerr << "MISMATCH: raw path: " << messyPaths[i] << "; " <<
+					"result: " << PathTree::materialize(rawNode) << std::endl;
+		}
+
+		tree.release(rawNode);
+		tree.release(nodes[i]);
+		tree.release(warmNodes[i]);
+	}
+
+	printf("normalize: paths: %zu; cold ns/lookup: %.1f; warm ns/lookup: %.1f; nodes: %zu; "
+		"rss MiB: %.1f; avg len: %.1f; %s\n",
+		messyPaths.size(), (double)coldNS / messyPaths.size(), (double)warmNS / messyPaths.size(),
+		numNodes, (rssAfterTree - std::min(rssBeforeTree, rssAfterTree) ) / 1048576.0,
+		(double)materializedLenSum / (2 * messyPaths.size() ),
+		numMismatches ? "MISMATCH" : "OK");
+
+	return numMismatches;
+}
+
+int main(int argc, char** argv)
+{
+	std::string corpusPath;
+	size_t numPaths = BENCH_DEFAULT_NUM_PATHS;
+	unsigned maxDepth = BENCH_DEFAULT_DEPTH;
+	std::string ruleCountsStr = BENCH_DEFAULT_RULE_COUNTS;
+	unsigned numIterations = BENCH_DEFAULT_ITERATIONS;
+	uint64_t seed = 1;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "p:n:d:r:i:s:h") ) != -1)
+	{
+		switch(opt)
+		{
+			case 'p':
+				corpusPath = optarg;
+				break;
+
+			case 'n':
+				numPaths = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'd':
+				maxDepth = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'r':
+				ruleCountsStr = optarg;
+				break;
+
+			case 'i':
+				numIterations = strtoul(optarg, NULL, 10);
+				break;
+
+			case 's':
+				seed = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'h':
+				printUsage(argv[0]);
+				return 0;
+
+			default:
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	if( (optind != argc) || !numPaths || !maxDepth || !numIterations)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	std::mt19937_64 random(seed);
+	StringVec corpus;
+
+	if(corpusPath.empty() )
+		generateTreeCorpus(numPaths, maxDepth, random, corpus);
+	else
+	if(!loadCorpusFile(corpusPath, corpus) )
+		return 1;
+
+	size_t pathLenSum = 0;
+
+	for(const std::string& path : corpus)
+		pathLenSum += path.length();
+
+	printf("corpus: %s; paths: %zu; avg len: %.1f\n",
+		corpusPath.empty() ? "generated" : corpusPath.c_str(), corpus.size(),
+		(double)pathLenSum / corpus.size() );
+
+	StringVec ruleCountsVec;
+	size_t numMismatches = 0;
+
+	boost::split(ruleCountsVec, ruleCountsStr, boost::is_any_of(","), boost::token_compress_on);
+
+	printf("%8s %10s %10s %8s %8s %10s %8s\n",
+		"rules", "build ms", "image KiB", "groups", "rss MiB", "ns/lookup", "hits");
+
+	for(const std::string& ruleCountStr : ruleCountsVec)
+	{
+		size_t numRules = strtoull(ruleCountStr.c_str(), NULL, 10);
+
+		if(numRules)
+			numMismatches += benchMatch(corpus, numRules, numIterations, random);
+	}
+
+	numMismatches += benchNormalize(corpus, random);
+
+	if(numMismatches)
+	{
+		std::cerr << "ERROR: Results differ from reference semantics: " << numMismatches <<
+			std::endl;
+		return 1;
+	}
+
+	return 0;
+}
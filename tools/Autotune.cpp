@@ -0,0 +1,921 @@
+/**
+ * vastpreload-autotune: Measure on which files of a directory tree O_DIRECT pays off and generate a
+ * path file (see LD_VAST_PATHFILE) with the recommended rules.
+ *
+ * The directory tree gets scanned (without crossing mounts) and the files get grouped by their
+ * file type, i.e. their extension. The groups with the most bytes get their own rule, all other
+ * files fall into a catch-all rule. For each group, a few sample files of different sizes get read
+ * sequentially at several request sizes, once buffered and once with O_DIRECT. The page cache
+ * of the file gets dropped before each pass over the file, so that buffered reads don't get served
+ * from memory. Each run is limited in bytes and time, so the whole measurement takes only a few
+ * seconds per group.
+ *
+ * A group gets O_DIRECT if direct reads are faster by the given margin (geometric mean over the
+ * request sizes that fit into its median file size). Optionally, writes get measured through a
+ * temporary file, in which case an extra rule for opens with write access gets added in front.
+ *
+ * Only reads of the existing files and writes to the temporary file happen, so this can run against
+ * any mount, including local disks.
+ *
+ * Example:
+ * $ vastpreload-autotune -w -o /data/myapp/vastpreload.paths /data/myapp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <getopt.h>
+#include <map>
+#include <sstream>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "Config.h"
+#include "PathMatchStore.h"
+
+#define AUTOTUNE_GROUP_OTHER		"*" // name of the catch-all group
+#define AUTOTUNE_MAX_SCAN_FILES		1000000 // scan stops after this many files
+#define AUTOTUNE_MAX_EXT_LEN		16 // longer extensions are not considered a file type
+#define AUTOTUNE_BUF_ALIGN			4096 // also the granularity of request sizes
+#define AUTOTUNE_MAX_PASSES			32 // max reads of the same file in a run
+
+#define AUTOTUNE_DEFAULT_REQSIZES	"4K,64K,1M,16M"
+#define AUTOTUNE_DEFAULT_SAMPLES	4
+#define AUTOTUNE_DEFAULT_GROUPS		8
+#define AUTOTUNE_DEFAULT_MAXBYTES	"256M"
+#define AUTOTUNE_DEFAULT_MAXMSEC	500
+#define AUTOTUNE_DEFAULT_MARGIN		10 // percent
+
+
+/**
+ * Throughput of runs at one request size.
+ */
+struct AutotuneSample
+{
+	uint64_t numBytes{0};
+	uint64_t numNSec{0};
+
+	double getMiBPerSec() const
+	{
+		return numNSec ? (numBytes * 1000.0) / numNSec * 1000000 / (1024 * 1024) : 0;
+	}
+};
+
+/**
+ * Buffered and direct results of all request sizes of a group (or of the write test).
+ */
+struct AutotuneResult
+{
+	std::vector<AutotuneSample> buffered; // index is request size index
+	std::vector<AutotuneSample> direct;
+	bool isDirectSupported{true}; // false if O_DIRECT got EINVAL
+	bool useDirect{false}; // the recommendation
+	double meanSpeedup{0}; // direct vs buffered
+	uint64_t minDirectReqSize{0}; // from this size on direct is faster by the margin; 0 if never
+};
+
+/**
+ * Files of one file type.
+ */
+struct AutotuneGroup
+{
+	std::string name; // extension without dot or AUTOTUNE_GROUP_OTHER
+	UInt64Vec fileSizes;
+	StringVec filePaths; // same order as fileSizes
+	uint64_t numBytes{0};
+	StringVec samplePaths;
+	AutotuneResult result;
+};
+
+/**
+ * Command line settings.
+ */
+struct AutotuneConfig
+{
+	UInt64Vec reqSizes;
+	unsigned numSamples{AUTOTUNE_DEFAULT_SAMPLES};
+	unsigned maxGroups{AUTOTUNE_DEFAULT_GROUPS};
+	uint64_t maxBytes{0};
+	uint64_t maxNSec{(uint64_t)AUTOTUNE_DEFAULT_MAXMSEC * 1000000};
+	unsigned marginPercent{AUTOTUNE_DEFAULT_MARGIN};
+	bool testWrites{false};
+};
+
+typedef std::map<std::string, AutotuneGroup> AutotuneGroupMap; // key is group name
+
+
+static void printUsage(const char* progName)
+{
+	std::cout <<
+		"Usage: " << progName << " [OPTIONS] DIR" << std::endl <<
+		std::endl <<
+		"Scan the directory tree DIR, compare buffered and O_DIRECT reads on sample files of each" <<
+		std::endl <<
+		"file type and print a summary and a path file with the recommended rules." << std::endl <<
+		std::endl <<
+		"Options:" << std::endl <<
+		"  -o FILE     Write the path file to FILE instead of printing it." << std::endl <<
+		"  -s SIZES    Comma-separated request sizes to test, multiples of " <<
+		AUTOTUNE_BUF_ALIGN << "." << std::endl <<
+		"              (Default: " AUTOTUNE_DEFAULT_REQSIZES ")" << std::endl <<
+		"  -n NUM      Sample files per file type. (Default: " <<
+		AUTOTUNE_DEFAULT_SAMPLES << ")" << std::endl <<
+		"  -g NUM      Max number of file types that get their own rule. (Default: " <<
+		AUTOTUNE_DEFAULT_GROUPS << ")" << std::endl <<
+		"  -b SIZE     Max bytes per file and run. (Default: " AUTOTUNE_DEFAULT_MAXBYTES ")" <<
+		std::endl <<
+		"  -t MSEC     Max time per file and run. (Default: " <<
+		AUTOTUNE_DEFAULT_MAXMSEC << ")" << std::endl <<
+		"  -m PERCENT  Min speedup of direct over buffered to recommend O_DIRECT. " <<
+		"(Default: " << AUTOTUNE_DEFAULT_MARGIN << ")" << std::endl <<
+		"  -w          Also test writes through a temporary file in DIR." << std::endl <<
+		"  -h          Print this help." << std::endl;
+}
+
+static uint64_t getNowNSec()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @return human-readable size, e.g. "64K".
+ */
+static std::string getSizeStr(uint64_t size)
+{
+	const char* const units = "KMGT";
+
+	if(!size || (size % 1024) )
+		return std::to_string(size);
+
+	unsigned unitIndex = 0;
+
+	for(size /= 1024; !(size % 1024) && (unitIndex < 3); size /= 1024)
+		unitIndex++;
+
+	return std::to_string(size) + units[unitIndex];
+}
+
+/**
+ * @return file type of a file name; AUTOTUNE_GROUP_OTHER if there is no usable extension.
+ */
+static std::string getGroupName(const char* fileName)
+{
+	const char* dotPos = strrchr(fileName, '.');
+
+	if(!dotPos || (dotPos == fileName) || !dotPos[1] ||
+		(strlen(dotPos + 1) > AUTOTUNE_MAX_EXT_LEN) )
+		return AUTOTUNE_GROUP_OTHER;
+
+	// extension must be usable literally in a path file pattern
+	for(const char* charPos = dotPos + 1; *charPos; charPos++)
+		if(strchr("*?[] \t", *charPos) )
+			return AUTOTUNE_GROUP_OTHER;
+
+	return dotPos + 1;
+}
+
+/**
+ * Recursively collect regular files below dirPath by file type. Symlinks and other mounts don't get
+ * followed.
+ *
+ * @numFilesLeft gets decreased for each found file; scan stops at 0.
+ */
+static void scanDir(const std::string& dirPath, dev_t dev, uint64_t& numFilesLeft,
+	AutotuneGroupMap& outGroups)
+{
+	DIR* dir = opendir(dirPath.c_str() );
+	if(!dir)
+	{
+		std::cerr << "WARNING: Skipping unreadable directory: " << dirPath << "; " <<
+			"Error: " << strerror(errno) << std::endl;
+		return;
+	}
+
+	std::unique_ptr<DIR, int(*)(DIR*)> dirCloser(dir, closedir);
+
+	while(struct dirent* entry = readdir(dir) )
+	{
+		if(!numFilesLeft)
+			return;
+
+		if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..") )
+			continue;
+
+		std::string entryPath = (dirPath == "/") ?
+			("/" + std::string(entry->d_name) ) : (dirPath + "/" + entry->d_name);
+		struct stat statBuf;
+
+		if(lstat(entryPath.c_str(), &statBuf) || (statBuf.st_dev != dev) )
+			continue;
+
+		if(S_ISDIR(statBuf.st_mode) )
+		{
+			scanDir(entryPath, dev, numFilesLeft, outGroups);
+			continue;
+		}
+
+		if(!S_ISREG(statBuf.st_mode) )
+			continue;
+
+		numFilesLeft--;
+
+		std::string groupName = getGroupName(entry->d_name);
+		AutotuneGroup& group = outGroups[groupName];
+
+		group.name = groupName;
+		group.fileSizes.push_back(statBuf.st_size);
+		group.filePaths.push_back(entryPath);
+		group.numBytes += statBuf.st_size;
+	}
+}
+
+/**
+ * Keep the maxGroups file types with the most bytes and move all other files into the catch-all
+ * group.
+ */
+static void mergeSmallGroups(unsigned maxGroups, AutotuneGroupMap& groups)
+{
+	std::vector<std::pair<uint64_t, std::string>> groupsBySize;
+
+	for(const auto& groupIter : groups)
+		if(groupIter.first != AUTOTUNE_GROUP_OTHER)
+			groupsBySize.push_back(std::make_pair(groupIter.second.numBytes, groupIter.first) );
+
+	std::sort(groupsBySize.rbegin(), groupsBySize.rend() );
+
+	for(size_t i = maxGroups; i < groupsBySize.size(); i++)
+	{
+		AutotuneGroup& smallGroup = groups[groupsBySize[i].second];
+		AutotuneGroup& otherGroup = groups[AUTOTUNE_GROUP_OTHER];
+
+		otherGroup.name = AUTOTUNE_GROUP_OTHER;
+		otherGroup.fileSizes.insert(otherGroup.fileSizes.end(), smallGroup.fileSizes.begin(),
+			smallGroup.fileSizes.end() );
+		otherGroup.filePaths.insert(otherGroup.filePaths.end(), smallGroup.filePaths.begin(),
+			smallGroup.filePaths.end() );
+		otherGroup.numBytes += smallGroup.numBytes;
+
+		groups.erase(groupsBySize[i].second);
+	}
+}
+
+/**
+ * Pick sample files that are evenly spread over the size range of the group. Empty files are not
+ * considered.
+ */
+static void pickSamples(unsigned numSamples, AutotuneGroup& group)
+{
+	std::vector<std::pair<uint64_t, size_t>> filesBySize; // size => index
+
+	for(size_t i = 0; i < group.fileSizes.size(); i++)
+		if(group.fileSizes[i])
+			filesBySize.push_back(std::make_pair(group.fileSizes[i], i) );
+
+	std::sort(filesBySize.begin(), filesBySize.end() );
+
+	size_t numPicks = std::min<size_t>(numSamples, filesBySize.size() );
+
+	// from the median to the largest file (as large files dominate the I/O time), if there are enough
+	const size_t firstIndex = std::min(filesBySize.size() / 2, filesBySize.size() - numPicks);
+
+	for(size_t i = 0; i < numPicks; i++)
+	{
+		size_t pickIndex = firstIndex + ( (numPicks > 1) ?
+			(i * (filesBySize.size() - 1 - firstIndex) ) / (numPicks - 1) : 0);
+
+		group.samplePaths.push_back(group.filePaths[filesBySize[pickIndex].second]);
+	}
+}
+
+/**
+ * @return median file size of the group.
+ */
+static uint64_t getMedianSize(const AutotuneGroup& group)
+{
+	if(group.fileSizes.empty() )
+		return 0;
+
+	UInt64Vec fileSizes(group.fileSizes);
+
+	std::nth_element(fileSizes.begin(), fileSizes.begin() + fileSizes.size() / 2, fileSizes.end() );
+
+	return fileSizes[fileSizes.size() / 2];
+}
+
+/**
+ * Drop the cached pages of a file.
+ */
+static void dropCache(const std::string& path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd == -1)
+		return;
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+/**
+ * Read a file sequentially from the beginning until end of file or until the byte or time limit.
+ * Small files get read multiple times (with the page cache dropped before each pass) to get a
+ * measurable time.
+ *
+ * @outIsEINVAL true if O_DIRECT was requested and is not supported for this file.
+ * @return false on error other than missing O_DIRECT support.
+ */
+static bool benchRead(const std::string& path, bool useDirect, uint64_t reqSize,
+	const AutotuneConfig& config, char* buf, AutotuneSample& outSample, bool& outIsEINVAL)
+{
+	uint64_t numNSec = 0;
+	uint64_t numBytes = 0;
+
+	outIsEINVAL = false;
+
+	for(unsigned pass = 0; (pass < AUTOTUNE_MAX_PASSES) && (numBytes < config.maxBytes) &&
+		(numNSec < config.maxNSec); pass++)
+	{
+		dropCache(path);
+
+		int fd = open(path.c_str(), O_RDONLY | (useDirect ? O_DIRECT : 0) );
+		if(fd == -1)
+		{
+			outIsEINVAL = useDirect && (errno == EINVAL);
+			return outIsEINVAL;
+		}
+
+		const uint64_t startNSec = getNowNSec();
+		uint64_t offset = 0;
+
+		while( (numBytes + offset < config.maxBytes) &&
+			(numNSec + (getNowNSec() - startNSec) < config.maxNSec) )
+		{
+			ssize_t readRes = pread(fd, buf, reqSize, offset);
+
+			if(readRes == -1)
+			{
+				outIsEINVAL = useDirect && (errno == EINVAL);
+				close(fd);
+				return outIsEINVAL;
+			}
+
+			offset += readRes;
+
+			if( (size_t)readRes < reqSize)
+				break; // end of file (no further read, as the offset is unaligned now)
+		}
+
+		numNSec += getNowNSec() - startNSec;
+		numBytes += offset;
+
+		close(fd);
+
+		if(!offset)
+			break; // file got truncated
+	}
+
+	dropCache(path);
+
+	outSample.numNSec += numNSec;
+	outSample.numBytes += numBytes;
+
+	return true;
+}
+
+/**
+ * Write a temporary file sequentially until the byte or time limit, including the final fsync.
+ *
+ * @outIsEINVAL true if O_DIRECT was requested and is not supported in this dir.
+ * @return false on error other than missing O_DIRECT support.
+ */
+static bool benchWrite(const std::string& path, bool useDirect, uint64_t reqSize,
+	const AutotuneConfig& config, char* buf, AutotuneSample& outSample, bool& outIsEINVAL)
+{
+	outIsEINVAL = false;
+
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (useDirect ? O_DIRECT : 0), 0600);
+	if(fd == -1)
+	{
+		outIsEINVAL = useDirect && (errno == EINVAL);
+		return outIsEINVAL;
+	}
+
+	const uint64_t startNSec = getNowNSec();
+	uint64_t offset = 0;
+
+	while( (offset < config.maxBytes) && ( (getNowNSec() - startNSec) < config.maxNSec) )
+	{
+		ssize_t writeRes = pwrite(fd, buf, reqSize, offset);
+
+		if(writeRes <= 0)
+		{
+			outIsEINVAL = useDirect && (writeRes == -1) && (errno == EINVAL);
+			close(fd);
+			return outIsEINVAL;
+		}
+
+		offset += writeRes;
+	}
+
+	fsync(fd);
+
+	outSample.numNSec += getNowNSec() - startNSec;
+	outSample.numBytes += offset;
+
+	close(fd);
+
+	return true;
+}
+
+/**
+ * Set the recommendation of a result based on the request sizes up to maxReqSize. The smallest
+ * request size always counts, so that small files also get a recommendation.
+ */
+static void evalResult(const AutotuneConfig& config, uint64_t maxReqSize,
+	AutotuneResult& result)
+{
+	const double minSpeedup = 1 + config.marginPercent / 100.0;
+	double logSpeedupSum = 0;
+	unsigned numSpeedups = 0;
+
+	result.minDirectReqSize = 0;
+
+	for(size_t i = 0; i < config.reqSizes.size(); i++)
+	{
+		double bufferedMiBPerSec = result.buffered[i].getMiBPerSec();
+		double directMiBPerSec = result.direct[i].getMiBPerSec();
+
+		if(!bufferedMiBPerSec || !directMiBPerSec)
+			continue;
+
+		double speedup = directMiBPerSec / bufferedMiBPerSec;
+
+		// smallest size from which direct stays faster for all larger sizes
+		if(speedup < minSpeedup)
+			result.minDirectReqSize = 0;
+		else
+		if(!result.minDirectReqSize)
+			result.minDirectReqSize = config.reqSizes[i];
+
+		if(i && (config.reqSizes[i] > maxReqSize) )
+			continue;
+
+		logSpeedupSum += log(speedup);
+		numSpeedups++;
+	}
+
+	result.meanSpeedup = numSpeedups ? exp(logSpeedupSum / numSpeedups) : 0;
+	result.useDirect = result.isDirectSupported && numSpeedups &&
+		(result.meanSpeedup >= minSpeedup);
+}
+
+/**
+ * Run buffered and direct reads at all request sizes on the samples of a group.
+ */
+static void benchGroup(const AutotuneConfig& config, char* buf, AutotuneGroup& group)
+{
+	AutotuneResult& result = group.result;
+
+	result.buffered.resize(config.reqSizes.size() );
+	result.direct.resize(config.reqSizes.size() );
+
+	for(size_t i = 0; i < config.reqSizes.size(); i++)
+	{
+		for(const std::string& samplePath : group.samplePaths)
+		{
+			bool isEINVAL;
+
+			if(!benchRead(samplePath, false, config.reqSizes[i], config, buf,
+				result.buffered[i], isEINVAL) )
+			{
+				std::cerr << "WARNING: Reading sample file failed: " << samplePath << "; " <<
+					"Error: " << strerror(errno) << std::endl;
+				continue;
+			}
+
+			if(!result.isDirectSupported)
+				continue;
+
+			if(!benchRead(samplePath, true, config.reqSizes[i], config, buf,
+				result.direct[i], isEINVAL) )
+			{
+				std::cerr << "WARNING: Reading sample file failed: " << samplePath << "; " <<
+					"Error: " << strerror(errno) << std::endl;
+				continue;
+			}
+
+			if(isEINVAL)
+				result.isDirectSupported = false;
+		}
+	}
+
+	evalResult(config, getMedianSize(group), result);
+}
+
+/**
+ * Run buffered and direct writes at all request sizes through a temporary file in dirPath.
+ *
+ * @return false on error.
+ */
+static bool benchWrites(const std::string& dirPath, const AutotuneConfig& config, char* buf,
+	AutotuneResult& outResult)
+{
+	std::string tmpPath = dirPath + "/.vastpreload-autotune.XXXXXX";
+
+	int tmpFD = mkstemp(&tmpPath[0]);
+	if(tmpFD == -1)
+	{
+		std::cerr << "ERROR: Creating temporary file failed: " << tmpPath << "; " <<
+			"Error: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	close(tmpFD);
+
+	outResult.buffered.resize(config.reqSizes.size() );
+	outResult.direct.resize(config.reqSizes.size() );
+
+	bool success = true;
+
+	for(size_t i = 0; success && (i < config.reqSizes.size() ); i++)
+	{
+		bool isEINVAL;
+
+		success = benchWrite(tmpPath, false, config.reqSizes[i], config, buf,
+			outResult.buffered[i], isEINVAL);
+
+		if(success && outResult.isDirectSupported)
+		{
+			success = benchWrite(tmpPath, true, config.reqSizes[i], config, buf,
+				outResult.direct[i], isEINVAL);
+
+			if(isEINVAL)
+				outResult.isDirectSupported = false;
+		}
+	}
+
+	if(!success)
+		std::cerr << "ERROR: Writing temporary file failed: " << tmpPath << "; " <<
+			"Error: " << strerror(errno) << std::endl;
+
+	unlink(tmpPath.c_str() );
+
+	// writes of new files are not limited by an existing file size
+	evalResult(config, config.reqSizes.back(), outResult);
+
+	return success;
+}
+
+/**
+ * @return e.g. "*.h5" or "*" for the catch-all group.
+ */
+static std::string getGroupLabel(const AutotuneGroup& group)
+{
+	return (group.name == AUTOTUNE_GROUP_OTHER) ? group.name : ("*." + group.name);
+}
+
+/**
+ * Print buffered and direct throughput and speedup per request size.
+ */
+static void printResult(const std::string& label, const AutotuneConfig& config,
+	const AutotuneResult& result)
+{
+	char row[128];
+
+	std::cout << std::endl << label << std::endl;
+
+	snprintf(row, sizeof(row), "  %-10s %14s %14s %10s", "reqsize", "buffered MiB/s",
+		"direct MiB/s", "speedup");
+	std::cout << row << std::endl;
+
+	for(size_t i = 0; i < config.reqSizes.size(); i++)
+	{
+		double bufferedMiBPerSec = result.buffered[i].getMiBPerSec();
+		double directMiBPerSec = result.direct[i].getMiBPerSec();
+
+		char speedupStr[32] = "";
+
+		if(bufferedMiBPerSec && directMiBPerSec)
+			snprintf(speedupStr, sizeof(speedupStr), "%.2fx",
+				directMiBPerSec / bufferedMiBPerSec);
+
+		snprintf(row, sizeof(row), "  %-10s %14.1f %14.1f %10s",
+			getSizeStr(config.reqSizes[i]).c_str(), bufferedMiBPerSec, directMiBPerSec,
+			speedupStr);
+		std::cout << row << std::endl;
+	}
+
+	std::cout << "  => " << (result.useDirect ? "direct" : "nodirect");
+
+	if(!result.isDirectSupported)
+		std::cout << " (O_DIRECT not supported)";
+	else
+	if(result.meanSpeedup)
+	{
+		char speedupStr[32];
+
+		snprintf(speedupStr, sizeof(speedupStr), "%.2fx", result.meanSpeedup);
+
+		std::cout << " (mean speedup: " << speedupStr;
+
+		if(result.minDirectReqSize)
+			std::cout << "; direct faster from: " << getSizeStr(result.minDirectReqSize);
+
+		std::cout << ")";
+	}
+
+	std::cout << std::endl;
+}
+
+/**
+ * @return comment line for the path file with the measured speedup of a result.
+ */
+static std::string getResultComment(const std::string& label, const AutotuneResult& result)
+{
+	std::ostringstream commentStream;
+
+	commentStream << "# " << label << ": ";
+
+	if(!result.isDirectSupported)
+		commentStream << "O_DIRECT not supported";
+	else
+	{
+		char speedupStr[32];
+
+		snprintf(speedupStr, sizeof(speedupStr), "%.2fx", result.meanSpeedup);
+
+		commentStream << "direct vs buffered " << speedupStr;
+
+		if(result.minDirectReqSize)
+			commentStream << ", faster from " << getSizeStr(result.minDirectReqSize) <<
+				" requests";
+	}
+
+	return commentStream.str();
+}
+
+/**
+ * Generate the path file. Rules for write access come first, as the first matching rule wins, then
+ * one rule per file type and finally the catch-all rule.
+ */
+static std::string getPathFile(const std::string& dirPath, const AutotuneGroupMap& groups,
+	const AutotuneResult* writeResult)
+{
+	std::ostringstream pathFileStream;
+	const std::string patternPrefix = (dirPath == "/") ? "/" : (dirPath + "/");
+
+	pathFileStream << "# Generated by vastpreload-autotune for " << dirPath << std::endl;
+
+	if(writeResult)
+		pathFileStream << getResultComment("writes", *writeResult) << std::endl <<
+			"[mode=wo+rw " << (writeResult->useDirect ? "direct" : "nodirect") << "] " <<
+			patternPrefix << "*" << std::endl;
+
+	const AutotuneGroup* otherGroup = NULL;
+
+	for(const auto& groupIter : groups)
+	{
+		const AutotuneGroup& group = groupIter.second;
+
+		if(group.result.buffered.empty() )
+			continue; // no samples, e.g. only empty files
+
+		if(group.name == AUTOTUNE_GROUP_OTHER)
+		{
+			otherGroup = &group;
+			continue;
+		}
+
+		pathFileStream << getResultComment(getGroupLabel(group), group.result) << std::endl <<
+			"[" << (group.result.useDirect ? "direct" : "nodirect") << "] " <<
+			patternPrefix << "*." << group.name << std::endl;
+	}
+
+	if(otherGroup)
+		pathFileStream << getResultComment("other files", otherGroup->result) << std::endl <<
+			"[" << (otherGroup->result.useDirect ? "direct" : "nodirect") << "] " <<
+			patternPrefix << "*" << std::endl;
+
+	return pathFileStream.str();
+}
+
+/**
+ * @return false if sizes string is invalid (which gets printed).
+ */
+static bool parseReqSizes(const std::string& sizesStr, UInt64Vec& outReqSizes)
+{
+	StringVec sizesVec;
+
+	boost::split(sizesVec, sizesStr, boost::is_any_of(",") );
+
+	outReqSizes.clear();
+
+	for(const std::string& sizeStr : sizesVec)
+	{
+		uint64_t reqSize;
+
+		if(!parseSizeStr(sizeStr.c_str(), reqSize) || !reqSize || (reqSize % AUTOTUNE_BUF_ALIGN) )
+		{
+			std::cerr << "ERROR: Invalid request size: " << sizeStr << std::endl;
+			return false;
+		}
+
+		outReqSizes.push_back(reqSize);
+	}
+
+	std::sort(outReqSizes.begin(), outReqSizes.end() );
+	outReqSizes.erase(std::unique(outReqSizes.begin(), outReqSizes.end() ), outReqSizes.end() );
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	AutotuneConfig config;
+	std::string outPath;
+	int opt;
+
+	parseReqSizes(AUTOTUNE_DEFAULT_REQSIZES, config.reqSizes);
+	parseSizeStr(AUTOTUNE_DEFAULT_MAXBYTES, config.maxBytes);
+
+	while( (opt = getopt(argc, argv, "o:s:n:g:b:t:m:wh") ) != -1)
+	{
+		switch(opt)
+		{
+			case 'o':
+				outPath = optarg;
+				break;
+
+			case 's':
+				if(!parseReqSizes(optarg, config.reqSizes) )
+					return 1;
+				break;
+
+			case 'n':
+				config.numSamples = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'g':
+				config.maxGroups = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'b':
+				if(!parseSizeStr(optarg, config.maxBytes) || !config.maxBytes)
+				{
+					std::cerr << "ERROR: Invalid size: " << optarg << std::endl;
+					return 1;
+				}
+				break;
+
+			case 't':
+				config.maxNSec = strtoull(optarg, NULL, 10) * 1000000;
+				break;
+
+			case 'm':
+				config.marginPercent = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'w':
+				config.testWrites = true;
+				break;
+
+			case 'h':
+				printUsage(argv[0]);
+				return 0;
+
+			default:
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	if( (argc - optind) != 1)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if(!config.numSamples || !config.maxNSec)
+	{
+		std::cerr << "ERROR: Number of samples and time limit must not be 0." << std::endl;
+		return 1;
+	}
+
+	// path file patterns get matched against absolute paths
+	char* realDirPath = realpath(argv[optind], NULL);
+	struct stat dirStat;
+
+	if(!realDirPath || stat(realDirPath, &dirStat) || !S_ISDIR(dirStat.st_mode) )
+	{
+		std::cerr << "ERROR: Not a directory: " << argv[optind] << std::endl;
+		free(realDirPath);
+		return 1;
+	}
+
+	const std::string dirPath(realDirPath);
+
+	free(realDirPath);
+
+	AutotuneGroupMap groups;
+	uint64_t numFilesLeft = AUTOTUNE_MAX_SCAN_FILES;
+	uint64_t scanStartNSec = getNowNSec();
+
+	scanDir(dirPath, dirStat.st_dev, numFilesLeft, groups);
+
+	uint64_t numFiles = AUTOTUNE_MAX_SCAN_FILES - numFilesLeft;
+	uint64_t numBytes = 0;
+
+	for(const auto& groupIter : groups)
+		numBytes += groupIter.second.numBytes;
+
+	std::cout << "Dir: " << dirPath << "; " <<
+		"Files: " << numFiles << "; " <<
+		"MiB: " << (numBytes / (1024 * 1024) ) << "; " <<
+		"File types: " << groups.size() << "; " <<
+		"Scan msec: " << ( (getNowNSec() - scanStartNSec) / 1000000) << std::endl;
+
+	if(!numFilesLeft)
+		std::cout << "NOTE: Scan stopped after " << AUTOTUNE_MAX_SCAN_FILES << " files." <<
+			std::endl;
+
+	mergeSmallGroups(config.maxGroups, groups);
+
+	char* buf;
+
+	if(posix_memalign( (void**)&buf, AUTOTUNE_BUF_ALIGN, config.reqSizes.back() ) )
+	{
+		std::cerr << "ERROR: Buffer allocation failed. Size: " << config.reqSizes.back() <<
+			std::endl;
+		return 1;
+	}
+
+	memset(buf, 'x', config.reqSizes.back() );
+
+	for(auto& groupIter : groups)
+	{
+		AutotuneGroup& group = groupIter.second;
+
+		pickSamples(config.numSamples, group);
+
+		if(group.samplePaths.empty() )
+			continue;
+
+		benchGroup(config, buf, group);
+
+		printResult("Reads of " + getGroupLabel(group) + " (" +
+			std::to_string(group.fileSizes.size() ) + " files; " +
+			std::to_string(group.numBytes / (1024 * 1024) ) + " MiB; median size: " +
+			getSizeStr(getMedianSize(group) ) + "; samples: " +
+			std::to_string(group.samplePaths.size() ) + ")", config, group.result);
+	}
+
+	AutotuneResult writeResult;
+
+	if(config.testWrites)
+	{
+		if(!benchWrites(dirPath, config, buf, writeResult) )
+		{
+			free(buf);
+			return 1;
+		}
+
+		printResult("Writes of a new file", config, writeResult);
+	}
+
+	free(buf);
+
+	std::string pathFileStr = getPathFile(dirPath, groups,
+		config.testWrites ? &writeResult : NULL);
+
+	if(outPath.empty() )
+	{
+		std::cout << std::endl << "Recommended path file:" << std::endl << pathFileStr;
+		return 0;
+	}
+
+	std::ofstream outStream(outPath);
+
+	outStream << pathFileStr;
+	outStream.close();
+
+	if(!outStream)
+	{
+		std::cerr << "ERROR: Writing path file failed: " << outPath << std::endl;
+		return 1;
+	}
+
+	// make sure that the library accepts the result
+	PathMatchStore pathMatchStore;
+
+	if(!pathMatchStore.loadPathFile(outPath) )
+		return 1; // (error message was printed by loadPathFile)
+
+	std::cout << std::endl << "Path file written: " << outPath << std::endl;
+
+	return 0;
+}
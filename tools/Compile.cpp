@@ -0,0 +1,151 @@
+/**
+ * vastpreload-compile: Validate a text path file and compile it into a binary path file, which the
+ * preload library can load with a single mmap instead of parsing the text file (see LD_VAST_PATHFILE).
+ *
+ * Example:
+ * $ vastpreload-compile /data/myapp/vastpreload.paths /data/myapp/vastpreload.paths.bin
+ * $ LD_VAST_PATHFILE=/data/myapp/vastpreload.paths.bin LD_PRELOAD=... ./myapp
+ */
+
+#include <getopt.h>
+#include "PathMatchStore.h"
+
+
+static void printUsage(const char* progName)
+{
+	std::cout <<
+		"Usage: " << progName << " [-d] INPUT [OUTPUT]" << std::endl <<
+		std::endl <<
+		"Validate the text path file INPUT and compile it into the binary path file OUTPUT." <<
+		std::endl <<
+		"If OUTPUT is not given, INPUT is only validated." << std::endl <<
+		std::endl <<
+		"Options:" << std::endl <<
+		"  -d    Print the compiled rules of INPUT (text or binary path file)." << std::endl <<
+		"  -h    Print this help." << std::endl;
+}
+
+/**
+ * Print summary and rules of a compiled image.
+ */
+static void dumpImage(const PathMatchImageHeader* image)
+{
+	const PathMatchImageRule* rules = PathMatchImage::getRules(image);
+
+	std::cout << "Version: " << image->version << "; " <<
+		"Bytes: " << image->imageLen << "; " <<
+		"Rules: " << image->numRules << "; " <<
+		"Prefix groups: " << image->numGroups << std::endl;
+
+	for(uint32_t i=0; i < image->numRules; i++)
+	{
+		std::string patternStr(PathMatchImage::getPattern(image, rules[i]), rules[i].patternLen);
+
+		std::cout << i << ": " <<
+			( (rules[i].actions & PATHMATCH_ACTION_DIRECT) ? "direct" : "nodirect");
+
+		if(rules[i].preallocExtent)
+			std::cout << " prealloc=" << rules[i].preallocExtent;
+
+		if(rules[i].expectedSize)
+			std::cout << " expectsize=" << rules[i].expectedSize;
+
+		if(rules[i].bwLimit)
+			std::cout << " bw=" << rules[i].bwLimit;
+
+		if(rules[i].iopsLimit)
+			std::cout << " iops=" << rules[i].iopsLimit;
+
+		if(rules[i].actions & PATHMATCH_ACTION_SHAREDLIMIT)
+			std::cout << " sharedlimit";
+
+		if(rules[i].exeLen)
+			std::cout << " exe=" << PathMatchImage::getExePattern(image, rules[i]);
+
+		if(rules[i].accessModes != PATHMATCH_MODE_ALL)
+		{
+			StringVec modesVec;
+
+			if(rules[i].accessModes & PATHMATCH_MODE_RDONLY)
+				modesVec.push_back("ro");
+
+			if(rules[i].accessModes & PATHMATCH_MODE_WRONLY)
+				modesVec.push_back("wo");
+
+			if(rules[i].accessModes & PATHMATCH_MODE_RDWR)
+				modesVec.push_back("rw");
+
+			std::cout << " mode=" << boost::join(modesVec, "+");
+		}
+
+		if(rules[i].rankLen)
+			std::cout << " rank=" << PathMatchImage::getRankList(image, rules[i]);
+
+		if(rules[i].localRankLen)
+			std::cout << " localrank=" << PathMatchImage::getLocalRankList(image, rules[i]);
+
+		std::cout << " " << patternStr << std::endl;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	bool doDump = false;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "dh") ) != -1)
+	{
+		switch(opt)
+		{
+			case 'd':
+				doDump = true;
+				break;
+
+			case 'h':
+				printUsage(argv[0]);
+				return 0;
+
+			default:
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	if( (optind >= argc) || ( (argc - optind) > 2) )
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	std::string inputPath = argv[optind];
+	PathMatchStore store;
+
+	bool loadRes = store.loadPathFile(inputPath);
+	if(!loadRes)
+		return 1; // (error message was printed by loadPathFile)
+
+	if(doDump)
+		dumpImage(store.getImage() );
+
+	if( (argc - optind) < 2)
+	{
+		if(!doDump)
+			std::cout << "Path file is valid. Rules: " << store.size() << std::endl;
+
+		return 0;
+	}
+
+	std::string outputPath = argv[optind + 1];
+
+	bool writeRes = store.writeImageFile(outputPath);
+	if(!writeRes)
+	{
+		std::cerr << "ERROR: Writing of binary path file failed: " << outputPath << "; " <<
+			"Error: " << strerror(errno) << std::endl;
+		return 1;
+	}
+
+	std::cout << "Compiled " << store.size() << " rules: " << outputPath << std::endl;
+
+	return 0;
+}
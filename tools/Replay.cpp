@@ -0,0 +1,750 @@
+/**
+ * vastpreload-replay: Replay an I/O trace that was captured by the preload library (see
+ * LD_VAST_TRACEFILE) against synthetic files in a local directory, to see the effect of a different
+ * O_DIRECT policy (e.g. a new path file) without rerunning the application.
+ *
+ * The files get created below the given directory with the path that they had in the trace. Files
+ * that get read are prefilled up to the highest read offset of the trace. Records get replayed in
+ * trace order from a single thread, either at full speed or with the original pacing. O_DIRECT gets
+ * removed after EINVAL errors and the call gets retried, just like the preload library does.
+ *
+ * For each policy, the report compares ops, throughput (bytes per time spent in the calls) and
+ * latency percentiles of the replay with the values recorded in the trace.
+ *
+ * Examples:
+ * $ LD_VAST_TRACEFILE=/tmp/myjob.%p.trace LD_VAST_PATHFILE=... LD_PRELOAD=... ./myjob
+ * $ vastpreload-replay -p trace -p /data/myjob/new.paths /tmp/myjob.1234.trace /tmp/replay
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <getopt.h>
+#include <map>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include "PathMatchStore.h"
+#include "TraceFile.h"
+
+#define REPLAY_POLICY_TRACE			"trace" // O_DIRECT as in the trace
+#define REPLAY_POLICY_BUFFERED		"buffered" // no O_DIRECT
+#define REPLAY_POLICY_DIRECT		"direct" // O_DIRECT for all files
+#define REPLAY_FILL_CHUNK_SIZE		(1024*1024) // write size to prefill files
+#define REPLAY_BUF_ALIGN			4096
+
+#define REPLAY_KIND_OPEN			0
+#define REPLAY_KIND_READ			1
+#define REPLAY_KIND_WRITE			2
+#define REPLAY_KIND_SYNC			3
+#define REPLAY_NUM_KINDS			4
+
+
+typedef std::vector<TraceRecord> TraceRecordVec;
+typedef std::vector<uint64_t> UInt64Vec;
+
+/**
+ * Results of a replay or of the original run in the trace.
+ */
+struct ReplayResult
+{
+	uint64_t numOps[REPLAY_NUM_KINDS] {};
+	uint64_t numBytes[REPLAY_NUM_KINDS] {};
+	uint64_t numErrors[REPLAY_NUM_KINDS] {};
+	UInt64Vec durations[REPLAY_NUM_KINDS]; // nsec of each op
+	uint64_t numEjects{0};
+	uint64_t elapsedNSec{0};
+};
+
+/**
+ * Decides whether a file gets O_DIRECT in a replay.
+ */
+class ReplayPolicy
+{
+	public:
+		ReplayPolicy(const std::string& name) : name(name) {}
+
+		std::string name; // REPLAY_POLICY_... or path file
+		std::unique_ptr<PathMatchStore> pathMatchStore; // NULL if not a path file policy
+
+		/**
+		 * @tracePath path of the file in the trace.
+		 * @traceFlags TRACE_FLAG_... of the open record.
+		 */
+		bool getUseDirect(const std::string& tracePath, uint8_t traceFlags) const
+		{
+			if(pathMatchStore)
+			{
+				const PathMatchImageRule* rule = pathMatchStore->getMatchingRule(tracePath);
+
+				return rule && (rule->actions & PATHMATCH_ACTION_DIRECT);
+			}
+
+			if(name == REPLAY_POLICY_DIRECT)
+				return true;
+
+			if(name == REPLAY_POLICY_BUFFERED)
+				return false;
+
+			return (traceFlags & TRACE_FLAG_DIRECT);
+		}
+};
+
+
+static const char* const kindNames[REPLAY_NUM_KINDS] = { "open", "read", "write", "sync" };
+
+
+static void printUsage(const char* progName)
+{
+	std::cout <<
+		"Usage: " << progName << " [OPTIONS] TRACE DIR" << std::endl <<
+		std::endl <<
+		"Replay the I/O trace TRACE (see LD_VAST_TRACEFILE) against synthetic files below the " <<
+		std::endl <<
+		"local directory DIR and compare throughput and latency with the trace." << std::endl <<
+		std::endl <<
+		"Options:" << std::endl <<
+		"  -p POLICY  O_DIRECT policy. Can be given multiple times to compare policies." <<
+		std::endl <<
+		"             (Default: " REPLAY_POLICY_TRACE ")" << std::endl <<
+		"               " REPLAY_POLICY_TRACE "     O_DIRECT where it was set in the trace." <<
+		std::endl <<
+		"               " REPLAY_POLICY_BUFFERED "  No O_DIRECT." << std::endl <<
+		"               " REPLAY_POLICY_DIRECT "    O_DIRECT for all files." << std::endl <<
+		"               PATHFILE  O_DIRECT for files that match the given (text or binary)" <<
+		std::endl <<
+		"                         path file." << std::endl <<
+		"  -t         Keep the original pacing of the trace. (Default: full speed)" << std::endl <<
+		"  -n NUM     Only replay the first NUM records." << std::endl <<
+		"  -k         Keep the synthetic files. (Default: remove them at the end)" << std::endl <<
+		"  -h         Print this help." << std::endl;
+}
+
+static uint64_t getNowNSec()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * @return REPLAY_KIND_...; -1 for records that are not replayed as timed ops.
+ */
+static int opToKind(uint8_t op)
+{
+	switch(op)
+	{
+		case TRACE_OP_OPEN: return REPLAY_KIND_OPEN;
+		case TRACE_OP_READ: return REPLAY_KIND_READ;
+		case TRACE_OP_WRITE: return REPLAY_KIND_WRITE;
+		case TRACE_OP_FSYNC: return REPLAY_KIND_SYNC;
+		case TRACE_OP_FDATASYNC: return REPLAY_KIND_SYNC;
+		default: return -1;
+	}
+}
+
+/**
+ * Read all records of a trace file.
+ *
+ * @outPaths path ID => path.
+ * @return false on error (which gets printed).
+ */
+static bool loadTrace(const std::string& tracePath, uint64_t maxRecords,
+	TraceRecordVec& outRecords, std::map<uint32_t, std::string>& outPaths)
+{
+	FILE* traceFile = fopen(tracePath.c_str(), "r");
+	if(!traceFile)
+	{
+		std::cerr << "ERROR: Opening trace file failed: " << tracePath << "; " <<
+			"Error: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	std::unique_ptr<FILE, int(*)(FILE*)> traceFileCloser(traceFile, fclose);
+
+	TraceFileHeader header;
+
+	if( (fread(&header, sizeof(header), 1, traceFile) != 1) ||
+		memcmp(header.magic, TRACEFILE_MAGIC, sizeof(header.magic) ) )
+	{
+		std::cerr << "ERROR: Not a trace file: " << tracePath << std::endl;
+		return false;
+	}
+
+	if( (header.version != TRACEFILE_VERSION) || (header.recordLen != sizeof(TraceRecord) ) )
+	{
+		std::cerr << "ERROR: Trace file format version " << header.version << " is not " <<
+			"supported by this tool version: " << tracePath << std::endl;
+		return false;
+	}
+
+	TraceRecord record;
+
+	while( (outRecords.size() < maxRecords) &&
+		(fread(&record, sizeof(record), 1, traceFile) == 1) )
+	{
+		if(record.op != TRACE_OP_PATH)
+		{
+			outRecords.push_back(record);
+			continue;
+		}
+
+		size_t paddedLen = record.count +
+			( (TRACE_PATH_PADDING - (record.count % TRACE_PATH_PADDING) ) % TRACE_PATH_PADDING);
+
+		std::string path(paddedLen, '\0');
+
+		if(fread(&path[0], 1, paddedLen, traceFile) != paddedLen)
+			break; // trace got cut off, e.g. because the process was killed
+
+		path.resize(record.count);
+
+		outPaths[record.pathID] = path;
+	}
+
+	if(ferror(traceFile) )
+	{
+		std::cerr << "ERROR: Reading trace file failed: " << tracePath << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Collect the results of the original run from the trace records.
+ */
+static void getTraceResult(const TraceRecordVec& records, ReplayResult& outResult)
+{
+	std::unordered_map<int32_t, uint8_t> fdFlags; // fd => TRACE_FLAG_... of last record
+
+	for(const TraceRecord& record : records)
+	{
+		int kind = opToKind(record.op);
+
+		if(kind != -1)
+		{
+			outResult.numOps[kind]++;
+			outResult.durations[kind].push_back(record.durationNSec);
+
+			if(record.result < 0)
+				outResult.numErrors[kind]++;
+			else
+			if( (kind == REPLAY_KIND_READ) || (kind == REPLAY_KIND_WRITE) )
+				outResult.numBytes[kind] += record.result;
+		}
+
+		// O_DIRECT got lost on an open fd => lib removed it after EINVAL
+		if( (record.op != TRACE_OP_OPEN) && fdFlags.count(record.fd) &&
+			(fdFlags[record.fd] & TRACE_FLAG_DIRECT) && !(record.flags & TRACE_FLAG_DIRECT) )
+			outResult.numEjects++;
+
+		if(record.op == TRACE_OP_CLOSE)
+			fdFlags.erase(record.fd);
+		else
+			fdFlags[record.fd] = record.flags;
+	}
+
+	if(!records.empty() )
+		outResult.elapsedNSec = records.back().startNSec + records.back().durationNSec -
+			records.front().startNSec;
+}
+
+/**
+ * Find the size that each file needs to have before the replay, i.e. the highest offset that gets
+ * read. Reads at the current file position get their offset by following the file position of the
+ * fd through the trace.
+ *
+ * @outFileSizes path ID => size; contains all paths that get opened.
+ */
+static void getInitialFileSizes(const TraceRecordVec& records,
+	std::map<uint32_t, uint64_t>& outFileSizes)
+{
+	std::unordered_map<int32_t, uint64_t> fdPositions;
+
+	for(const TraceRecord& record : records)
+	{
+		if(record.op == TRACE_OP_OPEN)
+		{
+			fdPositions[record.fd] = 0;
+			outFileSizes[record.pathID]; // add with size 0 if new
+			continue;
+		}
+
+		if( (record.op != TRACE_OP_READ) && (record.op != TRACE_OP_WRITE) )
+			continue;
+
+		uint64_t& position = fdPositions[record.fd];
+		uint64_t offset = (record.offset == TRACE_OFFSET_NONE) ? position : record.offset;
+		uint64_t numDone = (record.result > 0) ? record.result : 0;
+
+		if(record.offset == TRACE_OFFSET_NONE)
+			position += numDone;
+
+		if(record.op == TRACE_OP_READ)
+		{
+			// read up to requested count, not just result, as a short read might be end of file
+			uint64_t& fileSize = outFileSizes[record.pathID];
+
+			fileSize = std::max(fileSize, offset + numDone);
+		}
+	}
+}
+
+/**
+ * Create the parent dirs of path below baseDir.
+ *
+ * @outCreatedDirs dirs that didn't exist before get appended.
+ */
+static bool makeParentDirs(const std::string& path, StringVec& outCreatedDirs)
+{
+	for(size_t slashPos = path.find('/', 1); slashPos != std::string::npos;
+		slashPos = path.find('/', slashPos + 1) )
+	{
+		std::string dirPath = path.substr(0, slashPos);
+
+		if(!mkdir(dirPath.c_str(), 0755) )
+			outCreatedDirs.push_back(dirPath);
+		else
+		if(errno != EEXIST)
+		{
+			std::cerr << "ERROR: Creating directory failed: " << dirPath << "; " <<
+				"Error: " << strerror(errno) << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * (Re-)create the synthetic files with their initial size and drop them from the page cache, so
+ * that buffered reads of the replay don't get an unfair advantage.
+ */
+static bool createFiles(const std::string& baseDir, const std::map<uint32_t, std::string>& paths,
+	const std::map<uint32_t, uint64_t>& fileSizes, StringVec& outCreatedDirs)
+{
+	std::vector<char> fillBuf(REPLAY_FILL_CHUNK_SIZE, 'x');
+
+	for(const auto& sizeIter : fileSizes)
+	{
+		std::string replayPath = baseDir + paths.at(sizeIter.first);
+
+		if(!makeParentDirs(replayPath, outCreatedDirs) )
+			return false;
+
+		int fd = open(replayPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd == -1)
+		{
+			std::cerr << "ERROR: Creating file failed: " << replayPath << "; " <<
+				"Error: " << strerror(errno) << std::endl;
+			return false;
+		}
+
+		for(uint64_t offset = 0; offset < sizeIter.second; )
+		{
+			size_t writeLen = std::min<uint64_t>(fillBuf.size(), sizeIter.second - offset);
+
+			ssize_t writeRes = write(fd, fillBuf.data(), writeLen);
+			if(writeRes <= 0)
+			{
+				std::cerr << "ERROR: Writing file failed: " << replayPath << "; " <<
+					"Error: " << strerror(errno) << std::endl;
+				close(fd);
+				return false;
+			}
+
+			offset += writeRes;
+		}
+
+		fsync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+
+	return true;
+}
+
+/**
+ * Replay the records against the synthetic files.
+ */
+static void replay(const std::string& baseDir, const TraceRecordVec& records,
+	const std::map<uint32_t, std::string>& paths, const ReplayPolicy& policy, bool keepPacing,
+	ReplayResult& outResult)
+{
+	size_t maxCount = REPLAY_BUF_ALIGN;
+
+	for(const TraceRecord& record : records)
+		if( (record.op == TRACE_OP_READ) || (record.op == TRACE_OP_WRITE) )
+			maxCount = std::max<size_t>(maxCount, record.count);
+
+	char* buf;
+
+	// extra space to misalign the buffer like in the trace
+	if(posix_memalign( (void**)&buf, REPLAY_BUF_ALIGN, maxCount + REPLAY_BUF_ALIGN) )
+	{
+		std::cerr << "ERROR: Buffer allocation failed. Size: " << maxCount << std::endl;
+		exit(1);
+	}
+
+	memset(buf, 'x', maxCount + REPLAY_BUF_ALIGN);
+
+	std::unordered_map<int32_t, int> fdMap; // trace fd => replay fd
+
+	const uint64_t replayStartNSec = getNowNSec();
+	const uint64_t traceStartNSec = records.empty() ? 0 : records.front().startNSec;
+
+	for(const TraceRecord& record : records)
+	{
+		if(keepPacing)
+		{
+			uint64_t dueNSec = replayStartNSec + (record.startNSec - traceStartNSec);
+
+			struct timespec dueTime;
+
+			dueTime.tv_sec = dueNSec / 1000000000;
+			dueTime.tv_nsec = dueNSec % 1000000000;
+
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &dueTime, NULL) == EINTR)
+				; // signal handler interrupted us, so continue waiting
+		}
+
+		if(record.op == TRACE_OP_OPEN)
+		{
+			if(record.result < 0)
+				continue;
+
+			const std::string& tracePath = paths.at(record.pathID);
+			std::string replayPath = baseDir + tracePath;
+
+			int flags = record.count & ~(O_DIRECT | O_CLOEXEC | O_EXCL);
+
+			if(policy.getUseDirect(tracePath, record.flags) )
+				flags |= O_DIRECT;
+
+			uint64_t startNSec = getNowNSec();
+
+			int fd = open(replayPath.c_str(), flags, 0644);
+
+			outResult.durations[REPLAY_KIND_OPEN].push_back(getNowNSec() - startNSec);
+			outResult.numOps[REPLAY_KIND_OPEN]++;
+
+			if( (fd == -1) && (flags & O_DIRECT) && (errno == EINVAL) )
+			{ // filesystem doesn't support O_DIRECT
+				outResult.numEjects++;
+				fd = open(replayPath.c_str(), flags & ~O_DIRECT, 0644);
+			}
+
+			if(fd == -1)
+			{
+				outResult.numErrors[REPLAY_KIND_OPEN]++;
+				continue;
+			}
+
+			auto fdIter = fdMap.find(record.fd);
+
+			if(fdIter != fdMap.end() )
+				close(fdIter->second); // we missed the close of this trace fd
+
+			fdMap[record.fd] = fd;
+
+			continue;
+		}
+
+		auto fdIter = fdMap.find(record.fd);
+
+		if(fdIter == fdMap.end() )
+			continue; // fd not opened in the replayed part of the trace
+
+		const int fd = fdIter->second;
+
+		if(record.op == TRACE_OP_CLOSE)
+		{
+			close(fd);
+			fdMap.erase(fdIter);
+			continue;
+		}
+
+		int kind = opToKind(record.op);
+
+		if(kind == -1)
+			continue;
+
+		char* opBuf = buf + ( (record.bufAlignShift < TRACE_MAX_BUFALIGN_SHIFT) ?
+			(1 << record.bufAlignShift) : 0);
+
+		uint64_t startNSec = getNowNSec();
+		ssize_t opRes;
+
+		for(bool isRetry = false; ; isRetry = true)
+		{
+			if(record.op == TRACE_OP_FSYNC)
+				opRes = fsync(fd);
+			else
+			if(record.op == TRACE_OP_FDATASYNC)
+				opRes = fdatasync(fd);
+			else
+			if(record.op == TRACE_OP_READ)
+				opRes = (record.offset == TRACE_OFFSET_NONE) ?
+					read(fd, opBuf, record.count) :
+					pread(fd, opBuf, record.count, record.offset);
+			else
+				opRes = (record.offset == TRACE_OFFSET_NONE) ?
+					write(fd, opBuf, record.count) :
+					pwrite(fd, opBuf, record.count, record.offset);
+
+			if(isRetry || (opRes != -1) || (errno != EINVAL) )
+				break;
+
+			// same as the preload lib: remove O_DIRECT after EINVAL and retry
+			int fdFlags = fcntl(fd, F_GETFL);
+
+			if( (fdFlags == -1) || !(fdFlags & O_DIRECT) )
+				break;
+
+			fcntl(fd, F_SETFL, fdFlags & ~O_DIRECT);
+
+			outResult.numEjects++;
+		}
+
+		outResult.durations[kind].push_back(getNowNSec() - startNSec);
+		outResult.numOps[kind]++;
+
+		if(opRes == -1)
+			outResult.numErrors[kind]++;
+		else
+		if(kind != REPLAY_KIND_SYNC)
+			outResult.numBytes[kind] += opRes;
+	}
+
+	outResult.elapsedNSec = getNowNSec() - replayStartNSec;
+
+	for(const auto& fdIter : fdMap)
+		close(fdIter.second);
+
+	free(buf);
+}
+
+/**
+ * @percentile in 0..100.
+ * @durations gets sorted.
+ */
+static uint64_t getPercentile(UInt64Vec& durations, double percentile)
+{
+	if(durations.empty() )
+		return 0;
+
+	std::sort(durations.begin(), durations.end() );
+
+	size_t index = std::min<size_t>( (durations.size() * percentile) / 100, durations.size() - 1);
+
+	return durations[index];
+}
+
+/**
+ * @return relative change as string, e.g. "+12.3%"; empty if there is no base value.
+ */
+static std::string getDeltaStr(double baseValue, double newValue)
+{
+	if(!baseValue)
+		return "";
+
+	char deltaStr[32];
+
+	snprintf(deltaStr, sizeof(deltaStr), "%+.1f%%", ( (newValue - baseValue) * 100) / baseValue);
+
+	return deltaStr;
+}
+
+static void printRow(const std::string& name, double traceValue, double replayValue,
+	bool showDelta)
+{
+	char row[128];
+
+	snprintf(row, sizeof(row), "  %-18s %14.1f %14.1f %10s", name.c_str(), traceValue,
+		replayValue, showDelta ? getDeltaStr(traceValue, replayValue).c_str() : "");
+
+	std::cout << row << std::endl;
+}
+
+static void printResult(const ReplayPolicy& policy, ReplayResult& traceResult,
+	ReplayResult& replayResult)
+{
+	char header[128];
+
+	snprintf(header, sizeof(header), "  %-18s %14s %14s %10s", "", "trace", "replay", "delta");
+
+	std::cout << std::endl << "Policy: " << policy.name << std::endl << header << std::endl;
+
+	for(unsigned kind = 0; kind < REPLAY_NUM_KINDS; kind++)
+	{
+		if(!traceResult.numOps[kind] && !replayResult.numOps[kind])
+			continue;
+
+		const std::string kindName = kindNames[kind];
+
+		printRow(kindName + " ops", traceResult.numOps[kind], replayResult.numOps[kind], false);
+		printRow(kindName + " errors", traceResult.numErrors[kind], replayResult.numErrors[kind],
+			false);
+
+		if( (kind == REPLAY_KIND_READ) || (kind == REPLAY_KIND_WRITE) )
+		{
+			uint64_t traceNSec = 0;
+			uint64_t replayNSec = 0;
+
+			for(uint64_t duration : traceResult.durations[kind])
+				traceNSec += duration;
+
+			for(uint64_t duration : replayResult.durations[kind])
+				replayNSec += duration;
+
+			// throughput while in the calls, as the trace also contains the app's compute time
+			double traceMiBPerSec = traceNSec ?
+				(traceResult.numBytes[kind] * 1000.0) / traceNSec * 1000000 / (1024 * 1024) : 0;
+			double replayMiBPerSec = replayNSec ?
+				(replayResult.numBytes[kind] * 1000.0) / replayNSec * 1000000 / (1024 * 1024) : 0;
+
+			printRow(kindName + " MiB", traceResult.numBytes[kind] / (1024.0 * 1024),
+				replayResult.numBytes[kind] / (1024.0 * 1024), false);
+			printRow(kindName + " MiB/s", traceMiBPerSec, replayMiBPerSec, true);
+		}
+
+		printRow(kindName + " p50 usec",
+			getPercentile(traceResult.durations[kind], 50) / 1000.0,
+			getPercentile(replayResult.durations[kind], 50) / 1000.0, true);
+		printRow(kindName + " p99 usec",
+			getPercentile(traceResult.durations[kind], 99) / 1000.0,
+			getPercentile(replayResult.durations[kind], 99) / 1000.0, true);
+	}
+
+	printRow("O_DIRECT removals", traceResult.numEjects, replayResult.numEjects, false);
+	printRow("elapsed msec", traceResult.elapsedNSec / 1e6, replayResult.elapsedNSec / 1e6, true);
+}
+
+int main(int argc, char** argv)
+{
+	std::vector<std::unique_ptr<ReplayPolicy>> policies;
+	bool keepPacing = false;
+	bool keepFiles = false;
+	uint64_t maxRecords = ~0ULL;
+	int opt;
+
+	while( (opt = getopt(argc, argv, "p:tn:kh") ) != -1)
+	{
+		switch(opt)
+		{
+			case 'p':
+			{
+				std::unique_ptr<ReplayPolicy> policy(new ReplayPolicy(optarg) );
+
+				if( (policy->name != REPLAY_POLICY_TRACE) &&
+					(policy->name != REPLAY_POLICY_BUFFERED) &&
+					(policy->name != REPLAY_POLICY_DIRECT) )
+				{
+					policy->pathMatchStore.reset(new PathMatchStore() );
+
+					if(!policy->pathMatchStore->loadPathFile(optarg) )
+						return 1; // (error message was printed by loadPathFile)
+				}
+
+				policies.push_back(std::move(policy) );
+			} break;
+
+			case 't':
+				keepPacing = true;
+				break;
+
+			case 'n':
+				maxRecords = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'k':
+				keepFiles = true;
+				break;
+
+			case 'h':
+				printUsage(argv[0]);
+				return 0;
+
+			default:
+				printUsage(argv[0]);
+				return 1;
+		}
+	}
+
+	if( (argc - optind) != 2)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if(policies.empty() )
+		policies.emplace_back(new ReplayPolicy(REPLAY_POLICY_TRACE) );
+
+	std::string tracePath = argv[optind];
+	std::string baseDir = argv[optind + 1];
+
+	while( (baseDir.length() > 1) && (baseDir.back() == '/') )
+		baseDir.pop_back();
+
+	TraceRecordVec records;
+	std::map<uint32_t, std::string> paths;
+
+	if(!loadTrace(tracePath, maxRecords, records, paths) )
+		return 1;
+
+	// drop records of paths without definition (e.g. cut off trace)
+	records.erase(std::remove_if(records.begin(), records.end(),
+		[&paths](const TraceRecord& record) { return !paths.count(record.pathID); } ),
+		records.end() );
+
+	std::map<uint32_t, uint64_t> fileSizes;
+
+	getInitialFileSizes(records, fileSizes);
+
+	uint64_t totalFileSize = 0;
+
+	for(const auto& sizeIter : fileSizes)
+		totalFileSize += sizeIter.second;
+
+	std::cout << "Trace: " << tracePath << "; " <<
+		"Records: " << records.size() << "; " <<
+		"Files: " << fileSizes.size() << "; " <<
+		"Prefill MiB: " << (totalFileSize / (1024 * 1024) ) << std::endl;
+
+	ReplayResult traceResult;
+
+	getTraceResult(records, traceResult);
+
+	StringVec createdDirs;
+	int exitCode = 0;
+
+	for(const std::unique_ptr<ReplayPolicy>& policy : policies)
+	{
+		if(!createFiles(baseDir, paths, fileSizes, createdDirs) )
+		{
+			exitCode = 1;
+			break;
+		}
+
+		ReplayResult replayResult;
+
+		replay(baseDir, records, paths, *policy, keepPacing, replayResult);
+
+		printResult(*policy, traceResult, replayResult);
+	}
+
+	if(keepFiles)
+		return exitCode;
+
+	for(const auto& sizeIter : fileSizes)
+		unlink( (baseDir + paths.at(sizeIter.first) ).c_str() );
+
+	for(auto dirIter = createdDirs.rbegin(); dirIter != createdDirs.rend(); dirIter++)
+		rmdir(dirIter->c_str() ); // (fails for dirs that got created more than once, which is ok)
+
+	return exitCode;
+}